@@ -0,0 +1,327 @@
+/*
+ * a64gen.c - Build-time generator for the software backend's decoder
+ *
+ * Reads the encoding table in a64.def and writes a64dec.h, which holds
+ * a64_decode_row(): a tree of switches on instruction bit fields that
+ * maps an instruction word to its row of the table in a fixed handful of
+ * steps, whatever the number of rows.
+ *
+ * The tree is built top-down. At each node the generator switches on the
+ * run of up to A64GEN_MAX_FIELD bits that leaves the fewest rows per
+ * branch on average; rows that don't test some of those bits are copied
+ * into every branch they could match. A node ends in a leaf once its first
+ * row is fully decided, or with one mask compare when a single row is
+ * left. Rows keep their table order throughout, so an earlier row wins
+ * where two overlap.
+ *
+ * The table's A64_UNDEF encodings are checked against every row first:
+ * the decoder must leave them undefined.
+ *
+ * Usage: a64gen <output file>
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define A64GEN_MAX_FIELD 6
+#define A64GEN_MAX_ROWS 256
+
+typedef struct
+{
+    const char *name;
+    const char *pattern;
+    uint32_t mask;
+    uint32_t value;
+    bool used;
+} a64_row_t;
+
+static a64_row_t rows[] = {
+#define A64(name, pattern, decode) {#name, pattern, 0, 0, false},
+#include "a64.def"
+#undef A64
+};
+
+#define N_ROWS ((int)(sizeof(rows) / sizeof(rows[0])))
+
+static const struct
+{
+    uint32_t insn;
+    const char *what;
+} undefs[] = {
+#define A64(name, pattern, decode)
+#define A64_UNDEF(insn, what) {insn, what},
+#include "a64.def"
+#undef A64_UNDEF
+#undef A64
+};
+
+#define N_UNDEFS ((int)(sizeof(undefs) / sizeof(undefs[0])))
+
+static FILE *out;
+static int n_switches;
+static int max_depth;
+
+/* Parse a 32-character 0/1/x pattern, spaces allowed between fields */
+static bool parse_pattern(a64_row_t *r)
+{
+    int n = 0;
+
+    for (const char *p = r->pattern; *p != '\0'; p++)
+    {
+        if (*p == ' ')
+            continue;
+        if (n == 32 || (*p != '0' && *p != '1' && *p != 'x'))
+            return false;
+        r->mask <<= 1;
+        r->value <<= 1;
+        if (*p != 'x')
+        {
+            r->mask |= 1;
+            r->value |= (uint32_t)(*p - '0');
+        }
+        n++;
+    }
+    return n == 32;
+}
+
+static void indent(int depth)
+{
+    fprintf(out, "%*s", 4 * (depth + 1), "");
+}
+
+/*
+ * Pick the field to switch on: sets *lo and returns its width in bits.
+ * Candidates are runs of undecided bits that some row tests, scored by
+ * the average number of rows left per value, then by the largest.
+ */
+static int pick_field(const int *set, int n, uint32_t known, int *lo)
+{
+    uint32_t tested = 0;
+    int best_len = 0, best_max = 0, best_total = 0;
+
+    for (int i = 0; i < n; i++)
+        tested |= rows[set[i]].mask & ~known;
+
+    for (int l = 0; l < 32; l++)
+    {
+        for (int len = 1; len <= A64GEN_MAX_FIELD && l + len <= 32; len++)
+        {
+            uint32_t field = (uint32_t)(((1ull << len) - 1) << l);
+            int max = 0, total = 0;
+
+            if ((field & tested) != field)
+                break;
+            for (uint32_t v = 0; v < (1u << len); v++)
+            {
+                int size = 0;
+                for (int i = 0; i < n; i++)
+                {
+                    uint32_t m = rows[set[i]].mask & field;
+                    if (((v << l) & m) == (rows[set[i]].value & m))
+                        size++;
+                }
+                if (size > max)
+                    max = size;
+                total += size;
+            }
+            /* Compare total / 2^len, the average rows per branch */
+            if (best_len == 0 || (int64_t)total << best_len < (int64_t)best_total << len ||
+                ((int64_t)total << best_len == (int64_t)best_total << len && max < best_max))
+            {
+                *lo = l;
+                best_len = len;
+                best_max = max;
+                best_total = total;
+            }
+        }
+    }
+    return best_len;
+}
+
+static void emit_node(const int *set, int n, uint32_t known, int depth)
+{
+    if (depth > max_depth)
+        max_depth = depth;
+
+    if (n == 0)
+    {
+        indent(depth);
+        fprintf(out, "return -1;\n");
+        return;
+    }
+
+    a64_row_t *first = &rows[set[0]];
+    uint32_t rest = first->mask & ~known;
+
+    if (rest == 0)
+    {
+        first->used = true;
+        indent(depth);
+        fprintf(out, "return A64_%s;\n", first->name);
+        return;
+    }
+    if (n == 1)
+    {
+        first->used = true;
+        indent(depth);
+        fprintf(out, "return (insn & 0x%08x) == 0x%08x ? A64_%s : -1;\n",
+                rest, first->value & rest, first->name);
+        return;
+    }
+
+    int lo = 0, len = pick_field(set, n, known, &lo);
+    uint32_t values = 1u << len, field = ((1u << len) - 1) << lo;
+    int (*subsets)[A64GEN_MAX_ROWS] = calloc(values, sizeof(*subsets));
+    int *sizes = calloc(values, sizeof(*sizes));
+    bool *done = calloc(values, sizeof(*done));
+
+    if (subsets == NULL || sizes == NULL || done == NULL)
+    {
+        fprintf(stderr, "a64gen: out of memory\n");
+        exit(1);
+    }
+
+    for (uint32_t v = 0; v < values; v++)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            uint32_t m = rows[set[i]].mask & field;
+            if (((v << lo) & m) == (rows[set[i]].value & m))
+                subsets[v][sizes[v]++] = set[i];
+        }
+    }
+
+    /* The most common subset becomes the default: every path returns */
+    uint32_t dflt = 0;
+    int dflt_count = 0;
+    for (uint32_t v = 0; v < values; v++)
+    {
+        int c = 0;
+        for (uint32_t w = 0; w < values; w++)
+            if (sizes[w] == sizes[v] && memcmp(subsets[w], subsets[v], sizes[v] * sizeof(int)) == 0)
+                c++;
+        if (c > dflt_count)
+        {
+            dflt = v;
+            dflt_count = c;
+        }
+    }
+
+    n_switches++;
+    indent(depth);
+    fprintf(out, "switch ((insn >> %d) & 0x%x)\n", lo, values - 1);
+    indent(depth);
+    fprintf(out, "{\n");
+    for (uint32_t v = 0; v < values; v++)
+    {
+        if (done[v])
+            continue;
+        bool is_default = false;
+        for (uint32_t w = v; w < values; w++)
+        {
+            if (sizes[w] != sizes[v] || memcmp(subsets[w], subsets[v], sizes[v] * sizeof(int)) != 0)
+                continue;
+            done[w] = true;
+            if (w == dflt)
+                is_default = true;
+        }
+        if (is_default)
+            continue;
+        for (uint32_t w = v; w < values; w++)
+        {
+            if (sizes[w] != sizes[v] || memcmp(subsets[w], subsets[v], sizes[v] * sizeof(int)) != 0)
+                continue;
+            indent(depth);
+            fprintf(out, "case 0x%x:\n", w);
+        }
+        emit_node(subsets[v], sizes[v], known | field, depth + 1);
+    }
+    indent(depth);
+    fprintf(out, "default:\n");
+    emit_node(subsets[dflt], sizes[dflt], known | field, depth + 1);
+    indent(depth);
+    fprintf(out, "}\n");
+
+    free(subsets);
+    free(sizes);
+    free(done);
+}
+
+int main(int argc, char **argv)
+{
+    int set[A64GEN_MAX_ROWS];
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: %s <output file>\n", argv[0]);
+        return 1;
+    }
+    if (N_ROWS > A64GEN_MAX_ROWS)
+    {
+        fprintf(stderr, "a64gen: more than %d rows in a64.def\n", A64GEN_MAX_ROWS);
+        return 1;
+    }
+
+    for (int i = 0; i < N_ROWS; i++)
+    {
+        if (!parse_pattern(&rows[i]))
+        {
+            fprintf(stderr, "a64gen: a64.def: %s: bad pattern \"%s\"\n",
+                    rows[i].name, rows[i].pattern);
+            return 1;
+        }
+        set[i] = i;
+    }
+
+    /* Unallocated encodings no row may claim */
+    for (int u = 0; u < N_UNDEFS; u++)
+    {
+        for (int i = 0; i < N_ROWS; i++)
+        {
+            if ((undefs[u].insn & rows[i].mask) == rows[i].value)
+            {
+                fprintf(stderr, "a64gen: a64.def: %s matches 0x%08x (%s), which is "
+                        "unallocated\n", rows[i].name, undefs[u].insn, undefs[u].what);
+                return 1;
+            }
+        }
+    }
+
+    out = fopen(argv[1], "w");
+    if (out == NULL)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    fprintf(out, "/* Generated from a64.def by a64gen. Do not edit. */\n\n");
+    fprintf(out, "/* The row of a64.def that `insn` belongs to, -1 if none */\n");
+    fprintf(out, "static inline int a64_decode_row(uint32_t insn)\n{\n");
+    emit_node(set, N_ROWS, 0, 0);
+    fprintf(out, "}\n");
+    fprintf(out, "\n/* %d rows, %d switches, at most %d levels deep */\n",
+            N_ROWS, n_switches, max_depth);
+
+    /* A row that no instruction can reach is shadowed by earlier rows */
+    for (int i = 0; i < N_ROWS; i++)
+    {
+        if (!rows[i].used)
+        {
+            fprintf(stderr, "a64gen: a64.def: %s is unreachable\n", rows[i].name);
+            fclose(out);
+            remove(argv[1]);
+            return 1;
+        }
+    }
+
+    if (fclose(out) != 0)
+    {
+        perror(argv[1]);
+        remove(argv[1]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,19 @@
+/*
+ * hostclock.h - Host clocks shared by the VMM's modules
+ */
+
+#ifndef HOSTCLOCK_H
+#define HOSTCLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* CPU time used by the calling thread, in ns */
+static inline uint64_t thread_cpu_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+#endif /* HOSTCLOCK_H */
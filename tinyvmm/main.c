@@ -25,32 +25,54 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <unistd.h>
 #include <signal.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/socket.h>
 #include <sys/wait.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sysctl.h>
+#include <libproc.h>
 #include <mach/mach_time.h>
 #include <Hypervisor/Hypervisor.h>
 
+#include "swcpu.h"
+#include "tcache.h"
+#include "snapshot.h"
+#include "xfer.h"
+#include "hostclock.h"
+
 /* ============================================================================
  * Constants and Configuration
  * ============================================================================ */
 
-/* Guest memory size: 1MB is plenty for our tiny guest */
+/* Guest memory size: 1MB is plenty for our tiny guest (the default, see
+ * --mem). Larger guests are reserved, and only committed as they touch it */
 #define GUEST_MEM_SIZE (1 * 1024 * 1024)
+#define GUEST_MEM_MAX (64ull * 1024 * 1024 * 1024) /* The default 36-bit IPA space */
 
 /* Guest physical address where we load code */
 #define GUEST_CODE_ADDR 0x10000
 
-/* Stack grows down from end of memory */
+/* Stack grows down from end of the first megabyte */
 #define GUEST_STACK_ADDR (GUEST_MEM_SIZE - 0x1000)
 
+/* Secondary vCPUs get their own stacks below the boot vCPU's */
+#define GUEST_VCPU_STACK_SIZE 0x4000
+
 /* ARM64 Exception Syndrome Register (ESR) bit field extraction */
 #define ESR_EC_SHIFT 26
 #define ESR_EC_MASK 0x3F
 #define ESR_EC(esr) (((esr) >> ESR_EC_SHIFT) & ESR_EC_MASK)
 
 /* Exception Class (EC) values we care about */
+#define EC_WFX 0x01          /* WFI or WFE */
 #define EC_HVC64 0x16        /* HVC instruction (AArch64) */
 #define EC_SMC64 0x17        /* SMC instruction (AArch64) */
 #define EC_SYS64 0x18        /* MSR/MRS or System instruction */
@@ -61,6 +83,11 @@
 #define HYPERCALL_EXIT 0    /* Guest wants to exit */
 #define HYPERCALL_PUTCHAR 1 /* Print a character */
 #define HYPERCALL_PUTS 2    /* Print a string (address in x1) */
+#define HYPERCALL_FUZZ_START 3 /* Input buffer x1, size x2; returns length in x0 */
+#define HYPERCALL_FUZZ_END 4   /* Input handled (see "Fuzz Mode") */
+#define HYPERCALL_FREE_PAGES 5 /* Guest no longer needs [x1, x1 + x2) */
+#define HYPERCALL_LOCK_WAIT 6  /* Spinlock x1 reads x2, park until it changes */
+#define HYPERCALL_LOCK_KICK 7  /* Spinlock x1 released, wake its waiters */
 
 /* ============================================================================
  * Guest Code
@@ -233,18 +260,719 @@ static const uint32_t guest_code[] = {
     0x14000000, /* b . */
 };
 
+/*
+ * Compare-heavy benchmark guest: a loop of 10M iterations with three
+ * compares, a CSEL and a CINC each, then the checksum is printed in hex.
+ * Expected output: 000016bcc4442ce9
+ */
+static const uint32_t guest_cmploop[] = {
+    0xd2800013, /* mov x19, #0 (i) */
+    0xd2800015, /* mov x21, #0 (checksum) */
+    0xd292d016, /* mov x22, #0x9680 */
+    0xf2a01316, /* movk x22, #0x98, lsl #16 (10M) */
+
+    /* loop: */
+    0x92401e69, /* and x9, x19, #0xff */
+    0xf102013f, /* cmp x9, #0x80 */
+    0x9a93b12a, /* csel x10, x9, x19, lt */
+    0xf101015f, /* cmp x10, #0x40 */
+    0x9a9596b5, /* cinc x21, x21, hi */
+    0x8b0a02b5, /* add x21, x21, x10 */
+    0x91000673, /* add x19, x19, #1 */
+    0xeb16027f, /* cmp x19, x22 */
+    0x54ffff0b, /* b.lt loop */
+
+    /* Print x21 as 16 hex digits */
+    0xd2800797, /* mov x23, #60 */
+    /* print: */
+    0x9ad726a1, /* lsr x1, x21, x23 */
+    0x92400c21, /* and x1, x1, #0xf */
+    0xf100283f, /* cmp x1, #10 */
+    0x9100c022, /* add x2, x1, #'0' */
+    0x91015c23, /* add x3, x1, #('a' - 10) */
+    0x9a833041, /* csel x1, x2, x3, lo */
+    0xd2800020, /* mov x0, #1 (HYPERCALL_PUTCHAR) */
+    0xd4000002, /* hvc #0 */
+    0xf10012f7, /* subs x23, x23, #4 */
+    0x54fffeea, /* b.ge print */
+
+    0xd2800141, /* mov x1, #'\n' */
+    0xd2800020, /* mov x0, #1 */
+    0xd4000002, /* hvc #0 */
+
+    0xd2800000, /* mov x0, #0 (HYPERCALL_EXIT) */
+    0xd4000002, /* hvc #0 */
+};
+
+/*
+ * SMP atomics guest (--backend=sw --vcpus=N): every vCPU bumps four
+ * shared counters 1M times each, with LDXR/STXR, STADD, a CASAL loop and
+ * under an LDAXR/STLR spinlock. vCPU 0 waits for the others and prints
+ * the counters in hex, all four should be N * 1M (0x3d0900 for N = 4).
+ */
+static const uint32_t guest_atomics[] = {
+    0xd2a00118, /* mov x24, #0x80000 (lock) */
+    0x91010319, /* add x25, x24, #0x40 (A) */
+    0x9102031a, /* add x26, x24, #0x80 (B) */
+    0x9103031b, /* add x27, x24, #0xc0 (C, under the lock) */
+    0x9104031c, /* add x28, x24, #0x100 (vCPUs done) */
+    0x9105030c, /* add x12, x24, #0x140 (D) */
+    0xd2884813, /* mov x19, #0x4240 */
+    0xf2a001f3, /* movk x19, #0xf, lsl #16 (1M) */
+
+    /* loop: */
+    0xc85f7f29, /* ldxr x9, [x25] */
+    0x91000529, /* add x9, x9, #1 */
+    0xc80a7f29, /* stxr w10, x9, [x25] */
+    0x35ffffaa, /* cbnz w10, loop */
+    0xd2800029, /* mov x9, #1 */
+    0xf829035f, /* stadd x9, [x26] */
+    0xf9400189, /* ldr x9, [x12] */
+    /* cas: */
+    0x9100052a, /* add x10, x9, #1 */
+    0xaa0903eb, /* mov x11, x9 */
+    0xc8ebfd8a, /* casal x11, x10, [x12] */
+    0xeb09017f, /* cmp x11, x9 */
+    0xaa0b03e9, /* mov x9, x11 */
+    0x54ffff61, /* b.ne cas */
+    /* lock: */
+    0x885fff09, /* ldaxr w9, [x24] */
+    0x35ffffe9, /* cbnz w9, lock */
+    0x52800029, /* mov w9, #1 */
+    0x880a7f09, /* stxr w10, w9, [x24] */
+    0x35ffff8a, /* cbnz w10, lock */
+    0xf9400369, /* ldr x9, [x27] */
+    0x91000529, /* add x9, x9, #1 */
+    0xf9000369, /* str x9, [x27] */
+    0x889fff1f, /* stlr wzr, [x24] (unlock) */
+    0xf1000673, /* subs x19, x19, #1 */
+    0x54fffd21, /* b.ne loop */
+
+    0x52800029, /* mov w9, #1 */
+    0xb8e90389, /* ldaddal w9, w9, [x28] */
+    0xb4000075, /* cbz x21, wait (vCPU 0 reports) */
+    0xd2800000, /* mov x0, #0 (HYPERCALL_EXIT) */
+    0xd4000002, /* hvc #0 */
+
+    /* wait: */
+    0x88dfff89, /* ldar w9, [x28] */
+    0x6b16013f, /* cmp w9, w22 (number of vCPUs) */
+    0x54ffffc1, /* b.ne wait */
+    0xf940032f, /* ldr x15, [x25] */
+    0x94000009, /* bl print */
+    0xf940034f, /* ldr x15, [x26] */
+    0x94000007, /* bl print */
+    0xf940018f, /* ldr x15, [x12] */
+    0x94000005, /* bl print */
+    0xf940036f, /* ldr x15, [x27] */
+    0x94000003, /* bl print */
+    0xd2800000, /* mov x0, #0 (HYPERCALL_EXIT) */
+    0xd4000002, /* hvc #0 */
+
+    /* print: x15 as 16 hex digits and a newline */
+    0xd2800790, /* mov x16, #60 */
+    /* digit: */
+    0x9ad025e1, /* lsr x1, x15, x16 */
+    0x92400c21, /* and x1, x1, #0xf */
+    0xf100283f, /* cmp x1, #10 */
+    0x9100c022, /* add x2, x1, #'0' */
+    0x91015c23, /* add x3, x1, #('a' - 10) */
+    0x9a833041, /* csel x1, x2, x3, lo */
+    0xd2800020, /* mov x0, #1 (HYPERCALL_PUTCHAR) */
+    0xd4000002, /* hvc #0 */
+    0xf1001210, /* subs x16, x16, #4 */
+    0x54fffeea, /* b.ge digit */
+    0xd2800141, /* mov x1, #'\n' */
+    0xd2800020, /* mov x0, #1 */
+    0xd4000002, /* hvc #0 */
+    0xd65f03c0, /* ret */
+};
+
+/*
+ * Virtual timer guest: 100 periods of 1 ms (24000 ticks of the 24 MHz
+ * counter), each armed through CNTV_TVAL_EL0 and waited for with WFI
+ * and a poll of CNTV_CTL_EL0.ISTATUS. Prints the CNTVCT ticks it took in
+ * hex. The value depends on the host clock, except with --icount.
+ */
+static const uint32_t guest_timer[] = {
+    0xd53be053, /* mrs x19, cntvct_el0 (start) */
+    0xd2800c94, /* mov x20, #100 */
+
+    /* period: */
+    0xd28bb809, /* mov x9, #24000 */
+    0xd51be309, /* msr cntv_tval_el0, x9 */
+    0xd2800029, /* mov x9, #1 (ENABLE) */
+    0xd51be329, /* msr cntv_ctl_el0, x9 */
+    /* wait: */
+    0xd503207f, /* wfi */
+    0xd53be329, /* mrs x9, cntv_ctl_el0 */
+    0x3617ffc9, /* tbz w9, #2, wait (ISTATUS) */
+    0xf1000694, /* subs x20, x20, #1 */
+    0x54ffff01, /* b.ne period */
+
+    0xd51be33f, /* msr cntv_ctl_el0, xzr */
+    0xd53be055, /* mrs x21, cntvct_el0 */
+    0xcb1302b5, /* sub x21, x21, x19 */
+
+    /* Print x21 as 16 hex digits */
+    0xd2800797, /* mov x23, #60 */
+    /* print: */
+    0x9ad726a1, /* lsr x1, x21, x23 */
+    0x92400c21, /* and x1, x1, #0xf */
+    0xf100283f, /* cmp x1, #10 */
+    0x9100c022, /* add x2, x1, #'0' */
+    0x91015c23, /* add x3, x1, #('a' - 10) */
+    0x9a833041, /* csel x1, x2, x3, lo */
+    0xd2800020, /* mov x0, #1 (HYPERCALL_PUTCHAR) */
+    0xd4000002, /* hvc #0 */
+    0xf10012f7, /* subs x23, x23, #4 */
+    0x54fffeea, /* b.ge print */
+
+    0xd2800141, /* mov x1, #'\n' */
+    0xd2800020, /* mov x0, #1 */
+    0xd4000002, /* hvc #0 */
+
+    0xd2800000, /* mov x0, #0 (HYPERCALL_EXIT) */
+    0xd4000002, /* hvc #0 */
+};
+
+/*
+ * Fuzz target (--fuzz): asks for an input with FUZZ_START and crashes
+ * with a data abort when it starts with "FUZZ". It also counts its runs
+ * in memory and crashes if that count is ever above one, which it only
+ * is if a run saw memory left over from an earlier one. Run normally it
+ * gets an empty input and exits.
+ */
+static const uint32_t guest_fuzz[] = {
+    0xd2800060, /* mov x0, #3 (HYPERCALL_FUZZ_START) */
+    0xd2a00101, /* mov x1, #0x80000 (input buffer) */
+    0xd2800802, /* mov x2, #64 (its size) */
+    0xd4000002, /* hvc #0 */
+    0xaa0003f3, /* mov x19, x0 (input length) */
+    0xd2a00109, /* mov x9, #0x80000 */
+    0xf948012c, /* ldr x12, [x9, #0x1000] (run count) */
+    0x9100058c, /* add x12, x12, #1 */
+    0xf908012c, /* str x12, [x9, #0x1000] */
+    0xf100059f, /* cmp x12, #1 */
+    0x540001e1, /* b.ne crash */
+    0xf100127f, /* cmp x19, #4 */
+    0x540001e3, /* b.lo done */
+    0x3940012a, /* ldrb w10, [x9] */
+    0x7101195f, /* cmp w10, #'F' */
+    0x54000181, /* b.ne done */
+    0x3940052a, /* ldrb w10, [x9, #1] */
+    0x7101555f, /* cmp w10, #'U' */
+    0x54000121, /* b.ne done */
+    0x3940092a, /* ldrb w10, [x9, #2] */
+    0x7101695f, /* cmp w10, #'Z' */
+    0x540000c1, /* b.ne done */
+    0x39400d2a, /* ldrb w10, [x9, #3] */
+    0x7101695f, /* cmp w10, #'Z' */
+    0x54000061, /* b.ne done */
+
+    /* crash: */
+    0xd2a8000b, /* mov x11, #0x40000000 (outside guest memory) */
+    0xf900017f, /* str xzr, [x11] */
+
+    /* done: */
+    0xd2800080, /* mov x0, #4 (HYPERCALL_FUZZ_END) */
+    0xd4000002, /* hvc #0 */
+    0xd2800000, /* mov x0, #0 (HYPERCALL_EXIT) */
+    0xd4000002, /* hvc #0 */
+};
+
+/*
+ * Idle guest (--hibernate): three 1 s naps (24000000 ticks of the 24 MHz
+ * counter) on the virtual timer, printing a countdown digit after each.
+ * Between naps it does nothing but WFI, so an idle VM can be hibernated
+ * and woken by its timer.
+ */
+static const uint32_t guest_idle[] = {
+    0xd2800073, /* mov x19, #3 */
+
+    /* nap: */
+    0xd286c009, /* mov x9, #0x3600 */
+    0xf2a02dc9, /* movk x9, #0x16e, lsl #16 (24000000) */
+    0xd51be309, /* msr cntv_tval_el0, x9 */
+    0xd2800029, /* mov x9, #1 (ENABLE) */
+    0xd51be329, /* msr cntv_ctl_el0, x9 */
+    /* wait: */
+    0xd503207f, /* wfi */
+    0xd53be329, /* mrs x9, cntv_ctl_el0 */
+    0x3617ffc9, /* tbz w9, #2, wait (ISTATUS) */
+    0xd51be33f, /* msr cntv_ctl_el0, xzr */
+
+    0xd2800601, /* mov x1, #'0' */
+    0x8b130021, /* add x1, x1, x19 */
+    0xd2800020, /* mov x0, #1 (HYPERCALL_PUTCHAR) */
+    0xd4000002, /* hvc #0 */
+    0xd2800141, /* mov x1, #'\n' */
+    0xd2800020, /* mov x0, #1 */
+    0xd4000002, /* hvc #0 */
+    0xf1000673, /* subs x19, x19, #1 */
+    0x54fffde1, /* b.ne nap */
+
+    0xd2800000, /* mov x0, #0 (HYPERCALL_EXIT) */
+    0xd4000002, /* hvc #0 */
+};
+
+/*
+ * Sparse guest (--mem): stores to one page in every megabyte above the
+ * first, up to the RAM size the VMM passes in X23, then reports all of
+ * that memory free again with FREE_PAGES.
+ */
+static const uint32_t guest_sparse[] = {
+    0xd2a00213, /* mov x19, #0x100000 */
+
+    /* touch: */
+    0xeb17027f, /* cmp x19, x23 */
+    0x54000082, /* b.hs report */
+    0xf9000273, /* str x19, [x19] */
+    0x91440273, /* add x19, x19, #0x100000 */
+    0x17fffffc, /* b touch */
+
+    /* report: */
+    0xd2a00201, /* mov x1, #0x100000 */
+    0xeb0102ff, /* cmp x23, x1 */
+    0x54000089, /* b.ls done */
+    0xd28000a0, /* mov x0, #5 (HYPERCALL_FREE_PAGES) */
+    0xcb0102e2, /* sub x2, x23, x1 */
+    0xd4000002, /* hvc #0 */
+
+    /* done: */
+    0xd2800000, /* mov x0, #0 (HYPERCALL_EXIT) */
+    0xd4000002, /* hvc #0 */
+};
+
+/*
+ * Dirtying guest (--precopy): 400000 passes over 64 pages at 0x80000, each
+ * pass storing its number into the same word of every page, the next word
+ * every 1024 passes, so every page stays dirty but changes only a little
+ * at a time. Then prints the sum of all 64 pages in hex (000000012b5b3e40).
+ */
+static const uint32_t guest_dirty[] = {
+    0xd2a00114, /* mov x20, #0x80000 */
+    0xd2800015, /* mov x21, #0 */
+    0xd2835016, /* mov x22, #0x1a80 */
+    0xf2a000d6, /* movk x22, #6, lsl #16 (400000) */
+
+    /* pass: */
+    0xd34afea9, /* lsr x9, x21, #10 */
+    0x92402129, /* and x9, x9, #511 */
+    0x8b090e8a, /* add x10, x20, x9, lsl #3 */
+    0xd280080b, /* mov x11, #64 */
+    /* page: */
+    0xf9000155, /* str x21, [x10] */
+    0x9140054a, /* add x10, x10, #4096 */
+    0xf100056b, /* subs x11, x11, #1 */
+    0x54ffffa1, /* b.ne page */
+    0x910006b5, /* add x21, x21, #1 */
+    0xeb1602bf, /* cmp x21, x22 */
+    0x54fffec3, /* b.lo pass */
+
+    0xaa1403ea, /* mov x10, x20 */
+    0xd290000b, /* mov x11, #32768 (words) */
+    0xd280000c, /* mov x12, #0 */
+    /* sum: */
+    0xf8408549, /* ldr x9, [x10], #8 */
+    0x8b09018c, /* add x12, x12, x9 */
+    0xf100056b, /* subs x11, x11, #1 */
+    0x54ffffa1, /* b.ne sum */
+
+    0xd280020d, /* mov x13, #16 */
+    /* digit: */
+    0xd37cfd81, /* lsr x1, x12, #60 */
+    0xf100283f, /* cmp x1, #10 */
+    0x9100c022, /* add x2, x1, #'0' */
+    0x91015c23, /* add x3, x1, #('a' - 10) */
+    0x9a833041, /* csel x1, x2, x3, lo */
+    0xd2800020, /* mov x0, #1 (HYPERCALL_PUTCHAR) */
+    0xd4000002, /* hvc #0 */
+    0xd37ced8c, /* lsl x12, x12, #4 */
+    0xf10005ad, /* subs x13, x13, #1 */
+    0x54fffee1, /* b.ne digit */
+    0xd2800141, /* mov x1, #'\n' */
+    0xd2800020, /* mov x0, #1 */
+    0xd4000002, /* hvc #0 */
+
+    0xd2800000, /* mov x0, #0 (HYPERCALL_EXIT) */
+    0xd4000002, /* hvc #0 */
+};
+
+/*
+ * Lock-heavy SMP guest (--backend=sw --vcpus=N, see "vCPU Overcommit"):
+ * every vCPU takes a spinlock 20000 times and does some work on a shared
+ * counter under it, and some outside. The lock word holds the holder's
+ * vCPU index + 1, and bit 31 once someone waits. A waiter spins 256 times,
+ * then sets bit 31 and makes a LOCK_WAIT hypercall; an unlock that finds
+ * bit 31 set makes a LOCK_KICK. The last vCPU done prints the counter in
+ * hex, N * 20000 (0000000000013880 for N = 4).
+ */
+static const uint32_t guest_pvlock[] = {
+    0xd2a00118, /* mov x24, #0x80000 (lock) */
+    0x91010319, /* add x25, x24, #0x40 (counter) */
+    0x9102031c, /* add x28, x24, #0x80 (vCPUs done) */
+    0x110006b4, /* add w20, w21, #1 (lock word when held by us) */
+    0xd289c413, /* mov x19, #20000 */
+
+    /* acquire: */
+    0x5280200b, /* mov w11, #256 */
+    /* spin: */
+    0x885fff09, /* ldaxr w9, [x24] */
+    0x350003a9, /* cbnz w9, held */
+    0x880a7f14, /* stxr w10, w20, [x24] */
+    0x35ffffaa, /* cbnz w10, spin */
+    0xf9400329, /* ldr x9, [x25] */
+    0xd280080a, /* mov x10, #64 */
+    /* work: */
+    0x8b0a0129, /* add x9, x9, x10 */
+    0xf100054a, /* subs x10, x10, #1 */
+    0x54ffffc1, /* b.ne work */
+    0xd1207d29, /* sub x9, x9, #2079 (+1 in all) */
+    0xf9000329, /* str x9, [x25] */
+    0xb87f8309, /* swpl wzr, w9, [x24] (unlock) */
+    0x36f80089, /* tbz w9, #31, outside */
+    0xd28000e0, /* mov x0, #7 (HYPERCALL_LOCK_KICK) */
+    0xaa1803e1, /* mov x1, x24 */
+    0xd4000002, /* hvc #0 */
+    /* outside: */
+    0xd280080a, /* mov x10, #64 */
+    /* think: */
+    0xf100054a, /* subs x10, x10, #1 */
+    0x54ffffe1, /* b.ne think */
+    0xf1000673, /* subs x19, x19, #1 */
+    0x54fffd61, /* b.ne acquire */
+
+    0x52800029, /* mov w9, #1 */
+    0xb8e90389, /* ldaddal w9, w9, [x28] */
+    0x11000529, /* add w9, w9, #1 */
+    0x6b16013f, /* cmp w9, w22 (number of vCPUs) */
+    0x54000061, /* b.ne exit (the last one done reports) */
+    0xf940032f, /* ldr x15, [x25] */
+    0x9400000d, /* bl print */
+    /* exit: */
+    0xd2800000, /* mov x0, #0 (HYPERCALL_EXIT) */
+    0xd4000002, /* hvc #0 */
+
+    /* held: */
+    0x7100056b, /* subs w11, w11, #1 */
+    0x54fffc21, /* b.ne spin */
+    0x3201012c, /* orr w12, w9, #0x80000000 (waiting) */
+    0x880a7f0c, /* stxr w10, w12, [x24] */
+    0x35fffbaa, /* cbnz w10, acquire */
+    0xd28000c0, /* mov x0, #6 (HYPERCALL_LOCK_WAIT) */
+    0xaa1803e1, /* mov x1, x24 */
+    0x2a0c03e2, /* mov w2, w12 */
+    0xd4000002, /* hvc #0 */
+    0x17ffffd8, /* b acquire */
+
+    /* print: x15 as 16 hex digits and a newline */
+    0xd2800790, /* mov x16, #60 */
+    /* digit: */
+    0x9ad025e1, /* lsr x1, x15, x16 */
+    0x92400c21, /* and x1, x1, #0xf */
+    0xf100283f, /* cmp x1, #10 */
+    0x9100c022, /* add x2, x1, #'0' */
+    0x91015c23, /* add x3, x1, #('a' - 10) */
+    0x9a833041, /* csel x1, x2, x3, lo */
+    0xd2800020, /* mov x0, #1 (HYPERCALL_PUTCHAR) */
+    0xd4000002, /* hvc #0 */
+    0xf1001210, /* subs x16, x16, #4 */
+    0x54fffeea, /* b.ge digit */
+    0xd2800141, /* mov x1, #'\n' */
+    0xd2800020, /* mov x0, #1 */
+    0xd4000002, /* hvc #0 */
+    0xd65f03c0, /* ret */
+};
+
+/* A label in a guest image, for symbolizing profiles */
+typedef struct
+{
+    uint32_t offset; /* From the start of the image */
+    const char *name;
+} guest_sym_t;
+
+/* Labels of the images above, by offset, each list ends with a NULL name */
+static const guest_sym_t guest_code_syms[] = {
+    {0x000, "_start"}, {0x120, "loop"}, {0, NULL},
+};
+static const guest_sym_t guest_cmploop_syms[] = {
+    {0x00, "_start"}, {0x10, "loop"}, {0x38, "print"}, {0, NULL},
+};
+static const guest_sym_t guest_atomics_syms[] = {
+    {0x00, "_start"}, {0x20, "loop"}, {0x3c, "cas"}, {0x54, "lock"},
+    {0x94, "wait"}, {0xc8, "print"}, {0xcc, "digit"}, {0, NULL},
+};
+static const guest_sym_t guest_timer_syms[] = {
+    {0x00, "_start"}, {0x08, "period"}, {0x18, "wait"}, {0x3c, "print"}, {0, NULL},
+};
+static const guest_sym_t guest_fuzz_syms[] = {
+    {0x00, "_start"}, {0x64, "crash"}, {0x6c, "done"}, {0, NULL},
+};
+static const guest_sym_t guest_idle_syms[] = {
+    {0x00, "_start"}, {0x04, "nap"}, {0x18, "wait"}, {0, NULL},
+};
+static const guest_sym_t guest_sparse_syms[] = {
+    {0x00, "_start"}, {0x04, "touch"}, {0x18, "report"}, {0x30, "done"}, {0, NULL},
+};
+static const guest_sym_t guest_dirty_syms[] = {
+    {0x00, "_start"}, {0x10, "pass"}, {0x20, "page"}, {0x48, "sum"}, {0x5c, "digit"}, {0, NULL},
+};
+static const guest_sym_t guest_pvlock_syms[] = {
+    {0x00, "_start"}, {0x14, "acquire"}, {0x18, "spin"}, {0x30, "work"}, {0x58, "outside"},
+    {0x5c, "think"}, {0x88, "exit"}, {0x90, "held"}, {0xb8, "print"}, {0xbc, "digit"}, {0, NULL},
+};
+
+/* Guest images selectable with --guest */
+typedef struct
+{
+    const char *name;
+    const uint32_t *code;
+    size_t size;
+    const guest_sym_t *syms;
+} guest_image_t;
+
+static const guest_image_t guest_images[] = {
+    {"hello", guest_code, sizeof(guest_code), guest_code_syms},
+    {"cmploop", guest_cmploop, sizeof(guest_cmploop), guest_cmploop_syms},
+    {"atomics", guest_atomics, sizeof(guest_atomics), guest_atomics_syms},
+    {"timer", guest_timer, sizeof(guest_timer), guest_timer_syms},
+    {"fuzz", guest_fuzz, sizeof(guest_fuzz), guest_fuzz_syms},
+    {"idle", guest_idle, sizeof(guest_idle), guest_idle_syms},
+    {"sparse", guest_sparse, sizeof(guest_sparse), guest_sparse_syms},
+    {"dirty", guest_dirty, sizeof(guest_dirty), guest_dirty_syms},
+    {"pvlock", guest_pvlock, sizeof(guest_pvlock), guest_pvlock_syms},
+};
+
+/* Image every VM runs (set from the command line before any fork) */
+static const guest_image_t *guest_image = &guest_images[0];
+
+/* Guest RAM size of every VM (--mem, set before any fork) */
+static size_t guest_mem_size = GUEST_MEM_SIZE;
+
+/* ============================================================================
+ * VM Configuration
+ * ============================================================================
+ *
+ * Per-VM resource controls, modelled on the cgroup v2 knobs of the same
+ * name. macOS has no cgroups, so the VMM enforces them itself:
+ *
+ * - cpu.max:     the VM process may use at most `quota` us of CPU time in
+ *                every `period` us. A watchdog thread kicks the vCPU out
+ *                of the guest once the quota is used up and the vCPU sleeps
+ *                until the next period starts.
+ * - memory.high: soft limit on the process physical footprint. Above it
+ *                the VMM hands the guest's zero pages back to the host
+ *                and throttles the vCPU for one period instead of killing
+ *                it, the same way the kernel reclaims from and throttles a
+ *                cgroup. A VM still over the limit runs every other
+ *                period, so one that can't shrink slows down but is never
+ *                starved.
+ * - io.weight:   1..10000 (default 100), mapped onto a disk I/O policy.
+ *
+ * Limits are applied by the child itself right after fork(), before any
+ * guest memory exists, so there is no separate "move into group" step.
+ */
+
+#define MAX_VMS 2
+#define VM_MAX_VCPUS 8
+
+#define CPU_MAX_PERIOD_DEFAULT_US 100000 /* Same default period as cpu.max */
+#define IO_WEIGHT_DEFAULT 100
+
+#define VM_MAX_PREFAULT 8 /* --prefault ranges */
+
+/* Execution backends */
+#define VM_BACKEND_HVF 0 /* Hypervisor.framework (hardware) */
+#define VM_BACKEND_SW 1  /* Software translator, see swcpu.h */
+
+/* A range of guest physical addresses, end exclusive */
+typedef struct
+{
+    uint64_t start;
+    uint64_t end;
+} vm_range_t;
+
+typedef struct
+{
+    int id;                     /* VM identifier (1 or 2) */
+    int backend;                /* VM_BACKEND_* */
+    int vcpus;                  /* vCPUs per VM (more than 1: sw backend only) */
+    int pcpus;                  /* CPUs the vCPUs share (0 = one each) */
+    bool pvlock;                /* Handle the PV spinlock hypercalls */
+    char tcache_path[256];      /* Persistent translation cache ("" = none) */
+    uint32_t icount_mips;       /* CNTVCT from instruction count (0 = host clock) */
+    char profile_path[256];     /* Guest profile output, ".<id>" appended ("" = none) */
+    char wss_path[256];         /* Working-set log, ".<id>" appended ("" = none) */
+    uint32_t hibernate_idle_ms; /* Hibernate after this long idle (0 = never) */
+    uint32_t postcopy_ms;       /* Migrate this long after starting (0 = never) */
+    uint32_t precopy_rounds;    /* Copy memory this often first (0 = post-copy only) */
+    uint32_t upgrade_ms;        /* Hand over to a new VMM every this many ms (0 = never) */
+    int sched_class;            /* SCHED_* class (--sched) */
+    uint32_t sched_weight;      /* CPU share weight (0 = not scheduled) */
+    vm_range_t prefault[VM_MAX_PREFAULT]; /* Guest memory to fault in at creation */
+    int n_prefault;
+    char hib_path[256];         /* Hibernation snapshot, set by the parent */
+    uint64_t cpu_max_quota_us;  /* CPU time per period (0 = unlimited) */
+    uint64_t cpu_max_period_us; /* Accounting period for cpu_max_quota_us */
+    uint64_t mem_high;          /* Soft footprint limit in bytes (0 = none) */
+    int io_weight;              /* Relative disk I/O weight */
+
+    /* Spawn bookkeeping, filled in by the launcher */
+    uint64_t spawn_start_ns;    /* When the spawn was requested */
+    int bench_slot;             /* Spawn benchmark slot, or -1 */
+    bool resume;                /* Restore from hib_path instead of booting */
+    uint64_t wake_event_ns;     /* What woke a resumed VM, and when */
+    int migrate_fd;             /* Post-copy migration or live upgrade socket, or -1 */
+    int migrate_peer_fd;        /* The other process's end, closed by the child */
+    int up_next_fd;             /* New VMM: socket to its own successor, or -1 */
+    bool incoming;              /* Migration or upgrade destination: wait for the VM */
+} vm_config_t;
+
 /* ============================================================================
  * VMM State
  * ============================================================================ */
 
+/* Reasons for kicking a vCPU out of hv_vcpu_run() (bitmask) */
+#define VM_KICK_THROTTLE (1u << 0) /* Resource controller wants it paused */
+#define VM_KICK_STOP (1u << 1)     /* Another vCPU failed, stop the VM */
+#define VM_KICK_SAMPLE (1u << 2)   /* Profiler wants the guest PC */
+#define VM_KICK_PRESSURE (1u << 3) /* Host memory pressure, see mp_service() */
+#define VM_KICK_WSS (1u << 4)      /* Working-set estimator wants the accesses */
+#define VM_KICK_MIGRATE (1u << 5)  /* Post-copy migration step, see pc_service() */
+#define VM_KICK_DIRTY (1u << 6)    /* Pre-copy wants the dirty pages */
+#define VM_KICK_UPGRADE (1u << 7)  /* Live upgrade handover, see up_service() */
+#define VM_KICK_SCHED (1u << 8)    /* End of quantum or preempted, see sched_service() */
+#define VM_KICK_SLICE (1u << 9)    /* End of a vCPU's --pcpus quantum, see oc_service() */
+#define VM_KICK_RECLAIM (1u << 10) /* Over memory.high, see rctl_reclaim() */
+
+struct vm_state;
+
+/*
+ * One vCPU. The boot vCPU (index 0) runs on the main thread; with the
+ * software backend a VM can have more, each on a thread of its own.
+ */
 typedef struct
+{
+    struct vm_state *vm;       /* VM this vCPU belongs to */
+    int index;                 /* 0 = boot vCPU */
+    hv_vcpu_t vcpu;            /* vCPU handle */
+    hv_vcpu_exit_t *vcpu_exit; /* Pointer to exit info structure */
+    sw_cpu_t *sw;              /* Software vCPU (VM_BACKEND_SW only) */
+    hv_vcpu_exit_t sw_exit;    /* Exit info filled in for the software vCPU */
+    bool running;              /* Has not exited yet */
+    int result;                /* vcpu_run() result (secondary vCPUs) */
+    atomic_uint kick;          /* Pending VM_KICK_* reasons */
+    pthread_t thread;          /* Host thread (secondary vCPUs) */
+    uint64_t idle_since_ns;    /* Idle (only WFI) since, 0 = not idle */
+    uint64_t idle_insns;       /* sw->insns at the last WFI */
+    int oc_state;              /* OC_* (under vm->oc_lock, see "vCPU Overcommit") */
+    uint64_t oc_since_ns;      /* When it got its CPU */
+    uint64_t pv_lock;          /* Guest spinlock it is parked on... */
+    bool pv_parked;            /* ...if it is */
+    bool pv_kicked;
+} vcpu_state_t;
+
+typedef struct vm_state
 {
     int id;                    /* VM identifier (1 or 2) */
+    const vm_config_t *cfg;    /* Configuration this VM was launched with */
     void *mem;                 /* Guest memory (host virtual address) */
     size_t mem_size;           /* Size of guest memory */
-    hv_vcpu_t vcpu;            /* vCPU handle */
-    hv_vcpu_exit_t *vcpu_exit; /* Pointer to exit info structure */
-    bool running;              /* Is the VM still running? */
+    int mem_fd;                /* Guest memory's shared memory object (--upgrade), or -1 */
+    vcpu_state_t vcpus[VM_MAX_VCPUS];
+    int nr_vcpus;
+    atomic_uint code_epoch;    /* Shared by the software vCPUs (see swcpu.h) */
+    tcache_t *tcache;          /* Persistent translation cache, or NULL */
+    bool image_preloaded;      /* Guest memory came from the zygote template */
+
+    /* Resource control (see "VM Configuration") */
+    pthread_t rctl_thread;     /* cpu.max / memory.high watchdog */
+    bool rctl_started;
+    atomic_bool rctl_stop;
+    atomic_uint_fast64_t throttle_until_ns; /* vCPU sleeps until this time */
+    uint64_t nr_periods;       /* cpu.stat style counters */
+    uint64_t nr_throttled;
+    uint64_t throttled_usec;
+    uint64_t mem_high_events;  /* memory.events "high" counter */
+    uint64_t mem_high_reclaimed; /* Bytes reclaimed on crossing memory.high */
+    uint64_t mem_reported_free; /* Bytes the guest handed back (FREE_PAGES) */
+
+    /* PC sampler (see "Guest Profiling") */
+    pthread_t prof_thread;
+    bool prof_started;
+    atomic_bool prof_stop;
+    struct prof_sample *prof_samples; /* Hash table of PROF_MAX_PCS */
+    uint64_t prof_dropped;     /* Samples that found the table full */
+
+    /* Working-set estimator (see "Working-Set Estimation") */
+    pthread_t wss_thread;
+    bool wss_started;
+    atomic_bool wss_stop;
+    pthread_mutex_t wss_lock;  /* Guards wss_accessed and wss_age */
+    uint8_t *wss_accessed;     /* Bitmap: pages touched this interval */
+    uint8_t *wss_age;          /* Per page: intervals since touched */
+    atomic_int wss_pending;    /* vCPUs yet to hand over this interval */
+    FILE *wss_log;
+    uint64_t wss_start_ns;
+    uint64_t wss_hot, wss_warm, wss_cold;
+    uint64_t wss_peak_hot, wss_peak_warm;
+
+    /* Idle hibernation (see "Hibernation") */
+    bool hibernating;          /* Stopped to be written out */
+    uint64_t hib_wake_ns;      /* When its timer fires, UINT64_MAX if never */
+
+    /* Post-copy migration (see "Post-Copy Migration") */
+    pthread_t pc_thread;       /* Source: migration timer; destination: receiver */
+    bool pc_started;
+    atomic_bool pc_stop;
+    bool migrating;            /* Source: stopped to be sent to the destination */
+    uint64_t pc_stop_ns;       /* Source: when its vCPU stopped */
+    uint8_t *pc_absent;        /* Destination: bitmap of pages not yet received */
+    pthread_mutex_t pc_lock;   /* Guards the counters below and pc_eof */
+    pthread_cond_t pc_arrived; /* A page came in, or the source hung up */
+    bool pc_eof;
+    uint32_t pc_pages;         /* Pages the source is sending */
+    uint32_t pc_received;
+    uint32_t pc_demand;        /* Of those, fetched by a guest fault */
+    uint64_t pc_demand_wait_ns;
+    uint64_t pc_resume_ns;     /* When the guest ran again */
+    uint64_t pc_done_ns;       /* When the last page arrived, 0 = not yet */
+    uint64_t pc_done_insns;    /* Guest instructions by then */
+    xfer_encoder_t *pc_enc;    /* Source: page encoder, with its cache */
+    xfer_stats_t pc_xfer;      /* Pages encoded (source) or decoded (destination) */
+    uint8_t *pc_dirty;         /* Source: pages dirtied since the last round */
+    bool pc_harvested;         /* pc_dirty was handed over (under pc_lock) */
+    uint32_t pc_precopied;     /* Source: pages sent before stopping */
+
+    /* Live upgrade (see "Live Upgrade") */
+    int up_fd;                 /* Socket the next VMM connects on, or -1 */
+    pthread_t up_thread;       /* Waits for the next VMM to be ready */
+    bool up_started;
+    atomic_bool up_stop;
+    bool upgrading;            /* Old VMM: stopped to hand the VM over */
+    uint64_t up_stop_ns;       /* Old VMM: when its vCPU stopped */
+
+    /* Fair-share scheduling (see "Fair-Share Scheduling") */
+    struct sched_shared *sched; /* Slot of this VM, NULL = not scheduled */
+    pthread_t sched_thread;    /* Quantum ticker */
+    bool sched_started;
+    atomic_bool sched_stop;
+    uint64_t sched_cpu_ns;     /* Thread CPU time charged up to */
+
+    /* vCPU overcommit and PV spinlocks (see "vCPU Overcommit") */
+    pthread_mutex_t oc_lock;   /* Guards the CPUs, the queue and the parked vCPUs */
+    pthread_cond_t oc_cond;    /* A CPU was handed over, or a lock released */
+    bool oc_initialized;
+    int oc_free;               /* CPUs no vCPU holds */
+    int oc_queue[VM_MAX_VCPUS]; /* vCPUs waiting for a CPU, a ring */
+    int oc_head, oc_len;
+    pthread_t oc_thread;       /* Time slicer */
+    bool oc_started;
+    atomic_bool oc_stop;
+    uint64_t oc_preemptions;   /* Quanta ended with others waiting */
+    uint64_t oc_wait_ns;       /* vCPU time spent waiting for a CPU */
+    uint64_t pv_waits, pv_handoffs, pv_timeouts, pv_kicks;
 } vm_state_t;
 
 /* ============================================================================
@@ -289,414 +1017,7273 @@ static const char *hv_strerror(hv_return_t ret)
     } while (0)
 
 /* ============================================================================
- * VM Lifecycle Functions
+ * Time Helpers
  * ============================================================================ */
 
-/*
- * Initialize the VM: create VM instance and allocate guest memory
- */
-static int vm_init(vm_state_t *vm)
+/* Convert mach absolute time units (ticks) to nanoseconds */
+static uint64_t mach_to_ns(uint64_t ticks)
 {
-    printf("[VM %d] Creating virtual machine...\n", vm->id);
-
-    /* Step 1: Create the VM instance for this process */
-    HV_CHECK(hv_vm_create(NULL));
-    printf("[VM %d] VM created successfully\n", vm->id);
-
-    /* Step 2: Allocate guest memory
-     * We use mmap to get page-aligned memory that can be mapped into the guest
-     */
-    vm->mem_size = GUEST_MEM_SIZE;
-    vm->mem = mmap(NULL, vm->mem_size,
-                   PROT_READ | PROT_WRITE,
-                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-
-    if (vm->mem == MAP_FAILED)
+    static mach_timebase_info_data_t tb;
+    if (tb.denom == 0)
     {
-        perror("mmap");
-        hv_vm_destroy();
-        return -1;
+        mach_timebase_info(&tb);
     }
-    printf("[VM %d] Allocated %zu KB guest memory at %p\n",
-           vm->id, vm->mem_size / 1024, vm->mem);
-
-    /* Step 3: Map the host memory into guest physical address space
-     * The guest will see this memory starting at IPA (Intermediate Physical Address) 0
-     */
-    HV_CHECK(hv_vm_map(vm->mem, 0, vm->mem_size,
-                       HV_MEMORY_READ | HV_MEMORY_WRITE | HV_MEMORY_EXEC));
-    printf("[VM %d] Mapped guest memory: GPA 0x0 - 0x%zx\n", vm->id, vm->mem_size);
-
-    return 0;
+    return ticks * tb.numer / tb.denom;
 }
 
-/*
- * Create and configure the vCPU
- */
-static int vcpu_init(vm_state_t *vm)
+static uint64_t now_ns(void)
 {
-    printf("[VM %d] Creating vCPU...\n", vm->id);
+    return mach_to_ns(mach_absolute_time());
+}
 
-    /* Create the vCPU
-     * The exit pointer will be filled in by the framework
-     */
-    HV_CHECK(hv_vcpu_create(&vm->vcpu, &vm->vcpu_exit, NULL));
-    printf("[VM %d] vCPU created\n", vm->id);
+static void sleep_until_ns(uint64_t deadline)
+{
+    uint64_t now = now_ns();
+    if (deadline > now)
+    {
+        uint64_t delta = deadline - now;
+        struct timespec ts = {
+            .tv_sec = (time_t)(delta / 1000000000ull),
+            .tv_nsec = (long)(delta % 1000000000ull),
+        };
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+            ;
+    }
+}
 
-    /* Set up initial register state
-     *
-     * For ARM64:
-     * - PC: Where to start executing
-     * - SP: Stack pointer
-     * - CPSR: Current program status (we use EL1h = kernel mode with SP_EL1)
-     */
+static uint64_t timeval_usec(struct timeval tv)
+{
+    return (uint64_t)tv.tv_sec * 1000000ull + (uint64_t)tv.tv_usec;
+}
 
-    /* Program counter: point to our guest code */
-    HV_CHECK(hv_vcpu_set_reg(vm->vcpu, HV_REG_PC, GUEST_CODE_ADDR));
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
 
-    /* Stack pointer (SP_EL0 is used when running at EL1 with SP_EL0 selected) */
-    HV_CHECK(hv_vcpu_set_sys_reg(vm->vcpu, HV_SYS_REG_SP_EL0, GUEST_STACK_ADDR));
+/* ============================================================================
+ * Resource Control (runs inside the VM process)
+ * ============================================================================ */
 
-    /* CPSR: EL1h mode (bits [3:0] = 0b0101 = EL1 with SP_EL1)
-     * Bit 9 (E) = 0: Little endian
-     * Bit 8 (A) = 0: No SError masking
-     * Bit 7 (I) = 1: IRQ masked (we don't use interrupts)
-     * Bit 6 (F) = 1: FIQ masked
-     */
-    HV_CHECK(hv_vcpu_set_reg(vm->vcpu, HV_REG_CPSR, 0x3c5)); /* EL1h, interrupts masked */
+/* CPU time used by this process (all threads, including the vCPU), in us */
+static uint64_t process_cpu_usec(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return timeval_usec(ru.ru_utime) + timeval_usec(ru.ru_stime);
+}
 
-    /* Clear general purpose registers */
-    for (int i = 0; i <= 30; i++)
+/* Physical footprint of this process, the macOS analogue of memory.current */
+static uint64_t process_footprint(void)
+{
+    struct rusage_info_v4 ri;
+    if (proc_pid_rusage(getpid(), RUSAGE_INFO_V4, (rusage_info_t *)&ri) != 0)
     {
-        HV_CHECK(hv_vcpu_set_reg(vm->vcpu, HV_REG_X0 + i, 0));
+        return 0;
     }
+    return ri.ri_phys_footprint;
+}
 
-    /* Set X20 to VM ID so guest can identify itself */
-    HV_CHECK(hv_vcpu_set_reg(vm->vcpu, HV_REG_X20, vm->id));
-
-    printf("[VM %d] vCPU initialized: PC=0x%x, SP=0x%x\n",
-           vm->id, GUEST_CODE_ADDR, GUEST_STACK_ADDR);
-
-    return 0;
+/* Map a cgroup-style io.weight onto the closest macOS disk I/O policy */
+static int io_weight_to_policy(int weight)
+{
+    if (weight >= IO_WEIGHT_DEFAULT)
+        return IOPOL_IMPORTANT;
+    if (weight >= IO_WEIGHT_DEFAULT / 2)
+        return IOPOL_STANDARD;
+    if (weight >= IO_WEIGHT_DEFAULT / 10)
+        return IOPOL_UTILITY;
+    return IOPOL_THROTTLE;
 }
 
 /*
- * Load guest code into VM memory
+ * Apply the limits the kernel can enforce for us.
+ * Called in the freshly forked child, before the VM is created.
  */
-static int load_guest(vm_state_t *vm)
+static int rctl_apply(const vm_config_t *cfg)
 {
-    printf("[VM %d] Loading guest code...\n", vm->id);
-
-    /* Copy guest code to the appropriate location in guest memory */
-    size_t code_size = sizeof(guest_code);
-
-    if (GUEST_CODE_ADDR + code_size > vm->mem_size)
+    if (cfg->io_weight != IO_WEIGHT_DEFAULT &&
+        setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_PROCESS,
+                       io_weight_to_policy(cfg->io_weight)) != 0)
     {
-        fprintf(stderr, "[VM %d] Error: Guest code too large\n", vm->id);
+        perror("setiopolicy_np");
         return -1;
     }
-
-    memcpy((uint8_t *)vm->mem + GUEST_CODE_ADDR, guest_code, code_size);
-
-    printf("[VM %d] Loaded %zu bytes of guest code at GPA 0x%x\n",
-           vm->id, code_size, GUEST_CODE_ADDR);
-
     return 0;
 }
 
 /*
- * Handle a hypercall from the guest
- *
- * Hypercalls use the HVC instruction in ARM64. When the guest executes HVC,
- * we get an exception and can read the guest's registers to see what it wants.
+ * Force every vCPU out of hv_vcpu_run() so the run loops can act on
+ * `reason`. Safe to call from any thread.
  */
-static int handle_hypercall(vm_state_t *vm)
+static void vm_kick(vm_state_t *vm, unsigned int reason)
 {
-    uint64_t x0, x1, pc;
-    // static int call_count = 0;
+    for (int i = 0; i < vm->nr_vcpus; i++)
+    {
+        vcpu_state_t *vcpu = &vm->vcpus[i];
 
-    /* Read hypercall number and argument */
-    hv_vcpu_get_reg(vm->vcpu, HV_REG_X0, &x0);
-    hv_vcpu_get_reg(vm->vcpu, HV_REG_X1, &x1);
-    hv_vcpu_get_reg(vm->vcpu, HV_REG_PC, &pc);
+        atomic_fetch_or(&vcpu->kick, reason);
+        if (vcpu->sw != NULL)
+        {
+            sw_cpu_kick(vcpu->sw);
+        }
+        else
+        {
+            hv_vcpus_exit(&vcpu->vcpu, 1);
+        }
+    }
+}
 
-    /* Debug: show first few hypercalls */
-    // if (call_count < 20) {
-    //     fprintf(stderr, "[DEBUG] Hypercall #%d: PC=0x%llx x0=%llu x1=0x%llx('%c')\n",
-    //             call_count, pc, x0, x1, (x1 >= 32 && x1 < 127) ? (char)x1 : '?');
-    // }
-    // call_count++;
+/*
+ * Watchdog enforcing cpu.max and memory.high.
+ *
+ * Each period we sleep for as long as the remaining quota (the vCPU can't
+ * burn CPU faster than wall-clock time), then check actual usage. Once the
+ * quota is gone the vCPU is kicked and parked until the period ends.
+ *
+ * Over memory.high the vCPU is kicked to reclaim first. Throttling alone
+ * would not shrink anything, so the throttle is bounded: at most every
+ * other period, however long the footprint stays over the limit.
+ */
+static void *rctl_thread_main(void *arg)
+{
+    vm_state_t *vm = arg;
+    const vm_config_t *cfg = vm->cfg;
+    uint64_t period_ns = cfg->cpu_max_period_us * 1000;
+    bool mem_throttled = false; /* Last period was throttled for memory.high */
 
-    switch (x0)
+    while (!atomic_load(&vm->rctl_stop))
     {
-    case HYPERCALL_EXIT:
-        printf("\n[VM %d] Guest requested exit\n", vm->id);
-        vm->running = false;
-        break;
+        uint64_t end = now_ns() + period_ns;
+        uint64_t cpu_start = process_cpu_usec();
+        bool throttle = false;
 
-    case HYPERCALL_PUTCHAR:
-        /* Print a single character */
-        putchar((int)x1);
-        fflush(stdout);
-        break;
+        vm->nr_periods++;
 
-    case HYPERCALL_PUTS:
-        /* Print a string from guest memory */
+        /* memory.high: reclaim, and no CPU for this period unless the last
+         * one had none either */
+        if (cfg->mem_high && process_footprint() > cfg->mem_high)
+        {
+            vm->mem_high_events++;
+            vm_kick(vm, VM_KICK_RECLAIM);
+            throttle = !mem_throttled;
+        }
+        mem_throttled = throttle;
+
+        while (!throttle && cfg->cpu_max_quota_us)
         {
-            if (x1 < vm->mem_size)
+            uint64_t used = process_cpu_usec() - cpu_start;
+            uint64_t now = now_ns();
+
+            if (used >= cfg->cpu_max_quota_us)
             {
-                const char *str = (const char *)vm->mem + x1;
-                printf("%s", str);
+                throttle = true;
+                break;
+            }
+            if (now >= end)
+            {
+                break;
             }
+
+            uint64_t wake = now + (cfg->cpu_max_quota_us - used) * 1000;
+            sleep_until_ns(wake < end ? wake : end);
         }
-        break;
 
-    default:
-        printf("[VM %d] Unknown hypercall %llu at PC=0x%llx\n", vm->id, x0, pc);
-        break;
+        if (throttle)
+        {
+            vm->nr_throttled++;
+            atomic_store(&vm->throttle_until_ns, end);
+            vm_kick(vm, VM_KICK_THROTTLE);
+        }
+
+        sleep_until_ns(end);
     }
 
-    /* Note: PC already points past the HVC instruction after trap */
+    return NULL;
+}
+
+static int rctl_start(vm_state_t *vm)
+{
+    if (vm->cfg->cpu_max_quota_us == 0 && vm->cfg->mem_high == 0)
+    {
+        return 0; /* Nothing to enforce */
+    }
 
+    if (pthread_create(&vm->rctl_thread, NULL, rctl_thread_main, vm) != 0)
+    {
+        fprintf(stderr, "[VM %d] Failed to start resource controller\n", vm->id);
+        return -1;
+    }
+    vm->rctl_started = true;
     return 0;
 }
 
+static void rctl_stop(vm_state_t *vm)
+{
+    if (!vm->rctl_started)
+    {
+        return;
+    }
+
+    atomic_store(&vm->rctl_stop, true);
+    pthread_join(vm->rctl_thread, NULL);
+    vm->rctl_started = false;
+
+    printf("[VM %d] cpu.stat: nr_periods %llu nr_throttled %llu throttled_usec %llu\n",
+           vm->id, vm->nr_periods, vm->nr_throttled, vm->throttled_usec);
+    printf("[VM %d] memory.events: high %llu (%llu KB reclaimed)\n", vm->id,
+           vm->mem_high_events, vm->mem_high_reclaimed / 1024);
+}
+
+static uint64_t mp_reclaim(vm_state_t *vm); /* See "Memory Pressure" */
+
+/* Over memory.high: give the guest's zero pages back to the host */
+static void rctl_reclaim(vcpu_state_t *vcpu)
+{
+    vm_state_t *vm = vcpu->vm;
+
+    /* Other vCPUs could be writing the pages being freed */
+    if (vcpu->index != 0 || vm->nr_vcpus != 1)
+    {
+        return;
+    }
+    vm->mem_high_reclaimed += mp_reclaim(vm);
+}
+
+static void prof_sample(vcpu_state_t *vcpu); /* See "Guest Profiling" */
+static void mp_service(vcpu_state_t *vcpu);  /* See "Memory Pressure" */
+static void wss_harvest(vcpu_state_t *vcpu); /* See "Working-Set Estimation" */
+static void pc_service(vcpu_state_t *vcpu);  /* See "Post-Copy Migration" */
+static void pc_harvest(vcpu_state_t *vcpu);  /* See "Post-Copy Migration" */
+static void up_service(vcpu_state_t *vcpu);  /* See "Live Upgrade" */
+static void sched_service(vcpu_state_t *vcpu); /* See "Fair-Share Scheduling" */
+static void oc_service(vcpu_state_t *vcpu);  /* See "vCPU Overcommit" */
+
 /*
- * Handle a VM exit
- *
- * This is called whenever the guest stops executing and control returns
- * to the VMM. Common reasons include:
- * - Hypercalls (HVC instruction)
- * - System register access we don't allow
- * - Memory access faults
- * - Interrupts
+ * Act on kick requests. Called from the vCPU thread after a CANCELED exit.
  */
-static int handle_exit(vm_state_t *vm)
+static void vm_service_kicks(vcpu_state_t *vcpu)
 {
-    hv_vcpu_exit_t *exit = vm->vcpu_exit;
+    vm_state_t *vm = vcpu->vm;
+    unsigned int kick = atomic_exchange(&vcpu->kick, 0);
 
-    switch (exit->reason)
+    if (kick & VM_KICK_STOP)
     {
-    case HV_EXIT_REASON_EXCEPTION:
+        vcpu->running = false;
+        return;
+    }
+
+    if (kick & VM_KICK_SAMPLE)
     {
-        uint32_t ec = ESR_EC(exit->exception.syndrome);
-        uint64_t pc;
-        hv_vcpu_get_reg(vm->vcpu, HV_REG_PC, &pc);
+        prof_sample(vcpu);
+    }
 
-        switch (ec)
-        {
-        case EC_HVC64:
-            /* Hypervisor call - this is our communication channel */
-            return handle_hypercall(vm);
+    if (kick & VM_KICK_WSS)
+    {
+        wss_harvest(vcpu);
+    }
 
-        case EC_SYS64:
-            /* System register access - for now, just skip */
-            printf("[VM %d] System register access at PC=0x%llx, skipping\n", vm->id, pc);
-            hv_vcpu_set_reg(vm->vcpu, HV_REG_PC, pc + 4);
-            break;
+    if (kick & VM_KICK_DIRTY)
+    {
+        pc_harvest(vcpu);
+    }
 
-        case EC_DABORT_LOWER:
-            printf("[VM %d] Data abort at PC=0x%llx, fault addr=0x%llx\n",
-                   vm->id, pc, exit->exception.virtual_address);
-            vm->running = false;
-            return -1;
+    if (kick & VM_KICK_MIGRATE)
+    {
+        pc_service(vcpu);
+        if (!vcpu->running)
+        {
+            return;
+        }
+    }
 
-        case EC_IABORT_LOWER:
-            printf("[VM %d] Instruction abort at PC=0x%llx\n", vm->id, pc);
-            vm->running = false;
-            return -1;
+    if (kick & VM_KICK_UPGRADE)
+    {
+        up_service(vcpu);
+        return;
+    }
 
-        default:
-            printf("[VM %d] Unhandled exception EC=0x%x at PC=0x%llx\n", vm->id, ec, pc);
-            printf("[VM %d] Syndrome=0x%llx\n", vm->id, exit->exception.syndrome);
-            vm->running = false;
-            return -1;
+    if (kick & VM_KICK_PRESSURE)
+    {
+        mp_service(vcpu);
+        if (!vcpu->running)
+        {
+            return;
         }
-        break;
     }
 
-    case HV_EXIT_REASON_CANCELED:
-        printf("[VM %d] vCPU execution canceled\n", vm->id);
-        vm->running = false;
-        break;
+    if (kick & VM_KICK_SCHED)
+    {
+        sched_service(vcpu);
+    }
 
-    case HV_EXIT_REASON_VTIMER_ACTIVATED:
-        /* Virtual timer fired - we don't use it, just continue */
-        break;
+    if (kick & VM_KICK_SLICE)
+    {
+        oc_service(vcpu);
+    }
 
-    default:
-        printf("[VM %d] Unknown exit reason: %d\n", vm->id, exit->reason);
-        vm->running = false;
-        return -1;
+    if (kick & VM_KICK_RECLAIM)
+    {
+        rctl_reclaim(vcpu);
     }
 
-    return 0;
+    /* Every vCPU sleeps, the boot vCPU does the accounting */
+    if (kick & VM_KICK_THROTTLE)
+    {
+        uint64_t start = now_ns();
+        uint64_t until = atomic_load(&vm->throttle_until_ns);
+        if (until > start)
+        {
+            sleep_until_ns(until);
+            if (vcpu->index == 0)
+            {
+                vm->throttled_usec += (now_ns() - start) / 1000;
+            }
+        }
+    }
 }
 
-/*
- * Main VM execution loop
+/* ============================================================================
+ * Fair-Share Scheduling (runs inside the VM process)
+ * ============================================================================
+ *
+ * With --sched the VMs share --sched-cpus CPUs (default 1) through a
+ * scheduler of their own, in the manner of CFS: each VM accumulates a
+ * virtual runtime, the CPU time of its vCPU scaled down by its weight, and
+ * only the --sched-cpus runnable VMs with the least virtual runtime may
+ * run. The others wait in their vCPU loop. There is no scheduler process:
+ * the state is a table in shared memory, one slot per VM, that the parent
+ * maps before forking, like the memory pressure requests.
+ *
+ * Enforcement is time-slice accounting in the vCPU loop. A ticker thread
+ * kicks the vCPU at the end of each quantum, and the vCPU thread charges
+ * the CPU time it used to its VM and steps aside if another VM is owed
+ * the CPU more. How long a quantum is depends on the VM's class:
+ *
+ * - latency: 1 ms. A VM woken up by its timer is placed a little ahead of
+ *            the others (SCHED_WAKE_CREDIT_NS) and, if the CPUs are
+ *            busy, preempts the running VM furthest behind it with SIGURG
+ *            instead of waiting for that VM's quantum to end.
+ * - normal:  4 ms (the default).
+ * - batch:   20 ms, fewer interruptions for throughput.
+ *
+ * A VM in WFI gives its CPU up. When its timer fires it competes again
+ * from no less than the least virtual runtime of the others (less its
+ * credit), so sleeping banks no CPU time.
+ *
+ * Software backend with one vCPU only: Hypervisor.framework waits in WFI
+ * by itself, where the VMM cannot give the CPU away.
  */
-static int vm_run(vm_state_t *vm)
+
+#define SCHED_MAX_VMS 4                  /* Slots: MAX_VMS, or --bench-sched's VMs */
+#define SCHED_WEIGHT_DEFAULT 100
+#define SCHED_WAKE_CREDIT_NS 2000000ull  /* Latency class head start on waking */
+#define SCHED_POLL_US 200                /* How often a waiting VM looks for a CPU */
+#define SCHED_MAX_SAMPLES 4096           /* Wake latencies kept per VM */
+
+/* Classes (--sched) */
+#define SCHED_NORMAL 0
+#define SCHED_LATENCY 1
+#define SCHED_BATCH 2
+
+/* Slot states */
+#define SCHED_OFF 0     /* Not competing: not started, in WFI, or gone */
+#define SCHED_WAITING 1 /* Runnable, waiting for a CPU */
+#define SCHED_RUNNING 2
+
+static const char *const sched_class_names[] = {"normal", "latency", "batch"};
+static const uint64_t sched_quantum_ns[] = {4000000, 1000000, 20000000};
+
+/* One per VM, shared by the VM processes and the parent */
+typedef struct sched_shared
 {
-    printf("[VM %d] Starting guest execution...\n", vm->id);
-    printf("[VM %d] --- Guest Output ---\n", vm->id);
+    atomic_int state;                 /* SCHED_* */
+    atomic_int pid;                   /* Process the VM runs in now */
+    atomic_uint_fast64_t vruntime;    /* CPU ns * SCHED_WEIGHT_DEFAULT / weight */
+    atomic_bool preempt;              /* A waking VM wants the CPU */
 
-    vm->running = true;
+    /* Statistics, written by the VM */
+    atomic_uint_fast64_t run_ns;      /* CPU time charged */
+    atomic_uint_fast64_t wait_ns;     /* Runnable without a CPU */
+    atomic_uint_fast64_t preemptions; /* CPUs given up to a waking VM */
+    atomic_uint n_wakes;              /* Timer wakeups */
+    uint32_t wake_us[SCHED_MAX_SAMPLES]; /* Timer fired -> guest runs again */
+} sched_shared_t;
 
-    while (vm->running)
-    {
-        /* Run the vCPU until it exits */
-        hv_return_t ret = hv_vcpu_run(vm->vcpu);
+static sched_shared_t *sched_shared; /* SCHED_MAX_VMS slots, NULL = off */
+static int sched_cpus = 1;           /* --sched-cpus */
+static vm_state_t *sched_vm;         /* VM of this process, for the signal handler */
 
-        if (ret != HV_SUCCESS)
-        {
-            fprintf(stderr, "[VM %d] hv_vcpu_run failed: %s\n", vm->id, hv_strerror(ret));
-            return -1;
-        }
+/* --sched, one entry per VM, the last one repeated */
+static int sched_classes[MAX_VMS];
+static uint32_t sched_weights[MAX_VMS];
+static int n_sched_specs;
 
-        /* Handle the exit reason */
-        if (handle_exit(vm) < 0)
-        {
-            return -1;
-        }
+static void sched_on_sigurg(int sig)
+{
+    (void)sig;
+    if (sched_vm != NULL)
+    {
+        vm_kick(sched_vm, VM_KICK_SCHED);
     }
+}
 
-    printf("[VM %d] --- End Guest Output ---\n", vm->id);
-    return 0;
+/* Charge the CPU time the vCPU thread used since the last charge */
+static void sched_charge(vm_state_t *vm)
+{
+    uint64_t now = thread_cpu_ns();
+    uint64_t used = now - vm->sched_cpu_ns;
+
+    vm->sched_cpu_ns = now;
+    atomic_fetch_add(&vm->sched->run_ns, used);
+    atomic_fetch_add(&vm->sched->vruntime, used * SCHED_WEIGHT_DEFAULT / vm->cfg->sched_weight);
 }
 
 /*
- * Clean up VM resources
+ * May the VM have a CPU? It must be among the sched_cpus competing VMs
+ * with the least virtual runtime (ties go to the lower slot), and one
+ * `starting` to run also needs a CPU the others are not running on: a VM
+ * that should step aside does so at the end of its quantum.
  */
-static void vm_destroy(vm_state_t *vm)
+static bool sched_may_run(const vm_state_t *vm, bool starting)
 {
-    printf("[VM %d] Cleaning up...\n", vm->id);
+    int me = vm->id - 1;
+    uint64_t mine = atomic_load(&sched_shared[me].vruntime);
+    int ahead = 0, running = 0;
 
-    if (vm->vcpu)
+    for (int i = 0; i < SCHED_MAX_VMS; i++)
     {
-        hv_vcpu_destroy(vm->vcpu);
-    }
+        int state = atomic_load(&sched_shared[i].state);
+        uint64_t vr = atomic_load(&sched_shared[i].vruntime);
 
-    if (vm->mem)
-    {
-        hv_vm_unmap(0, vm->mem_size);
-        munmap(vm->mem, vm->mem_size);
+        if (i == me || state == SCHED_OFF)
+        {
+            continue;
+        }
+        ahead += vr < mine || (vr == mine && i < me);
+        running += state == SCHED_RUNNING;
     }
+    return ahead < sched_cpus && (!starting || running < sched_cpus);
+}
 
-    hv_vm_destroy();
+/* Least virtual runtime of the other competing VMs, UINT64_MAX if none */
+static uint64_t sched_min_vruntime(const vm_state_t *vm)
+{
+    uint64_t min = UINT64_MAX;
 
-    printf("[VM %d] VM destroyed\n", vm->id);
+    for (int i = 0; i < SCHED_MAX_VMS; i++)
+    {
+        uint64_t vr = atomic_load(&sched_shared[i].vruntime);
+        if (i != vm->id - 1 && atomic_load(&sched_shared[i].state) != SCHED_OFF && vr < min)
+        {
+            min = vr;
+        }
+    }
+    return min;
 }
 
-/* ============================================================================
- * Single VM Runner (called in child process)
- * ============================================================================ */
-
-static int run_single_vm(int vm_id)
+/* Wait in the vCPU loop until the VM may have a CPU */
+static void sched_wait(vm_state_t *vm)
 {
-    vm_state_t vm = {0};
-    vm.id = vm_id;
-    int result = 0;
+    uint64_t start = now_ns();
 
-    /* Initialize the VM */
-    if (vm_init(&vm) < 0)
+    atomic_store(&vm->sched->state, SCHED_WAITING);
+    while (!sched_may_run(vm, true))
     {
-        fprintf(stderr, "\n[VM %d] Failed to initialize VM.\n", vm_id);
-        fprintf(stderr, "Make sure you have the hypervisor entitlement.\n");
-        fprintf(stderr, "For development, run: codesign --entitlements entitlements.plist -s - tinyvmm\n");
-        return 1;
+        usleep(SCHED_POLL_US);
     }
+    atomic_store(&vm->sched->state, SCHED_RUNNING);
+    atomic_fetch_add(&vm->sched->wait_ns, now_ns() - start);
+    vm->sched_cpu_ns = thread_cpu_ns(); /* Waiting is not charged */
+}
 
-    /* Create vCPU */
-    if (vcpu_init(&vm) < 0)
+/* A latency VM woke up to busy CPUs: take one from the running VM
+ * furthest behind it rather than wait for that VM's quantum to end */
+static void sched_preempt(vm_state_t *vm)
+{
+    uint64_t worst = atomic_load(&vm->sched->vruntime);
+    int victim = -1;
+
+    for (int i = 0; i < SCHED_MAX_VMS; i++)
     {
-        vm_destroy(&vm);
-        return 1;
+        uint64_t vr = atomic_load(&sched_shared[i].vruntime);
+        if (i != vm->id - 1 && atomic_load(&sched_shared[i].state) == SCHED_RUNNING &&
+            vr > worst)
+        {
+            worst = vr;
+            victim = i;
+        }
     }
-
-    /* Load guest code */
-    if (load_guest(&vm) < 0)
+    if (victim >= 0)
     {
-        vm_destroy(&vm);
-        return 1;
+        atomic_store(&sched_shared[victim].preempt, true);
+        kill(atomic_load(&sched_shared[victim].pid), SIGURG);
     }
+}
 
-    /* Run the VM */
-    result = vm_run(&vm);
+/*
+ * Compete for a CPU again: at start, when the timer ends a WFI (`due` is
+ * when it fired), or when the guest ran on after a WFI without one (0).
+ */
+static void sched_wake(vm_state_t *vm, uint64_t due)
+{
+    bool latency = vm->cfg->sched_class == SCHED_LATENCY;
+    uint64_t floor = sched_min_vruntime(vm);
 
-    /* Clean up */
-    vm_destroy(&vm);
+    if (floor != UINT64_MAX)
+    {
+        uint64_t credit = latency ? SCHED_WAKE_CREDIT_NS : 0;
+        floor = floor > credit ? floor - credit : 0;
+        if (atomic_load(&vm->sched->vruntime) < floor)
+        {
+            atomic_store(&vm->sched->vruntime, floor);
+        }
+    }
 
-    if (result == 0)
+    atomic_store(&vm->sched->state, SCHED_WAITING);
+    if (latency && !sched_may_run(vm, true))
     {
-        printf("\n[VM %d] Guest completed successfully!\n", vm_id);
+        sched_preempt(vm);
     }
+    sched_wait(vm);
 
-    return result < 0 ? 1 : 0;
+    if (due != 0)
+    {
+        uint64_t now = now_ns();
+        unsigned int n = atomic_fetch_add(&vm->sched->n_wakes, 1);
+        if (n < SCHED_MAX_SAMPLES)
+        {
+            vm->sched->wake_us[n] = now > due ? (uint32_t)((now - due) / 1000) : 0;
+        }
+    }
 }
 
-/* ============================================================================
- * Main Entry Point
- * ============================================================================ */
-
-int main(void)
+/* WFI: the VM gives its CPU up while it sleeps */
+static void sched_idle(vm_state_t *vm)
 {
-    pid_t pid1, pid2;
-    int status1, status2;
-
-    printf("╔════════════════════════════════════════╗\n");
-    printf("║   TinyVMM - macOS Hypervisor Demo      ║\n");
-    printf("║   Running 2 VMs in parallel            ║\n");
-    printf("╚════════════════════════════════════════╝\n\n");
-    fflush(stdout);
+    if (vm->sched == NULL)
+    {
+        return;
+    }
+    sched_charge(vm);
+    atomic_store(&vm->sched->state, SCHED_OFF);
+}
 
-    /*
-     * Fork two child processes, each running its own VM.
-     * Apple's Hypervisor.framework allows one VM per process,
-     * so we use separate processes for true isolation.
-     */
+/* On the vCPU thread at the end of a quantum, or when preempted */
+static void sched_service(vcpu_state_t *vcpu)
+{
+    vm_state_t *vm = vcpu->vm;
+    bool preempted;
 
-    /* Fork first child for VM 1 */
-    pid1 = fork();
-    if (pid1 < 0)
+    if (vm->sched == NULL)
     {
-        perror("fork");
-        return 1;
+        return;
     }
-    if (pid1 == 0)
+    if (atomic_load(&vm->sched->state) == SCHED_OFF)
     {
-        /* Child process 1: Run VM 1 */
-        return run_single_vm(1);
+        sched_wake(vm, 0);
+        return;
     }
 
-    /* Fork second child for VM 2 */
-    pid2 = fork();
-    if (pid2 < 0)
+    sched_charge(vm);
+    preempted = atomic_exchange(&vm->sched->preempt, false);
+    if (sched_may_run(vm, false))
     {
-        perror("fork");
-        /* Kill first child if second fork fails */
-        kill(pid1, SIGTERM);
-        waitpid(pid1, NULL, 0);
-        return 1;
+        return;
     }
-    if (pid2 == 0)
+    if (preempted)
     {
-        /* Child process 2: Run VM 2 */
-        return run_single_vm(2);
+        atomic_fetch_add(&vm->sched->preemptions, 1);
+    }
+    sched_wait(vm);
+}
+
+/* Ends the quantum of the VM while it runs */
+static void *sched_thread_main(void *arg)
+{
+    vm_state_t *vm = arg;
+    uint64_t quantum = sched_quantum_ns[vm->cfg->sched_class];
+
+    while (!atomic_load(&vm->sched_stop))
+    {
+        sleep_until_ns(now_ns() + quantum);
+        if (atomic_load(&vm->sched->state) == SCHED_RUNNING)
+        {
+            vm_kick(vm, VM_KICK_SCHED);
+        }
+    }
+    return NULL;
+}
+
+/* Join the others, and wait for a CPU before the guest runs */
+static int sched_start(vm_state_t *vm)
+{
+    if (sched_shared == NULL || vm->cfg->sched_weight == 0)
+    {
+        return 0;
+    }
+    vm->sched = &sched_shared[vm->id - 1];
+    atomic_store(&vm->sched->pid, (int)getpid());
+    atomic_store(&vm->sched->preempt, false);
+    sched_vm = vm;
+    signal(SIGURG, sched_on_sigurg);
+
+    sched_wake(vm, 0);
+    if (pthread_create(&vm->sched_thread, NULL, sched_thread_main, vm) != 0)
+    {
+        fprintf(stderr, "[VM %d] Failed to start the scheduler tick\n", vm->id);
+        atomic_store(&vm->sched->state, SCHED_OFF);
+        vm->sched = NULL;
+        return -1;
+    }
+    vm->sched_started = true;
+    return 0;
+}
+
+/* Median, 99th percentile and worst of a slot's wake latencies */
+static unsigned int sched_wake_latency(const sched_shared_t *s, uint64_t *p50, uint64_t *p99,
+                                       uint64_t *max)
+{
+    unsigned int n = atomic_load(&s->n_wakes);
+    uint64_t *sorted;
+
+    n = n < SCHED_MAX_SAMPLES ? n : SCHED_MAX_SAMPLES;
+    *p50 = *p99 = *max = 0;
+    if (n == 0 || (sorted = malloc(n * sizeof(*sorted))) == NULL)
+    {
+        return 0;
+    }
+    for (unsigned int i = 0; i < n; i++)
+    {
+        sorted[i] = s->wake_us[i];
+    }
+    qsort(sorted, n, sizeof(*sorted), cmp_u64);
+    *p50 = sorted[n / 2];
+    *p99 = sorted[(n * 99) / 100];
+    *max = sorted[n - 1];
+    free(sorted);
+    return n;
+}
+
+static void sched_stop(vm_state_t *vm)
+{
+    uint64_t p50, p99, max;
+    unsigned int n;
+
+    if (vm->sched == NULL)
+    {
+        return;
+    }
+    if (vm->sched_started)
+    {
+        atomic_store(&vm->sched_stop, true);
+        pthread_join(vm->sched_thread, NULL);
+        vm->sched_started = false;
+    }
+    signal(SIGURG, SIG_IGN);
+    sched_vm = NULL;
+
+    /* A migrated VM may be competing from its new process already */
+    sched_charge(vm);
+    if (atomic_load(&vm->sched->pid) == (int)getpid())
+    {
+        atomic_store(&vm->sched->state, SCHED_OFF);
+    }
+
+    printf("[VM %d] sched: %s class, weight %u: ran %llu ms, waited %llu ms for a CPU, "
+           "preempted %llu times\n",
+           vm->id, sched_class_names[vm->cfg->sched_class], vm->cfg->sched_weight,
+           atomic_load(&vm->sched->run_ns) / 1000000, atomic_load(&vm->sched->wait_ns) / 1000000,
+           atomic_load(&vm->sched->preemptions));
+    n = sched_wake_latency(vm->sched, &p50, &p99, &max);
+    if (n != 0)
+    {
+        printf("[VM %d] sched: %u timer wakeups, running again after p50 %llu us, "
+               "p99 %llu us, max %llu us\n",
+               vm->id, n, p50, p99, max);
+    }
+    vm->sched = NULL;
+}
+
+/* Parent: the table, before any VM process is forked */
+static int sched_map(void)
+{
+    sched_shared = mmap(NULL, SCHED_MAX_VMS * sizeof(*sched_shared), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (sched_shared == MAP_FAILED)
+    {
+        perror("mmap");
+        sched_shared = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/* Parent: a VM process is gone, unless the VM has moved on it no longer
+ * competes */
+static void sched_release(int slot, pid_t pid)
+{
+    if (sched_shared != NULL && atomic_load(&sched_shared[slot].pid) == (int)pid)
+    {
+        atomic_store(&sched_shared[slot].state, SCHED_OFF);
+    }
+}
+
+/* ============================================================================
+ * vCPU Overcommit and PV Spinlocks (runs inside the VM process)
+ * ============================================================================
+ *
+ * --pcpus=N runs the software vCPUs of a VM on N CPUs, fewer than there
+ * are vCPUs, the way an overcommitted host does. A vCPU runs guest code
+ * only while it holds one of the N CPUs, and waits in a FIFO queue
+ * otherwise. Once a vCPU has run for OC_QUANTUM_US while others wait, the
+ * ticker thread kicks it, and it passes its CPU to the head of the queue
+ * and queues up again. A vCPU in WFI gives its CPU up.
+ *
+ * That brings lock-holder preemption with it: a vCPU that loses its CPU
+ * while it holds a guest spinlock leaves the others spinning on the lock
+ * for whole quanta. With --pvlock the guest can do better (see the pvlock
+ * guest). A vCPU that has spun for a while makes a LOCK_WAIT hypercall
+ * with the lock word as it saw it, which names the holder. If the word
+ * still reads the same, the host
+ *
+ * 1. gives the waiter's CPU straight to the holder if the holder is
+ *    waiting for one, ahead of the queue, else to the head of the queue,
+ * 2. and parks the waiter, without a CPU, until an unlock that finds
+ *    waiters makes a LOCK_KICK hypercall on the same lock, or PV_PARK_US.
+ *
+ * The word is checked under the lock the kicks take, as a futex does, so
+ * an unlock between the guest's look at the lock and its hypercall is not
+ * missed. Without --pvlock both hypercalls return right away and the
+ * guest spins on. Without --pcpus a parked vCPU still leaves its host CPU
+ * to the others, there is just no CPU to hand over.
+ */
+
+#define OC_QUANTUM_US 2000      /* Time slice of a vCPU on the --pcpus CPUs */
+#define PV_PARK_US 10000        /* Longest a LOCK_WAIT parks without a kick */
+#define PV_HOLDER_MASK 0xffffu  /* Lock word: holder's vCPU index + 1 */
+
+/* vCPU states under --pcpus */
+#define OC_OFF 0     /* No CPU: not started, in WFI, parked or exited */
+#define OC_QUEUED 1  /* Waiting for a CPU */
+#define OC_RUNNING 2 /* Has a CPU */
+
+/* Under oc_lock: take vCPU `index` out of the queue and give it a CPU */
+static void oc_grant_locked(vm_state_t *vm, int index)
+{
+    int n = 0;
+
+    for (int i = 0; i < vm->oc_len; i++)
+    {
+        int queued = vm->oc_queue[(vm->oc_head + i) % VM_MAX_VCPUS];
+        if (queued != index)
+        {
+            vm->oc_queue[n++] = queued;
+        }
+    }
+    vm->oc_head = 0;
+    vm->oc_len = n;
+    vm->vcpus[index].oc_state = OC_RUNNING;
+    vm->vcpus[index].oc_since_ns = now_ns();
+    pthread_cond_broadcast(&vm->oc_cond);
+}
+
+/* Under oc_lock: a vCPU stops running, its CPU goes to the head of the
+ * queue or back to the pool */
+static void oc_pass_locked(vcpu_state_t *vcpu)
+{
+    vm_state_t *vm = vcpu->vm;
+
+    vcpu->oc_state = OC_OFF;
+    if (vm->oc_len > 0)
+    {
+        oc_grant_locked(vm, vm->oc_queue[vm->oc_head]);
+    }
+    else
+    {
+        vm->oc_free++;
+    }
+}
+
+/* Under oc_lock: wait for a CPU */
+static void oc_acquire_locked(vcpu_state_t *vcpu)
+{
+    vm_state_t *vm = vcpu->vm;
+    uint64_t start = now_ns();
+
+    if (vm->oc_free > 0)
+    {
+        vm->oc_free--;
+        vcpu->oc_state = OC_RUNNING;
+        vcpu->oc_since_ns = start;
+        return;
+    }
+    vm->oc_queue[(vm->oc_head + vm->oc_len) % VM_MAX_VCPUS] = vcpu->index;
+    vm->oc_len++;
+    vcpu->oc_state = OC_QUEUED;
+    while (vcpu->oc_state != OC_RUNNING)
+    {
+        pthread_cond_wait(&vm->oc_cond, &vm->oc_lock);
+    }
+    vm->oc_wait_ns += now_ns() - start;
+}
+
+/* Before the vCPU runs guest code */
+static void oc_acquire(vcpu_state_t *vcpu)
+{
+    vm_state_t *vm = vcpu->vm;
+
+    if (vm->cfg->pcpus == 0)
+    {
+        return;
+    }
+    pthread_mutex_lock(&vm->oc_lock);
+    oc_acquire_locked(vcpu);
+    pthread_mutex_unlock(&vm->oc_lock);
+}
+
+/* The vCPU stops running guest code for a while, or for good */
+static void oc_release(vcpu_state_t *vcpu)
+{
+    vm_state_t *vm = vcpu->vm;
+
+    if (vm->cfg->pcpus == 0)
+    {
+        return;
+    }
+    pthread_mutex_lock(&vm->oc_lock);
+    if (vcpu->oc_state == OC_RUNNING)
+    {
+        oc_pass_locked(vcpu);
+    }
+    pthread_mutex_unlock(&vm->oc_lock);
+}
+
+/* On the vCPU thread, kicked at the end of its quantum: go to the back of
+ * the queue if anyone is waiting */
+static void oc_service(vcpu_state_t *vcpu)
+{
+    vm_state_t *vm = vcpu->vm;
+
+    pthread_mutex_lock(&vm->oc_lock);
+    if (vcpu->oc_state == OC_RUNNING && vm->oc_len > 0)
+    {
+        oc_pass_locked(vcpu);
+        vm->oc_preemptions++;
+        oc_acquire_locked(vcpu);
+    }
+    pthread_mutex_unlock(&vm->oc_lock);
+}
+
+/* Ends the quantum of vCPUs that have run for one while others wait */
+static void *oc_thread_main(void *arg)
+{
+    vm_state_t *vm = arg;
+
+    while (!atomic_load(&vm->oc_stop))
+    {
+        uint64_t now;
+
+        usleep(OC_QUANTUM_US / 4);
+        now = now_ns();
+        pthread_mutex_lock(&vm->oc_lock);
+        for (int i = 0; vm->oc_len > 0 && i < vm->nr_vcpus; i++)
+        {
+            vcpu_state_t *vcpu = &vm->vcpus[i];
+            if (vcpu->oc_state == OC_RUNNING &&
+                now - vcpu->oc_since_ns >= OC_QUANTUM_US * 1000ull)
+            {
+                atomic_fetch_or(&vcpu->kick, VM_KICK_SLICE);
+                sw_cpu_kick(vcpu->sw);
+            }
+        }
+        pthread_mutex_unlock(&vm->oc_lock);
+    }
+    return NULL;
+}
+
+static int oc_start(vm_state_t *vm)
+{
+    if (vm->cfg->pcpus == 0 && !vm->cfg->pvlock)
+    {
+        return 0;
+    }
+    pthread_mutex_init(&vm->oc_lock, NULL);
+    pthread_cond_init(&vm->oc_cond, NULL);
+    vm->oc_free = vm->cfg->pcpus;
+    vm->oc_initialized = true;
+
+    if (vm->cfg->pcpus != 0 &&
+        pthread_create(&vm->oc_thread, NULL, oc_thread_main, vm) != 0)
+    {
+        fprintf(stderr, "[VM %d] Failed to start the vCPU time slicer\n", vm->id);
+        return -1;
+    }
+    vm->oc_started = vm->cfg->pcpus != 0;
+    return 0;
+}
+
+static void oc_stop(vm_state_t *vm)
+{
+    if (!vm->oc_initialized)
+    {
+        return;
+    }
+    if (vm->oc_started)
+    {
+        atomic_store(&vm->oc_stop, true);
+        pthread_join(vm->oc_thread, NULL);
+        vm->oc_started = false;
+    }
+
+    if (vm->cfg->pcpus != 0)
+    {
+        printf("[VM %d] pcpus: %d vCPUs on %d CPUs, %llu quanta ended, %llu ms waited for a CPU\n",
+               vm->id, vm->nr_vcpus, vm->cfg->pcpus, vm->oc_preemptions,
+               vm->oc_wait_ns / 1000000);
+    }
+    if (vm->cfg->pvlock)
+    {
+        printf("[VM %d] pvlock: %llu waits (%llu handed the CPU to the holder, %llu timed out), "
+               "%llu kicks\n",
+               vm->id, vm->pv_waits, vm->pv_handoffs, vm->pv_timeouts, vm->pv_kicks);
+    }
+    pthread_cond_destroy(&vm->oc_cond);
+    pthread_mutex_destroy(&vm->oc_lock);
+    vm->oc_initialized = false;
+}
+
+/* LOCK_WAIT: park the vCPU while the lock word at `addr` still reads `seen` */
+static void pv_wait(vcpu_state_t *vcpu, uint64_t addr, uint32_t seen)
+{
+    vm_state_t *vm = vcpu->vm;
+    const uint32_t *word = (const uint32_t *)((uint8_t *)vm->mem + addr);
+    uint32_t holder = (seen & PV_HOLDER_MASK) - 1;
+    struct timespec deadline;
+
+    if (!vm->cfg->pvlock || addr > vm->mem_size - sizeof(*word) || (addr & 3) != 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&vm->oc_lock);
+    if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != seen)
+    {
+        pthread_mutex_unlock(&vm->oc_lock);
+        return;
+    }
+    vm->pv_waits++;
+
+    /* Our CPU is the holder's if it is waiting for one */
+    if (vcpu->oc_state == OC_RUNNING)
+    {
+        if (holder < (uint32_t)vm->nr_vcpus && vm->vcpus[holder].oc_state == OC_QUEUED)
+        {
+            vcpu->oc_state = OC_OFF;
+            oc_grant_locked(vm, (int)holder);
+            vm->pv_handoffs++;
+        }
+        else
+        {
+            oc_pass_locked(vcpu);
+        }
+    }
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += PV_PARK_US * 1000;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+    vcpu->pv_lock = addr;
+    vcpu->pv_parked = true;
+    vcpu->pv_kicked = false;
+    while (!vcpu->pv_kicked && __atomic_load_n(word, __ATOMIC_ACQUIRE) == seen)
+    {
+        if (pthread_cond_timedwait(&vm->oc_cond, &vm->oc_lock, &deadline) == ETIMEDOUT)
+        {
+            vm->pv_timeouts++;
+            break;
+        }
+    }
+    vcpu->pv_parked = false;
+
+    if (vm->cfg->pcpus != 0)
+    {
+        oc_acquire_locked(vcpu);
+    }
+    pthread_mutex_unlock(&vm->oc_lock);
+}
+
+/* LOCK_KICK: the lock at `addr` was released, wake the vCPUs parked on it */
+static void pv_kick(vm_state_t *vm, uint64_t addr)
+{
+    bool woke = false;
+
+    if (!vm->cfg->pvlock)
+    {
+        return;
+    }
+    pthread_mutex_lock(&vm->oc_lock);
+    vm->pv_kicks++;
+    for (int i = 0; i < vm->nr_vcpus; i++)
+    {
+        vcpu_state_t *vcpu = &vm->vcpus[i];
+        if (vcpu->pv_parked && vcpu->pv_lock == addr)
+        {
+            vcpu->pv_kicked = true;
+            woke = true;
+        }
+    }
+    if (woke)
+    {
+        pthread_cond_broadcast(&vm->oc_cond);
+    }
+    pthread_mutex_unlock(&vm->oc_lock);
+}
+
+/* ============================================================================
+ * Guest Profiling
+ * ============================================================================
+ *
+ * --profile=PATH reports where the guest spends its time. The software
+ * backend counts the entries of every translated block (sw_block_t.hits),
+ * which costs one increment per block and is exact. Hypervisor.framework
+ * has nothing like that, so there a sampler thread kicks the vCPU out of
+ * the guest every PROF_SAMPLE_US and records the PC it was at.
+ *
+ * At VM exit the hottest blocks (or PCs) are printed, symbolized with the
+ * labels of the guest image, and the whole profile is written to
+ * PATH.<vm id>, one "pc insns count symbol" line per block sorted by PC:
+ * a coverage map of the blocks that ran.
+ */
+
+#define PROF_SAMPLE_US 1000 /* PC sampling period (hvf backend) */
+#define PROF_MAX_PCS 4096   /* Distinct sampled PCs, a power of two */
+#define PROF_TOP 10         /* Blocks in the hot list */
+
+struct prof_sample
+{
+    uint64_t pc;
+    uint64_t count; /* 0 = free slot */
+};
+
+static void prof_sample(vcpu_state_t *vcpu)
+{
+    vm_state_t *vm = vcpu->vm;
+    uint64_t pc;
+
+    if (vm->prof_samples == NULL || hv_vcpu_get_reg(vcpu->vcpu, HV_REG_PC, &pc) != HV_SUCCESS)
+    {
+        return;
+    }
+
+    /* Open addressing, linear probing */
+    for (uint64_t i = 0; i < PROF_MAX_PCS; i++)
+    {
+        struct prof_sample *s = &vm->prof_samples[((pc >> 2) + i) & (PROF_MAX_PCS - 1)];
+        if (s->count == 0 || s->pc == pc)
+        {
+            s->pc = pc;
+            s->count++;
+            return;
+        }
+    }
+    vm->prof_dropped++;
+}
+
+static void *prof_thread_main(void *arg)
+{
+    vm_state_t *vm = arg;
+
+    while (!atomic_load(&vm->prof_stop))
+    {
+        sleep_until_ns(now_ns() + PROF_SAMPLE_US * 1000ull);
+        vm_kick(vm, VM_KICK_SAMPLE);
+    }
+    return NULL;
+}
+
+/* Start the PC sampler if this VM needs one */
+static int prof_start(vm_state_t *vm)
+{
+    if (vm->cfg->profile_path[0] == '\0' || vm->cfg->backend != VM_BACKEND_HVF)
+    {
+        return 0; /* Off, or the software backend counts blocks itself */
+    }
+
+    vm->prof_samples = calloc(PROF_MAX_PCS, sizeof(*vm->prof_samples));
+    if (vm->prof_samples == NULL ||
+        pthread_create(&vm->prof_thread, NULL, prof_thread_main, vm) != 0)
+    {
+        fprintf(stderr, "[VM %d] Failed to start the PC sampler\n", vm->id);
+        free(vm->prof_samples);
+        vm->prof_samples = NULL;
+        return -1;
+    }
+    vm->prof_started = true;
+    return 0;
+}
+
+static void prof_stop(vm_state_t *vm)
+{
+    if (!vm->prof_started)
+    {
+        return;
+    }
+    atomic_store(&vm->prof_stop, true);
+    pthread_join(vm->prof_thread, NULL);
+    vm->prof_started = false;
+}
+
+/* "label+0xoff" for a guest PC, from the labels of the image */
+static void prof_symbolize(uint64_t pc, char *buf, size_t size)
+{
+    const guest_sym_t *best = NULL;
+
+    if (pc >= GUEST_CODE_ADDR && pc < GUEST_CODE_ADDR + guest_image->size &&
+        guest_image->syms != NULL)
+    {
+        for (const guest_sym_t *s = guest_image->syms; s->name != NULL; s++)
+        {
+            if (GUEST_CODE_ADDR + s->offset <= pc)
+            {
+                best = s;
+            }
+        }
+    }
+    if (best == NULL)
+    {
+        snprintf(buf, size, "?");
+        return;
+    }
+    snprintf(buf, size, "%s+0x%llx", best->name, pc - GUEST_CODE_ADDR - best->offset);
+}
+
+/* Weight of a profile entry: guest instructions it accounts for */
+static uint64_t prof_weight(const sw_block_count_t *c)
+{
+    return c->hits * c->n_insns;
+}
+
+static int prof_cmp_weight(const void *a, const void *b)
+{
+    uint64_t x = prof_weight(*(const sw_block_count_t *const *)a);
+    uint64_t y = prof_weight(*(const sw_block_count_t *const *)b);
+    return x > y ? -1 : x < y;
+}
+
+static int prof_cmp_pc(const void *a, const void *b)
+{
+    const sw_block_count_t *x = a, *y = b;
+    return x->pc < y->pc ? -1 : x->pc > y->pc;
+}
+
+/*
+ * The VM's profile, sorted by PC: block counts of every software vCPU
+ * merged, or PC samples as one-instruction blocks. -1 if out of memory.
+ */
+static ssize_t prof_collect(vm_state_t *vm, sw_block_count_t **out)
+{
+    sw_block_count_t *all = NULL;
+    size_t n = 0, merged = 0;
+
+    if (vm->prof_samples != NULL)
+    {
+        all = malloc(PROF_MAX_PCS * sizeof(*all));
+        if (all == NULL)
+        {
+            return -1;
+        }
+        for (size_t i = 0; i < PROF_MAX_PCS; i++)
+        {
+            if (vm->prof_samples[i].count != 0)
+            {
+                all[n].pc = vm->prof_samples[i].pc;
+                all[n].n_insns = 1;
+                all[n].hits = vm->prof_samples[i].count;
+                n++;
+            }
+        }
+    }
+    for (int i = 0; i < vm->nr_vcpus && vm->vcpus[i].sw != NULL; i++)
+    {
+        sw_block_count_t *counts, *grown;
+        ssize_t count = sw_cpu_block_counts(vm->vcpus[i].sw, &counts);
+
+        if (count < 0)
+        {
+            free(all);
+            return -1;
+        }
+        grown = realloc(all, (n + (size_t)count + 1) * sizeof(*all));
+        if (grown == NULL)
+        {
+            free(counts);
+            free(all);
+            return -1;
+        }
+        all = grown;
+        memcpy(all + n, counts, (size_t)count * sizeof(*all));
+        n += (size_t)count;
+        free(counts);
+    }
+
+    /* The vCPUs ran the same blocks: one entry per PC */
+    qsort(all, n, sizeof(*all), prof_cmp_pc);
+    for (size_t i = 0; i < n; i++)
+    {
+        if (merged > 0 && all[merged - 1].pc == all[i].pc)
+        {
+            all[merged - 1].hits += all[i].hits;
+            if (all[i].n_insns > all[merged - 1].n_insns)
+            {
+                all[merged - 1].n_insns = all[i].n_insns;
+            }
+        }
+        else
+        {
+            all[merged++] = all[i];
+        }
+    }
+    *out = all;
+    return (ssize_t)merged;
+}
+
+/* Print the hot list and write the profile file */
+static void prof_report(vm_state_t *vm)
+{
+    const char *unit = vm->prof_samples != NULL ? "samples" : "entries";
+    sw_block_count_t *all, **ranked;
+    uint64_t total = 0;
+    char path[sizeof(vm->cfg->profile_path) + 16];
+    char sym[64];
+    ssize_t n;
+    FILE *f;
+
+    if (vm->cfg->profile_path[0] == '\0')
+    {
+        return;
+    }
+    n = prof_collect(vm, &all);
+    ranked = n >= 0 ? malloc(((size_t)n + 1) * sizeof(*ranked)) : NULL;
+    if (ranked == NULL)
+    {
+        fprintf(stderr, "[VM %d] Profile: out of memory\n", vm->id);
+        if (n >= 0)
+        {
+            free(all);
+        }
+        return;
+    }
+
+    for (ssize_t i = 0; i < n; i++)
+    {
+        ranked[i] = &all[i];
+        total += prof_weight(&all[i]);
+    }
+    qsort(ranked, (size_t)n, sizeof(*ranked), prof_cmp_weight);
+
+    if (vm->prof_samples != NULL)
+    {
+        printf("[VM %d] Profile: %llu PC samples (%llu dropped), hottest PCs:\n",
+               vm->id, total, vm->prof_dropped);
+    }
+    else
+    {
+        printf("[VM %d] Profile: %llu guest instructions in %zd blocks, hottest blocks:\n",
+               vm->id, total, n);
+    }
+    for (ssize_t i = 0; i < n && i < PROF_TOP; i++)
+    {
+        double share = total ? prof_weight(ranked[i]) * 100.0 / total : 0.0;
+
+        prof_symbolize(ranked[i]->pc, sym, sizeof(sym));
+        if (vm->prof_samples != NULL)
+        {
+            printf("[VM %d]   %5.1f%%  0x%llx  %-16s %llu samples\n",
+                   vm->id, share, ranked[i]->pc, sym, ranked[i]->hits);
+        }
+        else
+        {
+            printf("[VM %d]   %5.1f%%  0x%llx  %-16s %3u insns x %llu\n",
+                   vm->id, share, ranked[i]->pc, sym, ranked[i]->n_insns, ranked[i]->hits);
+        }
+    }
+
+    snprintf(path, sizeof(path), "%s.%d", vm->cfg->profile_path, vm->id);
+    f = fopen(path, "w");
+    if (f == NULL)
+    {
+        perror(path);
+    }
+    else
+    {
+        fprintf(f, "# tinyvmm profile of '%s': pc insns %s symbol\n", guest_image->name, unit);
+        for (ssize_t i = 0; i < n; i++)
+        {
+            prof_symbolize(all[i].pc, sym, sizeof(sym));
+            fprintf(f, "0x%llx %u %llu %s\n", all[i].pc, all[i].n_insns, all[i].hits, sym);
+        }
+        fclose(f);
+        printf("[VM %d] Profile written to %s\n", vm->id, path);
+    }
+
+    free(ranked);
+    free(all);
+    free(vm->prof_samples);
+    vm->prof_samples = NULL;
+}
+
+/* ============================================================================
+ * Working-Set Estimation
+ * ============================================================================
+ *
+ * --wss=PATH measures how much of its memory each VM really uses. The
+ * software backend marks the guest pages every vCPU touches (see
+ * sw_cpu_track_access()); every WSS_INTERVAL_MS the estimator thread
+ * kicks the vCPUs to hand their marks over, and ages every page:
+ *
+ *   hot   touched in the last interval
+ *   warm  touched in the last WSS_WARM_INTERVALS intervals, but not the last
+ *   cold  touched before that
+ *
+ * Pages never touched count as none of these. Each interval appends a
+ * "ms hot warm cold" line to PATH.<vm id>; at exit the file gets an
+ * "order" line with every page touched, in the order first touched. That
+ * is the order a restore should bring pages in, and hibernation snapshots
+ * are written in it.
+ */
+
+#define WSS_PAGE_SIZE 4096 /* Pages as the software backend tracks them */
+#define WSS_INTERVAL_MS 100
+#define WSS_WARM_INTERVALS 10
+#define WSS_NEVER 255 /* Age of a page never touched */
+
+static void wss_harvest(vcpu_state_t *vcpu)
+{
+    vm_state_t *vm = vcpu->vm;
+
+    if (vm->wss_accessed == NULL || vcpu->sw == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&vm->wss_lock);
+    sw_cpu_harvest_access(vcpu->sw, vm->wss_accessed);
+    pthread_mutex_unlock(&vm->wss_lock);
+    atomic_fetch_sub(&vm->wss_pending, 1);
+}
+
+/* Age the pages by one interval and log the counts */
+static void wss_tick(vm_state_t *vm)
+{
+    size_t n = vm->mem_size / WSS_PAGE_SIZE;
+    uint64_t hot = 0, warm = 0, cold = 0;
+
+    pthread_mutex_lock(&vm->wss_lock);
+    for (size_t i = 0; i < n; i++)
+    {
+        uint8_t *age = &vm->wss_age[i];
+
+        if ((vm->wss_accessed[i >> 3] >> (i & 7)) & 1)
+        {
+            *age = 0;
+        }
+        else if (*age < WSS_NEVER - 1)
+        {
+            (*age)++;
+        }
+
+        if (*age == 0)
+            hot++;
+        else if (*age < WSS_WARM_INTERVALS)
+            warm++;
+        else if (*age != WSS_NEVER)
+            cold++;
+    }
+    memset(vm->wss_accessed, 0, (n + 8) / 8);
+    pthread_mutex_unlock(&vm->wss_lock);
+
+    fprintf(vm->wss_log, "%llu %llu %llu %llu\n",
+            (now_ns() - vm->wss_start_ns) / 1000000, hot, warm, cold);
+    vm->wss_hot = hot;
+    vm->wss_warm = warm;
+    vm->wss_cold = cold;
+    if (hot > vm->wss_peak_hot)
+        vm->wss_peak_hot = hot;
+    if (hot + warm > vm->wss_peak_warm)
+        vm->wss_peak_warm = hot + warm;
+}
+
+static void *wss_thread_main(void *arg)
+{
+    vm_state_t *vm = arg;
+
+    while (!atomic_load(&vm->wss_stop))
+    {
+        sleep_until_ns(now_ns() + WSS_INTERVAL_MS * 1000000ull);
+
+        /* Collect the interval's accesses from every vCPU. One that has
+         * stopped, or sleeps in WFI for long, is counted next time. */
+        uint64_t deadline = now_ns() + WSS_INTERVAL_MS * 1000000ull / 2;
+        atomic_store(&vm->wss_pending, vm->nr_vcpus);
+        vm_kick(vm, VM_KICK_WSS);
+        while ((int)atomic_load(&vm->wss_pending) > 0 && now_ns() < deadline &&
+               !atomic_load(&vm->wss_stop))
+        {
+            usleep(200);
+        }
+        wss_tick(vm);
+    }
+    return NULL;
+}
+
+/* Start the estimator if this VM needs one (the vCPUs already track) */
+static int wss_start(vm_state_t *vm)
+{
+    size_t n = vm->mem_size / WSS_PAGE_SIZE;
+    char path[sizeof(vm->cfg->wss_path) + 16];
+
+    if (vm->cfg->wss_path[0] == '\0')
+    {
+        return 0;
+    }
+
+    snprintf(path, sizeof(path), "%s.%d", vm->cfg->wss_path, vm->id);
+    vm->wss_accessed = calloc((n + 8) / 8, 1);
+    vm->wss_age = malloc(n);
+    vm->wss_log = fopen(path, vm->cfg->resume ? "a" : "w"); /* A woken VM goes on */
+    if (vm->wss_accessed == NULL || vm->wss_age == NULL || vm->wss_log == NULL ||
+        pthread_mutex_init(&vm->wss_lock, NULL) != 0)
+    {
+        fprintf(stderr, "[VM %d] Failed to start the working-set estimator\n", vm->id);
+        goto fail;
+    }
+    memset(vm->wss_age, WSS_NEVER, n);
+    vm->wss_start_ns = now_ns();
+    if (!vm->cfg->resume)
+    {
+        fprintf(vm->wss_log, "# ms hot warm cold (%d KB pages, %zu in all)\n",
+                WSS_PAGE_SIZE / 1024, n);
+    }
+
+    if (pthread_create(&vm->wss_thread, NULL, wss_thread_main, vm) != 0)
+    {
+        fprintf(stderr, "[VM %d] Failed to start the working-set estimator\n", vm->id);
+        pthread_mutex_destroy(&vm->wss_lock);
+        goto fail;
+    }
+    vm->wss_started = true;
+    return 0;
+
+fail:
+    if (vm->wss_log != NULL)
+    {
+        fclose(vm->wss_log);
+        vm->wss_log = NULL;
+    }
+    free(vm->wss_accessed);
+    free(vm->wss_age);
+    vm->wss_accessed = NULL;
+    vm->wss_age = NULL;
+    return -1;
+}
+
+/* Stop the estimator: last interval, summary and the touch order */
+static void wss_stop(vm_state_t *vm)
+{
+    size_t n = vm->mem_size / WSS_PAGE_SIZE;
+    uint8_t *seen;
+    uint64_t touched = 0;
+
+    if (!vm->wss_started)
+    {
+        return;
+    }
+    atomic_store(&vm->wss_stop, true);
+    pthread_join(vm->wss_thread, NULL);
+    vm->wss_started = false;
+
+    /* The vCPUs have stopped, collect what they touched since */
+    for (int i = 0; i < vm->nr_vcpus; i++)
+    {
+        wss_harvest(&vm->vcpus[i]);
+    }
+    wss_tick(vm);
+
+    /* One order for the VM: the vCPUs' first touches, boot vCPU first */
+    seen = calloc((n + 8) / 8, 1);
+    fprintf(vm->wss_log, "order");
+    for (int i = 0; seen != NULL && i < vm->nr_vcpus; i++)
+    {
+        const sw_cpu_t *sw = vm->vcpus[i].sw;
+        for (uint32_t j = 0; sw != NULL && j < sw->n_touched; j++)
+        {
+            uint32_t page = sw->touch_order[j];
+            if (page < n && !((seen[page >> 3] >> (page & 7)) & 1))
+            {
+                seen[page >> 3] |= (uint8_t)(1u << (page & 7));
+                fprintf(vm->wss_log, " %u", page);
+                touched++;
+            }
+        }
+    }
+    fprintf(vm->wss_log, "\n");
+    free(seen);
+
+    printf("[VM %d] Working set: %llu hot, %llu warm, %llu cold pages at exit, "
+           "peak %llu hot, %llu hot+warm (%llu KB); %llu of %zu pages touched\n",
+           vm->id, vm->wss_hot, vm->wss_warm, vm->wss_cold, vm->wss_peak_hot,
+           vm->wss_peak_warm, vm->wss_peak_warm * WSS_PAGE_SIZE / 1024, touched, n);
+    printf("[VM %d] Working set log written to %s.%d\n", vm->id, vm->cfg->wss_path, vm->id);
+
+    fclose(vm->wss_log);
+    vm->wss_log = NULL;
+    pthread_mutex_destroy(&vm->wss_lock);
+    free(vm->wss_accessed);
+    free(vm->wss_age);
+    vm->wss_accessed = NULL;
+    vm->wss_age = NULL;
+}
+
+/* ============================================================================
+ * Hibernation
+ * ============================================================================
+ *
+ * With --hibernate=MS an idle VM is written out to disk and its process
+ * exits, giving back all of its memory. A vCPU counts as idle when it has
+ * done nothing but wait in WFI for MS milliseconds. The snapshot is the
+ * vCPU registers plus every guest page that is not all zeroes, saved and
+ * restored by --snapshot-threads threads (see snapshot.h). With
+ * --chunk-store the snapshot holds only chunk hashes, and the chunks go
+ * to a store that every snapshot shares.
+ *
+ * The parent restarts a hibernated VM from its snapshot when something
+ * needs it: the guest's virtual timer coming due (the only device that
+ * raises events here), or a wake-up request from the control plane, which
+ * is a SIGUSR1 sent to the parent. The woken VM reports how long after
+ * that event it was running again.
+ *
+ * Software backend with a single vCPU only: the snapshot is taken with
+ * sw_cpu_save_regs().
+ */
+
+#define VM_EXIT_HIBERNATED 3 /* VM process exit status: snapshot written */
+
+#define HIB_MAGIC 0x4e424948 /* "HIBN" */
+#define HIB_VERSION 2
+#define HIB_PAGE_SIZE SNAP_PAGE_SIZE
+#define HIB_WFI_SLEEP_US 10000 /* Longest sleep in WFI, kicks wait this long */
+#define HIB_IDLE_INSNS 64      /* More than this between two WFIs is work */
+
+/* Snapshot file header, followed by the n_pages pages as written by
+ * snap_write() (see snapshot.h) */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t vm_id;
+    uint32_t n_pages;
+    uint64_t mem_size;
+    uint64_t image_hash;  /* Guest image it was running */
+    uint64_t wake_ns;     /* now_ns() when its timer fires, UINT64_MAX = never */
+    sw_regs_t regs;
+} hib_header_t;
+
+/* Threads for snapshot saves and restores (--snapshot-threads, 0 = one
+ * per CPU) */
+static int snap_threads;
+
+/* Chunk store shared by all snapshots (--chunk-store, "" = none) */
+static char chunk_store_dir[256];
+
+/* Set by SIGUSR1 in the parent: wake every hibernated VM */
+static volatile sig_atomic_t hib_wake_requested;
+
+static void hib_on_sigusr1(int sig)
+{
+    (void)sig;
+    hib_wake_requested = 1;
+}
+
+/*
+ * Stop the (only, software) vCPU for run_single_vm() to write the VM out.
+ * It is to be woken when its virtual timer fires.
+ */
+static void vm_hibernate(vcpu_state_t *vcpu)
+{
+    vm_state_t *vm = vcpu->vm;
+    uint64_t left = sw_cpu_timer_ns(vcpu->sw);
+
+    vm->hib_wake_ns = left == UINT64_MAX ? UINT64_MAX : now_ns() + left;
+    vm->hibernating = true;
+    vcpu->running = false;
+}
+
+/*
+ * WFI. The software vCPU sleeps until its virtual timer fires, the only
+ * thing that ends a WFI here, in steps of at most HIB_WFI_SLEEP_US so
+ * kicks are still serviced. Hypervisor.framework waits by itself.
+ *
+ * This is also where an idle VM is found: once it has done nothing but
+ * WFI for the --hibernate window, and its timer is not due within another
+ * window, the vCPU is stopped for run_single_vm() to hibernate the VM.
+ */
+static void vcpu_wfi(vcpu_state_t *vcpu)
+{
+    vm_state_t *vm = vcpu->vm;
+    uint64_t window = (uint64_t)vm->cfg->hibernate_idle_ms * 1000000ull;
+    uint64_t now = now_ns();
+    uint64_t left, due;
+
+    if (vcpu->sw == NULL)
+    {
+        return;
+    }
+
+    if (vcpu->idle_since_ns == 0 || vcpu->sw->insns - vcpu->idle_insns > HIB_IDLE_INSNS)
+    {
+        vcpu->idle_since_ns = now;
+    }
+    vcpu->idle_insns = vcpu->sw->insns;
+
+    left = sw_cpu_timer_ns(vcpu->sw);
+    if (window != 0 && vm->nr_vcpus == 1 &&
+        now - vcpu->idle_since_ns >= window && left >= window)
+    {
+        printf("\n[VM %d] Idle for %llu ms, hibernating\n",
+               vm->id, (now - vcpu->idle_since_ns) / 1000000);
+        vm_hibernate(vcpu);
+        return;
+    }
+
+    /* With --sched the CPU is someone else's until the timer fires */
+    due = left == UINT64_MAX ? 0 : now + left;
+    sched_idle(vm);
+    if (left > HIB_WFI_SLEEP_US * 1000ull)
+    {
+        left = HIB_WFI_SLEEP_US * 1000ull;
+    }
+    oc_release(vcpu);
+    sleep_until_ns(now + left);
+    oc_acquire(vcpu);
+    if (vm->sched != NULL && sw_cpu_timer_ns(vcpu->sw) == 0)
+    {
+        sched_wake(vm, due);
+    }
+}
+
+/*
+ * mincore(): does the host page hold guest data? Pages the compressor or
+ * swap has taken are not MINCORE_INCORE but MINCORE_PAGED_OUT, and must
+ * not be mistaken for pages that were never touched.
+ */
+static bool mincore_has_data(char status)
+{
+    return (status & (MINCORE_INCORE | MINCORE_PAGED_OUT)) != 0;
+}
+
+static bool page_is_zero(const uint8_t *page, size_t size)
+{
+    const uint64_t *w = (const uint64_t *)page;
+
+    for (size_t i = 0; i < size / sizeof(*w); i++)
+    {
+        if (w[i] != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * The non-zero pages, in the order they go into the snapshot: the order
+ * the guest first touched them in when that was tracked (--wss), so a
+ * restore reads the pages it needs first first, then the rest by address.
+ * Pages that were never faulted in are zero and are not even read, which
+ * keeps a large sparse guest (--mem) sparse; pages that were paged out
+ * are read back in.
+ */
+static uint32_t hib_page_order(vm_state_t *vm, uint32_t *index)
+{
+    const sw_cpu_t *sw = vm->vcpus[0].sw;
+    const uint8_t *mem = vm->mem;
+    size_t total = vm->mem_size / HIB_PAGE_SIZE;
+    size_t host_page = (size_t)getpagesize();
+    uint8_t *listed = calloc(total, 1);
+    char *resident = malloc((vm->mem_size + host_page - 1) / host_page);
+    uint32_t n = 0;
+
+    if (resident != NULL && mincore(vm->mem, vm->mem_size, resident) != 0)
+    {
+        free(resident);
+        resident = NULL;
+    }
+
+    for (uint32_t i = 0; listed != NULL && i < sw->n_touched; i++)
+    {
+        uint32_t page = sw->touch_order[i];
+        if (page < total && !page_is_zero(mem + (size_t)page * HIB_PAGE_SIZE, HIB_PAGE_SIZE))
+        {
+            index[n++] = page;
+            listed[page] = 1;
+        }
+    }
+    for (size_t i = 0; i < total; i++)
+    {
+        if ((listed == NULL || !listed[i]) &&
+            (resident == NULL || mincore_has_data(resident[i * HIB_PAGE_SIZE / host_page])) &&
+            !page_is_zero(mem + i * HIB_PAGE_SIZE, HIB_PAGE_SIZE))
+        {
+            index[n++] = (uint32_t)i;
+        }
+    }
+    free(resident);
+    free(listed);
+    return n;
+}
+
+/* The chunk store, if there is one. *store is NULL without --chunk-store. */
+static int hib_store_open(int id, snap_store_t **store)
+{
+    *store = NULL;
+    if (chunk_store_dir[0] == '\0')
+    {
+        return 0;
+    }
+    *store = snap_store_open(chunk_store_dir);
+    if (*store == NULL)
+    {
+        fprintf(stderr, "[VM %d] Can't open chunk store %s\n", id, chunk_store_dir);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Write the stopped VM to cfg->hib_path. The file is written under a
+ * temporary name and renamed, so the parent never sees half a snapshot.
+ */
+static int hib_save(vm_state_t *vm)
+{
+    const char *path = vm->cfg->hib_path;
+    size_t total = vm->mem_size / HIB_PAGE_SIZE;
+    hib_header_t hdr = {0};
+    char tmp[sizeof(vm->cfg->hib_path) + 4];
+    snap_stats_t st = {0};
+    snap_store_t *store;
+    uint32_t *index;
+    FILE *f;
+    bool ok;
+
+    if (hib_store_open(vm->id, &store) < 0)
+    {
+        return -1;
+    }
+    index = malloc(total * sizeof(*index));
+    if (index == NULL)
+    {
+        snap_store_close(store);
+        return -1;
+    }
+
+    hdr.magic = HIB_MAGIC;
+    hdr.version = HIB_VERSION;
+    hdr.vm_id = (uint32_t)vm->id;
+    hdr.mem_size = vm->mem_size;
+    hdr.image_hash = vm->vcpus[0].sw->image_hash;
+    hdr.wake_ns = vm->hib_wake_ns;
+    sw_cpu_save_regs(vm->vcpus[0].sw, &hdr.regs);
+    hdr.n_pages = hib_page_order(vm, index);
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    f = fopen(tmp, "wb");
+    if (f == NULL)
+    {
+        perror(tmp);
+        free(index);
+        snap_store_close(store);
+        return -1;
+    }
+    ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 && fflush(f) == 0 &&
+         snap_write(fileno(f), sizeof(hdr), vm->mem, index, hdr.n_pages, store,
+                    snap_threads, &st) == 0;
+    free(index);
+    if (fclose(f) != 0 || !ok || rename(tmp, path) < 0)
+    {
+        fprintf(stderr, "[VM %d] Failed to write %s\n", vm->id, path);
+        if (ok && (f = fopen(tmp, "rb")) != NULL)
+        {
+            snap_release(fileno(f), sizeof(hdr), store);
+            fclose(f);
+        }
+        unlink(tmp);
+        snap_store_close(store);
+        return -1;
+    }
+    snap_store_close(store);
+
+    printf("[VM %d] Hibernated to %s: %u of %zu pages (%llu KB, %llu KB stored",
+           vm->id, path, hdr.n_pages, total, st.raw_bytes / 1024, st.stored_bytes / 1024);
+    if (store != NULL)
+    {
+        printf(", %llu KB already in the chunk store", st.shared_bytes / 1024);
+    }
+    printf(") in %llu us (%d thread%s)\n",
+           st.elapsed_ns / 1000, st.threads, st.threads == 1 ? "" : "s");
+    return 0;
+}
+
+/* Read a snapshot header, checking it belongs to this VM and image */
+static int hib_read_header(FILE *f, const vm_config_t *cfg, hib_header_t *hdr)
+{
+    if (fread(hdr, sizeof(*hdr), 1, f) != 1 || hdr->magic != HIB_MAGIC ||
+        hdr->version != HIB_VERSION || hdr->vm_id != (uint32_t)cfg->id ||
+        hdr->mem_size != guest_mem_size ||
+        hdr->image_hash != sw_hash64(guest_image->code, guest_image->size) ||
+        hdr->n_pages > guest_mem_size / HIB_PAGE_SIZE)
+    {
+        fprintf(stderr, "[VM %d] %s is not a snapshot of this VM\n", cfg->id, cfg->hib_path);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Resume a VM from its snapshot, in place of booting it. Called once
+ * the image is loaded; the snapshot is deleted when it has been read.
+ */
+static int hib_restore(vm_state_t *vm)
+{
+    const char *path = vm->cfg->hib_path;
+    hib_header_t hdr;
+    snap_stats_t st = {0};
+    snap_store_t *store;
+    bool ok = false;
+    FILE *f;
+
+    if (hib_store_open(vm->id, &store) < 0)
+    {
+        return -1;
+    }
+    f = fopen(path, "rb");
+    if (f == NULL)
+    {
+        perror(path);
+        snap_store_close(store);
+        return -1;
+    }
+    /* Everything but the image is still zero; the image pages the guest
+     * left nonzero are in the snapshot. The snapshot is used up, so its
+     * chunks lose their references. */
+    if (hib_read_header(f, vm->cfg, &hdr) == 0)
+    {
+        memset((uint8_t *)vm->mem + GUEST_CODE_ADDR, 0, guest_image->size);
+        ok = snap_read(fileno(f), sizeof(hdr), vm->mem, vm->mem_size, store, snap_threads,
+                       &st) == 0 &&
+             snap_release(fileno(f), sizeof(hdr), store) == 0;
+    }
+    fclose(f);
+    snap_store_close(store);
+    if (!ok)
+    {
+        fprintf(stderr, "[VM %d] Failed to read %s\n", vm->id, path);
+        return -1;
+    }
+
+    sw_cpu_load_regs(vm->vcpus[0].sw, &hdr.regs);
+    unlink(path);
+
+    printf("[VM %d] Woke from %s: %u pages in %llu us (%d thread%s), "
+           "running %llu us after the wake event\n",
+           vm->id, path, hdr.n_pages, st.elapsed_ns / 1000, st.threads,
+           st.threads == 1 ? "" : "s", (now_ns() - vm->cfg->wake_event_ns) / 1000);
+    return 0;
+}
+
+/* Parent side: when a hibernated VM wants to be woken by its timer */
+static int hib_wake_time(const vm_config_t *cfg, uint64_t *wake_ns)
+{
+    hib_header_t hdr;
+    FILE *f = fopen(cfg->hib_path, "rb");
+    int ret;
+
+    if (f == NULL)
+    {
+        return -1;
+    }
+    ret = hib_read_header(f, cfg, &hdr);
+    fclose(f);
+    if (ret == 0)
+    {
+        *wake_ns = hdr.wake_ns;
+    }
+    return ret;
+}
+
+/* Parent side: delete a snapshot that will not be woken, with its
+ * references to the chunk store */
+static void hib_discard(const vm_config_t *cfg)
+{
+    hib_header_t hdr;
+    snap_store_t *store;
+    FILE *f = fopen(cfg->hib_path, "rb");
+
+    if (f == NULL)
+    {
+        return;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, f) == 1 && hdr.magic == HIB_MAGIC &&
+        hdr.version == HIB_VERSION && hib_store_open(cfg->id, &store) == 0)
+    {
+        snap_release(fileno(f), sizeof(hdr), store);
+        snap_store_close(store);
+    }
+    fclose(f);
+    unlink(cfg->hib_path);
+}
+
+/* ============================================================================
+ * Post-Copy Migration
+ * ============================================================================
+ *
+ * With --postcopy=MS each VM moves to a new process MS milliseconds after
+ * it started. The parent starts the destination process next to the
+ * source, connected by a socket pair, and the destination waits for the
+ * VM. When the time comes the source stops its vCPU and sends the
+ * registers and the list of pages to follow (the same pages a snapshot
+ * would hold, see hib_page_order()); the destination loads the registers
+ * and resumes the guest straight away, with every listed page absent. The
+ * source then streams the pages in the background, in snapshot order.
+ *
+ * Linux would serve the destination's missing pages through userfaultfd;
+ * macOS has nothing like it, so the software vCPU traps them itself (see
+ * sw_cpu_t.absent_pages): touching an absent page exits with a
+ * translation fault, the vCPU thread asks the source for that page, and
+ * the source sends it ahead of the background stream. A receiver thread
+ * copies pages into guest memory as they come in and marks them present.
+ * Once all are in the vCPU drops the bitmap and runs at full speed again.
+ *
+ * With --precopy=N the source first copies memory while the guest keeps
+ * running: every nonzero page, then up to N-1 rounds of the pages the
+ * guest dirtied meanwhile, stopping early once few enough are left. Only
+ * the pages dirtied after the last round are then left for post-copy.
+ * Pages go out in the --xfer encoding (see xfer.h): a page sent again is
+ * usually a small delta against the version the destination already has.
+ *
+ * Reported: the downtime (source vCPU stopped until the destination's
+ * runs), the pages fetched on demand and how long the guest waited for
+ * them, and the degraded window until the last page arrived, with the
+ * guest's speed during and after it; and the transfer encoding's
+ * compression ratio and CPU time on both ends.
+ *
+ * Software backend with a single vCPU only, like hibernation.
+ */
+
+#define VM_EXIT_MIGRATED 4 /* VM process exit status: the VM moved away */
+
+#define PC_MAGIC 0x59504350 /* "PCPY" */
+#define PC_PAGE_SIZE XFER_PAGE_SIZE
+#define PC_PAGE_SWITCH UINT32_MAX /* pc_page_t page: the source stopped */
+#define PC_PRECOPY_DONE 16        /* Dirty pages few enough to stop pre-copy */
+
+/* Encoding of migrated pages (--xfer, XFER_MODE_*) */
+static int xfer_mode = XFER_MODE_DELTA;
+
+/* Sent once the source has stopped, after a pc_page_t with page
+ * PC_PAGE_SWITCH and before the pages left: n_pages uint32_t page numbers
+ * follow */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t vm_id;
+    uint32_t n_pages;
+    uint32_t reserved;
+    uint64_t mem_size;
+    uint64_t image_hash;  /* Guest image it is running */
+    uint64_t stop_ns;     /* now_ns() when the source vCPU stopped */
+    sw_regs_t regs;
+} pc_header_t;
+
+/* Each page, pre-copied or left for post-copy, in any order: this header
+ * and `size` bytes of it, encoded. The destination asks for a page by
+ * sending its number (uint32_t). */
+typedef struct
+{
+    uint32_t page;
+    uint8_t demand;       /* 1: sent because the destination asked for it */
+    uint8_t encoding;     /* XFER_* */
+    uint16_t size;
+} pc_page_t;
+
+static int read_full(int fd, void *buf, size_t len);        /* See "Zygote" */
+static int write_full(int fd, const void *buf, size_t len); /* See "Zygote" */
+
+static bool pc_page_absent(const vm_state_t *vm, uint64_t page)
+{
+    return (__atomic_load_n(&vm->pc_absent[page >> 3], __ATOMIC_ACQUIRE) >> (page & 7)) & 1;
+}
+
+/* Source: encode and send one page. A copy is encoded, the guest may be
+ * writing to it (it is then dirty again and sent again later). */
+static int pc_send_page(vm_state_t *vm, uint32_t page, bool demand)
+{
+    uint8_t copy[PC_PAGE_SIZE], out[PC_PAGE_SIZE];
+    pc_page_t msg = {.page = page, .demand = demand};
+    int encoding;
+
+    memcpy(copy, (uint8_t *)vm->mem + (uint64_t)page * PC_PAGE_SIZE, PC_PAGE_SIZE);
+    msg.size = (uint16_t)xfer_encode(vm->pc_enc, page, copy, out, &encoding, &vm->pc_xfer);
+    msg.encoding = (uint8_t)encoding;
+    if (write_full(vm->cfg->migrate_fd, &msg, sizeof(msg)) < 0 ||
+        write_full(vm->cfg->migrate_fd, out, msg.size) < 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/* Source, on the vCPU thread: hand over the pages dirtied since the
+ * last call */
+static void pc_harvest(vcpu_state_t *vcpu)
+{
+    vm_state_t *vm = vcpu->vm;
+
+    pthread_mutex_lock(&vm->pc_lock);
+    sw_cpu_harvest_dirty(vcpu->sw, vm->pc_dirty);
+    vm->pc_harvested = true;
+    pthread_cond_broadcast(&vm->pc_arrived);
+    pthread_mutex_unlock(&vm->pc_lock);
+}
+
+/* Source, on the timer thread: the dirty pages, from the vCPU. False if
+ * the VM stopped first. */
+static bool pc_collect_dirty(vm_state_t *vm)
+{
+    bool ok;
+
+    pthread_mutex_lock(&vm->pc_lock);
+    vm->pc_harvested = false;
+    pthread_mutex_unlock(&vm->pc_lock);
+    vm_kick(vm, VM_KICK_DIRTY);
+
+    pthread_mutex_lock(&vm->pc_lock);
+    while (!vm->pc_harvested && !atomic_load(&vm->pc_stop))
+    {
+        pthread_cond_wait(&vm->pc_arrived, &vm->pc_lock);
+    }
+    ok = vm->pc_harvested;
+    pthread_mutex_unlock(&vm->pc_lock);
+    return ok;
+}
+
+/*
+ * Source, while the guest runs: copy every nonzero page, then the pages
+ * dirtied meanwhile, round after round. The dirty marks are collected
+ * before each round's pages are read, so a write that lands during the
+ * round is caught by the next one.
+ */
+static void pc_precopy(vm_state_t *vm)
+{
+    uint64_t total = vm->mem_size / PC_PAGE_SIZE;
+    size_t host_page = (size_t)getpagesize();
+    char *resident = malloc((vm->mem_size + host_page - 1) / host_page);
+
+    if (!pc_collect_dirty(vm))
+    {
+        free(resident);
+        return;
+    }
+    memset(vm->pc_dirty, 0, (total + 8) / 8);
+    if (resident != NULL && mincore(vm->mem, vm->mem_size, resident) != 0)
+    {
+        free(resident);
+        resident = NULL;
+    }
+
+    for (uint32_t round = 0; round < vm->cfg->precopy_rounds; round++)
+    {
+        uint64_t start = now_ns();
+        uint64_t bytes = vm->pc_xfer.encoded_bytes;
+        uint32_t sent = 0;
+
+        if (round > 0 && !pc_collect_dirty(vm))
+        {
+            break;
+        }
+        for (uint64_t i = 0; i < total; i++)
+        {
+            bool send = round > 0 ? (vm->pc_dirty[i >> 3] >> (i & 7)) & 1
+                                  : (resident == NULL ||
+                                     mincore_has_data(resident[i * PC_PAGE_SIZE / host_page])) &&
+                                        !xfer_page_is_zero((uint8_t *)vm->mem + i * PC_PAGE_SIZE);
+            if (!send)
+            {
+                continue;
+            }
+            if (pc_send_page(vm, (uint32_t)i, false) < 0)
+            {
+                free(resident);
+                return;
+            }
+            sent++;
+        }
+        memset(vm->pc_dirty, 0, (total + 8) / 8);
+        vm->pc_precopied += sent;
+
+        printf("\n[VM %d] Pre-copy round %u: %u pages as %llu KB in %llu ms\n",
+               vm->id, round + 1, sent, (vm->pc_xfer.encoded_bytes - bytes) / 1024,
+               (now_ns() - start) / 1000000);
+        if (round > 0 && sent <= PC_PRECOPY_DONE)
+        {
+            break;
+        }
+    }
+    free(resident);
+}
+
+/* Source: the migration timer */
+static void *pc_timer_main(void *arg)
+{
+    vm_state_t *vm = arg;
+    uint64_t due = now_ns() + (uint64_t)vm->cfg->postcopy_ms * 1000000ull;
+
+    /* Short sleeps, so a guest that exits first is not held up */
+    while (!atomic_load(&vm->pc_stop) && now_ns() < due)
+    {
+        uint64_t step = now_ns() + HIB_WFI_SLEEP_US * 1000ull;
+        sleep_until_ns(step < due ? step : due);
+    }
+    if (vm->cfg->precopy_rounds != 0 && !atomic_load(&vm->pc_stop))
+    {
+        pc_precopy(vm);
+    }
+    if (!atomic_load(&vm->pc_stop))
+    {
+        vm_kick(vm, VM_KICK_MIGRATE);
+    }
+    return NULL;
+}
+
+/* Destination: copy pages into guest memory as they come in */
+static void *pc_receiver_main(void *arg)
+{
+    vm_state_t *vm = arg;
+    int fd = vm->cfg->migrate_fd;
+    uint64_t total = vm->mem_size / PC_PAGE_SIZE;
+    uint8_t data[PC_PAGE_SIZE];
+    pc_page_t msg;
+
+    while (read_full(fd, &msg, sizeof(msg)) == 0 && msg.size <= PC_PAGE_SIZE &&
+           read_full(fd, data, msg.size) == 0)
+    {
+        if (msg.page >= total || !pc_page_absent(vm, msg.page))
+        {
+            continue;
+        }
+
+        /* Nothing touches an absent page, it can be written in place */
+        if (xfer_decode(msg.encoding, data, msg.size,
+                        (uint8_t *)vm->mem + (uint64_t)msg.page * PC_PAGE_SIZE,
+                        &vm->pc_xfer) < 0)
+        {
+            fprintf(stderr, "[VM %d] Page %u arrived damaged\n", vm->id, msg.page);
+            break;
+        }
+        __atomic_fetch_and(&vm->pc_absent[msg.page >> 3], (uint8_t)~(1u << (msg.page & 7)),
+                           __ATOMIC_RELEASE);
+
+        pthread_mutex_lock(&vm->pc_lock);
+        if (++vm->pc_received == vm->pc_pages)
+        {
+            vm_kick(vm, VM_KICK_MIGRATE);
+        }
+        pthread_cond_broadcast(&vm->pc_arrived);
+        pthread_mutex_unlock(&vm->pc_lock);
+    }
+
+    pthread_mutex_lock(&vm->pc_lock);
+    vm->pc_eof = true;
+    pthread_cond_broadcast(&vm->pc_arrived);
+    pthread_mutex_unlock(&vm->pc_lock);
+    return NULL;
+}
+
+/* Source: start the migration timer, and with pre-copy the dirty page
+ * tracking. Destination: nothing to do here, pc_incoming() starts the
+ * receiver. */
+static int pc_start(vm_state_t *vm)
+{
+    uint64_t total = vm->mem_size / PC_PAGE_SIZE;
+
+    if (vm->cfg->postcopy_ms == 0 || vm->cfg->incoming)
+    {
+        return 0;
+    }
+    /* A destination that goes away must not take us with it */
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_mutex_init(&vm->pc_lock, NULL);
+    pthread_cond_init(&vm->pc_arrived, NULL);
+    vm->pc_enc = xfer_encoder_create(xfer_mode);
+    if (vm->pc_enc == NULL ||
+        (vm->cfg->precopy_rounds != 0 &&
+         ((vm->pc_dirty = calloc((total + 8) / 8, 1)) == NULL ||
+          sw_cpu_track_dirty(vm->vcpus[0].sw) < 0)) ||
+        pthread_create(&vm->pc_thread, NULL, pc_timer_main, vm) != 0)
+    {
+        fprintf(stderr, "[VM %d] Failed to start the migration timer\n", vm->id);
+        return -1;
+    }
+    vm->pc_started = true;
+    return 0;
+}
+
+static void pc_stop(vm_state_t *vm)
+{
+    if (vm->pc_started)
+    {
+        /* The receiver ends when the source hangs up, which it does once
+         * every page is sent or it is gone */
+        pthread_mutex_lock(&vm->pc_lock);
+        atomic_store(&vm->pc_stop, true);
+        pthread_cond_broadcast(&vm->pc_arrived);
+        pthread_mutex_unlock(&vm->pc_lock);
+        if (vm->cfg->incoming)
+        {
+            shutdown(vm->cfg->migrate_fd, SHUT_RDWR);
+        }
+        pthread_join(vm->pc_thread, NULL);
+        vm->pc_started = false;
+    }
+    xfer_encoder_destroy(vm->pc_enc);
+    vm->pc_enc = NULL;
+    free(vm->pc_dirty);
+    vm->pc_dirty = NULL;
+}
+
+/*
+ * On the source: the timer is up, stop the vCPU for run_single_vm() to
+ * send the VM. On the destination: the last page is in, stop checking.
+ */
+static void pc_service(vcpu_state_t *vcpu)
+{
+    vm_state_t *vm = vcpu->vm;
+
+    if (vm->cfg->incoming)
+    {
+        vcpu->sw->absent_pages = NULL;
+        vm->pc_done_ns = now_ns();
+        vm->pc_done_insns = vcpu->sw->insns;
+        return;
+    }
+    printf("\n[VM %d] Migrating\n", vm->id);
+    vm->pc_stop_ns = now_ns();
+    vm->migrating = true;
+    vcpu->running = false;
+}
+
+/*
+ * Destination, on the vCPU thread: bring in absent page `page` and wait
+ * for it. Returns -1 if the source hung up before sending it.
+ */
+static int pc_fetch(vm_state_t *vm, uint64_t page)
+{
+    uint64_t start;
+    uint32_t req = (uint32_t)page;
+
+    if (vm->pc_absent == NULL || page >= vm->mem_size / PC_PAGE_SIZE ||
+        !pc_page_absent(vm, page))
+    {
+        return 0;
+    }
+
+    /* A source that has sent everything may be gone already, the page is
+     * then on its way and the request does not matter */
+    start = now_ns();
+    (void)write_full(vm->cfg->migrate_fd, &req, sizeof(req));
+    pthread_mutex_lock(&vm->pc_lock);
+    while (pc_page_absent(vm, page) && !vm->pc_eof)
+    {
+        pthread_cond_wait(&vm->pc_arrived, &vm->pc_lock);
+    }
+    vm->pc_demand++;
+    vm->pc_demand_wait_ns += now_ns() - start;
+    pthread_mutex_unlock(&vm->pc_lock);
+
+    return pc_page_absent(vm, page) ? -1 : 0;
+}
+
+/*
+ * Destination: an abort of the guest. True if it was a touch of an absent
+ * page, which is now in, so the guest can retry the instruction.
+ */
+static bool pc_fault(vcpu_state_t *vcpu, uint64_t syndrome, uint64_t addr)
+{
+    vm_state_t *vm = vcpu->vm;
+
+    if (vm->pc_absent == NULL || (syndrome & 0x3f) != SW_FSC_ABSENT)
+    {
+        return false;
+    }
+    if (pc_fetch(vm, addr / PC_PAGE_SIZE) < 0)
+    {
+        printf("[VM %d] Page at 0x%llx never arrived\n", vm->id, addr);
+        return false;
+    }
+    return true;
+}
+
+/* Destination: bring in a NUL-terminated string the VMM is to read */
+static int pc_fetch_string(vm_state_t *vm, uint64_t addr)
+{
+    if (vm->pc_absent == NULL)
+    {
+        return 0;
+    }
+    while (addr < vm->mem_size)
+    {
+        uint64_t end = (addr | (PC_PAGE_SIZE - 1)) + 1;
+        if (pc_fetch(vm, addr / PC_PAGE_SIZE) < 0)
+        {
+            return -1;
+        }
+        if (memchr((const uint8_t *)vm->mem + addr, 0, end - addr) != NULL)
+        {
+            return 0;
+        }
+        addr = end;
+    }
+    return 0;
+}
+
+/*
+ * Source: send the stopped VM. Pages the destination asks for go first,
+ * the others follow in snapshot order. Returns -1 if the destination
+ * could not even take the registers.
+ */
+static int pc_send(vm_state_t *vm)
+{
+    int fd = vm->cfg->migrate_fd;
+    uint32_t total = (uint32_t)(vm->mem_size / PC_PAGE_SIZE);
+    pc_header_t hdr = {0};
+    pc_page_t stop = {.page = PC_PAGE_SWITCH};
+    uint32_t *index = malloc(total * sizeof(*index));
+    uint8_t *state = calloc(total, 1); /* 1: to send, 2: sent */
+    uint32_t next = 0, sent = 0, demand = 0;
+    uint64_t start = now_ns();
+    const xfer_stats_t *x = &vm->pc_xfer;
+
+    if (index == NULL || state == NULL)
+    {
+        free(index);
+        free(state);
+        return -1;
+    }
+
+    hdr.magic = PC_MAGIC;
+    hdr.vm_id = (uint32_t)vm->id;
+    hdr.mem_size = vm->mem_size;
+    hdr.image_hash = vm->vcpus[0].sw->image_hash;
+    hdr.stop_ns = vm->pc_stop_ns;
+    sw_cpu_save_regs(vm->vcpus[0].sw, &hdr.regs);
+
+    /* After pre-copy only the pages dirtied since its last round are left
+     * (the vCPU is stopped, this is its thread) */
+    if (vm->pc_dirty != NULL)
+    {
+        sw_cpu_harvest_dirty(vm->vcpus[0].sw, vm->pc_dirty);
+        for (uint32_t i = 0; i < total; i++)
+        {
+            if ((vm->pc_dirty[i >> 3] >> (i & 7)) & 1)
+            {
+                index[hdr.n_pages++] = i;
+            }
+        }
+    }
+    else
+    {
+        hdr.n_pages = hib_page_order(vm, index);
+    }
+    for (uint32_t i = 0; i < hdr.n_pages; i++)
+    {
+        state[index[i]] = 1;
+    }
+
+    if (write_full(fd, &stop, sizeof(stop)) < 0 || write_full(fd, &hdr, sizeof(hdr)) < 0 ||
+        write_full(fd, index, hdr.n_pages * sizeof(*index)) < 0)
+    {
+        fprintf(stderr, "[VM %d] Migration failed: destination not there\n", vm->id);
+        free(index);
+        free(state);
+        return -1;
+    }
+
+    while (sent < hdr.n_pages)
+    {
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        uint32_t page;
+        bool on_demand = false;
+
+        if (poll(&pfd, 1, 0) > 0)
+        {
+            /* A request, or the destination hung up (the guest is done) */
+            if (read_full(fd, &page, sizeof(page)) < 0)
+            {
+                break;
+            }
+            if (page >= total || state[page] != 1)
+            {
+                continue; /* Already on its way */
+            }
+            on_demand = true;
+        }
+        else
+        {
+            while (state[index[next]] != 1)
+            {
+                next++;
+            }
+            page = index[next];
+        }
+
+        if (pc_send_page(vm, page, on_demand) < 0)
+        {
+            break;
+        }
+        state[page] = 2;
+        sent++;
+        demand += on_demand;
+    }
+
+    printf("[VM %d] Sent %u of %u pages (%u on demand) in %llu ms, %u pre-copied before\n",
+           vm->id, sent, hdr.n_pages, demand, (now_ns() - start) / 1000000, vm->pc_precopied);
+    printf("[VM %d] Transfer: %llu pages, %llu KB as %llu KB (ratio %.2f): %llu zero, "
+           "%llu delta, %llu lz4, %llu raw; %llu cache hits, %.2f us CPU per page\n",
+           vm->id, x->pages, x->raw_bytes / 1024, x->encoded_bytes / 1024,
+           x->encoded_bytes ? (double)x->raw_bytes / x->encoded_bytes : 0.0, x->zero,
+           x->delta, x->lz4, x->raw, x->cache_hits,
+           x->pages ? x->cpu_ns / 1e3 / x->pages : 0.0);
+    free(index);
+    free(state);
+    return 0;
+}
+
+/*
+ * Destination: wait for the VM and take it over. Returns 0 once it can
+ * run, 1 if the source hung up without sending it (its guest finished
+ * first), -1 on error.
+ */
+static int pc_incoming(vm_state_t *vm)
+{
+    int fd = vm->cfg->migrate_fd;
+    uint64_t total = vm->mem_size / PC_PAGE_SIZE;
+    uint8_t data[PC_PAGE_SIZE];
+    uint64_t precopied = 0;
+    pc_header_t hdr;
+    pc_page_t msg;
+    uint32_t *index;
+
+    signal(SIGPIPE, SIG_IGN); /* Nor the source */
+    printf("[VM %d] Waiting for the VM to migrate in\n", vm->id);
+
+    /* Everything but the image is zero; the image pages the guest left
+     * nonzero are coming */
+    memset((uint8_t *)vm->mem + GUEST_CODE_ADDR, 0, guest_image->size);
+
+    /* Pre-copied pages, while the guest still runs on the source */
+    for (;;)
+    {
+        if (read_full(fd, &msg, sizeof(msg)) < 0)
+        {
+            printf("[VM %d] Nothing migrated in\n", vm->id);
+            return 1;
+        }
+        if (msg.page == PC_PAGE_SWITCH)
+        {
+            break;
+        }
+        if (msg.page >= total || msg.size > PC_PAGE_SIZE || read_full(fd, data, msg.size) < 0 ||
+            xfer_decode(msg.encoding, data, msg.size,
+                        (uint8_t *)vm->mem + (uint64_t)msg.page * PC_PAGE_SIZE,
+                        &vm->pc_xfer) < 0)
+        {
+            fprintf(stderr, "[VM %d] Migration stream is damaged\n", vm->id);
+            return -1;
+        }
+        precopied++;
+    }
+
+    if (read_full(fd, &hdr, sizeof(hdr)) < 0)
+    {
+        fprintf(stderr, "[VM %d] Migration stream is damaged\n", vm->id);
+        return -1;
+    }
+    if (hdr.magic != PC_MAGIC || hdr.vm_id != (uint32_t)vm->id ||
+        hdr.mem_size != vm->mem_size ||
+        hdr.image_hash != vm->vcpus[0].sw->image_hash || hdr.n_pages > total)
+    {
+        fprintf(stderr, "[VM %d] Migration stream is not for this VM\n", vm->id);
+        return -1;
+    }
+
+    index = malloc(hdr.n_pages * sizeof(*index) + 1);
+    vm->pc_absent = calloc((total + 7) / 8, 1);
+    if (index == NULL || vm->pc_absent == NULL ||
+        read_full(fd, index, hdr.n_pages * sizeof(*index)) < 0)
+    {
+        fprintf(stderr, "[VM %d] Failed to receive the page list\n", vm->id);
+        free(index);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < hdr.n_pages; i++)
+    {
+        if (index[i] < total)
+        {
+            vm->pc_absent[index[i] >> 3] |= (uint8_t)(1u << (index[i] & 7));
+        }
+    }
+    free(index);
+    vm->pc_pages = hdr.n_pages;
+
+    pthread_mutex_init(&vm->pc_lock, NULL);
+    pthread_cond_init(&vm->pc_arrived, NULL);
+    if (pthread_create(&vm->pc_thread, NULL, pc_receiver_main, vm) != 0)
+    {
+        fprintf(stderr, "[VM %d] Failed to start the page receiver\n", vm->id);
+        return -1;
+    }
+    vm->pc_started = true;
+
+    sw_cpu_load_regs(vm->vcpus[0].sw, &hdr.regs);
+    vm->pc_resume_ns = now_ns();
+    if (hdr.n_pages != 0)
+    {
+        vm->vcpus[0].sw->absent_pages = vm->pc_absent;
+    }
+    else
+    {
+        vm->pc_done_ns = vm->pc_resume_ns;
+    }
+    printf("[VM %d] Migrated in: resuming %llu us after the source stopped, "
+           "%llu pages pre-copied, %u to follow\n",
+           vm->id, (vm->pc_resume_ns - hdr.stop_ns) / 1000, precopied, hdr.n_pages);
+    return 0;
+}
+
+/* Destination: how the guest fared while its pages came in */
+static void pc_report(vm_state_t *vm)
+{
+    uint64_t end = now_ns();
+    uint64_t insns = vm->vcpus[0].sw->insns;
+
+    if (vm->pc_absent == NULL)
+    {
+        return;
+    }
+    printf("[VM %d] Post-copy: %u of %u pages fetched on demand, %llu us mean wait\n",
+           vm->id, vm->pc_demand, vm->pc_pages,
+           vm->pc_demand != 0 ? vm->pc_demand_wait_ns / vm->pc_demand / 1000 : 0);
+    printf("[VM %d] Decoded %llu pages from %llu KB, %.2f us CPU per page\n",
+           vm->id, vm->pc_xfer.pages, vm->pc_xfer.encoded_bytes / 1024,
+           vm->pc_xfer.pages ? vm->pc_xfer.cpu_ns / 1e3 / vm->pc_xfer.pages : 0.0);
+    if (vm->pc_done_ns == 0)
+    {
+        printf("[VM %d] Post-copy: guest finished with %u of %u pages in\n",
+               vm->id, vm->pc_received, vm->pc_pages);
+        return;
+    }
+
+    uint64_t during = vm->pc_done_ns - vm->pc_resume_ns;
+    uint64_t after = end - vm->pc_done_ns;
+    printf("[VM %d] Post-copy: degraded for %llu ms at %.1f MIPS, then %.1f MIPS\n",
+           vm->id, during / 1000000,
+           during ? vm->pc_done_insns * 1e3 / during : 0.0,
+           after ? (insns - vm->pc_done_insns) * 1e3 / after : 0.0);
+}
+
+/* ============================================================================
+ * Live Upgrade
+ * ============================================================================
+ *
+ * With --upgrade=MS each VM is handed over to a new VMM process every MS
+ * milliseconds, or when the parent gets a SIGHUP, running the
+ * --upgrade-binary (by default this one again), without stopping the
+ * guest for longer than the handover itself. Guest memory then lives in a
+ * POSIX shared memory object from the start (macOS has no memfd,
+ * shm_open() and shm_unlink() give the same anonymous file).
+ *
+ * Every VMM holds one end of a socket pair; the parent keeps the other
+ * until an upgrade is requested, so nothing runs ahead of time. Then the
+ * parent starts the new binary with its own arguments plus --upgrade-from,
+ * on that end and on one end of a fresh pair for the upgrade after it.
+ * The new VMM sets up a VM of its own and reports ready; then:
+ *
+ *   1. the old VMM stops its vCPU and sends the memory object and the
+ *      console (its stdout) with SCM_RIGHTS, followed by the vCPU
+ *      registers, which include the virtual timer, and the VMM's own
+ *      per-VM state;
+ *   2. the new VMM maps the memory object in place of its own guest
+ *      memory, loads the registers and resumes the guest. Not a byte of
+ *      guest memory is copied. It then tells the old VMM, which exits.
+ *
+ * The binaries may differ, so the state starts with a version and its
+ * size and the new VMM refuses what it does not understand. The old VMM
+ * runs the guest on if the handover does not complete. Translated code is
+ * not handed over: the new VMM translates again, or loads --tcache.
+ *
+ * Software backend with a single vCPU only, like post-copy migration.
+ */
+
+#define VM_EXIT_UPGRADED 5 /* VM process exit status: a new VMM runs the VM */
+
+#define UP_MAGIC 0x52475055 /* "UPGR" */
+#define UP_VERSION 1        /* Bump when up_state_t changes */
+#define UP_READY 'R'        /* New VMM -> old: set up, send the VM */
+#define UP_RESUMED 'G'      /* New VMM -> old: the guest runs here now */
+
+/* Descriptors passed with up_header_t */
+#define UP_FD_MEM 0     /* Guest memory */
+#define UP_FD_CONSOLE 1 /* Where the guest's output goes */
+#define UP_NR_FDS 2
+
+/* The new VMM binary (--upgrade-binary, default argv[0]) and the
+ * arguments it is started with: the parent's own */
+static const char *up_binary;
+static char **up_argv;
+static int up_argc;
+
+/* Parent: the new VMM's end of each VM's upgrade socket, -1 = none */
+static int up_fds[MAX_VMS];
+
+/* Set by SIGHUP in the parent: upgrade every VM now */
+static volatile sig_atomic_t up_requested;
+
+static void up_on_sighup(int sig)
+{
+    (void)sig;
+    up_requested = 1;
+}
+
+/* Sent with the descriptors attached, state_size bytes of up_state_t
+ * follow */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t vm_id;
+    uint32_t state_size;
+} up_header_t;
+
+typedef struct
+{
+    uint64_t mem_size;
+    uint64_t image_hash;        /* Guest image it is running */
+    uint64_t stop_ns;           /* now_ns() when the old vCPU stopped */
+    uint64_t insns;             /* Retired so far, the clock with --icount */
+    uint64_t mem_reported_free; /* VMM state: see vm_state_t */
+    uint64_t nr_periods;
+    uint64_t nr_throttled;
+    uint64_t throttled_usec;
+    uint64_t mem_high_events;
+    sw_regs_t regs;
+} up_state_t;
+
+/* Guest memory the new VMM can map: an unlinked shared memory object */
+static int up_mem_create(int vm_id, size_t size)
+{
+    char name[32];
+    int fd;
+
+    snprintf(name, sizeof(name), "/tinyvmm-%d-vm%d", (int)getpid(), vm_id);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+    {
+        perror("shm_open");
+        return -1;
+    }
+    shm_unlink(name);
+    if (ftruncate(fd, (off_t)size) < 0)
+    {
+        perror("ftruncate");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* In a child of the parent: the other VMs' sockets are not ours */
+static void up_close_parent_fds(void)
+{
+    for (int i = 0; i < MAX_VMS; i++)
+    {
+        if (up_fds[i] >= 0)
+        {
+            close(up_fds[i]);
+            up_fds[i] = -1;
+        }
+    }
+}
+
+/* Parent: a socket pair for the next upgrade of VM `i`. Returns the VMM's
+ * end; the parent keeps the other in up_fds[i]. */
+static int up_prepare(int i)
+{
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    {
+        perror("socketpair");
+        return -1;
+    }
+    up_fds[i] = sv[1];
+    return sv[0];
+}
+
+/* Parent: start the new VMM for `cfg`, which waits for the VM */
+static pid_t up_spawn(vm_config_t *cfg)
+{
+    char from[48];
+    char **argv;
+    pid_t pid;
+
+    cfg->spawn_start_ns = now_ns();
+    snprintf(from, sizeof(from), "--upgrade-from=%d,%d,%d", cfg->id, cfg->migrate_fd,
+             cfg->up_next_fd);
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0)
+    {
+        argv = calloc((size_t)up_argc + 2, sizeof(*argv));
+        if (argv != NULL)
+        {
+            up_close_parent_fds();
+            memcpy(argv, up_argv, (size_t)up_argc * sizeof(*argv));
+            argv[up_argc] = from;
+            execvp(up_binary, argv);
+        }
+        fprintf(stderr, "[VM %d] Cannot run %s: %s\n", cfg->id, up_binary, strerror(errno));
+        _exit(1);
+    }
+    if (pid < 0)
+    {
+        perror("fork");
+    }
+    return pid;
+}
+
+/* Parent: upgrade VM `i`. Starts the new VMM on the socket the running
+ * one waits on; that one hands the VM over once the new VMM is ready. */
+static pid_t up_request(const vm_config_t *cfg, int i)
+{
+    vm_config_t next = *cfg;
+    pid_t pid;
+
+    next.incoming = true;
+    next.migrate_fd = up_fds[i];
+    next.migrate_peer_fd = -1;
+    up_fds[i] = -1;
+    next.up_next_fd = up_prepare(i);
+
+    pid = up_spawn(&next);
+    close(next.migrate_fd);
+    if (next.up_next_fd >= 0)
+    {
+        close(next.up_next_fd);
+    }
+    if (pid < 0 && up_fds[i] >= 0)
+    {
+        close(up_fds[i]);
+        up_fds[i] = -1;
+    }
+    return pid;
+}
+
+/* Send `len` bytes with the UP_NR_FDS descriptors attached */
+static int up_send_fds(int sock, const void *buf, size_t len, const int *fds)
+{
+    char control[CMSG_SPACE(UP_NR_FDS * sizeof(int))] = {0};
+    struct iovec iov = {.iov_base = (void *)buf, .iov_len = len};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    ssize_t n;
+
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(UP_NR_FDS * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, UP_NR_FDS * sizeof(int));
+    do
+    {
+        n = sendmsg(sock, &msg, 0);
+    } while (n < 0 && errno == EINTR);
+    return n == (ssize_t)len ? 0 : -1;
+}
+
+/* Receive `len` bytes and the UP_NR_FDS descriptors sent with them.
+ * Returns 1 if the other end hung up instead. */
+static int up_recv_fds(int sock, void *buf, size_t len, int *fds)
+{
+    char control[CMSG_SPACE(UP_NR_FDS * sizeof(int))];
+    struct iovec iov = {.iov_base = buf, .iov_len = len};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg;
+    bool have_fds = false;
+    ssize_t n;
+
+    do
+    {
+        n = recvmsg(sock, &msg, MSG_WAITALL);
+    } while (n < 0 && errno == EINTR);
+    if (n == 0 || (n < 0 && errno == ECONNRESET))
+    {
+        return 1;
+    }
+
+    cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(UP_NR_FDS * sizeof(int)))
+    {
+        memcpy(fds, CMSG_DATA(cmsg), UP_NR_FDS * sizeof(int));
+        have_fds = true;
+    }
+    if (n == (ssize_t)len && have_fds && !(msg.msg_flags & MSG_CTRUNC))
+    {
+        return 0;
+    }
+    for (int i = 0; have_fds && i < UP_NR_FDS; i++)
+    {
+        close(fds[i]);
+    }
+    return -1;
+}
+
+/* Old VMM: wait for a new VMM to be started and ready. The guest keeps
+ * running until then. */
+static void *up_listen_main(void *arg)
+{
+    vm_state_t *vm = arg;
+    int fd = vm->up_fd;
+    char ready;
+
+    /* Short polls, so a guest that exits first is not held up */
+    while (!atomic_load(&vm->up_stop))
+    {
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        int n = poll(&pfd, 1, HIB_WFI_SLEEP_US / 1000);
+
+        if (n == 0 || (n < 0 && errno == EINTR))
+        {
+            continue;
+        }
+        if (n < 0 || read_full(fd, &ready, 1) < 0 || ready != UP_READY)
+        {
+            printf("\n[VM %d] No new VMM to upgrade to\n", vm->id);
+            break;
+        }
+        vm_kick(vm, VM_KICK_UPGRADE);
+        break;
+    }
+    return NULL;
+}
+
+static int up_start(vm_state_t *vm)
+{
+    if (vm->cfg->upgrade_ms == 0 || vm->up_fd < 0)
+    {
+        return 0;
+    }
+    /* A new VMM that goes away must not take us with it */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (pthread_create(&vm->up_thread, NULL, up_listen_main, vm) != 0)
+    {
+        fprintf(stderr, "[VM %d] Failed to wait for upgrades\n", vm->id);
+        return -1;
+    }
+    vm->up_started = true;
+    return 0;
+}
+
+static void up_stop(vm_state_t *vm)
+{
+    if (!vm->up_started)
+    {
+        return;
+    }
+    atomic_store(&vm->up_stop, true);
+    pthread_join(vm->up_thread, NULL);
+    vm->up_started = false;
+}
+
+/* Old VMM, on the vCPU thread: stop for run_single_vm() to hand over */
+static void up_service(vcpu_state_t *vcpu)
+{
+    vm_state_t *vm = vcpu->vm;
+
+    printf("\n[VM %d] Upgrading\n", vm->id);
+    vm->up_stop_ns = now_ns();
+    vm->upgrading = true;
+    vcpu->running = false;
+}
+
+/* Old VMM: hand the stopped VM over. 0 once the new VMM runs it, 1 if it
+ * did not take it, and the guest is to go on here. */
+static int up_send(vm_state_t *vm)
+{
+    int fd = vm->up_fd;
+    int fds[UP_NR_FDS] = {[UP_FD_MEM] = vm->mem_fd, [UP_FD_CONSOLE] = STDOUT_FILENO};
+    up_header_t hdr = {
+        .magic = UP_MAGIC,
+        .version = UP_VERSION,
+        .vm_id = (uint32_t)vm->id,
+        .state_size = sizeof(up_state_t),
+    };
+    up_state_t state = {0};
+    char ack;
+
+    state.mem_size = vm->mem_size;
+    state.image_hash = vm->vcpus[0].sw->image_hash;
+    state.stop_ns = vm->up_stop_ns;
+    state.insns = vm->vcpus[0].sw->insns;
+    state.mem_reported_free = vm->mem_reported_free;
+    state.nr_periods = vm->nr_periods;
+    state.nr_throttled = vm->nr_throttled;
+    state.throttled_usec = vm->throttled_usec;
+    state.mem_high_events = vm->mem_high_events;
+    sw_cpu_save_regs(vm->vcpus[0].sw, &state.regs);
+
+    /* The guest's output so far goes out before the new VMM's */
+    fflush(stdout);
+    if (up_send_fds(fd, &hdr, sizeof(hdr), fds) < 0 || write_full(fd, &state, sizeof(state)) < 0 ||
+        read_full(fd, &ack, 1) < 0 || ack != UP_RESUMED)
+    {
+        printf("[VM %d] The new VMM did not take over, resuming here\n", vm->id);
+        return 1;
+    }
+    printf("[VM %d] Handed over to the new VMM\n", vm->id);
+    return 0;
+}
+
+/* New VMM: wait for the VM and take it over. 1 if the old VMM finished
+ * it instead. */
+static int up_incoming(vm_state_t *vm)
+{
+    int fd = vm->cfg->migrate_fd;
+    int fds[UP_NR_FDS];
+    up_header_t hdr;
+    up_state_t state;
+    char msg = UP_READY;
+    int ret;
+
+    signal(SIGPIPE, SIG_IGN); /* Nor the old VMM */
+    printf("[VM %d] New VMM (PID %d) waiting for the VM\n", vm->id, (int)getpid());
+
+    if (write_full(fd, &msg, 1) < 0 || (ret = up_recv_fds(fd, &hdr, sizeof(hdr), fds)) > 0)
+    {
+        printf("[VM %d] Nothing handed over\n", vm->id);
+        return 1;
+    }
+    if (ret < 0)
+    {
+        fprintf(stderr, "[VM %d] Handover is damaged\n", vm->id);
+        return -1;
+    }
+    if (hdr.magic != UP_MAGIC || hdr.version != UP_VERSION ||
+        hdr.state_size != sizeof(state) || hdr.vm_id != (uint32_t)vm->id)
+    {
+        fprintf(stderr, "[VM %d] Old VMM hands over version %u (%u bytes), this one takes "
+                "version %u (%zu bytes): not taking over\n",
+                vm->id, hdr.version, hdr.state_size, UP_VERSION, sizeof(state));
+        close(fds[UP_FD_MEM]);
+        close(fds[UP_FD_CONSOLE]);
+        return -1;
+    }
+    if (read_full(fd, &state, sizeof(state)) < 0 || state.mem_size != vm->mem_size ||
+        state.image_hash != vm->vcpus[0].sw->image_hash)
+    {
+        fprintf(stderr, "[VM %d] Handover is not for this VM\n", vm->id);
+        close(fds[UP_FD_MEM]);
+        close(fds[UP_FD_CONSOLE]);
+        return -1;
+    }
+
+    /* The old VMM's memory replaces ours at the same address, so the
+     * vCPU's pointers into it stay valid */
+    if (mmap(vm->mem, vm->mem_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+             fds[UP_FD_MEM], 0) == MAP_FAILED)
+    {
+        perror("mmap");
+        close(fds[UP_FD_MEM]);
+        close(fds[UP_FD_CONSOLE]);
+        return -1;
+    }
+    vm->mem_fd = fds[UP_FD_MEM];
+
+    fflush(stdout);
+    dup2(fds[UP_FD_CONSOLE], STDOUT_FILENO);
+    close(fds[UP_FD_CONSOLE]);
+
+    vm->mem_reported_free = state.mem_reported_free;
+    vm->nr_periods = state.nr_periods;
+    vm->nr_throttled = state.nr_throttled;
+    vm->throttled_usec = state.throttled_usec;
+    vm->mem_high_events = state.mem_high_events;
+    vm->vcpus[0].sw->insns = state.insns; /* Before the timer is loaded */
+    sw_cpu_load_regs(vm->vcpus[0].sw, &state.regs);
+
+    /* If the old VMM is gone already the VM is ours all the same */
+    msg = UP_RESUMED;
+    write_full(fd, &msg, 1);
+
+    /* No longer incoming: the next upgrade comes on our own socket */
+    close(fd);
+    vm->up_fd = vm->cfg->up_next_fd;
+    printf("[VM %d] Upgraded in: resuming %llu us after the old VMM stopped, "
+           "%zu KB of guest memory taken over without copying\n",
+           vm->id, (now_ns() - state.stop_ns) / 1000, vm->mem_size / 1024);
+    return 0;
+}
+
+/* ============================================================================
+ * Memory Pressure (runs inside the VM process)
+ * ============================================================================
+ *
+ * The parent's pressure controller (see "Memory Pressure Controller")
+ * asks a VM to give memory back by setting a request in the shared
+ * mp_shared slot of the VM and sending it SIGUSR2. The signal kicks the
+ * vCPUs and the boot vCPU acts on the request between two runs, when
+ * guest memory is not being written:
+ *
+ * - MP_REQ_RECLAIM:   resident guest pages that are all zeroes are handed
+ *                     back to the host with MADV_FREE_REUSABLE. They read
+ *                     as zeroes either way, so the guest can't tell.
+ * - MP_REQ_HIBERNATE: the VM is hibernated right away, idle or not.
+ */
+
+#define MP_REQ_RECLAIM (1u << 0)
+#define MP_REQ_HIBERNATE (1u << 1)
+
+/* One per VM, shared between the parent and the VM processes */
+typedef struct
+{
+    atomic_uint request;               /* Pending MP_REQ_* */
+    atomic_uint_fast64_t reclaimed;    /* Bytes handed back, all requests */
+} mp_shared_t;
+
+static mp_shared_t *mp_shared; /* MAX_VMS slots, NULL = no controller */
+static vm_state_t *mp_vm;      /* VM of this process, for the signal handler */
+
+static void mp_on_sigusr2(int sig)
+{
+    (void)sig;
+    if (mp_vm != NULL)
+    {
+        vm_kick(mp_vm, VM_KICK_PRESSURE);
+    }
+}
+
+static int mp_start(vm_state_t *vm)
+{
+    if (mp_shared == NULL)
+    {
+        return 0;
+    }
+    mp_vm = vm;
+    signal(SIGUSR2, mp_on_sigusr2);
+    return 0;
+}
+
+static void mp_stop(vm_state_t *vm)
+{
+    if (mp_vm == vm)
+    {
+        signal(SIGUSR2, SIG_IGN);
+        mp_vm = NULL;
+    }
+}
+
+/* Hand zero pages back to the host, returns the number of bytes */
+static uint64_t mp_reclaim(vm_state_t *vm)
+{
+    size_t page = (size_t)getpagesize();
+    size_t n = vm->mem_size / page;
+    uint8_t *mem = vm->mem;
+    uint64_t freed = 0;
+    char *resident = malloc(n);
+
+    /* Only resident pages take memory; reading the others would fault
+     * them in */
+    if (resident == NULL || mincore(vm->mem, vm->mem_size, resident) != 0)
+    {
+        free(resident);
+        return 0;
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        if ((resident[i] & 1) && page_is_zero(mem + i * page, page) &&
+            madvise(mem + i * page, page, MADV_FREE_REUSABLE) == 0)
+        {
+            freed += page;
+        }
+    }
+    free(resident);
+    return freed;
+}
+
+static void mp_service(vcpu_state_t *vcpu)
+{
+    vm_state_t *vm = vcpu->vm;
+    unsigned int req;
+
+    /* Other vCPUs could be writing the pages being freed */
+    if (vcpu->index != 0 || vm->nr_vcpus != 1 || mp_shared == NULL)
+    {
+        return;
+    }
+    req = atomic_exchange(&mp_shared[vm->id - 1].request, 0);
+
+    if ((req & MP_REQ_HIBERNATE) && vcpu->sw != NULL && vm->cfg->hib_path[0] != '\0')
+    {
+        printf("\n[VM %d] Memory pressure, hibernating\n", vm->id);
+        vm_hibernate(vcpu);
+        return;
+    }
+    if (req & MP_REQ_RECLAIM)
+    {
+        uint64_t freed = mp_reclaim(vm);
+        atomic_fetch_add(&mp_shared[vm->id - 1].reclaimed, freed);
+        printf("\n[VM %d] Memory pressure, reclaimed %llu KB of free guest memory\n",
+               vm->id, freed / 1024);
+    }
+}
+
+/* ============================================================================
+ * VM Lifecycle Functions
+ * ============================================================================ */
+
+/* Guest memory with the image already loaded, prepared by the zygote */
+static void *guest_template;
+
+/*
+ * vCPU register access for either backend.
+ * Only the registers the VMM itself touches are supported.
+ */
+static hv_return_t vcpu_get_reg(vcpu_state_t *vcpu, hv_reg_t reg, uint64_t *value)
+{
+    if (vcpu->sw == NULL)
+    {
+        return hv_vcpu_get_reg(vcpu->vcpu, reg, value);
+    }
+
+    if (reg >= HV_REG_X0 && reg <= HV_REG_X30)
+        *value = vcpu->sw->x[reg - HV_REG_X0];
+    else if (reg == HV_REG_PC)
+        *value = vcpu->sw->pc;
+    else if (reg == HV_REG_CPSR)
+        *value = vcpu->sw->nzcv | 0x3c5;
+    else
+        return HV_BAD_ARGUMENT;
+    return HV_SUCCESS;
+}
+
+static hv_return_t vcpu_set_reg(vcpu_state_t *vcpu, hv_reg_t reg, uint64_t value)
+{
+    if (vcpu->sw == NULL)
+    {
+        return hv_vcpu_set_reg(vcpu->vcpu, reg, value);
+    }
+
+    if (reg >= HV_REG_X0 && reg <= HV_REG_X30)
+        vcpu->sw->x[reg - HV_REG_X0] = value;
+    else if (reg == HV_REG_PC)
+        vcpu->sw->pc = value;
+    else if (reg == HV_REG_CPSR)
+        vcpu->sw->nzcv = (uint32_t)value & 0xf0000000u;
+    else
+        return HV_BAD_ARGUMENT;
+    return HV_SUCCESS;
+}
+
+/*
+ * Free-page reporting: the guest hands back [gpa, gpa + size) with the
+ * FREE_PAGES hypercall. The host pages wholly inside it are released and
+ * read back as undefined (zero once the host reclaimed them) until the
+ * guest writes them again.
+ */
+static void vm_free_pages(vm_state_t *vm, uint64_t gpa, uint64_t size)
+{
+    uint64_t page = (uint64_t)getpagesize();
+    uint64_t start, end;
+
+    if (gpa >= vm->mem_size)
+    {
+        return;
+    }
+    end = size < vm->mem_size - gpa ? gpa + size : vm->mem_size;
+    start = (gpa + page - 1) & ~(page - 1);
+    end &= ~(page - 1);
+    if (start < end && madvise((uint8_t *)vm->mem + start, end - start, MADV_FREE_REUSABLE) == 0)
+    {
+        vm->mem_reported_free += end - start;
+    }
+}
+
+/* Bytes of guest memory currently backed by host memory */
+static uint64_t vm_resident_bytes(const vm_state_t *vm)
+{
+    size_t page = (size_t)getpagesize();
+    size_t n = (vm->mem_size + page - 1) / page;
+    char *resident = malloc(n);
+    uint64_t bytes = 0;
+
+    if (resident == NULL || mincore(vm->mem, vm->mem_size, resident) != 0)
+    {
+        free(resident);
+        return 0;
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        if (resident[i] & 1)
+            bytes += page;
+    }
+    free(resident);
+    return bytes;
+}
+
+/*
+ * Fault in the --prefault ranges of guest memory at creation, so the
+ * guest takes no host page faults on first touch. macOS has neither
+ * MAP_POPULATE nor MADV_POPULATE_WRITE, so every page is written, with
+ * the value it already holds (memory from the zygote is not all zero).
+ * Large ranges are split into VM_PREFAULT_CHUNK pieces for up to one
+ * thread per CPU.
+ */
+#define VM_PREFAULT_CHUNK (16ull << 20)
+#define VM_PREFAULT_MAX_THREADS 16
+
+typedef struct
+{
+    uint8_t *mem;
+    size_t page;
+    vm_range_t ranges[VM_MAX_PREFAULT]; /* Clamped to guest memory */
+    int n_ranges;
+    uint64_t n_chunks;                  /* In all the ranges */
+    atomic_uint_fast64_t next;          /* Next chunk to hand out */
+} prefault_work_t;
+
+/* Chunks in a range, the last one may be short */
+static uint64_t prefault_chunks(const vm_range_t *r)
+{
+    return (r->end - r->start + VM_PREFAULT_CHUNK - 1) / VM_PREFAULT_CHUNK;
+}
+
+static void *prefault_thread_main(void *arg)
+{
+    prefault_work_t *work = arg;
+    uint64_t chunk;
+
+    while ((chunk = atomic_fetch_add(&work->next, 1)) < work->n_chunks)
+    {
+        int r = 0;
+        while (chunk >= prefault_chunks(&work->ranges[r]))
+        {
+            chunk -= prefault_chunks(&work->ranges[r]);
+            r++;
+        }
+        uint64_t start = work->ranges[r].start + chunk * VM_PREFAULT_CHUNK;
+        uint64_t end = start + VM_PREFAULT_CHUNK < work->ranges[r].end
+                           ? start + VM_PREFAULT_CHUNK
+                           : work->ranges[r].end;
+
+        for (uint64_t a = start; a < end; a += work->page)
+        {
+            volatile uint8_t *p = work->mem + a;
+            *p = *p;
+        }
+    }
+    return NULL;
+}
+
+static void vm_prefault(vm_state_t *vm)
+{
+    const vm_config_t *cfg = vm->cfg;
+    prefault_work_t work = {.mem = vm->mem, .page = (size_t)getpagesize()};
+    pthread_t threads[VM_PREFAULT_MAX_THREADS];
+    uint64_t bytes = 0;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int n_threads = 1;
+
+    if (cfg->n_prefault == 0)
+    {
+        return;
+    }
+
+    for (int i = 0; i < cfg->n_prefault; i++)
+    {
+        uint64_t start = cfg->prefault[i].start & ~((uint64_t)work.page - 1);
+        uint64_t end = cfg->prefault[i].end < vm->mem_size ? cfg->prefault[i].end : vm->mem_size;
+        if (start < end)
+        {
+            work.ranges[work.n_ranges] = (vm_range_t){start, end};
+            work.n_chunks += prefault_chunks(&work.ranges[work.n_ranges]);
+            work.n_ranges++;
+            bytes += end - start;
+        }
+    }
+
+    /* A thread per chunk at most */
+    if (cpus > 1 && work.n_chunks > 1)
+    {
+        n_threads = (int)(work.n_chunks < (uint64_t)cpus ? work.n_chunks : (uint64_t)cpus);
+        if (n_threads > VM_PREFAULT_MAX_THREADS)
+        {
+            n_threads = VM_PREFAULT_MAX_THREADS;
+        }
+    }
+
+    uint64_t start = now_ns();
+    int started = 1;
+    for (; started < n_threads; started++)
+    {
+        if (pthread_create(&threads[started], NULL, prefault_thread_main, &work) != 0)
+        {
+            break; /* The rest is done with fewer threads */
+        }
+    }
+    prefault_thread_main(&work);
+    for (int i = 1; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    printf("[VM %d] Prefaulted %llu KB of guest memory in %llu us (%d thread%s)\n",
+           vm->id, bytes / 1024, (now_ns() - start) / 1000, started, started > 1 ? "s" : "");
+}
+
+/*
+ * Initialize the VM: create VM instance and allocate guest memory
+ */
+static int vm_init(vm_state_t *vm)
+{
+    bool hvf = vm->cfg->backend == VM_BACKEND_HVF;
+
+    printf("[VM %d] Creating virtual machine...\n", vm->id);
+
+    /* Step 1: Create the VM instance for this process
+     * (the software backend needs no hypervisor at all)
+     */
+    if (hvf)
+    {
+        HV_CHECK(hv_vm_create(NULL));
+    }
+    printf("[VM %d] VM created successfully (%s backend)\n",
+           vm->id, hvf ? "hvf" : "sw");
+
+    /* Step 2: Allocate guest memory
+     * We use mmap to get page-aligned memory that can be mapped into the guest.
+     * When spawned by the zygote, the memory already exists (inherited
+     * copy-on-write) with the guest image loaded, so we just take it over.
+     * With --upgrade it is a shared memory object a new VMM can map.
+     * MAP_NORESERVE: a large guest costs nothing until it touches memory.
+     */
+    vm->mem_size = guest_mem_size;
+    if (guest_template != NULL)
+    {
+        vm->mem = guest_template;
+        vm->image_preloaded = true;
+        guest_template = NULL;
+    }
+    else if (vm->cfg->upgrade_ms != 0 && !vm->cfg->incoming)
+    {
+        vm->mem_fd = up_mem_create(vm->id, vm->mem_size);
+        vm->mem = vm->mem_fd < 0 ? MAP_FAILED
+                                 : mmap(NULL, vm->mem_size, PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_NORESERVE, vm->mem_fd, 0);
+    }
+    else
+    {
+        vm->mem = mmap(NULL, vm->mem_size,
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    }
+
+    if (vm->mem == MAP_FAILED)
+    {
+        perror("mmap");
+        vm->mem = NULL;
+        if (hvf)
+        {
+            hv_vm_destroy();
+        }
+        return -1;
+    }
+    printf("[VM %d] Allocated %zu KB guest memory at %p\n",
+           vm->id, vm->mem_size / 1024, vm->mem);
+    vm_prefault(vm);
+
+    if (!hvf)
+    {
+        return 0;
+    }
+
+    /* Step 3: Map the host memory into guest physical address space
+     * The guest will see this memory starting at IPA (Intermediate Physical Address) 0
+     */
+    HV_CHECK(hv_vm_map(vm->mem, 0, vm->mem_size,
+                       HV_MEMORY_READ | HV_MEMORY_WRITE | HV_MEMORY_EXEC));
+    printf("[VM %d] Mapped guest memory: GPA 0x0 - 0x%zx\n", vm->id, vm->mem_size);
+
+    return 0;
+}
+
+/*
+ * Create and configure one vCPU
+ */
+static int vcpu_init_one(vm_state_t *vm, vcpu_state_t *vcpu)
+{
+    uint64_t sp = GUEST_STACK_ADDR - (uint64_t)vcpu->index * GUEST_VCPU_STACK_SIZE;
+
+    /* Create the vCPU
+     * The exit pointer will be filled in by the framework. The software
+     * vCPU fills in our own exit structure the same way (see sw_vcpu_run).
+     */
+    if (vm->cfg->backend == VM_BACKEND_SW)
+    {
+        vcpu->sw = malloc(sizeof(*vcpu->sw));
+        if (vcpu->sw == NULL || sw_cpu_init(vcpu->sw, vm->mem, vm->mem_size) < 0)
+        {
+            fprintf(stderr, "[VM %d] Failed to create software vCPU\n", vm->id);
+            free(vcpu->sw);
+            vcpu->sw = NULL;
+            return -1;
+        }
+        vcpu->vcpu_exit = &vcpu->sw_exit;
+        vcpu->sw->tcache = vm->tcache;
+        vcpu->sw->profile = vm->cfg->profile_path[0] != '\0';
+        if (vm->cfg->wss_path[0] != '\0' && sw_cpu_track_access(vcpu->sw) < 0)
+        {
+            fprintf(stderr, "[VM %d] Failed to enable access tracking\n", vm->id);
+            return -1;
+        }
+        if (vm->cfg->icount_mips != 0)
+        {
+            sw_cpu_set_icount(vcpu->sw, vm->cfg->icount_mips);
+        }
+
+        /* Code modified by one vCPU must be retranslated by all of them */
+        if (vm->nr_vcpus > 1)
+        {
+            vcpu->sw->code_epoch = &vm->code_epoch;
+        }
+    }
+    else
+    {
+        HV_CHECK(hv_vcpu_create(&vcpu->vcpu, &vcpu->vcpu_exit, NULL));
+    }
+    if (vm->nr_vcpus == 1)
+    {
+        printf("[VM %d] vCPU created\n", vm->id);
+    }
+
+    /* Set up initial register state
+     *
+     * For ARM64:
+     * - PC: Where to start executing
+     * - SP: Stack pointer
+     * - CPSR: Current program status (we use EL1h = kernel mode with SP_EL1)
+     */
+
+    /* Program counter: point to our guest code */
+    HV_CHECK(vcpu_set_reg(vcpu, HV_REG_PC, GUEST_CODE_ADDR));
+
+    /* Stack pointer (SP_EL0 is used when running at EL1 with SP_EL0 selected) */
+    if (vcpu->sw != NULL)
+    {
+        vcpu->sw->x[SW_REG_SP] = sp;
+    }
+    else
+    {
+        HV_CHECK(hv_vcpu_set_sys_reg(vcpu->vcpu, HV_SYS_REG_SP_EL0, sp));
+    }
+
+    /* CPSR: EL1h mode (bits [3:0] = 0b0101 = EL1 with SP_EL1)
+     * Bit 9 (E) = 0: Little endian
+     * Bit 8 (A) = 0: No SError masking
+     * Bit 7 (I) = 1: IRQ masked (we don't use interrupts)
+     * Bit 6 (F) = 1: FIQ masked
+     */
+    HV_CHECK(vcpu_set_reg(vcpu, HV_REG_CPSR, 0x3c5)); /* EL1h, interrupts masked */
+
+    /* Clear general purpose registers */
+    for (int i = 0; i <= 30; i++)
+    {
+        HV_CHECK(vcpu_set_reg(vcpu, HV_REG_X0 + i, 0));
+    }
+
+    /* Set X20 to VM ID so guest can identify itself, tell each vCPU
+     * which one it is (X21) out of how many (X22), and how much RAM
+     * there is (X23) */
+    HV_CHECK(vcpu_set_reg(vcpu, HV_REG_X20, vm->id));
+    HV_CHECK(vcpu_set_reg(vcpu, HV_REG_X21, vcpu->index));
+    HV_CHECK(vcpu_set_reg(vcpu, HV_REG_X22, vm->nr_vcpus));
+    HV_CHECK(vcpu_set_reg(vcpu, HV_REG_X23, vm->mem_size));
+
+    if (vm->nr_vcpus > 1)
+    {
+        printf("[VM %d] vCPU %d initialized: PC=0x%x, SP=0x%llx\n",
+               vm->id, vcpu->index, GUEST_CODE_ADDR, sp);
+    }
+    else
+    {
+        printf("[VM %d] vCPU initialized: PC=0x%x, SP=0x%x\n",
+               vm->id, GUEST_CODE_ADDR, GUEST_STACK_ADDR);
+    }
+
+    return 0;
+}
+
+/*
+ * Create and configure the vCPUs
+ */
+static int vcpu_init(vm_state_t *vm)
+{
+    if (vm->cfg->vcpus > 1)
+    {
+        printf("[VM %d] Creating %d vCPUs...\n", vm->id, vm->cfg->vcpus);
+    }
+    else
+    {
+        printf("[VM %d] Creating vCPU...\n", vm->id);
+    }
+
+    if (vm->cfg->backend == VM_BACKEND_SW && vm->cfg->tcache_path[0] != '\0')
+    {
+        vm->tcache = tcache_open(vm->cfg->tcache_path);
+        if (vm->tcache != NULL)
+        {
+            printf("[VM %d] Translation cache %s: %u blocks\n",
+                   vm->id, vm->cfg->tcache_path, tcache_size(vm->tcache));
+        }
+    }
+
+    vm->nr_vcpus = vm->cfg->vcpus;
+    for (int i = 0; i < vm->nr_vcpus; i++)
+    {
+        vm->vcpus[i].vm = vm;
+        vm->vcpus[i].index = i;
+    }
+    for (int i = 0; i < vm->nr_vcpus; i++)
+    {
+        if (vcpu_init_one(vm, &vm->vcpus[i]) < 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Load guest code into VM memory
+ */
+static int load_guest(vm_state_t *vm)
+{
+    printf("[VM %d] Loading guest code...\n", vm->id);
+
+    /* Copy guest code to the appropriate location in guest memory */
+    size_t code_size = guest_image->size;
+
+    if (GUEST_CODE_ADDR + code_size > vm->mem_size)
+    {
+        fprintf(stderr, "[VM %d] Error: Guest code too large\n", vm->id);
+        return -1;
+    }
+
+    /* The zygote template already holds the image */
+    if (!vm->image_preloaded)
+    {
+        memcpy((uint8_t *)vm->mem + GUEST_CODE_ADDR, guest_image->code, code_size);
+    }
+
+    printf("[VM %d] Loaded %zu bytes of guest code at GPA 0x%x\n",
+           vm->id, code_size, GUEST_CODE_ADDR);
+
+    /* Translations are cached per guest image */
+    for (int i = 0; i < vm->nr_vcpus; i++)
+    {
+        if (vm->vcpus[i].sw != NULL)
+        {
+            vm->vcpus[i].sw->image_hash = sw_hash64(guest_image->code, code_size);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Handle a hypercall from the guest
+ *
+ * Hypercalls use the HVC instruction in ARM64. When the guest executes HVC,
+ * we get an exception and can read the guest's registers to see what it wants.
+ */
+static int handle_hypercall(vcpu_state_t *vcpu)
+{
+    vm_state_t *vm = vcpu->vm;
+    uint64_t x0, x1, pc;
+    // static int call_count = 0;
+
+    /* Read hypercall number and argument */
+    vcpu_get_reg(vcpu, HV_REG_X0, &x0);
+    vcpu_get_reg(vcpu, HV_REG_X1, &x1);
+    vcpu_get_reg(vcpu, HV_REG_PC, &pc);
+
+    /* Debug: show first few hypercalls */
+    // if (call_count < 20) {
+    //     fprintf(stderr, "[DEBUG] Hypercall #%d: PC=0x%llx x0=%llu x1=0x%llx('%c')\n",
+    //             call_count, pc, x0, x1, (x1 >= 32 && x1 < 127) ? (char)x1 : '?');
+    // }
+    // call_count++;
+
+    switch (x0)
+    {
+    case HYPERCALL_EXIT:
+        /* Stops the calling vCPU; the VM is done when all have stopped */
+        if (vm->nr_vcpus > 1)
+        {
+            printf("\n[VM %d] vCPU %d requested exit\n", vm->id, vcpu->index);
+        }
+        else
+        {
+            printf("\n[VM %d] Guest requested exit\n", vm->id);
+        }
+        vcpu->running = false;
+        break;
+
+    case HYPERCALL_PUTCHAR:
+        /* Print a single character */
+        putchar((int)x1);
+        fflush(stdout);
+        break;
+
+    case HYPERCALL_PUTS:
+        /* Print a string from guest memory */
+        {
+            if (x1 < vm->mem_size && pc_fetch_string(vm, x1) == 0)
+            {
+                const char *str = (const char *)vm->mem + x1;
+                printf("%s", str);
+            }
+        }
+        break;
+
+    case HYPERCALL_FUZZ_START:
+        /* Not fuzzing: the guest gets an empty input */
+        vcpu_set_reg(vcpu, HV_REG_X0, 0);
+        break;
+
+    case HYPERCALL_FUZZ_END:
+        break;
+
+    case HYPERCALL_FREE_PAGES:
+        {
+            uint64_t x2;
+            vcpu_get_reg(vcpu, HV_REG_X2, &x2);
+            vm_free_pages(vm, x1, x2);
+        }
+        break;
+
+    case HYPERCALL_LOCK_WAIT:
+        {
+            uint64_t x2;
+            vcpu_get_reg(vcpu, HV_REG_X2, &x2);
+            pv_wait(vcpu, x1, (uint32_t)x2);
+        }
+        break;
+
+    case HYPERCALL_LOCK_KICK:
+        pv_kick(vm, x1);
+        break;
+
+    default:
+        printf("[VM %d] Unknown hypercall %llu at PC=0x%llx\n", vm->id, x0, pc);
+        break;
+    }
+
+    /* Note: PC already points past the HVC instruction after trap */
+
+    return 0;
+}
+
+/*
+ * Handle a VM exit
+ *
+ * This is called whenever the guest stops executing and control returns
+ * to the VMM. Common reasons include:
+ * - Hypercalls (HVC instruction)
+ * - System register access we don't allow
+ * - Memory access faults
+ * - Interrupts
+ */
+static int handle_exit(vcpu_state_t *vcpu)
+{
+    vm_state_t *vm = vcpu->vm;
+    hv_vcpu_exit_t *exit = vcpu->vcpu_exit;
+
+    switch (exit->reason)
+    {
+    case HV_EXIT_REASON_EXCEPTION:
+    {
+        uint32_t ec = ESR_EC(exit->exception.syndrome);
+        uint64_t pc;
+        vcpu_get_reg(vcpu, HV_REG_PC, &pc);
+
+        /* Anything but waiting ends an idle spell (see "Hibernation") */
+        if (ec != EC_WFX)
+        {
+            vcpu->idle_since_ns = 0;
+        }
+
+        switch (ec)
+        {
+        case EC_HVC64:
+            /* Hypervisor call - this is our communication channel */
+            return handle_hypercall(vcpu);
+
+        case EC_WFX:
+            /* No interrupts are delivered, guests poll for the timer
+             * after WFI: wait for it, or hibernate */
+            vcpu_wfi(vcpu);
+            vcpu_set_reg(vcpu, HV_REG_PC, pc + 4);
+            break;
+
+        case EC_SYS64:
+            /* System register access - for now, just skip */
+            printf("[VM %d] System register access at PC=0x%llx, skipping\n", vm->id, pc);
+            vcpu_set_reg(vcpu, HV_REG_PC, pc + 4);
+            break;
+
+        case EC_DABORT_LOWER:
+            /* Post-copy: a page that has not arrived yet */
+            if (pc_fault(vcpu, exit->exception.syndrome, exit->exception.virtual_address))
+            {
+                break;
+            }
+            printf("[VM %d] Data abort at PC=0x%llx, fault addr=0x%llx\n",
+                   vm->id, pc, exit->exception.virtual_address);
+            vcpu->running = false;
+            return -1;
+
+        case EC_IABORT_LOWER:
+            if (pc_fault(vcpu, exit->exception.syndrome, exit->exception.virtual_address))
+            {
+                break;
+            }
+            printf("[VM %d] Instruction abort at PC=0x%llx\n", vm->id, pc);
+            vcpu->running = false;
+            return -1;
+
+        default:
+            printf("[VM %d] Unhandled exception EC=0x%x at PC=0x%llx\n", vm->id, ec, pc);
+            printf("[VM %d] Syndrome=0x%llx\n", vm->id, exit->exception.syndrome);
+            vcpu->running = false;
+            return -1;
+        }
+        break;
+    }
+
+    case HV_EXIT_REASON_CANCELED:
+        /* Kicked by the VMM itself (see vm_kick): handle it and resume.
+         * A kick that arrives while we are already servicing an earlier
+         * one leaves a stale exit request behind, which is also harmless.
+         */
+        vm_service_kicks(vcpu);
+        break;
+
+    case HV_EXIT_REASON_VTIMER_ACTIVATED:
+        /* Virtual timer fired - we don't use it, just continue */
+        break;
+
+    default:
+        printf("[VM %d] Unknown exit reason: %d\n", vm->id, exit->reason);
+        vcpu->running = false;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Run the software vCPU, reporting the exit in the same form as
+ * hv_vcpu_run() does, so handle_exit() works for both backends.
+ */
+static hv_return_t sw_vcpu_run(vcpu_state_t *vcpu)
+{
+    hv_vcpu_exit_t *exit = &vcpu->sw_exit;
+    int ret = sw_cpu_run(vcpu->sw);
+
+    memset(exit, 0, sizeof(*exit));
+    if (ret == SW_EXIT_CANCELED)
+    {
+        exit->reason = HV_EXIT_REASON_CANCELED;
+    }
+    else if (ret == SW_EXIT_VTIMER)
+    {
+        exit->reason = HV_EXIT_REASON_VTIMER_ACTIVATED;
+    }
+    else
+    {
+        exit->reason = HV_EXIT_REASON_EXCEPTION;
+        exit->exception.syndrome = vcpu->sw->exit_syndrome;
+        exit->exception.virtual_address = vcpu->sw->exit_fault_addr;
+        exit->exception.physical_address = vcpu->sw->exit_fault_addr;
+    }
+    return HV_SUCCESS;
+}
+
+/*
+ * Run one vCPU until it exits. A failing vCPU stops the others too,
+ * the guest cannot make progress with one of its CPUs gone.
+ */
+static int vcpu_run(vcpu_state_t *vcpu)
+{
+    vm_state_t *vm = vcpu->vm;
+    int result = 0;
+
+    /* With --pcpus, wait for a CPU to run on */
+    oc_acquire(vcpu);
+    while (vcpu->running)
+    {
+        /* Run the vCPU until it exits */
+        hv_return_t ret = vcpu->sw != NULL ? sw_vcpu_run(vcpu) : hv_vcpu_run(vcpu->vcpu);
+
+        if (ret != HV_SUCCESS)
+        {
+            fprintf(stderr, "[VM %d] hv_vcpu_run failed: %s\n", vm->id, hv_strerror(ret));
+            vm_kick(vm, VM_KICK_STOP);
+            result = -1;
+            break;
+        }
+
+        /* Handle the exit reason */
+        if (handle_exit(vcpu) < 0)
+        {
+            vm_kick(vm, VM_KICK_STOP);
+            result = -1;
+            break;
+        }
+    }
+    oc_release(vcpu);
+    return result;
+}
+
+static void *vcpu_thread_main(void *arg)
+{
+    vcpu_state_t *vcpu = arg;
+
+    vcpu->result = vcpu_run(vcpu);
+    return NULL;
+}
+
+/*
+ * Main VM execution loop
+ */
+static int vm_run(vm_state_t *vm)
+{
+    int result = 0;
+
+    printf("[VM %d] Starting guest execution...\n", vm->id);
+    printf("[VM %d] --- Guest Output ---\n", vm->id);
+
+    for (int i = 0; i < vm->nr_vcpus; i++)
+    {
+        vm->vcpus[i].running = true;
+    }
+    struct rusage ru_start, ru_end;
+    getrusage(RUSAGE_SELF, &ru_start);
+    uint64_t start = now_ns();
+    uint64_t start_insns = vm->vcpus[0].sw != NULL ? vm->vcpus[0].sw->insns : 0;
+
+    /* Secondary vCPUs get a thread each, the boot vCPU runs right here */
+    for (int i = 1; i < vm->nr_vcpus; i++)
+    {
+        if (pthread_create(&vm->vcpus[i].thread, NULL, vcpu_thread_main, &vm->vcpus[i]) != 0)
+        {
+            fprintf(stderr, "[VM %d] Failed to start vCPU %d\n", vm->id, i);
+            vm->vcpus[i].running = false;
+            vm->vcpus[i].result = -1;
+            vm_kick(vm, VM_KICK_STOP);
+            vm->nr_vcpus = i;
+            break;
+        }
+    }
+
+    result = vcpu_run(&vm->vcpus[0]);
+    for (int i = 1; i < vm->nr_vcpus; i++)
+    {
+        pthread_join(vm->vcpus[i].thread, NULL);
+        if (vm->vcpus[i].result < 0)
+        {
+            result = -1;
+        }
+    }
+    if (result < 0)
+    {
+        return -1;
+    }
+
+    printf("[VM %d] --- End Guest Output ---\n", vm->id);
+
+    /* First touches of guest memory show up here, --prefault avoids them */
+    getrusage(RUSAGE_SELF, &ru_end);
+    printf("[VM %d] %ld host page faults while the guest ran\n",
+           vm->id, ru_end.ru_minflt - ru_start.ru_minflt);
+    if (vm->mem_size > GUEST_MEM_SIZE || vm->mem_reported_free != 0)
+    {
+        printf("[VM %d] Guest memory: %zu MB reserved, %llu KB resident, %llu KB reported free\n",
+               vm->id, vm->mem_size >> 20, vm_resident_bytes(vm) / 1024,
+               vm->mem_reported_free / 1024);
+    }
+
+    if (vm->vcpus[0].sw != NULL)
+    {
+        uint64_t elapsed = now_ns() - start;
+        unsigned long long insns = 0;
+        for (int i = 0; i < vm->nr_vcpus; i++)
+        {
+            insns += vm->vcpus[i].sw->insns;
+        }
+        insns -= start_insns; /* A VM taken over carries its count along */
+        printf("[VM %d] Ran %llu guest instructions in %.3f s (%.1f MIPS)\n",
+               vm->id, insns, elapsed / 1e9, elapsed ? insns * 1e3 / elapsed : 0.0);
+    }
+    return 0;
+}
+
+/*
+ * Clean up VM resources
+ */
+static void vm_destroy(vm_state_t *vm)
+{
+    printf("[VM %d] Cleaning up...\n", vm->id);
+
+    /* Stop the watchdog and sampler first, they may still kick the vCPU */
+    rctl_stop(vm);
+    prof_stop(vm);
+    wss_stop(vm);
+    mp_stop(vm);
+    pc_stop(vm);
+    up_stop(vm);
+    sched_stop(vm);
+    oc_stop(vm);
+    if (vm->cfg->bench_slot < 0)
+    {
+        prof_report(vm);
+    }
+
+    if (vm->nr_vcpus > 0 && vm->vcpus[0].sw != NULL)
+    {
+        /* Fold the secondaries' statistics into the boot vCPU's */
+        sw_cpu_t *total = vm->vcpus[0].sw;
+        for (int i = 1; i < vm->nr_vcpus; i++)
+        {
+            sw_cpu_t *sw = vm->vcpus[i].sw;
+            if (sw == NULL)
+            {
+                continue;
+            }
+            total->insns += sw->insns;
+            total->blocks_translated += sw->blocks_translated;
+            total->blocks_from_tcache += sw->blocks_from_tcache;
+            total->tcache_rejects += sw->tcache_rejects;
+            total->dispatches += sw->dispatches;
+            total->chain_hits += sw->chain_hits;
+            total->ibtc_hits += sw->ibtc_hits;
+            total->chain_inline += sw->chain_inline;
+            total->traces_formed += sw->traces_formed;
+            total->excl_fails += sw->excl_fails;
+        }
+        printf("[VM %d] sw: %llu insns, %llu blocks translated, %llu from tcache"
+               " (%llu rejected)\n",
+               vm->id, total->insns, total->blocks_translated,
+               total->blocks_from_tcache, total->tcache_rejects);
+        printf("[VM %d] sw: %llu dispatches, %llu chained, %llu via ibtc, %llu traces\n",
+               vm->id, total->dispatches, total->chain_hits,
+               total->ibtc_hits, total->traces_formed);
+        printf("[VM %d] sw: %llu blocks entered straight from a chained exit\n",
+               vm->id, total->chain_inline);
+        if (vm->nr_vcpus > 1)
+        {
+            printf("[VM %d] sw: %d vCPUs, %llu failed store-exclusives\n",
+                   vm->id, vm->nr_vcpus, total->excl_fails);
+        }
+    }
+    for (int i = 0; i < vm->nr_vcpus; i++)
+    {
+        vcpu_state_t *vcpu = &vm->vcpus[i];
+        if (vcpu->sw != NULL)
+        {
+            sw_cpu_destroy(vcpu->sw);
+            free(vcpu->sw);
+            vcpu->sw = NULL;
+        }
+        else if (vcpu->vcpu)
+        {
+            hv_vcpu_destroy(vcpu->vcpu);
+        }
+    }
+
+    /* Share our new translations with later VMs */
+    if (vm->tcache != NULL)
+    {
+        int saved = tcache_save(vm->tcache);
+        if (saved > 0)
+        {
+            printf("[VM %d] Translation cache saved: %d blocks\n", vm->id, saved);
+        }
+        tcache_close(vm->tcache);
+        vm->tcache = NULL;
+    }
+
+    if (vm->mem)
+    {
+        if (vm->cfg->backend == VM_BACKEND_HVF)
+        {
+            hv_vm_unmap(0, vm->mem_size);
+        }
+        munmap(vm->mem, vm->mem_size);
+    }
+    if (vm->mem_fd >= 0)
+    {
+        close(vm->mem_fd);
+    }
+
+    if (vm->cfg->backend == VM_BACKEND_HVF)
+    {
+        hv_vm_destroy();
+    }
+
+    printf("[VM %d] VM destroyed\n", vm->id);
+}
+
+/* ============================================================================
+ * Single VM Runner (called in child process)
+ * ============================================================================ */
+
+/* Spawn benchmark results, shared with every child (see bench_spawn) */
+static uint64_t *spawn_lat_ns;
+
+static int run_single_vm(const vm_config_t *cfg)
+{
+    vm_state_t vm = {0};
+    vm.id = cfg->id;
+    vm.cfg = cfg;
+    vm.mem_fd = -1;
+    vm.up_fd = cfg->upgrade_ms != 0 && !cfg->incoming ? cfg->migrate_fd : -1;
+    int vm_id = cfg->id;
+    int result = 0;
+
+    /* Spawn benchmark children stay quiet, there are lots of them */
+    if (cfg->bench_slot >= 0)
+    {
+        freopen("/dev/null", "w", stdout);
+    }
+
+    /* The parent's other end of our migration socket */
+    if (cfg->migrate_peer_fd >= 0)
+    {
+        close(cfg->migrate_peer_fd);
+    }
+    up_close_parent_fds();
+
+    /* Apply resource limits before anything is allocated */
+    if (rctl_apply(cfg) < 0)
+    {
+        return 1;
+    }
+
+    /* Initialize the VM */
+    if (vm_init(&vm) < 0)
+    {
+        fprintf(stderr, "\n[VM %d] Failed to initialize VM.\n", vm_id);
+        fprintf(stderr, "Make sure you have the hypervisor entitlement.\n");
+        fprintf(stderr, "For development, run: codesign --entitlements entitlements.plist -s - tinyvmm\n");
+        return 1;
+    }
+
+    /* Create vCPU */
+    if (vcpu_init(&vm) < 0)
+    {
+        vm_destroy(&vm);
+        return 1;
+    }
+
+    /* Load guest code, and the rest of its state when waking it */
+    if (load_guest(&vm) < 0 || (cfg->resume && hib_restore(&vm) < 0))
+    {
+        vm_destroy(&vm);
+        return 1;
+    }
+
+    /* Migration or upgrade destination: the VM comes from the source */
+    if (cfg->incoming &&
+        (result = cfg->upgrade_ms != 0 ? up_incoming(&vm) : pc_incoming(&vm)) != 0)
+    {
+        vm_destroy(&vm);
+        return result < 0 ? 1 : 0;
+    }
+
+    /* The VM is ready to run: this is the end of the spawn path */
+    uint64_t spawn_ns = now_ns() - cfg->spawn_start_ns;
+    if (cfg->bench_slot >= 0)
+    {
+        spawn_lat_ns[cfg->bench_slot] = spawn_ns;
+        vm_destroy(&vm);
+        return 0;
+    }
+    printf("[VM %d] Ready to run %llu us after spawn request\n",
+           vm_id, spawn_ns / 1000);
+
+    /* Start enforcing cpu.max / memory.high (needs the vCPU handle) */
+    if (rctl_start(&vm) < 0 || prof_start(&vm) < 0 || wss_start(&vm) < 0 ||
+        mp_start(&vm) < 0 || pc_start(&vm) < 0 || up_start(&vm) < 0 || sched_start(&vm) < 0 ||
+        oc_start(&vm) < 0)
+    {
+        vm_destroy(&vm);
+        return 1;
+    }
+
+    /* Run the VM, on here if a new VMM did not take it over */
+    for (;;)
+    {
+        result = vm_run(&vm);
+        if (result != 0 || !vm.upgrading || up_send(&vm) == 0)
+        {
+            break;
+        }
+        vm.upgrading = false;
+    }
+
+    /* Upgraded: the new VMM runs it now */
+    if (result == 0 && vm.upgrading)
+    {
+        vm_destroy(&vm);
+        return VM_EXIT_UPGRADED;
+    }
+
+    /* Idle: write it out, the parent starts it again when it is needed */
+    if (result == 0 && vm.hibernating)
+    {
+        result = hib_save(&vm);
+        vm_destroy(&vm);
+        return result < 0 ? 1 : VM_EXIT_HIBERNATED;
+    }
+
+    /* Migrating: the destination takes over once it has the registers */
+    if (result == 0 && vm.migrating)
+    {
+        result = pc_send(&vm);
+        vm_destroy(&vm);
+        return result < 0 ? 1 : VM_EXIT_MIGRATED;
+    }
+    if (result == 0)
+    {
+        pc_report(&vm);
+    }
+
+    /* Clean up */
+    vm_destroy(&vm);
+
+    if (result == 0)
+    {
+        printf("\n[VM %d] Guest completed successfully!\n", vm_id);
+    }
+
+    return result < 0 ? 1 : 0;
+}
+
+/* ============================================================================
+ * Zygote (pre-initialized VM spawner)
+ * ============================================================================
+ *
+ * By default every VM is a fork() of main() and does all of its setup
+ * after the fork. With --zygote we start one helper process up front that
+ * has already done the setup that does not depend on the VM: guest memory
+ * is allocated with the image loaded and every page faulted in, and malloc
+ * and the timebase are warmed up. The parent asks it over a control socket
+ * to spawn VMs; each VM is a fork() of the zygote and inherits all of that
+ * copy-on-write.
+ *
+ * Hypervisor.framework state can't be inherited across fork() (one VM per
+ * process), so every child still calls hv_vm_create() itself.
+ *
+ * The zygote reaps its children and reports their exit status back, since
+ * the parent can't waitpid() on them.
+ */
+
+#define ZYGOTE_SPAWN 1   /* parent -> zygote: fork a VM from cfg */
+#define ZYGOTE_SPAWNED 2 /* zygote -> parent: VM started (or pid -1) */
+#define ZYGOTE_EXITED 3  /* zygote -> parent: VM process exited */
+
+typedef struct
+{
+    uint32_t op;
+    vm_config_t cfg;
+} zygote_request_t;
+
+typedef struct
+{
+    uint32_t op;
+    pid_t pid;
+    int status;        /* waitpid() status for ZYGOTE_EXITED */
+    uint64_t cpu_usec; /* Final CPU time for ZYGOTE_EXITED */
+} zygote_reply_t;
+
+static int zygote_fd = -1; /* Parent's end of the control socket */
+static pid_t zygote_pid = -1;
+static int zygote_sigchld_pipe[2] = {-1, -1};
+
+/* Exit reports received while waiting for something else */
+static zygote_reply_t *zygote_exited;
+static size_t zygote_exited_count;
+static size_t zygote_exited_cap;
+
+static int read_full(int fd, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+    while (len > 0)
+    {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    while (len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static void zygote_on_sigchld(int sig)
+{
+    (void)sig;
+    int saved = errno;
+    (void)write(zygote_sigchld_pipe[1], "c", 1);
+    errno = saved;
+}
+
+/* Do all the VM-independent setup once, so children don't have to */
+static int zygote_warmup(void)
+{
+    long page = sysconf(_SC_PAGESIZE);
+
+    guest_template = mmap(NULL, guest_mem_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (guest_template == MAP_FAILED)
+    {
+        perror("zygote: mmap");
+        guest_template = NULL;
+        return -1;
+    }
+
+    /* Fault in the first megabyte, where the image and stacks are, then
+     * load the image; the rest of a larger guest stays untouched */
+    for (size_t off = 0; off < GUEST_MEM_SIZE; off += (size_t)page)
+    {
+        ((volatile uint8_t *)guest_template)[off] = 0;
+    }
+    memcpy((uint8_t *)guest_template + GUEST_CODE_ADDR, guest_image->code, guest_image->size);
+
+    /* Warm up the allocator and the timebase */
+    free(malloc(256 * 1024));
+    (void)now_ns();
+
+    return 0;
+}
+
+static void zygote_main(int fd)
+{
+    struct sigaction sa = {0};
+
+    if (pipe(zygote_sigchld_pipe) < 0 || zygote_warmup() < 0)
+    {
+        _exit(1);
+    }
+    fcntl(zygote_sigchld_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(zygote_sigchld_pipe[1], F_SETFL, O_NONBLOCK);
+    sa.sa_handler = zygote_on_sigchld;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, NULL);
+
+    for (;;)
+    {
+        struct pollfd pfds[2] = {
+            {.fd = fd, .events = POLLIN},
+            {.fd = zygote_sigchld_pipe[0], .events = POLLIN},
+        };
+
+        if (poll(pfds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        /* Report exited VMs */
+        if (pfds[1].revents & POLLIN)
+        {
+            char drain[64];
+            struct rusage ru;
+            zygote_reply_t reply = {.op = ZYGOTE_EXITED};
+
+            while (read(zygote_sigchld_pipe[0], drain, sizeof(drain)) > 0)
+                ;
+            while ((reply.pid = wait4(-1, &reply.status, WNOHANG, &ru)) > 0)
+            {
+                reply.cpu_usec = timeval_usec(ru.ru_utime) + timeval_usec(ru.ru_stime);
+                write_full(fd, &reply, sizeof(reply));
+            }
+        }
+
+        /* Spawn requests (EOF means the parent is done with us) */
+        if (pfds[0].revents & (POLLIN | POLLHUP))
+        {
+            zygote_request_t req;
+            zygote_reply_t reply = {.op = ZYGOTE_SPAWNED};
+
+            if (read_full(fd, &req, sizeof(req)) < 0 || req.op != ZYGOTE_SPAWN)
+            {
+                break;
+            }
+
+            fflush(stdout);
+            reply.pid = fork();
+            if (reply.pid == 0)
+            {
+                /* VM process: drop the zygote's plumbing and run */
+                signal(SIGCHLD, SIG_DFL);
+                close(fd);
+                close(zygote_sigchld_pipe[0]);
+                close(zygote_sigchld_pipe[1]);
+                exit(run_single_vm(&req.cfg));
+            }
+            write_full(fd, &reply, sizeof(reply));
+        }
+    }
+
+    while (wait(NULL) > 0)
+        ;
+    _exit(0);
+}
+
+static int zygote_start(void)
+{
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    {
+        perror("socketpair");
+        return -1;
+    }
+
+    fflush(stdout);
+    zygote_pid = fork();
+    if (zygote_pid < 0)
+    {
+        perror("fork");
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if (zygote_pid == 0)
+    {
+        close(sv[0]);
+        zygote_main(sv[1]);
+    }
+
+    close(sv[1]);
+    zygote_fd = sv[0];
+    return 0;
+}
+
+static void zygote_stop(void)
+{
+    if (zygote_fd < 0)
+    {
+        return;
+    }
+    close(zygote_fd);
+    waitpid(zygote_pid, NULL, 0);
+    zygote_fd = -1;
+    zygote_pid = -1;
+    zygote_exited_count = 0;
+}
+
+/* Read one reply; exit reports are queued for zygote_reap() */
+static int zygote_read_reply(zygote_reply_t *reply)
+{
+    if (read_full(zygote_fd, reply, sizeof(*reply)) < 0)
+    {
+        fprintf(stderr, "[Parent] Lost connection to zygote\n");
+        return -1;
+    }
+
+    if (reply->op == ZYGOTE_EXITED)
+    {
+        if (zygote_exited_count == zygote_exited_cap)
+        {
+            zygote_exited_cap = zygote_exited_cap ? zygote_exited_cap * 2 : 16;
+            zygote_exited = realloc(zygote_exited, zygote_exited_cap * sizeof(*reply));
+            if (zygote_exited == NULL)
+            {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        zygote_exited[zygote_exited_count++] = *reply;
+    }
+    return 0;
+}
+
+static pid_t zygote_spawn(const vm_config_t *cfg)
+{
+    zygote_request_t req = {.op = ZYGOTE_SPAWN, .cfg = *cfg};
+    zygote_reply_t reply;
+
+    if (write_full(zygote_fd, &req, sizeof(req)) < 0)
+    {
+        perror("zygote: write");
+        return -1;
+    }
+
+    do
+    {
+        if (zygote_read_reply(&reply) < 0)
+        {
+            return -1;
+        }
+    } while (reply.op != ZYGOTE_SPAWNED);
+
+    return reply.pid;
+}
+
+static int zygote_reap(pid_t pid, int *status, uint64_t *cpu_usec, bool block)
+{
+    for (;;)
+    {
+        for (size_t i = 0; i < zygote_exited_count; i++)
+        {
+            if (zygote_exited[i].pid == pid)
+            {
+                *status = zygote_exited[i].status;
+                *cpu_usec = zygote_exited[i].cpu_usec;
+                zygote_exited[i] = zygote_exited[--zygote_exited_count];
+                return 1;
+            }
+        }
+
+        struct pollfd pfd = {.fd = zygote_fd, .events = POLLIN};
+        zygote_reply_t reply;
+
+        if (poll(&pfd, 1, block ? -1 : 0) <= 0)
+        {
+            return 0;
+        }
+        if (zygote_read_reply(&reply) < 0)
+        {
+            return -1;
+        }
+    }
+}
+
+/* ============================================================================
+ * VM Launcher
+ * ============================================================================
+ *
+ * Spawns VM processes either directly with fork() or through the zygote,
+ * and reaps them again. Both paths look the same to main().
+ */
+
+static bool use_zygote;
+
+static pid_t vm_spawn(vm_config_t *cfg)
+{
+    cfg->spawn_start_ns = now_ns();
+
+    if (use_zygote)
+    {
+        return zygote_spawn(cfg);
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        /* Child process: run one VM */
+        exit(run_single_vm(cfg));
+    }
+    if (pid < 0)
+    {
+        perror("fork");
+    }
+    return pid;
+}
+
+/* Returns 1 once `pid` has exited, 0 while it runs, -1 on error */
+static int vm_reap(pid_t pid, int *status, uint64_t *cpu_usec, bool block)
+{
+    if (use_zygote)
+    {
+        return zygote_reap(pid, status, cpu_usec, block);
+    }
+
+    struct rusage ru;
+    pid_t ret = wait4(pid, status, block ? 0 : WNOHANG, &ru);
+    if (ret < 0)
+    {
+        return -1;
+    }
+    if (ret == 0)
+    {
+        return 0;
+    }
+    *cpu_usec = timeval_usec(ru.ru_utime) + timeval_usec(ru.ru_stime);
+    return 1;
+}
+
+/* ============================================================================
+ * Spawn Latency Benchmark
+ * ============================================================================
+ *
+ * Spawns `count` VMs one after another with each launcher and reports the
+ * time from the spawn request until the VM is ready to run (memory mapped,
+ * vCPU created, guest loaded). The VMs exit right there.
+ */
+
+static int bench_spawn_one_mode(const vm_config_t *defaults, int count, bool zygote)
+{
+    use_zygote = zygote;
+    if (zygote && zygote_start() < 0)
+    {
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        vm_config_t cfg = *defaults;
+        int status;
+        uint64_t cpu_usec;
+
+        cfg.id = 1;
+        cfg.bench_slot = i;
+        spawn_lat_ns[i] = 0;
+
+        pid_t pid = vm_spawn(&cfg);
+        if (pid < 0 || vm_reap(pid, &status, &cpu_usec, true) != 1 ||
+            !WIFEXITED(status) || WEXITSTATUS(status) != 0 || spawn_lat_ns[i] == 0)
+        {
+            fprintf(stderr, "[Bench] Spawn %d failed\n", i);
+            zygote_stop();
+            return -1;
+        }
+    }
+
+    zygote_stop();
+
+    uint64_t sum = 0;
+    qsort(spawn_lat_ns, (size_t)count, sizeof(uint64_t), cmp_u64);
+    for (int i = 0; i < count; i++)
+    {
+        sum += spawn_lat_ns[i];
+    }
+
+    printf("[Bench] %-6s spawns=%d mean=%llu us p50=%llu us p99=%llu us min=%llu us\n",
+           zygote ? "zygote" : "fork", count,
+           sum / (uint64_t)count / 1000,
+           spawn_lat_ns[count / 2] / 1000,
+           spawn_lat_ns[(count * 99) / 100] / 1000,
+           spawn_lat_ns[0] / 1000);
+    return 0;
+}
+
+static int bench_spawn(const vm_config_t *defaults, int count)
+{
+    /* Shared with every VM process, which writes its own slot */
+    spawn_lat_ns = mmap(NULL, (size_t)count * sizeof(uint64_t), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (spawn_lat_ns == MAP_FAILED)
+    {
+        perror("mmap");
+        return 1;
+    }
+
+    printf("[Bench] Spawn latency, request -> VM ready to run\n");
+    if (bench_spawn_one_mode(defaults, count, false) < 0 ||
+        bench_spawn_one_mode(defaults, count, true) < 0)
+    {
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * --bench-snapshot=SIZE: save and restore SIZE of synthetic guest memory
+ * with 1, 2, 4... threads up to one per CPU, and report the throughput
+ * and the speedup over one thread. A quarter of the pages are zero (and
+ * left out, as hibernation does), a quarter random and the rest text-like,
+ * so compression has some work to do. The file goes to $TMPDIR and is
+ * not synced: this measures the page cache, not the disk.
+ */
+static uint64_t bench_snap_size;
+
+static uint64_t bench_rand(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static int bench_snapshot(uint64_t size)
+{
+    static const char *const words[] = {"guest", "page", "vcpu", "timer", "hypercall",
+                                        "snapshot", "memory", "chunk"};
+    size_t n = size / HIB_PAGE_SIZE;
+    uint8_t *mem = mmap(NULL, n * HIB_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    uint32_t *index = malloc(n * sizeof(*index));
+    const char *tmpdir = getenv("TMPDIR");
+    char path[256];
+    uint64_t seed = 0x9e3779b97f4a7c15ull;
+    uint64_t save1 = 0, restore1 = 0;
+    uint32_t n_pages = 0;
+    int max_threads = snap_threads > 0 ? snap_threads : snap_default_threads();
+    int ret = 0;
+
+    if (mem == MAP_FAILED || index == NULL || n == 0)
+    {
+        fprintf(stderr, "[Bench] Can't allocate %llu bytes\n", size);
+        return 1;
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        uint8_t *page = mem + i * HIB_PAGE_SIZE;
+        switch (bench_rand(&seed) % 4)
+        {
+        case 0:
+            continue;
+        case 1:
+            for (size_t off = 0; off < HIB_PAGE_SIZE; off += 8)
+            {
+                uint64_t r = bench_rand(&seed);
+                memcpy(page + off, &r, 8);
+            }
+            break;
+        default:
+            for (size_t off = 0; off < HIB_PAGE_SIZE;)
+            {
+                const char *w = words[bench_rand(&seed) % 8];
+                size_t len = strlen(w) + 1 < HIB_PAGE_SIZE - off ? strlen(w) + 1
+                                                                 : HIB_PAGE_SIZE - off;
+                memcpy(page + off, w, len - 1);
+                page[off + len - 1] = ' ';
+                off += len;
+            }
+            break;
+        }
+        index[n_pages++] = (uint32_t)i;
+    }
+
+    snprintf(path, sizeof(path), "%s/tinyvmm-%d-bench.snap",
+             tmpdir != NULL ? tmpdir : "/tmp", (int)getpid());
+    printf("[Bench] Snapshot of %zu MB, %u nonzero pages, up to %d thread%s\n",
+           n * HIB_PAGE_SIZE >> 20, n_pages, max_threads, max_threads == 1 ? "" : "s");
+
+    for (int threads = 1; ret == 0; threads = threads * 2 < max_threads ? threads * 2 : max_threads)
+    {
+        snap_stats_t save = {0}, restore = {0};
+        uint8_t *copy = mmap(NULL, n * HIB_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+
+        if (copy == MAP_FAILED || fd < 0 ||
+            snap_write(fd, 0, mem, index, n_pages, NULL, threads, &save) < 0 ||
+            snap_read(fd, 0, copy, n * HIB_PAGE_SIZE, NULL, threads, &restore) < 0 ||
+            memcmp(mem, copy, n * HIB_PAGE_SIZE) != 0)
+        {
+            fprintf(stderr, "[Bench] Snapshot with %d threads failed\n", threads);
+            ret = 1;
+        }
+        else
+        {
+            if (threads == 1)
+            {
+                save1 = save.elapsed_ns;
+                restore1 = restore.elapsed_ns;
+            }
+            printf("[Bench] threads=%-2d save %5llu MB/s (x%.2f)  restore %5llu MB/s (x%.2f)  "
+                   "%llu MB stored\n",
+                   threads, save.raw_bytes * 1000 / (save.elapsed_ns + 1),
+                   (double)save1 / (double)(save.elapsed_ns + 1),
+                   restore.raw_bytes * 1000 / (restore.elapsed_ns + 1),
+                   (double)restore1 / (double)(restore.elapsed_ns + 1),
+                   save.stored_bytes >> 20);
+        }
+        if (fd >= 0)
+            close(fd);
+        if (copy != MAP_FAILED)
+            munmap(copy, n * HIB_PAGE_SIZE);
+        if (threads == max_threads)
+            break;
+    }
+
+    unlink(path);
+    free(index);
+    munmap(mem, n * HIB_PAGE_SIZE);
+    return ret;
+}
+
+/* ============================================================================
+ * Scheduling Benchmark
+ * ============================================================================
+ *
+ * --bench-sched=MS runs mixed workloads under the fair-share scheduler on
+ * one CPU (see "Fair-Share Scheduling"), each VM in a process of its own
+ * with its output thrown away, started one after the other:
+ *
+ * 1. Fairness: three cmploop VMs of weights 100, 200 and 400 for MS ms,
+ *    or until the first one is done. Reported: each VM's share of the CPU
+ *    next to the share its weight entitles it to, and Jain's fairness
+ *    index of the two (1 = exactly as weighted, 1/3 = one VM got it all).
+ * 2. Tail latency: the timer guest, which wakes up every millisecond,
+ *    next to two cmploop VMs, until it is done or MS ms have passed.
+ *    First every VM is a batch VM of the same weight, plain round-robin in
+ *    batch quanta, then the timer VM is in the latency class. Reported:
+ *    how long after its timer fired the timer VM ran again, and the
+ *    shares of the CPU.
+ */
+
+#define BENCH_SCHED_VMS 3
+
+typedef struct
+{
+    const char *guest;
+    int sched_class;
+    uint32_t weight;
+} bench_sched_vm_t;
+
+static uint32_t bench_sched_ms;
+
+/* Run the VMs until MS ms have passed or one is done, and return the CPU
+ * time each got by then in `run_ns` */
+static int bench_sched_run(const vm_config_t *defaults, const bench_sched_vm_t *vms,
+                           uint64_t ms, uint64_t *run_ns)
+{
+    pid_t pids[BENCH_SCHED_VMS];
+    uint64_t end = now_ns() + ms * 1000000ull;
+    int started = 0, status;
+    bool done = false;
+
+    memset(sched_shared, 0, SCHED_MAX_VMS * sizeof(*sched_shared));
+    for (; started < BENCH_SCHED_VMS; started++)
+    {
+        vm_config_t cfg = *defaults;
+
+        cfg.id = started + 1;
+        cfg.sched_class = vms[started].sched_class;
+        cfg.sched_weight = vms[started].weight;
+        for (size_t i = 0; i < sizeof(guest_images) / sizeof(guest_images[0]); i++)
+        {
+            if (strcmp(guest_images[i].name, vms[started].guest) == 0)
+            {
+                guest_image = &guest_images[i];
+            }
+        }
+
+        fflush(stdout);
+        pids[started] = fork();
+        if (pids[started] == 0)
+        {
+            freopen("/dev/null", "w", stdout);
+            exit(run_single_vm(&cfg));
+        }
+        if (pids[started] < 0)
+        {
+            perror("fork");
+            break;
+        }
+
+        /* One at a time, so setting up a VM does not count against the
+         * ones already running */
+        for (int waited = 0; atomic_load(&sched_shared[started].pid) == 0 && waited < 1000;
+             waited++)
+        {
+            usleep(1000);
+        }
+    }
+
+    while (started == BENCH_SCHED_VMS && !done && now_ns() < end)
+    {
+        usleep(1000);
+        for (int i = 0; i < BENCH_SCHED_VMS && !done; i++)
+        {
+            done = waitpid(pids[i], &status, WNOHANG) == pids[i];
+        }
+    }
+    for (int i = 0; i < BENCH_SCHED_VMS; i++)
+    {
+        run_ns[i] = atomic_load(&sched_shared[i].run_ns);
+    }
+
+    for (int i = 0; i < started; i++)
+    {
+        kill(pids[i], SIGKILL);
+        waitpid(pids[i], &status, 0);
+    }
+    return started == BENCH_SCHED_VMS ? 0 : -1;
+}
+
+/* Latency run: two cmploop VMs, then the timer VM next to them */
+static int bench_sched_latency(const vm_config_t *defaults, const char *label, int timer_class,
+                               uint64_t ms)
+{
+    const bench_sched_vm_t vms[BENCH_SCHED_VMS] = {
+        {"cmploop", SCHED_BATCH, SCHED_WEIGHT_DEFAULT},
+        {"cmploop", SCHED_BATCH, SCHED_WEIGHT_DEFAULT},
+        {"timer", timer_class, SCHED_WEIGHT_DEFAULT},
+    };
+    uint64_t run_ns[BENCH_SCHED_VMS], total = 0;
+    uint64_t p50, p99, max;
+    unsigned int n;
+
+    if (bench_sched_run(defaults, vms, ms, run_ns) < 0)
+    {
+        return -1;
+    }
+    for (int i = 0; i < BENCH_SCHED_VMS; i++)
+    {
+        total += run_ns[i];
+    }
+    n = sched_wake_latency(&sched_shared[2], &p50, &p99, &max);
+    printf("[Bench] %-11s wakeups=%-4u p50=%llu us p99=%llu us max=%llu us  "
+           "CPU cmploop %.1f%% / %.1f%% timer %.1f%%\n",
+           label, n, p50, p99, max, 100.0 * run_ns[0] / (total + 1),
+           100.0 * run_ns[1] / (total + 1), 100.0 * run_ns[2] / (total + 1));
+    return 0;
+}
+
+static int bench_sched(const vm_config_t *defaults, uint32_t ms)
+{
+    const bench_sched_vm_t fair[BENCH_SCHED_VMS] = {
+        {"cmploop", SCHED_NORMAL, 100},
+        {"cmploop", SCHED_NORMAL, 200},
+        {"cmploop", SCHED_NORMAL, 400},
+    };
+    uint64_t run_ns[BENCH_SCHED_VMS], total = 0;
+    uint32_t weights = 0;
+    double sum = 0, sum_sq = 0;
+
+    if (sched_map() < 0)
+    {
+        return 1;
+    }
+    sched_cpus = 1;
+
+    printf("[Bench] Fairness, %d cmploop VMs on one CPU for up to %u ms\n",
+           BENCH_SCHED_VMS, ms);
+    if (bench_sched_run(defaults, fair, ms, run_ns) < 0)
+    {
+        return 1;
+    }
+    for (int i = 0; i < BENCH_SCHED_VMS; i++)
+    {
+        total += run_ns[i];
+        weights += fair[i].weight;
+    }
+    for (int i = 0; i < BENCH_SCHED_VMS; i++)
+    {
+        double share = (double)run_ns[i] / (double)(total + 1);
+        double entitled = (double)fair[i].weight / weights;
+
+        printf("[Bench] weight %-4u %5.1f%% of the CPU (entitled %.1f%%), %llu ms\n",
+               fair[i].weight, 100.0 * share, 100.0 * entitled, run_ns[i] / 1000000);
+        sum += share / entitled;
+        sum_sq += (share / entitled) * (share / entitled);
+    }
+    printf("[Bench] Jain's fairness index %.3f\n",
+           sum_sq > 0 ? sum * sum / (BENCH_SCHED_VMS * sum_sq) : 0.0);
+
+    printf("[Bench] Wakeup latency, timer VM (1 ms periods) next to 2 cmploop VMs\n");
+    if (bench_sched_latency(defaults, "round-robin", SCHED_BATCH, ms) < 0 ||
+        bench_sched_latency(defaults, "fair-share", SCHED_LATENCY, ms) < 0)
+    {
+        return 1;
+    }
+    return 0;
+}
+
+/* ============================================================================
+ * PV Spinlock Benchmark
+ * ============================================================================
+ *
+ * --bench-pvlock=N runs the pvlock guest with N vCPUs (see "vCPU
+ * Overcommit"): first on N CPUs, then overcommitted on N/2 CPUs with
+ * plain spinning, then on N/2 CPUs with --pvlock. Each run is a VM process
+ * of its own with its output thrown away, timed from spawn to exit.
+ * Reported: lock acquisitions per second, each vCPU takes the lock 20000
+ * times.
+ */
+
+#define BENCH_PVLOCK_ITERS 20000 /* Lock acquisitions per vCPU in the pvlock guest */
+
+static int bench_pvlock_vcpus;
+
+static int bench_pvlock_one(const vm_config_t *defaults, const char *label, int pcpus, bool pv)
+{
+    vm_config_t cfg = *defaults;
+    uint64_t start, elapsed, cpu_usec;
+    int status;
+    pid_t pid;
+
+    cfg.id = 1;
+    cfg.vcpus = bench_pvlock_vcpus;
+    cfg.pcpus = pcpus;
+    cfg.pvlock = pv;
+
+    fflush(stdout);
+    start = now_ns();
+    pid = fork();
+    if (pid == 0)
+    {
+        freopen("/dev/null", "w", stdout);
+        exit(run_single_vm(&cfg));
+    }
+    if (pid < 0 || vm_reap(pid, &status, &cpu_usec, true) != 1 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0)
+    {
+        fprintf(stderr, "[Bench] %s run failed\n", label);
+        return -1;
+    }
+    elapsed = now_ns() - start;
+
+    printf("[Bench] %-13s vcpus=%d cpus=%d %8.0f locks/s  %.3f s, %.3f s CPU\n",
+           label, cfg.vcpus, pcpus != 0 ? pcpus : cfg.vcpus,
+           (double)cfg.vcpus * BENCH_PVLOCK_ITERS * 1e9 / (double)elapsed, elapsed / 1e9,
+           cpu_usec / 1e6);
+    return 0;
+}
+
+static int bench_pvlock(const vm_config_t *defaults)
+{
+    int overcommit = bench_pvlock_vcpus / 2;
+
+    guest_image = &guest_images[0];
+    for (size_t i = 0; i < sizeof(guest_images) / sizeof(guest_images[0]); i++)
+    {
+        if (strcmp(guest_images[i].name, "pvlock") == 0)
+        {
+            guest_image = &guest_images[i];
+        }
+    }
+
+    printf("[Bench] Lock-heavy guest, %d vCPUs\n", bench_pvlock_vcpus);
+    if (bench_pvlock_one(defaults, "dedicated", 0, false) < 0 ||
+        bench_pvlock_one(defaults, "overcommit", overcommit, false) < 0 ||
+        bench_pvlock_one(defaults, "overcommit+pv", overcommit, true) < 0)
+    {
+        return 1;
+    }
+    return 0;
+}
+
+/* ============================================================================
+ * Batch Mode
+ * ============================================================================
+ *
+ * --batch=N runs N copies of the guest image inside this process on the
+ * software backend: first one VM after the other on the scalar
+ * interpreter, then SW_BATCH_LANES at a time in lockstep (see swcpu.h).
+ * Both runs report their aggregate guest instruction rate, and every VM
+ * must print the same thing in both. Guest memory is mapped lazily, so
+ * a tiny guest only costs the few pages it touches.
+ *
+ * A VM in WFI waits for its virtual timer. The scalar run sleeps; in
+ * lockstep the lane is parked, the rest of its group running on, and the
+ * group only sleeps once all its lanes wait. Time spent asleep is left
+ * out of both rates, since it says nothing about the interpreters.
+ */
+
+#define BATCH_MAX_VMS 16384
+
+typedef struct
+{
+    uint64_t out_hash; /* FNV-1a of everything the guest printed */
+    uint64_t out_len;
+    bool exited;       /* Made the EXIT hypercall */
+} batch_vm_t;
+
+static void batch_out(batch_vm_t *vm, const char *s, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        vm->out_hash = (vm->out_hash ^ (uint8_t)s[i]) * 0x100000001b3ull;
+    }
+    vm->out_len += len;
+}
+
+/* Service a hypercall of a batch VM, returns false once it has exited */
+static bool batch_hypercall(batch_vm_t *vm, const uint8_t *mem, uint64_t x0, uint64_t x1)
+{
+    char c;
+
+    switch (x0)
+    {
+    case HYPERCALL_EXIT:
+        vm->exited = true;
+        return false;
+
+    case HYPERCALL_PUTCHAR:
+        c = (char)x1;
+        batch_out(vm, &c, 1);
+        break;
+
+    case HYPERCALL_PUTS:
+        if (x1 < GUEST_MEM_SIZE)
+        {
+            const char *str = (const char *)mem + x1;
+            batch_out(vm, str, strnlen(str, GUEST_MEM_SIZE - x1));
+        }
+        break;
+
+    default:
+        break;
+    }
+    return true;
+}
+
+/* Handle the exit of a batch VM, returns false once it has stopped */
+static bool batch_exit(batch_vm_t *vm, int id, const uint8_t *mem, uint64_t syndrome,
+                       uint64_t pc, uint64_t x0, uint64_t x1)
+{
+    if (ESR_EC(syndrome) == EC_HVC64)
+    {
+        return batch_hypercall(vm, mem, x0, x1);
+    }
+    fprintf(stderr, "[Batch] VM %d: unhandled exception EC=0x%llx at PC=0x%llx\n",
+            id, ESR_EC(syndrome), pc);
+    return false;
+}
+
+/*
+ * Sleep `ns` for a VM in WFI, adding the time to `*wait_ns`. Nothing can
+ * wake a VM whose timer is not armed, so it returns from WFI at once.
+ */
+static void batch_wait(uint64_t ns, uint64_t *wait_ns)
+{
+    uint64_t start = now_ns();
+
+    if (ns == UINT64_MAX || ns == 0)
+    {
+        return;
+    }
+    sleep_until_ns(start + ns);
+    *wait_ns += now_ns() - start;
+}
+
+/* Fresh guest memory for `count` VMs, each with the image loaded */
+static uint8_t *batch_map(int count)
+{
+    uint8_t *mem = mmap(NULL, (size_t)count * GUEST_MEM_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        perror("mmap");
+        return NULL;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        memcpy(mem + (size_t)i * GUEST_MEM_SIZE + GUEST_CODE_ADDR,
+               guest_image->code, guest_image->size);
+    }
+    return mem;
+}
+
+/*
+ * One VM after the other on a single software vCPU. All VMs run the same
+ * image, so the vCPU keeps its translations from one VM to the next.
+ */
+static int batch_run_scalar(uint8_t *mem, int count, batch_vm_t *vms, uint64_t *insns,
+                            uint64_t *wait_ns)
+{
+    sw_cpu_t *cpu = malloc(sizeof(*cpu));
+
+    if (cpu == NULL || sw_cpu_init(cpu, mem, GUEST_MEM_SIZE) < 0)
+    {
+        free(cpu);
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        cpu->mem = mem + (size_t)i * GUEST_MEM_SIZE;
+        memset(cpu->x, 0, sizeof(cpu->x));
+        cpu->x[20] = (uint64_t)i + 1;
+        cpu->x[22] = 1;
+        cpu->x[SW_REG_SP] = GUEST_STACK_ADDR;
+        cpu->pc = GUEST_CODE_ADDR;
+        cpu->nzcv = 0;
+
+        while (sw_cpu_run(cpu) == SW_EXIT_EXCEPTION)
+        {
+            if (ESR_EC(cpu->exit_syndrome) == EC_WFX)
+            {
+                batch_wait(sw_cpu_timer_ns(cpu), wait_ns);
+                cpu->pc += 4;
+                continue;
+            }
+            if (!batch_exit(&vms[i], i + 1, cpu->mem, cpu->exit_syndrome, cpu->pc,
+                            cpu->x[0], cpu->x[1]))
+            {
+                break;
+            }
+        }
+    }
+
+    *insns = cpu->insns;
+    sw_cpu_destroy(cpu);
+    free(cpu);
+    return 0;
+}
+
+/* SW_BATCH_LANES VMs at a time in lockstep */
+static int batch_run_lockstep(uint8_t *mem, int count, batch_vm_t *vms, sw_batch_t **stats,
+                              uint64_t *wait_ns)
+{
+    sw_cpu_t *code = malloc(sizeof(*code));
+    sw_batch_t *bt;
+
+    if (code == NULL || sw_cpu_init(code, mem, GUEST_MEM_SIZE) < 0)
+    {
+        free(code);
+        return -1;
+    }
+    bt = sw_batch_create(code);
+    if (bt == NULL)
+    {
+        sw_cpu_destroy(code);
+        free(code);
+        return -1;
+    }
+
+    for (int base = 0; base < count; base += SW_BATCH_LANES)
+    {
+        int n = count - base < SW_BATCH_LANES ? count - base : SW_BATCH_LANES;
+        uint32_t lanes = (uint32_t)((1ull << n) - 1);
+        uint32_t parked = 0; /* In WFI until their timer fires */
+
+        sw_batch_reset(bt);
+        for (int l = 0; l < n; l++)
+        {
+            bt->mem[l] = mem + (size_t)(base + l) * GUEST_MEM_SIZE;
+            bt->x[20][l] = (uint64_t)(base + l) + 1;
+            bt->x[22][l] = 1;
+            bt->x[SW_REG_SP][l] = GUEST_STACK_ADDR;
+            bt->pc[l] = GUEST_CODE_ADDR;
+        }
+
+        while (lanes != 0)
+        {
+            uint64_t first = UINT64_MAX;
+
+            for (int l = 0; l < n; l++)
+            {
+                uint64_t left;
+
+                if ((parked & (1u << l)) == 0)
+                {
+                    continue;
+                }
+                left = sw_batch_timer_ns(bt, (unsigned)l);
+                if (left == 0 || left == UINT64_MAX)
+                {
+                    parked &= ~(1u << l);
+                }
+                else if (left < first)
+                {
+                    first = left;
+                }
+            }
+            if ((lanes & ~parked) == 0)
+            {
+                batch_wait(first, wait_ns);
+                continue;
+            }
+
+            uint32_t run = lanes & ~parked;
+            sw_batch_run(bt, run);
+            for (int l = 0; l < n; l++)
+            {
+                if ((run & (1u << l)) == 0)
+                {
+                    continue;
+                }
+                if (ESR_EC(bt->exit_syndrome[l]) == EC_WFX)
+                {
+                    bt->pc[l] += 4;
+                    parked |= 1u << l;
+                }
+                else if (!batch_exit(&vms[base + l], base + l + 1, bt->mem[l],
+                                     bt->exit_syndrome[l], bt->pc[l], bt->x[0][l],
+                                     bt->x[1][l]))
+                {
+                    lanes &= ~(1u << l);
+                }
+            }
+        }
+    }
+
+    *stats = bt;
+    return 0;
+}
+
+static int batch_mode(int count)
+{
+    batch_vm_t *scalar_vms = calloc((size_t)count, sizeof(batch_vm_t));
+    batch_vm_t *batch_vms = calloc((size_t)count, sizeof(batch_vm_t));
+    sw_batch_t *bt = NULL;
+    uint64_t scalar_insns = 0, scalar_ns, batch_ns, start;
+    uint64_t scalar_wait_ns = 0, batch_wait_ns = 0;
+    double speedup;
+    uint8_t *mem;
+    int matches = 0, exited = 0;
+
+    if (scalar_vms == NULL || batch_vms == NULL)
+    {
+        return 1;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        scalar_vms[i].out_hash = batch_vms[i].out_hash = 0xcbf29ce484222325ull;
+    }
+
+    printf("[Batch] %d VMs running '%s', %d lanes per group\n",
+           count, guest_image->name, SW_BATCH_LANES);
+
+    if ((mem = batch_map(count)) == NULL)
+    {
+        return 1;
+    }
+    start = now_ns();
+    if (batch_run_scalar(mem, count, scalar_vms, &scalar_insns, &scalar_wait_ns) < 0)
+    {
+        return 1;
+    }
+    scalar_ns = now_ns() - start - scalar_wait_ns;
+    munmap(mem, (size_t)count * GUEST_MEM_SIZE);
+
+    if ((mem = batch_map(count)) == NULL)
+    {
+        return 1;
+    }
+    start = now_ns();
+    if (batch_run_lockstep(mem, count, batch_vms, &bt, &batch_wait_ns) < 0)
+    {
+        return 1;
+    }
+    batch_ns = now_ns() - start - batch_wait_ns;
+    munmap(mem, (size_t)count * GUEST_MEM_SIZE);
+
+    for (int i = 0; i < count; i++)
+    {
+        exited += batch_vms[i].exited;
+        matches += scalar_vms[i].exited == batch_vms[i].exited &&
+                   scalar_vms[i].out_hash == batch_vms[i].out_hash &&
+                   scalar_vms[i].out_len == batch_vms[i].out_len;
+    }
+
+    speedup = batch_ns && scalar_ns ? (double)scalar_ns / batch_ns : 0.0;
+    printf("[Batch] scalar:   %llu guest instructions in %.3f s (%.1f MIPS)",
+           scalar_insns, scalar_ns / 1e9, scalar_ns ? scalar_insns * 1e3 / scalar_ns : 0.0);
+    if (scalar_wait_ns != 0)
+    {
+        printf(", %.3f s more in WFI", scalar_wait_ns / 1e9);
+    }
+    printf("\n[Batch] lockstep: %llu guest instructions in %.3f s (%.1f MIPS)",
+           bt->insns, batch_ns / 1e9, batch_ns ? bt->insns * 1e3 / batch_ns : 0.0);
+    if (batch_wait_ns != 0)
+    {
+        printf(", %.3f s more in WFI", batch_wait_ns / 1e9);
+    }
+    printf("\n[Batch] lockstep: %.1f of %d lanes busy per issued instruction, "
+           "%llu lane-instructions run scalar\n",
+           bt->issued ? (double)bt->insns / bt->issued : 0.0, SW_BATCH_LANES, bt->scalar_ops);
+    printf("[Batch] %.2fx the scalar rate; %d of %d VMs exited, %d outputs match\n",
+           speedup, exited, count, matches);
+    if (speedup != 0.0 && speedup < 1.0)
+    {
+        printf("[Batch] Lockstep is slower than scalar for this guest: %.0f%% of its "
+               "instructions ran lane by lane\n",
+               bt->insns ? bt->scalar_ops * 100.0 / bt->insns : 0.0);
+    }
+
+    sw_cpu_destroy(bt->code);
+    free(bt->code);
+    sw_batch_destroy(bt);
+    free(scalar_vms);
+    free(batch_vms);
+    return exited == count && matches == count ? 0 : 1;
+}
+
+/* ============================================================================
+ * Fuzz Mode
+ * ============================================================================
+ *
+ * --fuzz=N fuzzes the guest inside this process on the software backend.
+ * The guest runs until its FUZZ_START hypercall, which names an input
+ * buffer (x1) and its size (x2). That is the snapshot: guest memory and
+ * registers are saved there and the vCPU starts tracking dirty pages.
+ * Each of the N execs then writes an input into the buffer, returns its
+ * length in x0 and runs the guest until FUZZ_END or EXIT, a crash (any
+ * other exception) or FUZZ_EXEC_LIMIT instructions, which counts as a
+ * hang. Afterwards only the pages the guest dirtied are copied back and
+ * the registers reloaded. Translations carry over from one exec to the
+ * next, so an exec costs little more than the guest code it runs.
+ *
+ * Inputs are mutations of a corpus that starts as one input of zeros.
+ * With coverage on, an input that takes an edge between blocks for the
+ * first time, or takes it a new number of times (bucketed as in AFL),
+ * joins the corpus. Crashes are reported once per faulting PC. The random
+ * generator has a fixed seed, so a fuzzing run is repeatable.
+ */
+
+#define FUZZ_MAX_INPUT 4096     /* Also capped by the guest's buffer */
+#define FUZZ_MAX_CORPUS 4096
+#define FUZZ_EXEC_LIMIT 1000000 /* Guest instructions before an exec is a hang */
+#define FUZZ_MAX_CRASHES 64     /* Distinct crash PCs remembered */
+
+typedef struct
+{
+    uint8_t *data;
+    size_t len;
+} fuzz_input_t;
+
+typedef struct
+{
+    sw_cpu_t *cpu;
+    uint8_t *snapshot;        /* Guest memory at FUZZ_START */
+    sw_regs_t regs;           /* Registers at FUZZ_START */
+    uint64_t buf;             /* Guest input buffer */
+    uint64_t buf_size;
+    bool coverage;            /* Edge coverage feedback */
+    uint8_t virgin[SW_COV_MAP_SIZE]; /* Hit count buckets not seen yet */
+    fuzz_input_t corpus[FUZZ_MAX_CORPUS];
+    int corpus_size;
+    uint64_t rng;
+    uint64_t crash_pcs[FUZZ_MAX_CRASHES];
+    int n_crash_pcs;
+
+    /* Statistics */
+    uint64_t execs;
+    uint64_t crashes;
+    uint64_t hangs;
+    uint64_t edges;
+    uint64_t pages_restored;
+} fuzz_state_t;
+
+/* Outcome of one exec */
+#define FUZZ_OK 0
+#define FUZZ_CRASH 1
+#define FUZZ_HANG 2
+
+/* xorshift64* */
+static uint64_t fuzz_rand(fuzz_state_t *fz)
+{
+    fz->rng ^= fz->rng >> 12;
+    fz->rng ^= fz->rng << 25;
+    fz->rng ^= fz->rng >> 27;
+    return fz->rng * 0x2545f4914f6cdd1dull;
+}
+
+/* A mutation of a random corpus entry in `out`, returns its length */
+static size_t fuzz_mutate(fuzz_state_t *fz, uint8_t *out)
+{
+    static const uint8_t interesting[] = {0x00, 0x01, 0x10, 0x20, 0x40, 0x7f, 0x80, 0xff};
+    const fuzz_input_t *base = &fz->corpus[fuzz_rand(fz) % (uint64_t)fz->corpus_size];
+    size_t len = base->len;
+    int n = 1 + (int)(fuzz_rand(fz) % 4);
+
+    memcpy(out, base->data, len);
+    for (int i = 0; i < n; i++)
+    {
+        uint64_t r = fuzz_rand(fz);
+        size_t pos = len != 0 ? (size_t)((r >> 8) % len) : 0;
+        uint8_t val = (uint8_t)(r >> 40);
+
+        switch (r % 7)
+        {
+        case 0: /* Flip a bit */
+            if (len != 0)
+                out[pos] ^= (uint8_t)(1u << (val & 7));
+            break;
+        case 1: /* Random byte */
+            if (len != 0)
+                out[pos] = val;
+            break;
+        case 2: /* Interesting byte */
+            if (len != 0)
+                out[pos] = interesting[val % sizeof(interesting)];
+            break;
+        case 3: /* Add or subtract a little */
+            if (len != 0)
+                out[pos] += (uint8_t)(val % 33) - 16;
+            break;
+        case 4: /* Insert a byte */
+            if (len < fz->buf_size)
+            {
+                memmove(out + pos + 1, out + pos, len - pos);
+                out[pos] = val;
+                len++;
+            }
+            break;
+        case 5: /* Delete a byte */
+            if (len > 1)
+            {
+                memmove(out + pos, out + pos + 1, len - pos - 1);
+                len--;
+            }
+            break;
+        case 6: /* Splice in a piece of another input, same offset */
+        {
+            const fuzz_input_t *other = &fz->corpus[val % (uint64_t)fz->corpus_size];
+            if (pos < len && pos < other->len)
+            {
+                size_t max = (len < other->len ? len : other->len) - pos;
+                size_t count = 1 + (size_t)((r >> 48) % max);
+                memcpy(out + pos, other->data + pos, count);
+            }
+            break;
+        }
+        }
+    }
+    return len;
+}
+
+/* Add an input to the corpus (dropped once the corpus is full) */
+static void fuzz_add(fuzz_state_t *fz, const uint8_t *data, size_t len)
+{
+    uint8_t *copy;
+
+    if (fz->corpus_size == FUZZ_MAX_CORPUS || (copy = malloc(len + 1)) == NULL)
+    {
+        return;
+    }
+    memcpy(copy, data, len);
+    fz->corpus[fz->corpus_size].data = copy;
+    fz->corpus[fz->corpus_size].len = len;
+    fz->corpus_size++;
+}
+
+/* AFL's hit count buckets: 1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+ */
+static uint8_t fuzz_bucket(uint8_t hits)
+{
+    if (hits <= 2)
+        return hits;
+    if (hits == 3)
+        return 4;
+    if (hits < 8)
+        return 8;
+    if (hits < 16)
+        return 16;
+    if (hits < 32)
+        return 32;
+    return hits < 128 ? 64 : 128;
+}
+
+/* Did the last exec hit an edge, or a hit count bucket, not seen before? */
+static bool fuzz_new_coverage(fuzz_state_t *fz)
+{
+    const uint8_t *map = fz->cpu->cov_map;
+    bool found = false;
+
+    for (size_t i = 0; i < SW_COV_MAP_SIZE; i += 8)
+    {
+        uint64_t word;
+
+        /* Most of the map is zero, skip it eight entries at a time */
+        memcpy(&word, map + i, sizeof(word));
+        if (word == 0)
+        {
+            continue;
+        }
+        for (size_t j = i; j < i + 8; j++)
+        {
+            uint8_t bucket = fuzz_bucket(map[j]);
+            if ((bucket & fz->virgin[j]) == 0)
+            {
+                continue;
+            }
+            if (fz->virgin[j] == 0xff)
+            {
+                fz->edges++;
+            }
+            fz->virgin[j] &= (uint8_t)~bucket;
+            found = true;
+        }
+    }
+    return found;
+}
+
+/* Report a crash the first time its PC shows up */
+static void fuzz_crash(fuzz_state_t *fz, const uint8_t *input, size_t len)
+{
+    sw_cpu_t *cpu = fz->cpu;
+
+    fz->crashes++;
+    for (int i = 0; i < fz->n_crash_pcs; i++)
+    {
+        if (fz->crash_pcs[i] == cpu->pc)
+        {
+            return;
+        }
+    }
+    if (fz->n_crash_pcs < FUZZ_MAX_CRASHES)
+    {
+        fz->crash_pcs[fz->n_crash_pcs++] = cpu->pc;
+    }
+
+    printf("[Fuzz] Crash at PC=0x%llx (EC=0x%llx, FAR=0x%llx) after %llu execs, input:",
+           cpu->pc, ESR_EC(cpu->exit_syndrome), cpu->exit_fault_addr, fz->execs);
+    for (size_t i = 0; i < len && i < 64; i++)
+    {
+        printf(" %02x", input[i]);
+    }
+    printf("%s\n", len > 64 ? " ..." : "");
+}
+
+/* Run one input from the snapshot and restore the snapshot afterwards */
+static int fuzz_exec(fuzz_state_t *fz, const uint8_t *input, size_t len)
+{
+    sw_cpu_t *cpu = fz->cpu;
+    int result = FUZZ_OK;
+
+    memcpy(cpu->mem + fz->buf, input, len);
+    sw_cpu_mark_dirty(cpu, fz->buf, len);
+    cpu->x[0] = len;
+    cpu->insn_limit = cpu->insns + FUZZ_EXEC_LIMIT;
+    if (fz->coverage)
+    {
+        memset(cpu->cov_map, 0, SW_COV_MAP_SIZE);
+        cpu->cov_prev = 0;
+    }
+
+    for (;;)
+    {
+        int ret = sw_cpu_run(cpu);
+
+        if (ret == SW_EXIT_LIMIT)
+        {
+            result = FUZZ_HANG;
+            break;
+        }
+        if (ret != SW_EXIT_EXCEPTION)
+        {
+            continue;
+        }
+
+        uint32_t ec = ESR_EC(cpu->exit_syndrome);
+        if (ec == EC_WFX)
+        {
+            cpu->pc += 4;
+            continue;
+        }
+        if (ec != EC_HVC64)
+        {
+            result = FUZZ_CRASH;
+            break;
+        }
+
+        /* Guest output is dropped, there would be far too much of it */
+        if (cpu->x[0] == HYPERCALL_FUZZ_END || cpu->x[0] == HYPERCALL_EXIT ||
+            cpu->x[0] == HYPERCALL_FUZZ_START)
+        {
+            break;
+        }
+    }
+
+    fz->execs++;
+    if (result == FUZZ_CRASH)
+    {
+        fuzz_crash(fz, input, len);
+    }
+    else if (result == FUZZ_HANG)
+    {
+        fz->hangs++;
+    }
+
+    fz->pages_restored += sw_cpu_restore_dirty(cpu, fz->snapshot);
+    sw_cpu_load_regs(cpu, &fz->regs);
+    cpu->insn_limit = UINT64_MAX;
+    return result;
+}
+
+/* Run the guest from reset up to its FUZZ_START hypercall */
+static int fuzz_boot(fuzz_state_t *fz)
+{
+    sw_cpu_t *cpu = fz->cpu;
+
+    cpu->x[20] = 1;
+    cpu->x[22] = 1;
+    cpu->x[SW_REG_SP] = GUEST_STACK_ADDR;
+    cpu->pc = GUEST_CODE_ADDR;
+
+    for (;;)
+    {
+        int ret = sw_cpu_run(cpu);
+        if (ret != SW_EXIT_EXCEPTION)
+        {
+            continue;
+        }
+
+        uint32_t ec = ESR_EC(cpu->exit_syndrome);
+        if (ec == EC_WFX)
+        {
+            cpu->pc += 4;
+            continue;
+        }
+        if (ec != EC_HVC64)
+        {
+            fprintf(stderr, "[Fuzz] Guest crashed before FUZZ_START: EC=0x%x at PC=0x%llx\n",
+                    ec, cpu->pc);
+            return -1;
+        }
+
+        switch (cpu->x[0])
+        {
+        case HYPERCALL_FUZZ_START:
+            fz->buf = cpu->x[1];
+            fz->buf_size = cpu->x[2] < FUZZ_MAX_INPUT ? cpu->x[2] : FUZZ_MAX_INPUT;
+            if (fz->buf_size == 0 || fz->buf >= GUEST_MEM_SIZE ||
+                fz->buf_size > GUEST_MEM_SIZE - fz->buf)
+            {
+                fprintf(stderr, "[Fuzz] Bad input buffer 0x%llx (%llu bytes)\n",
+                        cpu->x[1], cpu->x[2]);
+                return -1;
+            }
+            return 0;
+
+        case HYPERCALL_PUTCHAR:
+            putchar((int)cpu->x[1]);
+            break;
+
+        case HYPERCALL_EXIT:
+            fprintf(stderr, "[Fuzz] Guest exited without making the FUZZ_START hypercall\n");
+            return -1;
+
+        default:
+            break;
+        }
+    }
+}
+
+static int fuzz_mode(int count, bool coverage)
+{
+    fuzz_state_t *fz = calloc(1, sizeof(*fz));
+    uint8_t *mem, *input;
+    uint64_t start, insns, elapsed;
+    int result = 1;
+
+    if (fz == NULL)
+    {
+        return 1;
+    }
+    fz->coverage = coverage;
+    fz->rng = 0x9e3779b97f4a7c15ull;
+    memset(fz->virgin, 0xff, sizeof(fz->virgin));
+
+    mem = mmap(NULL, GUEST_MEM_SIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    fz->snapshot = malloc(GUEST_MEM_SIZE);
+    fz->cpu = malloc(sizeof(*fz->cpu));
+    input = malloc(FUZZ_MAX_INPUT);
+    if (mem == MAP_FAILED || fz->snapshot == NULL || fz->cpu == NULL || input == NULL ||
+        sw_cpu_init(fz->cpu, mem, GUEST_MEM_SIZE) < 0)
+    {
+        fprintf(stderr, "[Fuzz] Out of memory\n");
+        return 1;
+    }
+    memcpy(mem + GUEST_CODE_ADDR, guest_image->code, guest_image->size);
+
+    /* On from the start: no traces get formed that would hide edges */
+    if (coverage && (fz->cpu->cov_map = calloc(SW_COV_MAP_SIZE, 1)) == NULL)
+    {
+        fprintf(stderr, "[Fuzz] Out of memory\n");
+        return 1;
+    }
+
+    printf("[Fuzz] Fuzzing '%s' for %d execs, coverage %s\n",
+           guest_image->name, count, coverage ? "on" : "off");
+    if (fuzz_boot(fz) < 0)
+    {
+        goto out;
+    }
+
+    /* Take the snapshot */
+    memcpy(fz->snapshot, mem, GUEST_MEM_SIZE);
+    sw_cpu_save_regs(fz->cpu, &fz->regs);
+    if (sw_cpu_track_dirty(fz->cpu) < 0)
+    {
+        fprintf(stderr, "[Fuzz] Out of memory\n");
+        goto out;
+    }
+    printf("[Fuzz] Snapshot at PC=0x%llx, input buffer 0x%llx (%llu bytes)\n",
+           fz->regs.pc, fz->buf, fz->buf_size);
+
+    memset(input, 0, fz->buf_size < 16 ? fz->buf_size : 16);
+    fuzz_add(fz, input, fz->buf_size < 16 ? fz->buf_size : 16);
+
+    start = now_ns();
+    insns = fz->cpu->insns;
+    for (int i = 0; i < count; i++)
+    {
+        size_t len = fuzz_mutate(fz, input);
+        int ret = fuzz_exec(fz, input, len);
+
+        if (coverage && ret == FUZZ_OK && fuzz_new_coverage(fz))
+        {
+            fuzz_add(fz, input, len);
+        }
+    }
+    elapsed = now_ns() - start;
+    insns = fz->cpu->insns - insns;
+
+    printf("[Fuzz] %llu execs in %.3f s (%.0f execs/s), %llu guest instructions\n",
+           fz->execs, elapsed / 1e9, elapsed ? fz->execs * 1e9 / elapsed : 0.0, insns);
+    printf("[Fuzz] %llu edges, %d inputs in the corpus, %.2f pages restored per exec\n",
+           fz->edges, fz->corpus_size, fz->execs ? (double)fz->pages_restored / fz->execs : 0.0);
+    printf("[Fuzz] %llu crashes at %d distinct PCs, %llu hangs\n",
+           fz->crashes, fz->n_crash_pcs, fz->hangs);
+    result = 0;
+
+out:
+    free(fz->cpu->cov_map);
+    fz->cpu->cov_map = NULL;
+    sw_cpu_destroy(fz->cpu);
+    free(fz->cpu);
+    for (int i = 0; i < fz->corpus_size; i++)
+    {
+        free(fz->corpus[i].data);
+    }
+    free(fz->snapshot);
+    free(input);
+    free(fz);
+    munmap(mem, GUEST_MEM_SIZE);
+    return result;
+}
+
+/* ============================================================================
+ * Per-VM Metrics (parent side)
+ * ============================================================================
+ *
+ * The parent samples every VM process while it runs. These are the macOS
+ * counterparts of the cgroup files we would otherwise read:
+ *
+ *   cpu_usec       cpu.stat usage_usec
+ *   runnable_usec  time runnable but waiting for a core (cpu.pressure)
+ *   footprint      memory.current (physical footprint)
+ *   footprint_peak memory.peak
+ *   pageins        page faults that waited on I/O (memory.pressure)
+ *   disk_*         io.stat rbytes / wbytes
+ *
+ * A VM that hibernates (see "Hibernation") is a new process each time it
+ * wakes, and one that migrates (see "Post-Copy Migration") is a new
+ * process afterwards; its CPU time adds up over all of them, the rest is
+ * the latest.
+ */
+
+#define METRICS_SAMPLE_US 50000
+
+typedef struct
+{
+    uint64_t cpu_usec;
+    uint64_t runnable_usec;
+    uint64_t footprint;
+    uint64_t footprint_peak;
+    uint64_t pageins;
+    uint64_t disk_read;
+    uint64_t disk_written;
+    uint64_t cpu_usec_hibernated; /* CPU time of the VM's earlier processes (before
+                                   * the last wake, migration or upgrade) */
+    uint64_t cpu_recent_usec;     /* CPU per sample, moving average */
+    uint64_t hibernations;
+    uint64_t migrations;
+    uint64_t upgrades;
+    uint64_t mp_reclaims;         /* Memory pressure controller actions */
+    uint64_t mp_reclaimed;        /* Bytes given back by them */
+    uint64_t mp_hibernations;
+} vm_metrics_t;
+
+static void metrics_sample(pid_t pid, vm_metrics_t *m)
+{
+    struct rusage_info_v4 ri;
+
+    if (proc_pid_rusage(pid, RUSAGE_INFO_V4, (rusage_info_t *)&ri) != 0)
+    {
+        return; /* Already exited: keep the last sample */
+    }
+
+    /* CPU times are reported in mach absolute time units */
+    uint64_t cpu_usec = mach_to_ns(ri.ri_user_time + ri.ri_system_time) / 1000;
+    if (cpu_usec >= m->cpu_usec)
+    {
+        m->cpu_recent_usec = (m->cpu_recent_usec * 3 + (cpu_usec - m->cpu_usec)) / 4;
+    }
+    m->cpu_usec = cpu_usec;
+    m->runnable_usec = mach_to_ns(ri.ri_runnable_time) / 1000;
+    m->footprint = ri.ri_phys_footprint;
+    m->footprint_peak = ri.ri_lifetime_max_phys_footprint;
+    m->pageins = ri.ri_pageins;
+    m->disk_read = ri.ri_diskio_bytesread;
+    m->disk_written = ri.ri_diskio_byteswritten;
+}
+
+static void metrics_print(int vm_id, const vm_metrics_t *m)
+{
+    printf("[Parent] VM %d metrics: cpu_usec=%llu runnable_usec=%llu "
+           "footprint_kb=%llu peak_kb=%llu pageins=%llu "
+           "disk_read=%llu disk_written=%llu",
+           vm_id, m->cpu_usec + m->cpu_usec_hibernated, m->runnable_usec,
+           m->footprint / 1024, m->footprint_peak / 1024, m->pageins,
+           m->disk_read, m->disk_written);
+    if (m->hibernations != 0)
+    {
+        printf(" hibernations=%llu", m->hibernations);
+    }
+    if (m->migrations != 0)
+    {
+        printf(" migrations=%llu", m->migrations);
+    }
+    if (m->upgrades != 0)
+    {
+        printf(" upgrades=%llu", m->upgrades);
+    }
+    if (m->mp_reclaims != 0 || m->mp_hibernations != 0)
+    {
+        printf(" pressure_reclaims=%llu reclaimed_kb=%llu pressure_hibernations=%llu",
+               m->mp_reclaims, m->mp_reclaimed / 1024, m->mp_hibernations);
+    }
+    printf("\n");
+}
+
+/* ============================================================================
+ * Memory Pressure Controller (parent side)
+ * ============================================================================
+ *
+ * Keeps a dense host away from the kernel's jetsam (its OOM killer). The
+ * nearest macOS has to PSI is the memorystatus pressure level, which the
+ * parent reads every metrics sample. While it is raised, the controller
+ * acts in steps, one step per interval (--mem-pressure=...,MS):
+ *
+ *   warn or critical  every VM reclaims its free guest pages
+ *   critical          then the coldest VM, the one that used the least
+ *                     CPU lately, is hibernated; one more each interval
+ *
+ * There is no balloon device, so there is no step between the two. The
+ * policy sets how far the controller may go: `reclaim` stops at the first
+ * step, `hibernate` needs VMs that can hibernate (--backend=sw, one vCPU).
+ * Once the level is back to normal the hibernated VMs are woken, one per
+ * interval. Timer wakes of hibernated VMs wait while it is critical.
+ */
+
+#define MP_POLICY_OFF 0
+#define MP_POLICY_RECLAIM 1
+#define MP_POLICY_HIBERNATE 2
+
+#define MP_INTERVAL_DEFAULT_MS 1000
+
+#define MP_LEVEL_NORMAL 0
+#define MP_LEVEL_WARN 1
+#define MP_LEVEL_CRITICAL 2
+
+static int mp_policy = MP_POLICY_OFF;
+static uint32_t mp_interval_ms = MP_INTERVAL_DEFAULT_MS;
+
+static const char *const mp_level_names[] = {"normal", "warn", "critical"};
+
+typedef struct
+{
+    int level;                 /* MP_LEVEL_* */
+    bool reclaimed;            /* Step one done for this pressure spell */
+    uint64_t next_action_ns;   /* Interval between steps */
+    uint64_t last_ns;
+    uint64_t level_ns[3];      /* Time spent at each level */
+    uint64_t actions;
+    bool evicted[MAX_VMS];     /* Hibernated by the controller */
+} mp_state_t;
+
+static int mp_read_level(void)
+{
+    int level = 0;
+    size_t len = sizeof(level);
+
+    /* kVMPressureNormal 1, Warning 2, Urgent 3, Critical 4 */
+    if (sysctlbyname("kern.memorystatus_vm_pressure_level", &level, &len, NULL, 0) != 0)
+    {
+        return MP_LEVEL_NORMAL;
+    }
+    return level >= 4 ? MP_LEVEL_CRITICAL : level >= 2 ? MP_LEVEL_WARN : MP_LEVEL_NORMAL;
+}
+
+static void mp_request(pid_t pid, int vm_id, unsigned int req)
+{
+    atomic_fetch_or(&mp_shared[vm_id - 1].request, req);
+    kill(pid, SIGUSR2);
+}
+
+/*
+ * One controller step, after each metrics sample. `running` marks VMs
+ * with a live process; VMs to be woken from hibernation get `wake` set.
+ */
+static void mp_control(mp_state_t *mp, const pid_t *pids, const bool *running,
+                       vm_metrics_t *metrics, bool *wake)
+{
+    uint64_t now = now_ns();
+    int level = mp_read_level();
+
+    if (mp->last_ns != 0)
+    {
+        mp->level_ns[mp->level] += now - mp->last_ns;
+    }
+    mp->last_ns = now;
+    if (level != mp->level)
+    {
+        printf("[Parent] Memory pressure %s -> %s\n",
+               mp_level_names[mp->level], mp_level_names[level]);
+        mp->level = level;
+        mp->next_action_ns = 0;
+    }
+    if (now < mp->next_action_ns)
+    {
+        return;
+    }
+
+    if (level == MP_LEVEL_NORMAL)
+    {
+        mp->reclaimed = false;
+        for (int i = 0; i < MAX_VMS; i++)
+        {
+            if (mp->evicted[i])
+            {
+                mp->evicted[i] = false;
+                wake[i] = true;
+                mp->next_action_ns = now + mp_interval_ms * 1000000ull;
+                break;
+            }
+        }
+        return;
+    }
+    mp->next_action_ns = now + mp_interval_ms * 1000000ull;
+
+    if (!mp->reclaimed || level == MP_LEVEL_WARN)
+    {
+        for (int i = 0; i < MAX_VMS; i++)
+        {
+            if (running[i])
+            {
+                mp_request(pids[i], i + 1, MP_REQ_RECLAIM);
+                metrics[i].mp_reclaims++;
+                mp->actions++;
+            }
+        }
+        printf("[Parent] Memory pressure %s: reclaiming free guest pages\n",
+               mp_level_names[level]);
+        mp->reclaimed = true;
+        return;
+    }
+
+    if (mp_policy < MP_POLICY_HIBERNATE)
+    {
+        return;
+    }
+
+    int coldest = -1;
+    for (int i = 0; i < MAX_VMS; i++)
+    {
+        if (running[i] && !mp->evicted[i] &&
+            (coldest < 0 || metrics[i].cpu_recent_usec < metrics[coldest].cpu_recent_usec))
+        {
+            coldest = i;
+        }
+    }
+    if (coldest >= 0)
+    {
+        printf("[Parent] Memory pressure %s: hibernating VM %d (footprint %llu KB)\n",
+               mp_level_names[level], coldest + 1, metrics[coldest].footprint / 1024);
+        mp_request(pids[coldest], coldest + 1, MP_REQ_HIBERNATE);
+        mp->evicted[coldest] = true;
+        metrics[coldest].mp_hibernations++;
+        mp->actions++;
+    }
+}
+
+static void mp_print(const mp_state_t *mp)
+{
+    printf("[Parent] Memory pressure: warn %llu ms, critical %llu ms, %llu actions\n",
+           mp->level_ns[MP_LEVEL_WARN] / 1000000, mp->level_ns[MP_LEVEL_CRITICAL] / 1000000,
+           mp->actions);
+}
+
+/* ============================================================================
+ * Command Line
+ * ============================================================================ */
+
+/* Parse a byte count with an optional K/M/G suffix */
+static int parse_size(const char *str, uint64_t *out)
+{
+    char *end;
+    errno = 0;
+    unsigned long long val = strtoull(str, &end, 0);
+
+    if (errno != 0 || end == str)
+    {
+        return -1;
+    }
+
+    switch (*end)
+    {
+    case 'G':
+    case 'g':
+        val <<= 10;
+        /* fall through */
+    case 'M':
+    case 'm':
+        val <<= 10;
+        /* fall through */
+    case 'K':
+    case 'k':
+        val <<= 10;
+        end++;
+        break;
+    }
+
+    if (*end != '\0')
+    {
+        return -1;
+    }
+    *out = val;
+    return 0;
+}
+
+/* Parse "QUOTA[,PERIOD]" in microseconds, or "max" for no limit */
+static int parse_cpu_max(const char *str, vm_config_t *cfg)
+{
+    if (strcmp(str, "max") == 0)
+    {
+        cfg->cpu_max_quota_us = 0;
+        return 0;
+    }
+
+    char *end;
+    unsigned long long quota = strtoull(str, &end, 10);
+    unsigned long long period = CPU_MAX_PERIOD_DEFAULT_US;
+
+    if (end == str)
+    {
+        return -1;
+    }
+    if (*end == ',')
+    {
+        const char *p = end + 1;
+        period = strtoull(p, &end, 10);
+        if (end == p)
+        {
+            return -1;
+        }
+    }
+    if (*end != '\0' || quota == 0 || period == 0)
+    {
+        return -1;
+    }
+
+    cfg->cpu_max_quota_us = quota;
+    cfg->cpu_max_period_us = period;
+    return 0;
+}
+
+/* --prefault: "all", or comma separated guest address ranges START-END */
+static int parse_prefault(const char *str, vm_config_t *cfg)
+{
+    char buf[256];
+
+    if (strlen(str) >= sizeof(buf))
+    {
+        return -1;
+    }
+    strcpy(buf, str);
+
+    cfg->n_prefault = 0;
+    for (char *tok = strtok(buf, ","); tok != NULL; tok = strtok(NULL, ","))
+    {
+        char *dash = strchr(tok, '-');
+        vm_range_t *r;
+
+        if (cfg->n_prefault == VM_MAX_PREFAULT)
+        {
+            return -1;
+        }
+        r = &cfg->prefault[cfg->n_prefault++];
+        if (strcmp(tok, "all") == 0)
+        {
+            r->start = 0;
+            r->end = UINT64_MAX;
+            continue;
+        }
+        if (dash == NULL)
+        {
+            return -1;
+        }
+        *dash = '\0';
+        if (parse_size(tok, &r->start) < 0 || parse_size(dash + 1, &r->end) < 0 ||
+            r->end <= r->start)
+        {
+            return -1;
+        }
+    }
+    return cfg->n_prefault > 0 ? 0 : -1;
+}
+
+/* CLASS[:WEIGHT][,CLASS[:WEIGHT]...] */
+static int parse_sched(const char *arg)
+{
+    char buf[256];
+    char *save = NULL;
+
+    if (strlen(arg) >= sizeof(buf))
+    {
+        return -1;
+    }
+    strcpy(buf, arg);
+    n_sched_specs = 0;
+    for (char *tok = strtok_r(buf, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save))
+    {
+        char *colon = strchr(tok, ':');
+        int cls = -1;
+        long weight = SCHED_WEIGHT_DEFAULT;
+
+        if (n_sched_specs == MAX_VMS)
+        {
+            return -1;
+        }
+        if (colon != NULL)
+        {
+            char *end;
+            *colon = '\0';
+            weight = strtol(colon + 1, &end, 10);
+            if (*end != '\0' || weight < 1 || weight > 10000)
+            {
+                return -1;
+            }
+        }
+        for (int i = 0; i < 3; i++)
+        {
+            if (strcmp(tok, sched_class_names[i]) == 0)
+            {
+                cls = i;
+            }
+        }
+        if (cls < 0)
+        {
+            return -1;
+        }
+        sched_classes[n_sched_specs] = cls;
+        sched_weights[n_sched_specs] = (uint32_t)weight;
+        n_sched_specs++;
+    }
+    return n_sched_specs > 0 ? 0 : -1;
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [options]\n", prog);
+    printf("\n");
+    printf("Per-VM resource controls (applied to every VM):\n");
+    printf("  --cpu-max=QUOTA[,PERIOD]  CPU time in us per period (default period %d us)\n",
+           CPU_MAX_PERIOD_DEFAULT_US);
+    printf("  --mem-high=SIZE           Soft memory limit, e.g. 64M\n");
+    printf("  --io-weight=N             Disk I/O weight 1..10000 (default %d)\n",
+           IO_WEIGHT_DEFAULT);
+    printf("  --mem=SIZE                Guest RAM, e.g. 4G, reserved and committed on\n");
+    printf("                            first touch (default 1M)\n");
+    printf("  --prefault=all|START-END[,START-END...]\n");
+    printf("                            Fault in guest memory at creation\n");
+    printf("  --mem-pressure=POLICY[,MS]  On host memory pressure: reclaim free guest\n");
+    printf("                            pages, or also hibernate cold VMs (POLICY\n");
+    printf("                            reclaim|hibernate), a step every MS ms (default %d)\n",
+           MP_INTERVAL_DEFAULT_MS);
+    printf("\n");
+    printf("Spawning:\n");
+    printf("  --zygote                  Fork VMs from a pre-initialized zygote process\n");
+    printf("  --bench-spawn=N           Measure spawn latency of N VMs, fork vs zygote\n");
+    printf("  --bench-snapshot=SIZE     Measure snapshot save/restore of SIZE bytes as\n");
+    printf("                            threads are added\n");
+    printf("\n");
+    printf("Execution:\n");
+    printf("  --backend=hvf|sw          Hypervisor.framework (default) or software translator\n");
+    printf("  --tcache=PATH             Persistent translation cache for --backend=sw\n");
+    printf("  --vcpus=N                 vCPUs per VM, 1..%d (--backend=sw only)\n",
+           VM_MAX_VCPUS);
+    printf("  --pcpus=N                 Run the vCPUs of a VM on N CPUs, time-sliced\n");
+    printf("                            (--backend=sw only)\n");
+    printf("  --pvlock                  Park vCPUs waiting on a guest spinlock and hand\n");
+    printf("                            their CPU to the holder (LOCK_WAIT/LOCK_KICK)\n");
+    printf("  --bench-pvlock=N          Measure the pvlock guest with N vCPUs on N CPUs,\n");
+    printf("                            then on N/2, spinning vs --pvlock\n");
+    printf("  --icount=MIPS             Guest time from instruction count at MIPS\n");
+    printf("                            (deterministic, --backend=sw only)\n");
+    printf("  --guest=hello|cmploop|atomics|timer|fuzz|idle|sparse|dirty|pvlock\n");
+    printf("                            Guest image to run (default hello)\n");
+    printf("  --profile=PATH            Hot blocks at exit, full profile to PATH.<vm id>\n");
+    printf("                            (block counts with sw, PC samples with hvf)\n");
+    printf("  --wss=PATH                Estimate working sets, log to PATH.<vm id>\n");
+    printf("                            (--backend=sw only)\n");
+    printf("  --batch=N                 Run N copies of the guest in-process, scalar vs\n");
+    printf("                            lockstep SIMD interpreter (experimental; only\n");
+    printf("                            guests of plain ALU ops and branches gain, those\n");
+    printf("                            heavy in atomics run ~4x slower in lockstep)\n");
+    printf("  --fuzz=N                  Fuzz the guest in-process for N execs from a\n");
+    printf("                            snapshot at its FUZZ_START hypercall\n");
+    printf("  --fuzz-blind              Fuzz without edge coverage feedback\n");
+    printf("  --hibernate=MS            Write a VM idle for MS ms to disk, wake it on its\n");
+    printf("                            timer or SIGUSR1 (--backend=sw, --vcpus=1)\n");
+    printf("  --snapshot-threads=N      Threads to save and restore snapshots with\n");
+    printf("                            (default one per CPU, at most %d)\n", SNAP_MAX_THREADS);
+    printf("  --chunk-store=DIR         Keep snapshot chunks in a content-addressed store\n");
+    printf("                            shared by all snapshots\n");
+    printf("  --postcopy=MS             Migrate each VM to a new process after MS ms,\n");
+    printf("                            pages following on demand (--backend=sw, --vcpus=1)\n");
+    printf("  --precopy=N               Copy memory in up to N rounds before switching\n");
+    printf("  --xfer=raw|delta|lz4      Migrated page encoding: as is, zero pages and XOR\n");
+    printf("                            deltas (default), or also LZ4\n");
+    printf("  --upgrade=MS              Hand each VM over to a new VMM process every MS ms\n");
+    printf("                            or on SIGHUP, sharing its memory (--backend=sw,\n");
+    printf("                            --vcpus=1)\n");
+    printf("  --upgrade-binary=PATH     New VMM to run for --upgrade (default this one)\n");
+    printf("  --sched=CLASS[:WEIGHT][,...]\n");
+    printf("                            Share the CPU by weight (default %d), one entry\n",
+           SCHED_WEIGHT_DEFAULT);
+    printf("                            per VM, the last repeated; CLASS latency|normal|\n");
+    printf("                            batch (--backend=sw, --vcpus=1)\n");
+    printf("  --sched-cpus=N            CPUs the --sched VMs share (default 1)\n");
+    printf("  --bench-sched=MS          Measure fairness and wakeup latency of mixed\n");
+    printf("                            workloads under --sched, MS ms per run\n");
+    printf("  -h, --help                Show this help\n");
+}
+
+static int parse_args(int argc, char **argv, vm_config_t *defaults, int *bench_spawns,
+                      int *batch_vms, int *fuzz_execs, bool *fuzz_coverage)
+{
+    enum
+    {
+        OPT_CPU_MAX = 256,
+        OPT_MEM_HIGH,
+        OPT_IO_WEIGHT,
+        OPT_ZYGOTE,
+        OPT_BENCH_SPAWN,
+        OPT_BACKEND,
+        OPT_TCACHE,
+        OPT_GUEST,
+        OPT_VCPUS,
+        OPT_BATCH,
+        OPT_ICOUNT,
+        OPT_FUZZ,
+        OPT_FUZZ_BLIND,
+        OPT_PROFILE,
+        OPT_HIBERNATE,
+        OPT_MEM_PRESSURE,
+        OPT_WSS,
+        OPT_PREFAULT,
+        OPT_MEM,
+        OPT_SNAPSHOT_THREADS,
+        OPT_BENCH_SNAPSHOT,
+        OPT_CHUNK_STORE,
+        OPT_POSTCOPY,
+        OPT_PRECOPY,
+        OPT_XFER,
+        OPT_UPGRADE,
+        OPT_UPGRADE_BINARY,
+        OPT_UPGRADE_FROM,
+        OPT_SCHED,
+        OPT_SCHED_CPUS,
+        OPT_BENCH_SCHED,
+        OPT_PCPUS,
+        OPT_PVLOCK,
+        OPT_BENCH_PVLOCK,
+    };
+    static const struct option options[] = {
+        {"cpu-max", required_argument, NULL, OPT_CPU_MAX},
+        {"mem-high", required_argument, NULL, OPT_MEM_HIGH},
+        {"io-weight", required_argument, NULL, OPT_IO_WEIGHT},
+        {"zygote", no_argument, NULL, OPT_ZYGOTE},
+        {"bench-spawn", required_argument, NULL, OPT_BENCH_SPAWN},
+        {"backend", required_argument, NULL, OPT_BACKEND},
+        {"tcache", required_argument, NULL, OPT_TCACHE},
+        {"guest", required_argument, NULL, OPT_GUEST},
+        {"vcpus", required_argument, NULL, OPT_VCPUS},
+        {"batch", required_argument, NULL, OPT_BATCH},
+        {"icount", required_argument, NULL, OPT_ICOUNT},
+        {"fuzz", required_argument, NULL, OPT_FUZZ},
+        {"fuzz-blind", no_argument, NULL, OPT_FUZZ_BLIND},
+        {"profile", required_argument, NULL, OPT_PROFILE},
+        {"hibernate", required_argument, NULL, OPT_HIBERNATE},
+        {"mem-pressure", required_argument, NULL, OPT_MEM_PRESSURE},
+        {"wss", required_argument, NULL, OPT_WSS},
+        {"prefault", required_argument, NULL, OPT_PREFAULT},
+        {"mem", required_argument, NULL, OPT_MEM},
+        {"snapshot-threads", required_argument, NULL, OPT_SNAPSHOT_THREADS},
+        {"bench-snapshot", required_argument, NULL, OPT_BENCH_SNAPSHOT},
+        {"chunk-store", required_argument, NULL, OPT_CHUNK_STORE},
+        {"postcopy", required_argument, NULL, OPT_POSTCOPY},
+        {"precopy", required_argument, NULL, OPT_PRECOPY},
+        {"xfer", required_argument, NULL, OPT_XFER},
+        {"upgrade", required_argument, NULL, OPT_UPGRADE},
+        {"upgrade-binary", required_argument, NULL, OPT_UPGRADE_BINARY},
+        {"upgrade-from", required_argument, NULL, OPT_UPGRADE_FROM},
+        {"sched", required_argument, NULL, OPT_SCHED},
+        {"sched-cpus", required_argument, NULL, OPT_SCHED_CPUS},
+        {"bench-sched", required_argument, NULL, OPT_BENCH_SCHED},
+        {"pcpus", required_argument, NULL, OPT_PCPUS},
+        {"pvlock", no_argument, NULL, OPT_PVLOCK},
+        {"bench-pvlock", required_argument, NULL, OPT_BENCH_PVLOCK},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "h", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case OPT_CPU_MAX:
+            if (parse_cpu_max(optarg, defaults) < 0)
+            {
+                fprintf(stderr, "Invalid --cpu-max: %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case OPT_MEM_HIGH:
+            if (parse_size(optarg, &defaults->mem_high) < 0)
+            {
+                fprintf(stderr, "Invalid --mem-high: %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case OPT_IO_WEIGHT:
+            defaults->io_weight = atoi(optarg);
+            if (defaults->io_weight < 1 || defaults->io_weight > 10000)
+            {
+                fprintf(stderr, "Invalid --io-weight: %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case OPT_SNAPSHOT_THREADS:
+            snap_threads = atoi(optarg);
+            if (snap_threads < 1 || snap_threads > SNAP_MAX_THREADS)
+            {
+                fprintf(stderr, "Invalid --snapshot-threads: %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case OPT_CHUNK_STORE:
+            snprintf(chunk_store_dir, sizeof(chunk_store_dir), "%s", optarg);
+            break;
+
+        case OPT_BENCH_SNAPSHOT:
+            if (parse_size(optarg, &bench_snap_size) < 0 || bench_snap_size < HIB_PAGE_SIZE)
+            {
+                fprintf(stderr, "Invalid --bench-snapshot: %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case OPT_MEM:
+        {
+            uint64_t size;
+            if (parse_size(optarg, &size) < 0 || size < GUEST_MEM_SIZE ||
+                size > GUEST_MEM_MAX || size % GUEST_MEM_SIZE != 0)
+            {
+                fprintf(stderr, "Invalid --mem: %s (whole megabytes, 1M..64G)\n", optarg);
+                return -1;
+            }
+            guest_mem_size = (size_t)size;
+            break;
+        }
+
+        case OPT_PREFAULT:
+            if (parse_prefault(optarg, defaults) < 0)
+            {
+                fprintf(stderr, "Invalid --prefault: %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case OPT_ZYGOTE:
+            use_zygote = true;
+            break;
+
+        case OPT_BENCH_SPAWN:
+            *bench_spawns = atoi(optarg);
+            if (*bench_spawns < 1)
+            {
+                fprintf(stderr, "Invalid --bench-spawn: %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case OPT_BACKEND:
+            if (strcmp(optarg, "hvf") == 0)
+            {
+                defaults->backend = VM_BACKEND_HVF;
+            }
+            else if (strcmp(optarg, "sw") == 0)
+            {
+                defaults->backend = VM_BACKEND_SW;
+            }
+            else
+            {
+                fprintf(stderr, "Invalid --backend: %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case OPT_TCACHE:
+            if (strlen(optarg) >= sizeof(defaults->tcache_path))
+            {
+                fprintf(stderr, "--tcache path too long\n");
+                return -1;
+            }
+            strcpy(defaults->tcache_path, optarg);
+            break;
+
+        case OPT_PROFILE:
+            if (strlen(optarg) >= sizeof(defaults->profile_path))
+            {
+                fprintf(stderr, "--profile path too long\n");
+                return -1;
+            }
+            strcpy(defaults->profile_path, optarg);
+            break;
+
+        case OPT_WSS:
+            if (strlen(optarg) >= sizeof(defaults->wss_path))
+            {
+                fprintf(stderr, "--wss path too long\n");
+                return -1;
+            }
+            strcpy(defaults->wss_path, optarg);
+            break;
+
+        case OPT_GUEST:
+            guest_image = NULL;
+            for (size_t i = 0; i < sizeof(guest_images) / sizeof(guest_images[0]); i++)
+            {
+                if (strcmp(optarg, guest_images[i].name) == 0)
+                    guest_image = &guest_images[i];
+            }
+            if (guest_image == NULL)
+            {
+                fprintf(stderr, "Invalid --guest: %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case OPT_VCPUS:
+            defaults->vcpus = atoi(optarg);
+            if (defaults->vcpus < 1 || defaults->vcpus > VM_MAX_VCPUS)
+            {
+                fprintf(stderr, "Invalid --vcpus: %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case OPT_BATCH:
+            *batch_vms = atoi(optarg);
+            if (*batch_vms < 1 || *batch_vms > BATCH_MAX_VMS)
+            {
+                fprintf(stderr, "Invalid --batch: %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case OPT_ICOUNT:
+        {
+            int mips = atoi(optarg);
+            if (mips < 1 || mips > 1000000)
+            {
+                fprintf(stderr, "Invalid --icount: %s\n", optarg);
+                return -1;
+            }
+            defaults->icount_mips = (uint32_t)mips;
+            break;
+        }
+
+        case OPT_FUZZ:
+            *fuzz_execs = atoi(optarg);
+            if (*fuzz_execs < 1)
+            {
+                fprintf(stderr, "Invalid --fuzz: %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case OPT_FUZZ_BLIND:
+            *fuzz_coverage = false;
+            break;
+
+        case OPT_HIBERNATE:
+        {
+            int ms = atoi(optarg);
+            if (ms < 1)
+            {
+                fprintf(stderr, "Invalid --hibernate: %s\n", optarg);
+                return -1;
+            }
+            defaults->hibernate_idle_ms = (uint32_t)ms;
+            break;
+        }
+
+        case OPT_POSTCOPY:
+        {
+            int ms = atoi(optarg);
+            if (ms < 1)
+            {
+                fprintf(stderr, "Invalid --postcopy: %s\n", optarg);
+                return -1;
+            }
+            defaults->postcopy_ms = (uint32_t)ms;
+            break;
+        }
+
+        case OPT_PRECOPY:
+        {
+            int rounds = atoi(optarg);
+            if (rounds < 1)
+            {
+                fprintf(stderr, "Invalid --precopy: %s\n", optarg);
+                return -1;
+            }
+            defaults->precopy_rounds = (uint32_t)rounds;
+            break;
+        }
+
+        case OPT_XFER:
+            if (strcmp(optarg, "raw") == 0)
+            {
+                xfer_mode = XFER_MODE_RAW;
+            }
+            else if (strcmp(optarg, "delta") == 0)
+            {
+                xfer_mode = XFER_MODE_DELTA;
+            }
+            else if (strcmp(optarg, "lz4") == 0)
+            {
+                xfer_mode = XFER_MODE_LZ4;
+            }
+            else
+            {
+                fprintf(stderr, "Invalid --xfer: %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case OPT_UPGRADE:
+        {
+            int ms = atoi(optarg);
+            if (ms < 1)
+            {
+                fprintf(stderr, "Invalid --upgrade: %s\n", optarg);
+                return -1;
+            }
+            defaults->upgrade_ms = (uint32_t)ms;
+            break;
+        }
+
+        case OPT_UPGRADE_BINARY:
+            up_binary = optarg;
+            break;
+
+        /* Passed to the new VMM by up_spawn(): the VM it takes over, and
+         * the socket of the upgrade after it (-1 = none) */
+        case OPT_UPGRADE_FROM:
+            if (sscanf(optarg, "%d,%d,%d", &defaults->id, &defaults->migrate_fd,
+                       &defaults->up_next_fd) != 3 ||
+                defaults->id < 1 || defaults->id > MAX_VMS || defaults->migrate_fd < 0 ||
+                defaults->up_next_fd < -1)
+            {
+                fprintf(stderr, "Invalid --upgrade-from: %s\n", optarg);
+                return -1;
+            }
+            defaults->incoming = true;
+            break;
+
+        case OPT_SCHED:
+            if (parse_sched(optarg) < 0)
+            {
+                fprintf(stderr, "Invalid --sched: %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case OPT_SCHED_CPUS:
+            sched_cpus = atoi(optarg);
+            if (sched_cpus < 1 || sched_cpus > MAX_VMS)
+            {
+                fprintf(stderr, "Invalid --sched-cpus: %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case OPT_BENCH_SCHED:
+        {
+            int ms = atoi(optarg);
+            if (ms < 1)
+            {
+                fprintf(stderr, "Invalid --bench-sched: %s\n", optarg);
+                return -1;
+            }
+            bench_sched_ms = (uint32_t)ms;
+            break;
+        }
+
+        case OPT_PCPUS:
+            defaults->pcpus = atoi(optarg);
+            if (defaults->pcpus < 1 || defaults->pcpus > VM_MAX_VCPUS)
+            {
+                fprintf(stderr, "Invalid --pcpus: %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case OPT_PVLOCK:
+            defaults->pvlock = true;
+            break;
+
+        case OPT_BENCH_PVLOCK:
+            bench_pvlock_vcpus = atoi(optarg);
+            if (bench_pvlock_vcpus < 2 || bench_pvlock_vcpus > VM_MAX_VCPUS)
+            {
+                fprintf(stderr, "Invalid --bench-pvlock: %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case OPT_MEM_PRESSURE:
+        {
+            const char *comma = strchr(optarg, ',');
+            size_t len = comma != NULL ? (size_t)(comma - optarg) : strlen(optarg);
+
+            if (len == 7 && strncmp(optarg, "reclaim", len) == 0)
+            {
+                mp_policy = MP_POLICY_RECLAIM;
+            }
+            else if (len == 9 && strncmp(optarg, "hibernate", len) == 0)
+            {
+                mp_policy = MP_POLICY_HIBERNATE;
+            }
+            else
+            {
+                fprintf(stderr, "Invalid --mem-pressure: %s\n", optarg);
+                return -1;
+            }
+            if (comma != NULL)
+            {
+                int ms = atoi(comma + 1);
+                if (ms < 1)
+                {
+                    fprintf(stderr, "Invalid --mem-pressure: %s\n", optarg);
+                    return -1;
+                }
+                mp_interval_ms = (uint32_t)ms;
+            }
+            break;
+        }
+
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    /* Hypervisor.framework vCPUs are bound to their thread, only the
+     * software backend runs secondary vCPUs */
+    if (defaults->vcpus > 1 && defaults->backend != VM_BACKEND_SW)
+    {
+        fprintf(stderr, "--vcpus > 1 requires --backend=sw\n");
+        return -1;
+    }
+    if (defaults->icount_mips != 0 && defaults->backend != VM_BACKEND_SW)
+    {
+        fprintf(stderr, "--icount requires --backend=sw\n");
+        return -1;
+    }
+    if (defaults->hibernate_idle_ms != 0 &&
+        (defaults->backend != VM_BACKEND_SW || defaults->vcpus != 1))
+    {
+        fprintf(stderr, "--hibernate requires --backend=sw and one vCPU\n");
+        return -1;
+    }
+    if (defaults->wss_path[0] != '\0' && defaults->backend != VM_BACKEND_SW)
+    {
+        fprintf(stderr, "--wss requires --backend=sw\n");
+        return -1;
+    }
+    if (mp_policy == MP_POLICY_HIBERNATE &&
+        (defaults->backend != VM_BACKEND_SW || defaults->vcpus != 1))
+    {
+        fprintf(stderr, "--mem-pressure=hibernate requires --backend=sw and one vCPU\n");
+        return -1;
+    }
+    if (chunk_store_dir[0] != '\0' && defaults->hibernate_idle_ms == 0 &&
+        mp_policy != MP_POLICY_HIBERNATE)
+    {
+        fprintf(stderr, "--chunk-store requires --hibernate or --mem-pressure=hibernate\n");
+        return -1;
+    }
+    if (defaults->postcopy_ms != 0 &&
+        (defaults->backend != VM_BACKEND_SW || defaults->vcpus != 1))
+    {
+        fprintf(stderr, "--postcopy requires --backend=sw and one vCPU\n");
+        return -1;
+    }
+    if (defaults->postcopy_ms != 0 &&
+        (use_zygote || defaults->hibernate_idle_ms != 0 || mp_policy == MP_POLICY_HIBERNATE))
+    {
+        fprintf(stderr, "--postcopy is not supported with --zygote or hibernation\n");
+        return -1;
+    }
+    if (defaults->precopy_rounds != 0 && defaults->postcopy_ms == 0)
+    {
+        fprintf(stderr, "--precopy requires --postcopy\n");
+        return -1;
+    }
+    if (defaults->upgrade_ms != 0 &&
+        (defaults->backend != VM_BACKEND_SW || defaults->vcpus != 1))
+    {
+        fprintf(stderr, "--upgrade requires --backend=sw and one vCPU\n");
+        return -1;
+    }
+    if (defaults->upgrade_ms != 0 &&
+        (use_zygote || defaults->hibernate_idle_ms != 0 || mp_policy != MP_POLICY_OFF ||
+         defaults->postcopy_ms != 0))
+    {
+        fprintf(stderr, "--upgrade is not supported with --zygote, --mem-pressure, "
+                "hibernation or --postcopy\n");
+        return -1;
+    }
+    if ((up_binary != NULL || defaults->incoming) && defaults->upgrade_ms == 0)
+    {
+        fprintf(stderr, "--upgrade-binary and --upgrade-from require --upgrade\n");
+        return -1;
+    }
+    if ((n_sched_specs > 0 || bench_sched_ms != 0) &&
+        (defaults->backend != VM_BACKEND_SW || defaults->vcpus != 1))
+    {
+        fprintf(stderr, "--sched and --bench-sched require --backend=sw and one vCPU\n");
+        return -1;
+    }
+    if (n_sched_specs > 0 && defaults->upgrade_ms != 0)
+    {
+        fprintf(stderr, "--sched is not supported with --upgrade\n");
+        return -1;
+    }
+    if ((defaults->pcpus != 0 || bench_pvlock_vcpus != 0) &&
+        defaults->backend != VM_BACKEND_SW)
+    {
+        fprintf(stderr, "--pcpus and --bench-pvlock require --backend=sw\n");
+        return -1;
+    }
+    if (sched_cpus != 1 && n_sched_specs == 0)
+    {
+        fprintf(stderr, "--sched-cpus requires --sched\n");
+        return -1;
+    }
+    if (guest_mem_size != GUEST_MEM_SIZE && (*batch_vms > 0 || *fuzz_execs > 0))
+    {
+        fprintf(stderr, "--mem is not supported with --batch or --fuzz\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* ============================================================================
+ * Main Entry Point
+ * ============================================================================ */
+
+int main(int argc, char **argv)
+{
+    vm_config_t defaults = {
+        .cpu_max_period_us = CPU_MAX_PERIOD_DEFAULT_US,
+        .io_weight = IO_WEIGHT_DEFAULT,
+        .backend = VM_BACKEND_HVF,
+        .vcpus = 1,
+        .bench_slot = -1,
+        .migrate_fd = -1,
+        .migrate_peer_fd = -1,
+        .up_next_fd = -1,
+    };
+    vm_config_t configs[MAX_VMS];
+    vm_metrics_t metrics[MAX_VMS] = {0};
+    pid_t pids[MAX_VMS];
+    pid_t dest_pids[MAX_VMS]; /* Post-copy destinations or new VMMs, -1 = none */
+    uint64_t up_due_ns[MAX_VMS]; /* Next --upgrade, UINT64_MAX = none due */
+    int status[MAX_VMS];
+    bool done[MAX_VMS] = {false};
+    bool hibernated[MAX_VMS] = {false};
+    uint64_t wake_ns[MAX_VMS];
+    mp_state_t mp = {0};
+    int bench_spawns = 0;
+    int batch_vms = 0;
+    int fuzz_execs = 0;
+    bool fuzz_coverage = true;
+
+    /* A new VMM for --upgrade gets the same arguments */
+    up_argc = argc;
+    up_argv = malloc(((size_t)argc + 1) * sizeof(*up_argv));
+    if (up_argv == NULL)
+    {
+        perror("malloc");
+        return 1;
+    }
+    memcpy(up_argv, argv, ((size_t)argc + 1) * sizeof(*up_argv));
+    for (int i = 0; i < MAX_VMS; i++)
+    {
+        up_fds[i] = -1;
+    }
+
+    if (parse_args(argc, argv, &defaults, &bench_spawns, &batch_vms, &fuzz_execs,
+                   &fuzz_coverage) < 0)
+    {
+        return 1;
+    }
+    if (up_binary == NULL)
+    {
+        up_binary = up_argv[0];
+    }
+
+    /* Started by up_spawn(): this is the new VMM of one VM */
+    if (defaults.incoming)
+    {
+        defaults.spawn_start_ns = now_ns();
+        return run_single_vm(&defaults);
+    }
+
+    if (fuzz_execs > 0)
+    {
+        return fuzz_mode(fuzz_execs, fuzz_coverage);
+    }
+
+    if (batch_vms > 0)
+    {
+        return batch_mode(batch_vms);
+    }
+
+    if (bench_spawns > 0)
+    {
+        return bench_spawn(&defaults, bench_spawns);
+    }
+
+    if (bench_snap_size > 0)
+    {
+        return bench_snapshot(bench_snap_size);
+    }
+
+    if (bench_sched_ms > 0)
+    {
+        return bench_sched(&defaults, bench_sched_ms);
+    }
+
+    if (bench_pvlock_vcpus > 0)
+    {
+        return bench_pvlock(&defaults);
+    }
+
+    printf("╔════════════════════════════════════════╗\n");
+    printf("║   TinyVMM - macOS Hypervisor Demo      ║\n");
+    printf("║   Running 2 VMs in parallel            ║\n");
+    printf("╚════════════════════════════════════════╝\n\n");
+    fflush(stdout);
+
+    /* The pressure controller's requests, SIGUSR2 only kicks the VM
+     * (ignored until it has one, see mp_start) */
+    if (mp_policy != MP_POLICY_OFF)
+    {
+        mp_shared = mmap(NULL, MAX_VMS * sizeof(*mp_shared), PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mp_shared == MAP_FAILED)
+        {
+            perror("mmap");
+            return 1;
+        }
+        signal(SIGUSR2, SIG_IGN);
+    }
+
+    /* The fair-share scheduler's table (see "Fair-Share Scheduling") */
+    if (n_sched_specs > 0 && sched_map() < 0)
+    {
+        return 1;
+    }
+
+    if (use_zygote && zygote_start() < 0)
+    {
+        return 1;
+    }
+
+    /* SIGUSR1 is the control plane's "wake up" (see "Hibernation") */
+    bool can_hibernate = defaults.hibernate_idle_ms != 0 || mp_policy == MP_POLICY_HIBERNATE;
+    if (can_hibernate)
+    {
+        signal(SIGUSR1, hib_on_sigusr1);
+    }
+
+    /* SIGHUP is "upgrade now" (see "Live Upgrade") */
+    if (defaults.upgrade_ms != 0)
+    {
+        signal(SIGHUP, up_on_sighup);
+    }
+
+    /*
+     * Start one child process per VM.
+     * Apple's Hypervisor.framework allows one VM per process,
+     * so we use separate processes for true isolation.
+     */
+    for (int i = 0; i < MAX_VMS; i++)
+    {
+        configs[i] = defaults;
+        configs[i].id = i + 1;
+        if (n_sched_specs > 0)
+        {
+            int spec = i < n_sched_specs ? i : n_sched_specs - 1;
+            configs[i].sched_class = sched_classes[spec];
+            configs[i].sched_weight = sched_weights[spec];
+        }
+        if (can_hibernate)
+        {
+            const char *tmpdir = getenv("TMPDIR");
+            snprintf(configs[i].hib_path, sizeof(configs[i].hib_path),
+                     "%s/tinyvmm-%d-vm%d.hib", tmpdir != NULL ? tmpdir : "/tmp",
+                     (int)getpid(), configs[i].id);
+        }
+
+        /* With --postcopy a second process waits to take the VM over */
+        dest_pids[i] = -1;
+        up_due_ns[i] = UINT64_MAX;
+        if (defaults.postcopy_ms != 0)
+        {
+            int sv[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+            {
+                perror("socketpair");
+                sv[0] = sv[1] = -1;
+            }
+            else
+            {
+                vm_config_t incoming = configs[i];
+                incoming.incoming = true;
+                incoming.migrate_fd = sv[1];
+                incoming.migrate_peer_fd = sv[0];
+                configs[i].migrate_fd = sv[0];
+                configs[i].migrate_peer_fd = sv[1];
+                dest_pids[i] = vm_spawn(&incoming);
+            }
+            pids[i] = dest_pids[i] >= 0 ? vm_spawn(&configs[i]) : -1;
+            close(sv[0]);
+            close(sv[1]);
+        }
+        /* With --upgrade the new VMM is started when the upgrade is due */
+        else if (defaults.upgrade_ms != 0)
+        {
+            configs[i].migrate_fd = up_prepare(i);
+            pids[i] = configs[i].migrate_fd >= 0 ? vm_spawn(&configs[i]) : -1;
+            close(configs[i].migrate_fd);
+            configs[i].migrate_fd = -1;
+            up_due_ns[i] = now_ns() + (uint64_t)defaults.upgrade_ms * 1000000ull;
+        }
+        else
+        {
+            pids[i] = vm_spawn(&configs[i]);
+        }
+        if (pids[i] < 0)
+        {
+            /* Kill the children we already started */
+            uint64_t cpu_usec;
+            for (int j = 0; j < i; j++)
+            {
+                kill(pids[j], SIGTERM);
+                vm_reap(pids[j], &status[j], &cpu_usec, true);
+            }
+            for (int j = 0; j <= i; j++)
+            {
+                if (dest_pids[j] > 0)
+                {
+                    kill(dest_pids[j], SIGTERM);
+                    vm_reap(dest_pids[j], &status[j], &cpu_usec, true);
+                }
+            }
+            zygote_stop();
+            return 1;
+        }
     }
 
     /* Parent process: Wait for both VMs to complete */
-    printf("[Parent] Started VM 1 (PID %d) and VM 2 (PID %d)\n", pid1, pid2);
+    printf("[Parent] Started VM 1 (PID %d) and VM 2 (PID %d)%s\n",
+           pids[0], pids[1], use_zygote ? " via zygote" : "");
     printf("[Parent] Waiting for VMs to complete...\n\n");
 
-    waitpid(pid1, &status1, 0);
-    waitpid(pid2, &status2, 0);
+    /* Sample per-VM usage until every child has been reaped, waking
+     * hibernated VMs when they are due */
+    for (int remaining = MAX_VMS; remaining > 0;)
+    {
+        bool wake_all = hib_wake_requested != 0;
+        bool upgrade_all = up_requested != 0;
+        bool wake[MAX_VMS] = {false};
+        uint64_t next = now_ns() + METRICS_SAMPLE_US * 1000ull;
+
+        hib_wake_requested = 0;
+        up_requested = 0;
+        if (mp_policy != MP_POLICY_OFF)
+        {
+            bool running[MAX_VMS];
+            for (int i = 0; i < MAX_VMS; i++)
+            {
+                running[i] = !done[i] && !hibernated[i];
+            }
+            mp_control(&mp, pids, running, metrics, wake);
+        }
+
+        for (int i = 0; i < MAX_VMS; i++)
+        {
+            uint64_t cpu_usec;
+            int ret;
+
+            if (done[i])
+            {
+                continue;
+            }
+
+            if (hibernated[i])
+            {
+                uint64_t now = now_ns();
+                bool timer = now >= wake_ns[i] && mp.level != MP_LEVEL_CRITICAL;
+                if (!wake_all && !wake[i] && !timer)
+                {
+                    if (wake_ns[i] > now && wake_ns[i] < next)
+                    {
+                        next = wake_ns[i];
+                    }
+                    continue;
+                }
+                printf("[Parent] Waking VM %d (%s)\n", configs[i].id,
+                       wake_all ? "SIGUSR1" : wake[i] ? "memory pressure over" : "timer");
+                configs[i].resume = true;
+                configs[i].wake_event_ns = timer ? wake_ns[i] : now;
+                hibernated[i] = false;
+                pids[i] = vm_spawn(&configs[i]);
+                if (pids[i] < 0)
+                {
+                    status[i] = 1 << 8;
+                    done[i] = true;
+                    remaining--;
+                    continue;
+                }
+            }
+
+            metrics_sample(pids[i], &metrics[i]);
+
+            ret = vm_reap(pids[i], &status[i], &cpu_usec, false);
+            if (ret != 0)
+            {
+                sched_release(i, pids[i]);
+                if (ret < 0)
+                {
+                    status[i] = 1 << 8; /* Treat as a failed VM */
+                }
+                else
+                {
+                    /* Exact final CPU time from the kernel */
+                    metrics[i].cpu_usec = cpu_usec;
+                }
+
+                if (ret > 0 && WIFEXITED(status[i]) &&
+                    WEXITSTATUS(status[i]) == VM_EXIT_HIBERNATED &&
+                    hib_wake_time(&configs[i], &wake_ns[i]) == 0)
+                {
+                    metrics[i].cpu_usec_hibernated += cpu_usec;
+                    metrics[i].cpu_usec = 0;
+                    metrics[i].hibernations++;
+                    hibernated[i] = true;
+                    if (wake_ns[i] == UINT64_MAX)
+                    {
+                        printf("[Parent] VM %d hibernated, wakes on SIGUSR1 to PID %d\n",
+                               configs[i].id, (int)getpid());
+                    }
+                    else
+                    {
+                        printf("[Parent] VM %d hibernated, wakes in %llu ms or on SIGUSR1\n",
+                               configs[i].id,
+                               wake_ns[i] > now_ns() ? (wake_ns[i] - now_ns()) / 1000000 : 0);
+                        next = wake_ns[i] < next ? wake_ns[i] : next;
+                    }
+                    continue;
+                }
+
+                /* Migrated or upgraded: follow the VM to its new process */
+                if (ret > 0 && WIFEXITED(status[i]) &&
+                    (WEXITSTATUS(status[i]) == VM_EXIT_MIGRATED ||
+                     WEXITSTATUS(status[i]) == VM_EXIT_UPGRADED) &&
+                    dest_pids[i] > 0)
+                {
+                    bool upgraded = WEXITSTATUS(status[i]) == VM_EXIT_UPGRADED;
+                    printf("[Parent] VM %d %s from PID %d to PID %d\n", configs[i].id,
+                           upgraded ? "upgraded" : "migrated", (int)pids[i],
+                           (int)dest_pids[i]);
+                    metrics[i].cpu_usec_hibernated += cpu_usec;
+                    metrics[i].cpu_usec = 0;
+                    if (upgraded)
+                    {
+                        metrics[i].upgrades++;
+                        up_due_ns[i] = now_ns() + (uint64_t)defaults.upgrade_ms * 1000000ull;
+                    }
+                    else
+                    {
+                        metrics[i].migrations++;
+                    }
+                    pids[i] = dest_pids[i];
+                    dest_pids[i] = -1;
+                    continue;
+                }
+
+                /* Finished before migrating or upgrading: the destination
+                 * sees the socket close and gives up */
+                if (dest_pids[i] > 0)
+                {
+                    int dest_status;
+                    vm_reap(dest_pids[i], &dest_status, &cpu_usec, true);
+                    dest_pids[i] = -1;
+                }
+                if (up_fds[i] >= 0)
+                {
+                    close(up_fds[i]);
+                    up_fds[i] = -1;
+                }
+                done[i] = true;
+                remaining--;
+                continue;
+            }
+
+            /* Upgrade due: the running VMM hands over once the new one is
+             * ready. Only after the reap, so a VMM whose guest has just
+             * finished is not sent a successor. */
+            if (up_fds[i] >= 0 && dest_pids[i] < 0 &&
+                (upgrade_all || now_ns() >= up_due_ns[i]))
+            {
+                printf("[Parent] Upgrading VM %d (%s)\n", configs[i].id,
+                       upgrade_all ? "SIGHUP" : "timer");
+                dest_pids[i] = up_request(&configs[i], i);
+                up_due_ns[i] = UINT64_MAX;
+            }
+            else if (up_due_ns[i] < next)
+            {
+                next = up_due_ns[i];
+            }
+        }
+
+        /* A SIGUSR1 cuts the sleep short */
+        uint64_t now = now_ns();
+        if (remaining > 0 && next > now)
+        {
+            usleep((useconds_t)((next - now) / 1000));
+        }
+    }
+
+    zygote_stop();
+
+    for (int i = 0; mp_shared != NULL && i < MAX_VMS; i++)
+    {
+        metrics[i].mp_reclaimed = atomic_load(&mp_shared[i].reclaimed);
+    }
+
+    /* Snapshots left by a VM that failed to wake */
+    for (int i = 0; i < MAX_VMS; i++)
+    {
+        if (configs[i].hib_path[0] != '\0')
+        {
+            hib_discard(&configs[i]);
+        }
+    }
+    if (chunk_store_dir[0] != '\0')
+    {
+        snap_store_t *store = snap_store_open(chunk_store_dir);
+        uint64_t chunks, bytes;
+        if (store != NULL && snap_store_usage(store, &chunks, &bytes) == 0)
+        {
+            printf("[Parent] Chunk store %s: %llu chunks, %llu KB\n",
+                   chunk_store_dir, chunks, bytes / 1024);
+        }
+        snap_store_close(store);
+    }
 
     printf("\n[Parent] Both VMs finished.\n");
+    if (mp_policy != MP_POLICY_OFF)
+    {
+        mp_print(&mp);
+    }
+
+    bool ok = true;
+    for (int i = 0; i < MAX_VMS; i++)
+    {
+        metrics_print(configs[i].id, &metrics[i]);
+        if (!WIFEXITED(status[i]) || WEXITSTATUS(status[i]) != 0)
+        {
+            ok = false;
+        }
+    }
 
     /* Return success only if both VMs succeeded */
-    if (WIFEXITED(status1) && WEXITSTATUS(status1) == 0 &&
-        WIFEXITED(status2) && WEXITSTATUS(status2) == 0)
+    if (ok)
     {
         printf("[Parent] All VMs completed successfully!\n");
         return 0;
@@ -0,0 +1,710 @@
+/*
+ * snapshot.c - Guest memory snapshots
+ *
+ * See snapshot.h for the file format.
+ */
+
+#include "snapshot.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <compression.h>
+#include <CommonCrypto/CommonDigest.h>
+
+/* LZ4: fast enough on both ends to keep up with an SSD per thread */
+#define SNAP_ALGORITHM COMPRESSION_LZ4
+
+#define SNAP_CHUNK_BYTES ((size_t)SNAP_CHUNK_PAGES * SNAP_PAGE_SIZE)
+
+struct snap_store
+{
+    char *dir;
+};
+
+/* ============================================================================
+ * Hashing
+ * ============================================================================ */
+
+/*
+ * SHA-256: chunks from different VMs meet in the store, so a guest must not
+ * be able to pick contents whose hash matches another guest's chunk.
+ * CommonCrypto uses the CPU's SHA instructions where there are any.
+ */
+snap_hash_t snap_hash(const void *data, size_t len)
+{
+    snap_hash_t h;
+
+    CC_SHA256(data, (CC_LONG)len, h.bytes);
+    return h;
+}
+
+static bool hash_equal(const snap_hash_t *a, const snap_hash_t *b)
+{
+    return memcmp(a->bytes, b->bytes, sizeof(a->bytes)) == 0;
+}
+
+/* ============================================================================
+ * Thread Pool
+ * ============================================================================ */
+
+typedef struct
+{
+    int fd;
+    uint64_t off;              /* Of the snap_header_t */
+    uint8_t *mem;
+    uint64_t mem_size;
+    const uint32_t *pages;
+    uint32_t n_pages;
+    snap_chunk_t *chunks;
+    uint32_t n_chunks;
+    snap_store_t *store;       /* Chunk store, or NULL */
+    atomic_uint next;          /* Next chunk to take */
+    atomic_uint_fast64_t end;  /* Next free offset for chunk data (save) */
+    atomic_uint_fast64_t stored;
+    atomic_uint_fast64_t shared;
+    atomic_bool failed;
+} snap_job_t;
+
+static uint64_t snap_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+int snap_default_threads(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n < 1)
+        return 1;
+    return n < SNAP_MAX_THREADS ? (int)n : SNAP_MAX_THREADS;
+}
+
+/* Run `worker` on `threads` threads, this one included */
+static void snap_run(snap_job_t *job, int threads, void *(*worker)(void *))
+{
+    pthread_t tids[SNAP_MAX_THREADS];
+    int started = 0;
+
+    for (int i = 1; i < threads; i++)
+    {
+        if (pthread_create(&tids[started], NULL, worker, job) != 0)
+            break;
+        started++;
+    }
+    worker(job);
+    for (int i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+}
+
+static int write_full(int fd, const void *buf, size_t len, uint64_t off)
+{
+    const uint8_t *p = buf;
+
+    while (len > 0)
+    {
+        ssize_t n = pwrite(fd, p, len, (off_t)off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= (size_t)n;
+        off += (uint64_t)n;
+    }
+    return 0;
+}
+
+static int read_full(int fd, void *buf, size_t len, uint64_t off)
+{
+    uint8_t *p = buf;
+
+    while (len > 0)
+    {
+        ssize_t n = pread(fd, p, len, (off_t)off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= (size_t)n;
+        off += (uint64_t)n;
+    }
+    return 0;
+}
+
+/* Per-thread buffers: one chunk of pages, its compressed form, scratch */
+typedef struct
+{
+    uint8_t *raw;
+    uint8_t *packed;
+    void *scratch;
+} snap_buffers_t;
+
+static int buffers_alloc(snap_buffers_t *b, bool encode)
+{
+    size_t scratch = encode ? compression_encode_scratch_buffer_size(SNAP_ALGORITHM)
+                            : compression_decode_scratch_buffer_size(SNAP_ALGORITHM);
+
+    b->raw = malloc(SNAP_CHUNK_BYTES);
+    b->packed = malloc(SNAP_CHUNK_BYTES);
+    b->scratch = scratch != 0 ? malloc(scratch) : NULL;
+    if (b->raw == NULL || b->packed == NULL || (scratch != 0 && b->scratch == NULL))
+        return -1;
+    return 0;
+}
+
+static void buffers_free(snap_buffers_t *b)
+{
+    free(b->raw);
+    free(b->packed);
+    free(b->scratch);
+}
+
+/* ============================================================================
+ * Chunk Store
+ * ============================================================================ */
+
+/* <dir>/<2 hex digits>/<62 hex digits>, sets *slash to the second '/' */
+static void object_path(const snap_store_t *store, snap_hash_t hash, char *path,
+                        size_t size, size_t *slash)
+{
+    char hex[2 * sizeof(hash.bytes) + 1];
+
+    for (size_t i = 0; i < sizeof(hash.bytes); i++)
+        snprintf(hex + 2 * i, 3, "%02x", hash.bytes[i]);
+    snprintf(path, size, "%s/%.2s/%s", store->dir, hex, hex + 2);
+    if (slash != NULL)
+        *slash = strlen(store->dir) + 3;
+}
+
+/*
+ * Add `delta` to the reference count of a chunk. Returns the new count,
+ * or -1 if the chunk is not in the store (or was deleted meanwhile). At
+ * zero the chunk is deleted while its lock is still held, so anyone who
+ * opened it before then finds it unlinked and starts over.
+ */
+static int object_adjust(snap_store_t *store, snap_hash_t hash, int delta, snap_object_t *obj)
+{
+    char path[1024];
+    struct stat st;
+    int fd, refs = -1;
+
+    object_path(store, hash, path, sizeof(path), NULL);
+    fd = open(path, O_RDWR);
+    if (fd < 0)
+        return -1;
+
+    if (flock(fd, LOCK_EX) == 0 && fstat(fd, &st) == 0 && st.st_nlink > 0 &&
+        read_full(fd, obj, sizeof(*obj), 0) == 0 &&
+        memcmp(obj->magic, SNAP_OBJECT_MAGIC, sizeof(obj->magic)) == 0 &&
+        hash_equal(&obj->hash, &hash) &&
+        (delta > 0 || obj->refs > 0))
+    {
+        obj->refs += (uint32_t)delta;
+        if (obj->refs == 0)
+        {
+            unlink(path);
+            refs = 0;
+        }
+        else if (write_full(fd, &obj->refs, sizeof(obj->refs),
+                            offsetof(snap_object_t, refs)) == 0)
+        {
+            refs = (int)obj->refs;
+        }
+    }
+    close(fd);
+    return refs;
+}
+
+/*
+ * Add a chunk with one reference. Written under a temporary name and
+ * linked into place, so readers never see a partial chunk; if another
+ * writer got there first, its chunk gets the reference instead.
+ */
+static int object_put(snap_store_t *store, snap_hash_t hash, const uint8_t *data,
+                      uint32_t stored_size, uint32_t raw_size)
+{
+    snap_object_t obj = {0};
+    char path[1024], tmp[1040];
+    size_t slash;
+    int fd, ret = -1;
+
+    memcpy(obj.magic, SNAP_OBJECT_MAGIC, sizeof(obj.magic));
+    obj.refs = 1;
+    obj.stored_size = stored_size;
+    obj.raw_size = raw_size;
+    obj.hash = hash;
+
+    object_path(store, hash, path, sizeof(path), &slash);
+    path[slash] = '\0';
+    if (mkdir(path, 0700) < 0 && errno != EEXIST)
+        return -1;
+    path[slash] = '/';
+
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    fd = mkstemp(tmp);
+    if (fd < 0)
+        return -1;
+    if (write_full(fd, &obj, sizeof(obj), 0) < 0 ||
+        write_full(fd, data, stored_size, sizeof(obj)) < 0)
+    {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    close(fd);
+
+    /* A chunk that is deleted between link() and the lock is tried again */
+    for (int tries = 0; ret < 0 && tries < 8; tries++)
+    {
+        if (link(tmp, path) == 0)
+            ret = 0;
+        else if (errno != EEXIST)
+            break;
+        else if (object_adjust(store, hash, 1, &obj) > 0)
+            ret = 0;
+    }
+    unlink(tmp);
+    return ret;
+}
+
+snap_store_t *snap_store_open(const char *dir)
+{
+    struct stat st;
+    snap_store_t *store;
+
+    if ((mkdir(dir, 0700) < 0 && errno != EEXIST) || stat(dir, &st) < 0 ||
+        !S_ISDIR(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & 022) != 0)
+    {
+        return NULL;
+    }
+    store = calloc(1, sizeof(*store));
+    if (store == NULL || (store->dir = strdup(dir)) == NULL)
+    {
+        free(store);
+        return NULL;
+    }
+    return store;
+}
+
+void snap_store_close(snap_store_t *store)
+{
+    if (store == NULL)
+        return;
+    free(store->dir);
+    free(store);
+}
+
+int snap_store_usage(snap_store_t *store, uint64_t *n_chunks, uint64_t *bytes)
+{
+    DIR *top = opendir(store->dir);
+    struct dirent *d;
+
+    *n_chunks = 0;
+    *bytes = 0;
+    if (top == NULL)
+        return -1;
+
+    while ((d = readdir(top)) != NULL)
+    {
+        char sub[1024];
+        DIR *dir;
+        struct dirent *e;
+
+        if (strlen(d->d_name) != 2 || d->d_name[0] == '.')
+            continue;
+        snprintf(sub, sizeof(sub), "%s/%s", store->dir, d->d_name);
+        dir = opendir(sub);
+        while (dir != NULL && (e = readdir(dir)) != NULL)
+        {
+            char path[2048];
+            struct stat st;
+
+            /* Temporary files have a '.' in their name */
+            if (strchr(e->d_name, '.') != NULL)
+                continue;
+            snprintf(path, sizeof(path), "%s/%s", sub, e->d_name);
+            if (stat(path, &st) == 0)
+            {
+                (*n_chunks)++;
+                *bytes += (uint64_t)st.st_size;
+            }
+        }
+        if (dir != NULL)
+            closedir(dir);
+    }
+    closedir(top);
+    return 0;
+}
+
+/* ============================================================================
+ * Save
+ * ============================================================================ */
+
+static void *save_worker(void *arg)
+{
+    snap_job_t *job = arg;
+    snap_buffers_t buf;
+
+    if (buffers_alloc(&buf, true) < 0)
+    {
+        atomic_store(&job->failed, true);
+        buffers_free(&buf);
+        return NULL;
+    }
+
+    for (;;)
+    {
+        uint32_t i = atomic_fetch_add(&job->next, 1);
+        if (i >= job->n_chunks || atomic_load(&job->failed))
+            break;
+
+        uint32_t first = i * SNAP_CHUNK_PAGES;
+        uint32_t n = job->n_pages - first < SNAP_CHUNK_PAGES ? job->n_pages - first
+                                                              : SNAP_CHUNK_PAGES;
+        size_t raw_size = (size_t)n * SNAP_PAGE_SIZE;
+        snap_chunk_t *c = &job->chunks[i];
+        snap_object_t obj;
+
+        for (uint32_t j = 0; j < n; j++)
+        {
+            memcpy(buf.raw + (size_t)j * SNAP_PAGE_SIZE,
+                   job->mem + (size_t)job->pages[first + j] * SNAP_PAGE_SIZE, SNAP_PAGE_SIZE);
+        }
+        c->raw_size = (uint32_t)raw_size;
+        c->hash = snap_hash(buf.raw, raw_size);
+
+        /* Already in the store: just take a reference */
+        if (job->store != NULL && object_adjust(job->store, c->hash, 1, &obj) > 0)
+        {
+            c->stored_size = obj.stored_size;
+            c->offset = SNAP_IN_STORE;
+            atomic_fetch_add(&job->shared, raw_size);
+            continue;
+        }
+
+        /* Keep the raw bytes unless compression saves something */
+        size_t packed = compression_encode_buffer(buf.packed, raw_size - 1, buf.raw, raw_size,
+                                                  buf.scratch, SNAP_ALGORITHM);
+        const uint8_t *data = packed != 0 ? buf.packed : buf.raw;
+        size_t size = packed != 0 ? packed : raw_size;
+
+        c->stored_size = (uint32_t)size;
+        atomic_fetch_add(&job->stored, size);
+        if (job->store != NULL)
+        {
+            if (object_put(job->store, c->hash, data, (uint32_t)size, (uint32_t)raw_size) < 0)
+            {
+                atomic_store(&job->failed, true);
+                break;
+            }
+            c->offset = SNAP_IN_STORE;
+            continue;
+        }
+
+        c->offset = atomic_fetch_add(&job->end, size);
+        if (write_full(job->fd, data, size, job->off + c->offset) < 0)
+        {
+            atomic_store(&job->failed, true);
+            break;
+        }
+    }
+
+    buffers_free(&buf);
+    return NULL;
+}
+
+int snap_write(int fd, uint64_t off, const void *mem, const uint32_t *pages,
+               uint32_t n_pages, snap_store_t *store, int threads, snap_stats_t *stats)
+{
+    snap_header_t hdr = {0};
+    snap_job_t job = {0};
+    uint64_t start = snap_now_ns();
+    size_t index_size = (size_t)n_pages * sizeof(*pages);
+    size_t table_size;
+    int ret = 0;
+
+    if (threads <= 0)
+        threads = snap_default_threads();
+    if (threads > SNAP_MAX_THREADS)
+        threads = SNAP_MAX_THREADS;
+
+    memcpy(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic));
+    hdr.version = SNAP_FORMAT_VERSION;
+    hdr.chunk_pages = SNAP_CHUNK_PAGES;
+    hdr.n_pages = n_pages;
+    hdr.n_chunks = (n_pages + SNAP_CHUNK_PAGES - 1) / SNAP_CHUNK_PAGES;
+    table_size = (size_t)hdr.n_chunks * sizeof(snap_chunk_t);
+
+    job.fd = fd;
+    job.off = off;
+    job.mem = (uint8_t *)mem;
+    job.pages = pages;
+    job.n_pages = n_pages;
+    job.n_chunks = hdr.n_chunks;
+    job.store = store;
+    job.chunks = calloc(hdr.n_chunks + 1, sizeof(snap_chunk_t));
+    atomic_init(&job.end, sizeof(hdr) + index_size + table_size);
+    if (job.chunks == NULL)
+        return -1;
+
+    if (threads > (int)hdr.n_chunks)
+        threads = hdr.n_chunks > 0 ? (int)hdr.n_chunks : 1;
+    snap_run(&job, threads, save_worker);
+
+    /* The chunk table is only known once every chunk is placed */
+    hdr.end = atomic_load(&job.end);
+    if (atomic_load(&job.failed) ||
+        write_full(fd, &hdr, sizeof(hdr), off) < 0 ||
+        write_full(fd, pages, index_size, off + sizeof(hdr)) < 0 ||
+        write_full(fd, job.chunks, table_size, off + sizeof(hdr) + index_size) < 0)
+    {
+        ret = -1;
+    }
+
+    /* A snapshot that was not written holds no references */
+    for (uint32_t i = 0; ret < 0 && i < hdr.n_chunks; i++)
+    {
+        snap_object_t obj;
+        if (job.chunks[i].offset == SNAP_IN_STORE)
+            object_adjust(store, job.chunks[i].hash, -1, &obj);
+    }
+
+    if (stats != NULL)
+    {
+        stats->threads = threads;
+        stats->raw_bytes = (uint64_t)n_pages * SNAP_PAGE_SIZE;
+        stats->stored_bytes = atomic_load(&job.stored);
+        stats->shared_bytes = atomic_load(&job.shared);
+        stats->elapsed_ns = snap_now_ns() - start;
+    }
+    free(job.chunks);
+    return ret;
+}
+
+/* ============================================================================
+ * Restore
+ * ============================================================================ */
+
+static void *restore_worker(void *arg)
+{
+    snap_job_t *job = arg;
+    snap_buffers_t buf;
+
+    if (buffers_alloc(&buf, false) < 0)
+    {
+        atomic_store(&job->failed, true);
+        buffers_free(&buf);
+        return NULL;
+    }
+
+    for (;;)
+    {
+        uint32_t i = atomic_fetch_add(&job->next, 1);
+        if (i >= job->n_chunks || atomic_load(&job->failed))
+            break;
+
+        const snap_chunk_t *c = &job->chunks[i];
+        uint32_t first = i * SNAP_CHUNK_PAGES;
+        uint32_t n = job->n_pages - first < SNAP_CHUNK_PAGES ? job->n_pages - first
+                                                              : SNAP_CHUNK_PAGES;
+        bool packed = c->stored_size != c->raw_size;
+        const uint8_t *src = packed ? buf.packed : buf.raw;
+        const uint8_t *raw = buf.raw;
+        void *map = MAP_FAILED;
+        size_t map_size = 0;
+        bool ok = c->raw_size == (size_t)n * SNAP_PAGE_SIZE && c->stored_size <= c->raw_size;
+
+        if (ok && c->offset == SNAP_IN_STORE)
+        {
+            /* Chunks in the store are mapped, not copied in */
+            char path[1024];
+            struct stat st;
+            int fd = -1;
+
+            if (job->store != NULL)
+            {
+                object_path(job->store, c->hash, path, sizeof(path), NULL);
+                fd = open(path, O_RDONLY);
+            }
+            ok = fd >= 0 && fstat(fd, &st) == 0 &&
+                 (size_t)st.st_size == sizeof(snap_object_t) + c->stored_size;
+            if (ok)
+            {
+                map_size = (size_t)st.st_size;
+                map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                ok = map != MAP_FAILED;
+            }
+            if (fd >= 0)
+                close(fd);
+            if (ok)
+            {
+                src = (const uint8_t *)map + sizeof(snap_object_t);
+                if (!packed)
+                    raw = src;
+            }
+        }
+        else if (ok)
+        {
+            ok = read_full(job->fd, (uint8_t *)src, c->stored_size, job->off + c->offset) == 0;
+        }
+
+        if (ok && packed)
+        {
+            ok = compression_decode_buffer(buf.raw, c->raw_size, src, c->stored_size,
+                                           buf.scratch, SNAP_ALGORITHM) == c->raw_size;
+        }
+        if (ok)
+        {
+            snap_hash_t h = snap_hash(raw, c->raw_size);
+            ok = hash_equal(&h, &c->hash);
+        }
+        if (ok)
+        {
+            for (uint32_t j = 0; j < n; j++)
+            {
+                memcpy(job->mem + (size_t)job->pages[first + j] * SNAP_PAGE_SIZE,
+                       raw + (size_t)j * SNAP_PAGE_SIZE, SNAP_PAGE_SIZE);
+            }
+            atomic_fetch_add(&job->stored, c->stored_size);
+        }
+        if (map != MAP_FAILED)
+            munmap(map, map_size);
+        if (!ok)
+        {
+            atomic_store(&job->failed, true);
+            break;
+        }
+    }
+
+    buffers_free(&buf);
+    return NULL;
+}
+
+/* Read the header and chunk table, and the page list if `pages` is not NULL */
+static int read_tables(int fd, uint64_t off, uint64_t mem_size, snap_header_t *hdr,
+                       uint32_t **pages, snap_chunk_t **chunks)
+{
+    uint64_t index_size;
+
+    *chunks = NULL;
+    if (pages != NULL)
+        *pages = NULL;
+
+    if (read_full(fd, hdr, sizeof(*hdr), off) < 0 ||
+        memcmp(hdr->magic, SNAP_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->version != SNAP_FORMAT_VERSION || hdr->chunk_pages != SNAP_CHUNK_PAGES ||
+        hdr->n_pages > mem_size / SNAP_PAGE_SIZE ||
+        hdr->n_chunks != (hdr->n_pages + SNAP_CHUNK_PAGES - 1) / SNAP_CHUNK_PAGES)
+    {
+        return -1;
+    }
+    index_size = (uint64_t)hdr->n_pages * sizeof(uint32_t);
+
+    *chunks = malloc(((size_t)hdr->n_chunks + 1) * sizeof(snap_chunk_t));
+    if (*chunks == NULL ||
+        read_full(fd, *chunks, (size_t)hdr->n_chunks * sizeof(snap_chunk_t),
+                  off + sizeof(*hdr) + index_size) < 0)
+    {
+        goto fail;
+    }
+    if (pages == NULL)
+        return 0;
+
+    *pages = malloc(index_size + sizeof(uint32_t));
+    if (*pages == NULL || read_full(fd, *pages, index_size, off + sizeof(*hdr)) < 0)
+        goto fail;
+    for (uint32_t i = 0; i < hdr->n_pages; i++)
+    {
+        if ((*pages)[i] >= mem_size / SNAP_PAGE_SIZE)
+            goto fail;
+    }
+    return 0;
+
+fail:
+    free(*chunks);
+    *chunks = NULL;
+    if (pages != NULL)
+    {
+        free(*pages);
+        *pages = NULL;
+    }
+    return -1;
+}
+
+int snap_read(int fd, uint64_t off, void *mem, uint64_t mem_size, snap_store_t *store,
+              int threads, snap_stats_t *stats)
+{
+    snap_header_t hdr;
+    snap_job_t job = {0};
+    uint64_t start = snap_now_ns();
+    uint32_t *pages = NULL;
+    int ret = -1;
+
+    if (threads <= 0)
+        threads = snap_default_threads();
+    if (threads > SNAP_MAX_THREADS)
+        threads = SNAP_MAX_THREADS;
+
+    if (read_tables(fd, off, mem_size, &hdr, &pages, &job.chunks) < 0)
+        return -1;
+
+    job.fd = fd;
+    job.off = off;
+    job.mem = mem;
+    job.mem_size = mem_size;
+    job.pages = pages;
+    job.n_pages = hdr.n_pages;
+    job.n_chunks = hdr.n_chunks;
+    job.store = store;
+
+    if (threads > (int)hdr.n_chunks)
+        threads = hdr.n_chunks > 0 ? (int)hdr.n_chunks : 1;
+    snap_run(&job, threads, restore_worker);
+    if (!atomic_load(&job.failed))
+        ret = 0;
+
+    if (stats != NULL)
+    {
+        stats->threads = threads;
+        stats->raw_bytes = (uint64_t)hdr.n_pages * SNAP_PAGE_SIZE;
+        stats->stored_bytes = atomic_load(&job.stored);
+        stats->elapsed_ns = snap_now_ns() - start;
+    }
+
+    free(pages);
+    free(job.chunks);
+    return ret;
+}
+
+int snap_release(int fd, uint64_t off, snap_store_t *store)
+{
+    snap_header_t hdr;
+    snap_chunk_t *chunks;
+
+    if (read_tables(fd, off, UINT64_MAX, &hdr, NULL, &chunks) < 0)
+        return -1;
+    for (uint32_t i = 0; store != NULL && i < hdr.n_chunks; i++)
+    {
+        snap_object_t obj;
+        if (chunks[i].offset == SNAP_IN_STORE)
+            object_adjust(store, chunks[i].hash, -1, &obj);
+    }
+    free(chunks);
+    return 0;
+}
@@ -0,0 +1,135 @@
+/*
+ * snapshot.h - Guest memory snapshots
+ *
+ * A snapshot stores a list of guest pages, in the order the caller gives
+ * them, and reads them back to the same guest physical addresses. The
+ * pages are cut into chunks of SNAP_CHUNK_PAGES; a pool of threads takes
+ * one chunk at a time, hashes and compresses it, and writes it with its
+ * own pwrite() at the next free file offset. A restore does the reverse:
+ * each thread reads a chunk, decompresses it, checks its hash and copies
+ * its pages into the target mapping.
+ *
+ * File layout (at the offset the caller passes, host format):
+ *
+ *   snap_header_t
+ *   uint32_t[n_pages]           guest page numbers
+ *   snap_chunk_t[n_chunks]      chunk i holds pages [i * chunk_pages, ...)
+ *   chunk data                  in the order the threads finished them
+ *
+ * Chunk store: with a snap_store_t, chunks go to a content-addressed
+ * directory shared by every snapshot instead of into the file, which then
+ * only holds their hashes (offset SNAP_IN_STORE). A chunk that is already
+ * in the store is neither compressed nor written again. Each chunk is one
+ * file, <dir>/<first 2 hex digits>/<other 62 hex digits>:
+ *
+ *   snap_object_t               header, with the reference count
+ *   stored bytes                mapped straight into memory on restore
+ *
+ * Every snapshot that lists a chunk holds one reference to it, taken by
+ * snap_write() and dropped by snap_release(); the chunk is deleted when
+ * the last one goes. Reference counts are updated under an flock() of the
+ * chunk file, so VM processes can share the store.
+ *
+ * A chunk is shared on its SHA-256 alone, so a guest cannot plant contents
+ * in another guest's memory through a hash collision. Whether a chunk was
+ * already there still shows in how long a save takes, so a store should
+ * only be shared by VMs of one trust domain; snap_store_open() refuses a
+ * directory that is not the caller's or that others can write to.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SNAP_MAGIC "TVMMSN1"
+#define SNAP_FORMAT_VERSION 3
+#define SNAP_OBJECT_MAGIC "TVMMCH2"
+
+#define SNAP_PAGE_SIZE 4096
+#define SNAP_CHUNK_PAGES 64 /* 256 KB of guest memory per chunk */
+#define SNAP_MAX_THREADS 16
+
+/* SHA-256 of a chunk's raw bytes: its name in the store */
+typedef struct
+{
+    uint8_t bytes[32];
+} snap_hash_t;
+
+typedef struct
+{
+    char magic[8];        /* SNAP_MAGIC */
+    uint32_t version;     /* SNAP_FORMAT_VERSION */
+    uint32_t chunk_pages; /* SNAP_CHUNK_PAGES when written */
+    uint32_t n_pages;
+    uint32_t n_chunks;
+    uint64_t end;         /* Offset just past the last chunk */
+} snap_header_t;
+
+#define SNAP_IN_STORE UINT64_MAX /* snap_chunk_t offset: in the chunk store */
+
+typedef struct
+{
+    uint64_t offset;      /* Of the stored bytes from the snap_header_t, or
+                           * SNAP_IN_STORE */
+    uint32_t stored_size; /* Equal to raw_size: stored uncompressed */
+    uint32_t raw_size;
+    snap_hash_t hash;     /* snap_hash() of the raw bytes */
+} snap_chunk_t;
+
+/* Header of a chunk in the store */
+typedef struct
+{
+    char magic[8];        /* SNAP_OBJECT_MAGIC */
+    uint32_t refs;        /* Snapshots that list this chunk */
+    uint32_t stored_size;
+    uint32_t raw_size;
+    uint32_t reserved;
+    snap_hash_t hash;
+} snap_object_t;
+
+typedef struct snap_store snap_store_t;
+
+/* What a save or restore did, for reporting */
+typedef struct
+{
+    int threads;
+    uint64_t raw_bytes;    /* Guest memory saved or restored */
+    uint64_t stored_bytes; /* Bytes of chunk data written (or read) */
+    uint64_t shared_bytes; /* Raw bytes of chunks the store already had */
+    uint64_t elapsed_ns;
+} snap_stats_t;
+
+/* Threads to use when the caller asks for 0: one per CPU, at most
+ * SNAP_MAX_THREADS */
+int snap_default_threads(void);
+
+snap_hash_t snap_hash(const void *data, size_t len);
+
+/* Write the n_pages pages of `mem` listed in `pages` to `fd` at `off`,
+ * with the chunks in `store` unless it is NULL. Returns 0, or -1 if
+ * anything failed to write (no store references are left behind). */
+int snap_write(int fd, uint64_t off, const void *mem, const uint32_t *pages,
+               uint32_t n_pages, snap_store_t *store, int threads, snap_stats_t *stats);
+
+/* Read a snapshot written by snap_write() at `off` into `mem`. Pages not
+ * in the snapshot are left alone. Returns 0, or -1 if the snapshot is
+ * damaged, does not fit in mem_size, or can't be read. */
+int snap_read(int fd, uint64_t off, void *mem, uint64_t mem_size, snap_store_t *store,
+              int threads, snap_stats_t *stats);
+
+/* Drop the store references of the snapshot at `off`, before the file
+ * holding it is deleted. Returns 0, or -1 if it can't be read. */
+int snap_release(int fd, uint64_t off, snap_store_t *store);
+
+/* Open the chunk store in `dir`, creating it if need be. NULL on error,
+ * or if `dir` belongs to another user or is group or world writable. */
+snap_store_t *snap_store_open(const char *dir);
+
+void snap_store_close(snap_store_t *store);
+
+/* Chunks in the store and the bytes they take */
+int snap_store_usage(snap_store_t *store, uint64_t *n_chunks, uint64_t *bytes);
+
+#endif /* SNAPSHOT_H */
@@ -0,0 +1,4907 @@
+/*
+ * swcpu.c - Software AArch64 backend for TinyVMM
+ *
+ * Guest code is translated one block at a time. A block starts at a guest
+ * PC and runs up to and including the first branch or exception-raising
+ * instruction, at most SW_BLOCK_MAX_INSNS instructions and never across a
+ * guest page boundary. Each guest instruction becomes exactly one sw_insn_t
+ * with all of its fields already extracted, so the interpreter loop never
+ * looks at encoding bits again.
+ *
+ * The dispatcher avoids hash lookups where it can: direct exits are
+ * chained to their successor block, indirect branches go through a small
+ * target cache, and hot blocks are stitched into superblocks (traces) so
+ * most taken branches never leave the interpreter loop at all.
+ *
+ * See swcpu.h for the overall design.
+ */
+
+#include "swcpu.h"
+#include "swsimd.h"
+#include "tcache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* ============================================================================
+ * Operations
+ * ============================================================================ */
+
+enum
+{
+    SW_OP_UNDEF,  /* Unallocated or unsupported encoding */
+    SW_OP_END,    /* Not an instruction: block ends, continue at pc_off */
+    SW_OP_LOOP,   /* Not an instruction: trace goes round again from ops[0] */
+    SW_OP_NOP,
+
+    /* Data processing - immediate */
+    SW_OP_MOVI,   /* rd = imm (MOVZ, MOVN, ADR, ADRP) */
+    SW_OP_MOVK,   /* rd<aux+15:aux> = imm */
+    SW_OP_ADD_IMM,
+    SW_OP_ADDS_IMM,
+    SW_OP_SUB_IMM,
+    SW_OP_SUBS_IMM,
+    SW_OP_AND_IMM,
+    SW_OP_ORR_IMM,
+    SW_OP_EOR_IMM,
+    SW_OP_ANDS_IMM,
+    SW_OP_SBFM,   /* aux = immr, aux2 = imms */
+    SW_OP_BFM,
+    SW_OP_UBFM,
+    SW_OP_EXTR,   /* aux = lsb */
+
+    /* Data processing - register */
+    SW_OP_ADD_SREG, /* aux = shift type, aux2 = amount */
+    SW_OP_ADDS_SREG,
+    SW_OP_SUB_SREG,
+    SW_OP_SUBS_SREG,
+    SW_OP_ADD_EREG, /* aux = extend option, aux2 = left shift */
+    SW_OP_ADDS_EREG,
+    SW_OP_SUB_EREG,
+    SW_OP_SUBS_EREG,
+    SW_OP_AND_SREG, /* SW_F_INV negates rm (BIC, ORN, EON, BICS) */
+    SW_OP_ORR_SREG,
+    SW_OP_EOR_SREG,
+    SW_OP_ANDS_SREG,
+    SW_OP_ADC,
+    SW_OP_ADCS,
+    SW_OP_SBC,
+    SW_OP_SBCS,
+    SW_OP_CSEL,   /* aux = condition */
+    SW_OP_CSINC,
+    SW_OP_CSINV,
+    SW_OP_CSNEG,
+    SW_OP_CCMN,   /* aux = condition, aux2 = nzcv, SW_F_IMM: imm instead of rm */
+    SW_OP_CCMP,
+    SW_OP_UDIV,
+    SW_OP_SDIV,
+    SW_OP_LSLV,
+    SW_OP_LSRV,
+    SW_OP_ASRV,
+    SW_OP_RORV,
+    SW_OP_MADD,   /* rd = ra + rn * rm */
+    SW_OP_MSUB,
+    SW_OP_SMADDL,
+    SW_OP_SMSUBL,
+    SW_OP_UMADDL,
+    SW_OP_UMSUBL,
+    SW_OP_SMULH,
+    SW_OP_UMULH,
+    SW_OP_RBIT,
+    SW_OP_REV16,
+    SW_OP_REV32,
+    SW_OP_REV,
+    SW_OP_CLZ,
+    SW_OP_CLS,
+
+    /* Loads and stores: aux = log2(access size) */
+    SW_OP_LD,     /* rd = [rn + imm] */
+    SW_OP_LD_PRE, /* rn += imm; rd = [rn] */
+    SW_OP_LD_POST,/* rd = [rn]; rn += imm */
+    SW_OP_LD_REG, /* rd = [rn + ext(rm)], aux2 = option << 1 | S */
+    SW_OP_ST,
+    SW_OP_ST_PRE,
+    SW_OP_ST_POST,
+    SW_OP_ST_REG,
+    SW_OP_LDP,    /* rd, ra = [rn + imm], SW_F_PRE / SW_F_POST writeback */
+    SW_OP_STP,
+
+    /* Atomics, see "Atomics" below. rd = Rt, rn = base, aux = log2(size);
+     * the address must be aligned to the whole access. */
+    SW_OP_LDAR,   /* rd = [rn], sequentially consistent */
+    SW_OP_STLR,   /* [rn] = rd, sequentially consistent */
+    SW_OP_LDXR,   /* rd = [rn] and arm the exclusive monitor, SW_F_ACQ */
+    SW_OP_STXR,   /* [rn] = rd if the monitor still holds; rm = 0 or 1 */
+    SW_OP_LDXP,   /* rd, ra = [rn], aux = log2(size of one register) */
+    SW_OP_STXP,
+    SW_OP_CAS,    /* if [rn] == rm: [rn] = rd; ra = old [rn] */
+    SW_OP_CASP,   /* Same with register pairs, rd/rm/ra are raw numbers */
+    SW_OP_AMO,    /* rd = [rn]; [rn] = [rn] <aux2> rm (SW_AMO_*) */
+
+    /* Branches (all end the block), imm = absolute target */
+    SW_OP_B,
+    SW_OP_BL,
+    SW_OP_BCOND,  /* aux = condition */
+    SW_OP_CBZ,
+    SW_OP_CBNZ,
+    SW_OP_TBZ,    /* aux = bit number */
+    SW_OP_TBNZ,
+    SW_OP_BR,
+    SW_OP_BLR,
+    SW_OP_RET,
+
+    /* Exceptions and system */
+    SW_OP_HVC,    /* imm = imm16 */
+    SW_OP_EXC,    /* Other synchronous exception, imm = syndrome */
+    SW_OP_WFI,
+    SW_OP_DMB,    /* aux = SW_BARRIER_* */
+    SW_OP_CLREX,
+    SW_OP_SYSTRAP,/* MRS/MSR of a register we don't emulate */
+    SW_OP_MRS,    /* aux = SW_SYSREG_* */
+    SW_OP_MSR,
+    SW_OP_IC_FLUSH,
+
+    /* AdvSIMD loads and stores: rd (and ra) = V registers, rn = base,
+     * aux = log2(access size). Post-indexed structure loads add rm, or imm
+     * with SW_F_IMM. */
+    SW_OP_VLD,      /* Vt = [rn + imm], SW_F_PRE / SW_F_POST writeback */
+    SW_OP_VST,
+    SW_OP_VLD_REG,  /* Vt = [rn + ext(rm)], aux2 = option << 1 | S */
+    SW_OP_VST_REG,
+    SW_OP_VLDP,     /* rd, ra = [rn + imm] */
+    SW_OP_VSTP,
+    SW_OP_VLDN,     /* LD1-LD4 (multiple structures): ra = registers,
+                     * aux = log2(element size), aux2 = elements per structure */
+    SW_OP_VSTN,
+    SW_OP_VLDR,     /* LD1R-LD4R: one structure into every lane, ra = registers */
+    SW_OP_VLD_LANE, /* LD1-LD4 (single structure): aux2 = lane, ra = registers */
+    SW_OP_VST_LANE,
+
+    /* AdvSIMD data processing, see sw_exec_simd(). rd, rn, rm are V
+     * registers unless noted, aux = log2(lane size), SW_F_Q = 128-bit. */
+    SW_OP_VADD,
+    SW_OP_VSUB,
+    SW_OP_VMUL,
+    SW_OP_VMLA,
+    SW_OP_VMLS,
+    SW_OP_VCMEQ,
+    SW_OP_VCMGT,
+    SW_OP_VCMGE,
+    SW_OP_VCMHI,
+    SW_OP_VCMHS,
+    SW_OP_VCMTST,
+    SW_OP_VSMAX,
+    SW_OP_VSMIN,
+    SW_OP_VUMAX,
+    SW_OP_VUMIN,
+    SW_OP_VSQADD,
+    SW_OP_VUQADD,
+    SW_OP_VSQSUB,
+    SW_OP_VUQSUB,
+    SW_OP_VADDP,
+    SW_OP_VSMAXP,
+    SW_OP_VSMINP,
+    SW_OP_VUMAXP,
+    SW_OP_VUMINP,
+    SW_OP_VAND,
+    SW_OP_VBIC,
+    SW_OP_VORR,
+    SW_OP_VORN,
+    SW_OP_VEOR,
+    SW_OP_VBSL,
+    SW_OP_VBIT,
+    SW_OP_VBIF,
+    SW_OP_VCNT,
+    SW_OP_VNOT,
+    SW_OP_VRBIT,
+    SW_OP_VCLZ,
+    SW_OP_VABS,
+    SW_OP_VNEG,
+    SW_OP_VCMZ,     /* Compare with zero, aux2 = SW_CMZ_* */
+    SW_OP_VREV,     /* Reverse lanes in containers of 1 << aux2 bytes */
+    SW_OP_VXTN,     /* Narrow to aux-sized lanes; SW_F_Q writes the upper half */
+    SW_OP_VSHRN,    /* Same after a right shift by aux2 */
+    SW_OP_VADDV,    /* Reductions: Vd = lane 0 */
+    SW_OP_VSMAXV,
+    SW_OP_VSMINV,
+    SW_OP_VUMAXV,
+    SW_OP_VUMINV,
+    SW_OP_VSADDLV,
+    SW_OP_VUADDLV,
+    SW_OP_VSHL,     /* Shift by immediate: aux2 = amount */
+    SW_OP_VUSHR,
+    SW_OP_VSSHR,
+    SW_OP_VUSRA,
+    SW_OP_VSSRA,
+    SW_OP_VUSHLL,   /* Widen aux-sized lanes (upper half with SW_F_Q) and shift */
+    SW_OP_VSSHLL,
+    SW_OP_VZIP1,
+    SW_OP_VZIP2,
+    SW_OP_VUZP1,
+    SW_OP_VUZP2,
+    SW_OP_VTRN1,
+    SW_OP_VTRN2,
+    SW_OP_VEXT,     /* aux2 = first byte */
+    SW_OP_VTBL,     /* ra = table registers */
+    SW_OP_VTBX,
+    SW_OP_VMOVI,    /* imm = 64-bit pattern, repeated */
+    SW_OP_VORR_IMM,
+    SW_OP_VBIC_IMM,
+    SW_OP_VDUP_ELEM,/* aux2 = lane */
+    SW_OP_VINS_ELEM,/* Vd[aux2] = Vn[ra] */
+    SW_OP_VDUP_GEN, /* rn = X register */
+    SW_OP_VINS_GEN, /* Vd[aux2] = rn (X register) */
+    SW_OP_VFMOV_GEN,/* Vd = rn (X register), other lanes zeroed */
+    SW_OP_VUMOV,    /* rd (X register) = Vn[aux2] */
+    SW_OP_VSMOV,
+    SW_OP_VADDP_D,  /* Dd = Vn.d[0] + Vn.d[1] */
+
+    SW_OP_COUNT
+};
+
+/* sw_insn_t.flags */
+#define SW_F_32 0x01     /* 32-bit operation (W registers) */
+#define SW_F_INV 0x02    /* Invert second operand */
+#define SW_F_SIGNED 0x04 /* Sign-extending load */
+#define SW_F_PRE 0x08    /* Pre-index writeback */
+#define SW_F_POST 0x10   /* Post-index writeback */
+#define SW_F_IMM 0x20    /* Immediate instead of register operand */
+#define SW_F_TRACE 0x40  /* Branch inside a trace: continue with the next op */
+#define SW_F_TAKEN 0x80  /* ...if it was taken (else if it was not taken) */
+#define SW_F_Q 0x02      /* AdvSIMD: 128-bit vector, else 64-bit (shares SW_F_INV) */
+#define SW_F_ACQ 0x08    /* Atomics: acquire semantics (shares SW_F_PRE) */
+
+/* SW_OP_AMO operations, in the order of the LSE opc field */
+enum
+{
+    SW_AMO_ADD,
+    SW_AMO_CLR,
+    SW_AMO_EOR,
+    SW_AMO_SET,
+    SW_AMO_SMAX,
+    SW_AMO_SMIN,
+    SW_AMO_UMAX,
+    SW_AMO_UMIN,
+    SW_AMO_SWP,
+};
+
+/* SW_OP_DMB kinds, from the CRm field of DMB / DSB */
+enum
+{
+    SW_BARRIER_FULL,
+    SW_BARRIER_LD,
+    SW_BARRIER_ST,
+};
+
+/* SW_OP_VCMZ conditions */
+enum
+{
+    SW_CMZ_EQ,
+    SW_CMZ_GT,
+    SW_CMZ_GE,
+    SW_CMZ_LE,
+    SW_CMZ_LT,
+};
+
+/* How sw_exec_block() left a block */
+enum
+{
+    SW_CONT_DIRECT,   /* Direct branch or fall-through */
+    SW_CONT_INDIRECT, /* BR / BLR / RET */
+    SW_CONT_EXIT,     /* Exception, leave sw_cpu_run() */
+};
+
+/* System registers we emulate (sw_insn_t.aux for MRS/MSR) */
+enum
+{
+    SW_SYSREG_NZCV,
+    SW_SYSREG_TPIDR_EL0,
+    SW_SYSREG_TPIDR_EL1,
+    SW_SYSREG_CNTVCT_EL0,
+    SW_SYSREG_CNTFRQ_EL0,
+    SW_SYSREG_CNTV_CTL_EL0,
+    SW_SYSREG_CNTV_CVAL_EL0,
+    SW_SYSREG_CNTV_TVAL_EL0,
+    SW_SYSREG_FPCR,
+    SW_SYSREG_FPSR,
+};
+
+/* op0:op1:CRn:CRm:op2 as found in bits [20:5] of MRS/MSR */
+#define SYSREG_ID(op0, op1, crn, crm, op2) \
+    (((op0) << 14) | ((op1) << 11) | ((crn) << 7) | ((crm) << 3) | (op2))
+
+/* Virtual counter frequency, the same 24 MHz Apple Silicon reports */
+#define SW_CNTFRQ 24000000ull
+
+/* CNTV_CTL_EL0 */
+#define CNTV_CTL_ENABLE (1u << 0)
+#define CNTV_CTL_IMASK (1u << 1)
+#define CNTV_CTL_ISTATUS (1u << 2)
+
+/* Exception classes for syndromes we raise */
+#define EC_UNKNOWN 0x00
+#define EC_WFX 0x01
+#define EC_SVC64 0x15
+#define EC_HVC64 0x16
+#define EC_SMC64 0x17
+#define EC_SYS64 0x18
+#define EC_IABORT_LOWER 0x20
+#define EC_DABORT_LOWER 0x24
+#define EC_BRK64 0x3c
+
+#define ESR_IL (1u << 25)
+#define ESR(ec, iss) (((uint64_t)(ec) << 26) | ESR_IL | (iss))
+
+#define GUEST_PAGE_SHIFT 12
+#define GUEST_PAGE_SIZE (1ull << GUEST_PAGE_SHIFT)
+
+/* ============================================================================
+ * Helpers
+ * ============================================================================ */
+
+uint64_t sw_hash64(const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    uint64_t h = 0xcbf29ce484222325ull;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= p[i];
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+static inline uint64_t sext(uint64_t v, unsigned bits)
+{
+    unsigned s = 64 - bits;
+    return (uint64_t)((int64_t)(v << s) >> s);
+}
+
+static inline uint64_t ones(unsigned bits)
+{
+    return bits >= 64 ? ~0ull : (1ull << bits) - 1;
+}
+
+static inline uint64_t ror64(uint64_t v, unsigned n, unsigned width)
+{
+    n %= width;
+    if (n == 0)
+        return v;
+    return ((v >> n) | (v << (width - n))) & ones(width);
+}
+
+/* AddWithCarry() from the ARM ARM, optionally producing NZCV */
+static inline uint64_t add_with_carry(uint64_t a, uint64_t b, unsigned carry,
+                                      bool is32, uint32_t *nzcv)
+{
+    uint64_t r;
+    bool c, v;
+
+    if (is32)
+    {
+        uint32_t x = (uint32_t)a, y = (uint32_t)b;
+        uint64_t usum = (uint64_t)x + y + carry;
+        int64_t ssum = (int64_t)(int32_t)x + (int32_t)y + carry;
+        r = (uint32_t)usum;
+        c = usum != r;
+        v = ssum != (int32_t)r;
+        if (nzcv)
+            *nzcv = ((r >> 31) & 1 ? SW_NZCV_N : 0) | (r == 0 ? SW_NZCV_Z : 0) |
+                    (c ? SW_NZCV_C : 0) | (v ? SW_NZCV_V : 0);
+        return r;
+    }
+
+    unsigned __int128 usum = (unsigned __int128)a + b + carry;
+    r = (uint64_t)usum;
+    c = (usum >> 64) != 0;
+    v = ((~(a ^ b) & (a ^ r)) >> 63) != 0;
+    if (nzcv)
+        *nzcv = (r >> 63 ? SW_NZCV_N : 0) | (r == 0 ? SW_NZCV_Z : 0) |
+                (c ? SW_NZCV_C : 0) | (v ? SW_NZCV_V : 0);
+    return r;
+}
+
+static inline uint32_t logic_flags(uint64_t r, bool is32)
+{
+    bool n = is32 ? (r >> 31) & 1 : r >> 63;
+    return (n ? SW_NZCV_N : 0) | (r == 0 ? SW_NZCV_Z : 0);
+}
+
+static inline bool cond_holds(uint32_t nzcv, unsigned cond)
+{
+    bool n = nzcv & SW_NZCV_N, z = nzcv & SW_NZCV_Z;
+    bool c = nzcv & SW_NZCV_C, v = nzcv & SW_NZCV_V;
+    bool r;
+
+    switch (cond >> 1)
+    {
+    case 0: r = z; break;
+    case 1: r = c; break;
+    case 2: r = n; break;
+    case 3: r = v; break;
+    case 4: r = c && !z; break;
+    case 5: r = n == v; break;
+    case 6: r = n == v && !z; break;
+    default: r = true; break;
+    }
+
+    if ((cond & 1) && cond != 0xf)
+        r = !r;
+    return r;
+}
+
+static inline uint64_t shift_reg(uint64_t v, unsigned type, unsigned amount, bool is32)
+{
+    if (is32)
+    {
+        uint32_t w = (uint32_t)v;
+        switch (type)
+        {
+        case 0: return (uint32_t)(w << amount);
+        case 1: return w >> amount;
+        case 2: return (uint32_t)((int32_t)w >> amount);
+        default: return ror64(w, amount, 32);
+        }
+    }
+
+    switch (type)
+    {
+    case 0: return v << amount;
+    case 1: return v >> amount;
+    case 2: return (uint64_t)((int64_t)v >> amount);
+    default: return ror64(v, amount, 64);
+    }
+}
+
+static inline uint64_t extend_reg(uint64_t v, unsigned option, unsigned shift)
+{
+    switch (option)
+    {
+    case 0: v = (uint8_t)v; break;
+    case 1: v = (uint16_t)v; break;
+    case 2: v = (uint32_t)v; break;
+    case 3: break;
+    case 4: v = sext(v, 8); break;
+    case 5: v = sext(v, 16); break;
+    case 6: v = sext(v, 32); break;
+    default: break;
+    }
+    return v << shift;
+}
+
+static inline uint64_t width_mask(uint64_t v, bool is32)
+{
+    return is32 ? (uint32_t)v : v;
+}
+
+/* ============================================================================
+ * Lazy Flags
+ * ============================================================================
+ *
+ * Build with -DSW_EAGER_FLAGS to compute NZCV on every flag-setting
+ * instruction instead, for comparison.
+ */
+
+static inline void flags_add(sw_cpu_t *cpu, uint64_t a, uint64_t b, bool is32)
+{
+#ifdef SW_EAGER_FLAGS
+    add_with_carry(a, b, 0, is32, &cpu->nzcv);
+#else
+    cpu->flags_op = is32 ? SW_FLAGS_ADD32 : SW_FLAGS_ADD64;
+    cpu->flags_a = a;
+    cpu->flags_b = b;
+#endif
+}
+
+static inline void flags_sub(sw_cpu_t *cpu, uint64_t a, uint64_t b, bool is32)
+{
+#ifdef SW_EAGER_FLAGS
+    add_with_carry(a, ~b, 1, is32, &cpu->nzcv);
+#else
+    cpu->flags_op = is32 ? SW_FLAGS_SUB32 : SW_FLAGS_SUB64;
+    cpu->flags_a = a;
+    cpu->flags_b = b;
+#endif
+}
+
+static inline void flags_logic(sw_cpu_t *cpu, uint64_t r, bool is32)
+{
+#ifdef SW_EAGER_FLAGS
+    cpu->nzcv = logic_flags(r, is32);
+#else
+    cpu->flags_op = is32 ? SW_FLAGS_LOGIC32 : SW_FLAGS_LOGIC64;
+    cpu->flags_a = r;
+#endif
+}
+
+static inline void flags_set(sw_cpu_t *cpu, uint32_t nzcv)
+{
+    cpu->flags_op = SW_FLAGS_NZCV;
+    cpu->nzcv = nzcv;
+}
+
+/* Materialize NZCV from the recorded operation */
+static uint32_t flags_get(sw_cpu_t *cpu)
+{
+    uint64_t a = cpu->flags_a, b = cpu->flags_b;
+
+    switch (cpu->flags_op)
+    {
+    case SW_FLAGS_ADD64:
+    case SW_FLAGS_ADD32:
+        add_with_carry(a, b, 0, cpu->flags_op == SW_FLAGS_ADD32, &cpu->nzcv);
+        break;
+    case SW_FLAGS_SUB64:
+    case SW_FLAGS_SUB32:
+        add_with_carry(a, ~b, 1, cpu->flags_op == SW_FLAGS_SUB32, &cpu->nzcv);
+        break;
+    case SW_FLAGS_LOGIC64:
+    case SW_FLAGS_LOGIC32:
+        cpu->nzcv = logic_flags(a, cpu->flags_op == SW_FLAGS_LOGIC32);
+        break;
+    default:
+        return cpu->nzcv;
+    }
+
+    cpu->flags_op = SW_FLAGS_NZCV;
+    return cpu->nzcv;
+}
+
+/*
+ * Evaluate a condition. After a compare or a logical op the common
+ * conditions follow directly from the operands; everything else goes
+ * through the materialized flags.
+ */
+static inline bool flags_cond(sw_cpu_t *cpu, unsigned cond)
+{
+    uint64_t a = cpu->flags_a, b = cpu->flags_b;
+
+    switch (cpu->flags_op)
+    {
+    case SW_FLAGS_SUB64:
+        switch (cond)
+        {
+        case 0x0: return a == b;
+        case 0x1: return a != b;
+        case 0x2: return a >= b;
+        case 0x3: return a < b;
+        case 0x8: return a > b;
+        case 0x9: return a <= b;
+        case 0xa: return (int64_t)a >= (int64_t)b;
+        case 0xb: return (int64_t)a < (int64_t)b;
+        case 0xc: return (int64_t)a > (int64_t)b;
+        case 0xd: return (int64_t)a <= (int64_t)b;
+        default: break;
+        }
+        break;
+
+    case SW_FLAGS_SUB32:
+        switch (cond)
+        {
+        case 0x0: return (uint32_t)a == (uint32_t)b;
+        case 0x1: return (uint32_t)a != (uint32_t)b;
+        case 0x2: return (uint32_t)a >= (uint32_t)b;
+        case 0x3: return (uint32_t)a < (uint32_t)b;
+        case 0x8: return (uint32_t)a > (uint32_t)b;
+        case 0x9: return (uint32_t)a <= (uint32_t)b;
+        case 0xa: return (int32_t)a >= (int32_t)b;
+        case 0xb: return (int32_t)a < (int32_t)b;
+        case 0xc: return (int32_t)a > (int32_t)b;
+        case 0xd: return (int32_t)a <= (int32_t)b;
+        default: break;
+        }
+        break;
+
+    case SW_FLAGS_LOGIC32:
+        a = (uint64_t)(int64_t)(int32_t)a;
+        /* fall through */
+    case SW_FLAGS_LOGIC64:
+        switch (cond)
+        {
+        case 0x0: return a == 0;
+        case 0x1: return a != 0;
+        case 0x4: case 0xb: return (int64_t)a < 0;
+        case 0x5: case 0xa: return (int64_t)a >= 0;
+        case 0xc: return (int64_t)a > 0;
+        case 0xd: return (int64_t)a <= 0;
+        default: break;
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    return cond_holds(flags_get(cpu), cond);
+}
+
+/* Bitfield move (SBFM/BFM/UBFM), following the ARM ARM pseudocode */
+static uint64_t bitfield(uint64_t dst, uint64_t src, unsigned immr, unsigned imms,
+                         int kind, bool is32)
+{
+    unsigned datasize = is32 ? 32 : 64;
+    uint64_t field, mask;
+    unsigned width, pos;
+
+    if (imms >= immr)
+    {
+        width = imms - immr + 1;
+        pos = 0;
+        field = (src >> immr) & ones(width);
+    }
+    else
+    {
+        width = imms + 1;
+        pos = datasize - immr;
+        field = src & ones(width);
+    }
+
+    mask = ones(width) << pos;
+    field <<= pos;
+
+    switch (kind)
+    {
+    case SW_OP_BFM:
+        dst = (dst & ~mask) | field;
+        break;
+    case SW_OP_SBFM:
+        dst = field;
+        if ((field >> (pos + width - 1)) & 1)
+            dst |= ~ones(pos + width);
+        break;
+    default:
+        dst = field;
+        break;
+    }
+    return width_mask(dst, is32);
+}
+
+/* ============================================================================
+ * Guest Memory
+ * ============================================================================ */
+
+static inline bool mem_ok(const sw_cpu_t *cpu, uint64_t addr, uint64_t size)
+{
+    return addr < cpu->mem_size && size <= cpu->mem_size - addr;
+}
+
+static inline uint64_t mem_read(const uint8_t *p, unsigned size_log2)
+{
+    switch (size_log2)
+    {
+    case 0:
+        return *p;
+    case 1:
+    {
+        uint16_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+    case 2:
+    {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+    default:
+    {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+    }
+}
+
+static inline void mem_write(uint8_t *p, unsigned size_log2, uint64_t val)
+{
+    switch (size_log2)
+    {
+    case 0:
+        *p = (uint8_t)val;
+        break;
+    case 1:
+    {
+        uint16_t v = (uint16_t)val;
+        memcpy(p, &v, sizeof(v));
+        break;
+    }
+    case 2:
+    {
+        uint32_t v = (uint32_t)val;
+        memcpy(p, &v, sizeof(v));
+        break;
+    }
+    default:
+        memcpy(p, &val, sizeof(val));
+        break;
+    }
+}
+
+static inline bool page_has_code(const sw_cpu_t *cpu, uint64_t addr)
+{
+    uint64_t page = addr >> GUEST_PAGE_SHIFT;
+    return (cpu->code_pages[page >> 3] >> (page & 7)) & 1;
+}
+
+static inline void mark_dirty(uint8_t *bitmap, uint64_t addr)
+{
+    uint64_t page = addr >> GUEST_PAGE_SHIFT;
+    bitmap[page >> 3] |= (uint8_t)(1u << (page & 7));
+}
+
+/* First access to a page since the last harvest (see sw_cpu_track_access()) */
+static void sw_touch_page(sw_cpu_t *cpu, uint64_t page)
+{
+    uint8_t bit = (uint8_t)(1u << (page & 7));
+
+    cpu->accessed_pages[page >> 3] |= bit;
+    if (!(cpu->touched_pages[page >> 3] & bit))
+    {
+        cpu->touched_pages[page >> 3] |= bit;
+        cpu->touch_order[cpu->n_touched++] = (uint32_t)page;
+    }
+}
+
+static inline void mark_accessed(sw_cpu_t *cpu, uint64_t addr)
+{
+    uint64_t page = addr >> GUEST_PAGE_SHIFT;
+    if (!((cpu->accessed_pages[page >> 3] >> (page & 7)) & 1))
+        sw_touch_page(cpu, page);
+}
+
+/* Post-copy: has the page holding `addr` arrived? (see absent_pages) */
+static inline bool page_present(const sw_cpu_t *cpu, uint64_t addr)
+{
+    uint64_t page = addr >> GUEST_PAGE_SHIFT;
+    return !((__atomic_load_n(&cpu->absent_pages[page >> 3], __ATOMIC_ACQUIRE) >> (page & 7)) & 1);
+}
+
+/* Post-copy: true if the page holding `addr` has not arrived, making it
+ * the address of the abort about to be raised */
+static inline bool page_absent(sw_cpu_t *cpu, uint64_t addr)
+{
+    if (page_present(cpu, addr))
+        return false;
+    cpu->absent_fault = true;
+    cpu->absent_addr = addr & ~(GUEST_PAGE_SIZE - 1);
+    return true;
+}
+
+/* Every data access, before it has any effect: false if it must fault
+ * on a page that is still absent, else marked for working-set tracking */
+static inline bool note_access(sw_cpu_t *cpu, uint64_t addr, uint64_t size)
+{
+    if (cpu->absent_pages != NULL &&
+        (page_absent(cpu, addr) || page_absent(cpu, addr + size - 1)))
+    {
+        return false;
+    }
+    if (cpu->accessed_pages != NULL)
+    {
+        mark_accessed(cpu, addr);
+        mark_accessed(cpu, addr + size - 1);
+    }
+    return true;
+}
+
+/* Stores into translated code invalidate the block cache */
+static inline void note_store(sw_cpu_t *cpu, uint64_t addr, uint64_t size)
+{
+    if (page_has_code(cpu, addr) || page_has_code(cpu, addr + size - 1))
+        cpu->flush_pending = true;
+    if (cpu->dirty_pages != NULL)
+    {
+        mark_dirty(cpu->dirty_pages, addr);
+        mark_dirty(cpu->dirty_pages, addr + size - 1);
+    }
+}
+
+/* Apply the sign/width extension of a load */
+static inline uint64_t load_extend(uint64_t v, const sw_insn_t *in)
+{
+    if (in->flags & SW_F_SIGNED)
+        v = sext(v, 8u << in->aux);
+    if (in->flags & SW_F_32)
+        v = (uint32_t)v;
+    return v;
+}
+
+/* ============================================================================
+ * Atomics
+ * ============================================================================
+ *
+ * Guest atomics run as host atomics on guest memory, so vCPUs on different
+ * host threads (see sw_cpu_t.code_epoch) need no lock between them.
+ *
+ * LDAR/STLR are sequentially consistent, which is what their RCsc ordering
+ * needs. LSE atomics and CAS are sequentially consistent read-modify-writes
+ * whatever their acquire/release bits say: on x86 every locked instruction
+ * is a full barrier anyway, and on arm64 the difference is one instruction.
+ *
+ * The exclusive monitor is local to each vCPU. LDXR records the address and
+ * the value it loaded; STXR is a compare-and-swap of that value for the new
+ * one, so it fails if another vCPU changed the location in between. As in
+ * other emulators that do this, a change that is later undone (ABA) goes
+ * unnoticed, which no lock-free algorithm built on LDXR/STXR can tell from
+ * a store that happened before the LDXR. All accesses must be aligned to
+ * their full size, like on hardware with the MMU off.
+ */
+
+static inline bool mem_aligned(uint64_t addr, unsigned size_log2)
+{
+    return (addr & ((1ull << size_log2) - 1)) == 0;
+}
+
+/* One set of helpers per access size, on naturally aligned host memory */
+#define SW_ATOMIC_HELPERS(bits)                                                 \
+    static inline uint64_t amo_cas##bits(uint8_t *p, uint64_t expected,         \
+                                         uint64_t desired)                      \
+    {                                                                           \
+        uint##bits##_t old = (uint##bits##_t)expected;                          \
+        __atomic_compare_exchange_n((uint##bits##_t *)p, &old,                  \
+                                    (uint##bits##_t)desired, false,             \
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);        \
+        return old;                                                             \
+    }                                                                           \
+                                                                                \
+    static inline uint64_t amo_rmw##bits(uint8_t *p, unsigned op, uint64_t val) \
+    {                                                                           \
+        uint##bits##_t *m = (uint##bits##_t *)p, v = (uint##bits##_t)val;       \
+        uint##bits##_t old, new;                                                \
+                                                                                \
+        switch (op)                                                             \
+        {                                                                       \
+        case SW_AMO_ADD:                                                        \
+            return __atomic_fetch_add(m, v, __ATOMIC_SEQ_CST);                  \
+        case SW_AMO_CLR:                                                        \
+            return __atomic_fetch_and(m, (uint##bits##_t)~v, __ATOMIC_SEQ_CST); \
+        case SW_AMO_EOR:                                                        \
+            return __atomic_fetch_xor(m, v, __ATOMIC_SEQ_CST);                  \
+        case SW_AMO_SET:                                                        \
+            return __atomic_fetch_or(m, v, __ATOMIC_SEQ_CST);                   \
+        case SW_AMO_SWP:                                                        \
+            return __atomic_exchange_n(m, v, __ATOMIC_SEQ_CST);                 \
+        }                                                                       \
+                                                                                \
+        /* Min / max: compare-and-swap loop */                                  \
+        old = __atomic_load_n(m, __ATOMIC_RELAXED);                             \
+        do                                                                      \
+        {                                                                       \
+            bool take;                                                          \
+            switch (op)                                                         \
+            {                                                                   \
+            case SW_AMO_SMAX:                                                   \
+                take = (int##bits##_t)v > (int##bits##_t)old;                   \
+                break;                                                          \
+            case SW_AMO_SMIN:                                                   \
+                take = (int##bits##_t)v < (int##bits##_t)old;                   \
+                break;                                                          \
+            case SW_AMO_UMAX:                                                   \
+                take = v > old;                                                 \
+                break;                                                          \
+            default:                                                            \
+                take = v < old;                                                 \
+                break;                                                          \
+            }                                                                   \
+            new = take ? v : old;                                               \
+        } while (!__atomic_compare_exchange_n(m, &old, new, false,              \
+                                              __ATOMIC_SEQ_CST,                 \
+                                              __ATOMIC_RELAXED));               \
+        return old;                                                             \
+    }
+
+SW_ATOMIC_HELPERS(8)
+SW_ATOMIC_HELPERS(16)
+SW_ATOMIC_HELPERS(32)
+SW_ATOMIC_HELPERS(64)
+
+#undef SW_ATOMIC_HELPERS
+
+/* Compare-and-swap, returning the old value (== expected on success) */
+static inline uint64_t amo_cas(uint8_t *p, unsigned size_log2, uint64_t expected,
+                               uint64_t desired)
+{
+    switch (size_log2)
+    {
+    case 0:
+        return amo_cas8(p, expected, desired);
+    case 1:
+        return amo_cas16(p, expected, desired);
+    case 2:
+        return amo_cas32(p, expected, desired);
+    default:
+        return amo_cas64(p, expected, desired);
+    }
+}
+
+/* 128-bit compare-and-swap of two little-endian doublewords */
+static inline bool amo_cas128(uint8_t *p, uint64_t *old, uint64_t lo, uint64_t hi)
+{
+    unsigned __int128 expected = ((unsigned __int128)old[1] << 64) | old[0];
+    unsigned __int128 desired = ((unsigned __int128)hi << 64) | lo;
+    bool ok = __atomic_compare_exchange_n((unsigned __int128 *)p, &expected, desired,
+                                          false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    old[0] = (uint64_t)expected;
+    old[1] = (uint64_t)(expected >> 64);
+    return ok;
+}
+
+static inline uint64_t amo_rmw(uint8_t *p, unsigned size_log2, unsigned op, uint64_t val)
+{
+    switch (size_log2)
+    {
+    case 0:
+        return amo_rmw8(p, op, val);
+    case 1:
+        return amo_rmw16(p, op, val);
+    case 2:
+        return amo_rmw32(p, op, val);
+    default:
+        return amo_rmw64(p, op, val);
+    }
+}
+
+/* Single-copy atomic load; `acquire` makes it sequentially consistent */
+static inline uint64_t amo_load(const uint8_t *p, unsigned size_log2, bool acquire)
+{
+#define AMO_LOAD(type)                                                        \
+    (acquire ? __atomic_load_n((const type *)p, __ATOMIC_SEQ_CST)             \
+             : __atomic_load_n((const type *)p, __ATOMIC_RELAXED))
+
+    switch (size_log2)
+    {
+    case 0:
+        return AMO_LOAD(uint8_t);
+    case 1:
+        return AMO_LOAD(uint16_t);
+    case 2:
+        return AMO_LOAD(uint32_t);
+    default:
+        return AMO_LOAD(uint64_t);
+    }
+
+#undef AMO_LOAD
+}
+
+static inline void amo_store(uint8_t *p, unsigned size_log2, uint64_t val)
+{
+    switch (size_log2)
+    {
+    case 0:
+        __atomic_store_n(p, (uint8_t)val, __ATOMIC_SEQ_CST);
+        break;
+    case 1:
+        __atomic_store_n((uint16_t *)p, (uint16_t)val, __ATOMIC_SEQ_CST);
+        break;
+    case 2:
+        __atomic_store_n((uint32_t *)p, (uint32_t)val, __ATOMIC_SEQ_CST);
+        break;
+    default:
+        __atomic_store_n((uint64_t *)p, val, __ATOMIC_SEQ_CST);
+        break;
+    }
+}
+
+/* ============================================================================
+ * Decoder
+ * ============================================================================ */
+
+/* Register 31 as XZR (source) */
+static inline uint8_t rz(unsigned r)
+{
+    return r == 31 ? SW_REG_ZR : (uint8_t)r;
+}
+
+/* Register 31 as XZR (destination) */
+static inline uint8_t wz(unsigned r)
+{
+    return r == 31 ? SW_REG_SINK : (uint8_t)r;
+}
+
+/* Register 31 as SP */
+static inline uint8_t rsp(unsigned r)
+{
+    return r == 31 ? SW_REG_SP : (uint8_t)r;
+}
+
+static inline uint32_t bits(uint32_t insn, unsigned hi, unsigned lo)
+{
+    return (insn >> lo) & ((1u << (hi - lo + 1)) - 1);
+}
+
+/* DecodeBitMasks() for logical immediates */
+static bool decode_bitmask(unsigned n, unsigned imms, unsigned immr, bool is32,
+                           uint64_t *out)
+{
+    unsigned combined = (n << 6) | (~imms & 0x3f);
+    int len = 31 - __builtin_clz(combined | 1);
+
+    if (combined == 0 || len < 1 || (is32 && n))
+        return false;
+
+    unsigned size = 1u << len;
+    unsigned levels = size - 1;
+    unsigned s = imms & levels, r = immr & levels;
+
+    if (s == levels)
+        return false;
+
+    uint64_t elem = ror64(ones(s + 1), r, size);
+    uint64_t result = 0;
+    for (unsigned i = 0; i < 64; i += size)
+        result |= elem << i;
+
+    *out = is32 ? (uint32_t)result : result;
+    return true;
+}
+
+static int decode_sysreg(unsigned id)
+{
+    switch (id)
+    {
+    case SYSREG_ID(3, 3, 4, 2, 0): return SW_SYSREG_NZCV;
+    case SYSREG_ID(3, 3, 13, 0, 2): return SW_SYSREG_TPIDR_EL0;
+    case SYSREG_ID(3, 0, 13, 0, 4): return SW_SYSREG_TPIDR_EL1;
+    case SYSREG_ID(3, 3, 14, 0, 2): return SW_SYSREG_CNTVCT_EL0;
+    case SYSREG_ID(3, 3, 14, 0, 0): return SW_SYSREG_CNTFRQ_EL0;
+    case SYSREG_ID(3, 3, 14, 3, 1): return SW_SYSREG_CNTV_CTL_EL0;
+    case SYSREG_ID(3, 3, 14, 3, 2): return SW_SYSREG_CNTV_CVAL_EL0;
+    case SYSREG_ID(3, 3, 14, 3, 0): return SW_SYSREG_CNTV_TVAL_EL0;
+    case SYSREG_ID(3, 3, 4, 4, 0): return SW_SYSREG_FPCR;
+    case SYSREG_ID(3, 3, 4, 4, 1): return SW_SYSREG_FPSR;
+    default: return -1;
+    }
+}
+
+/*
+ * Work out the kind of a load/store from its size and opc fields.
+ * Returns 1 for a load, 0 for a store, 2 for a prefetch, -1 if unallocated.
+ */
+static int decode_ldst_kind(unsigned size, unsigned opc, uint8_t *flags)
+{
+    *flags = 0;
+    switch (opc)
+    {
+    case 0:
+        return 0;
+    case 1:
+        return 1;
+    case 2:
+        if (size == 3)
+            return 2;
+        *flags = SW_F_SIGNED;
+        return 1;
+    default:
+        if (size >= 2)
+            return -1;
+        *flags = SW_F_SIGNED | SW_F_32;
+        return 1;
+    }
+}
+
+/*
+ * Every encoding class in a64.def has a decoder with the same signature.
+ * Not every class needs the PC.
+ */
+#define A64_DECODER(fn) \
+    static void fn(uint32_t insn, __attribute__((unused)) uint64_t pc, sw_insn_t *in)
+
+/* ---- Data processing (immediate) ---------------------------------------- */
+
+A64_DECODER(decode_adr)
+{
+    uint64_t imm = sext((bits(insn, 23, 5) << 2) | bits(insn, 30, 29), 21);
+
+    in->op = SW_OP_MOVI;
+    in->rd = wz(bits(insn, 4, 0));
+    in->imm = (int64_t)(bits(insn, 31, 31) ? (pc & ~0xfffull) + (imm << 12) : pc + imm);
+}
+
+A64_DECODER(decode_addsub_imm)
+{
+    static const uint8_t ops[4] = {SW_OP_ADD_IMM, SW_OP_ADDS_IMM,
+                                   SW_OP_SUB_IMM, SW_OP_SUBS_IMM};
+    unsigned rd = bits(insn, 4, 0);
+
+    in->op = ops[bits(insn, 30, 29)];
+    in->flags = bits(insn, 31, 31) ? 0 : SW_F_32;
+    in->rd = bits(insn, 29, 29) ? wz(rd) : rsp(rd);
+    in->rn = rsp(bits(insn, 9, 5));
+    in->imm = (int64_t)bits(insn, 21, 10) << (bits(insn, 22, 22) ? 12 : 0);
+}
+
+A64_DECODER(decode_logic_imm)
+{
+    static const uint8_t ops[4] = {SW_OP_AND_IMM, SW_OP_ORR_IMM,
+                                   SW_OP_EOR_IMM, SW_OP_ANDS_IMM};
+    bool sf = bits(insn, 31, 31);
+    unsigned opc = bits(insn, 30, 29), rd = bits(insn, 4, 0);
+    uint64_t imm;
+
+    if (!decode_bitmask(bits(insn, 22, 22), bits(insn, 15, 10),
+                        bits(insn, 21, 16), !sf, &imm))
+        return;
+    in->op = ops[opc];
+    in->flags = sf ? 0 : SW_F_32;
+    in->rd = opc == 3 ? wz(rd) : rsp(rd);
+    in->rn = rz(bits(insn, 9, 5));
+    in->imm = (int64_t)imm;
+}
+
+A64_DECODER(decode_movewide)
+{
+    bool sf = bits(insn, 31, 31);
+    unsigned opc = bits(insn, 30, 29), hw = bits(insn, 22, 21);
+    uint64_t imm16 = bits(insn, 20, 5);
+
+    if (opc == 1 || (!sf && hw >= 2))
+        return;
+    in->flags = sf ? 0 : SW_F_32;
+    in->rd = wz(bits(insn, 4, 0));
+    if (opc == 3)
+    {
+        in->op = SW_OP_MOVK;
+        in->aux = (uint8_t)(hw * 16);
+        in->imm = (int64_t)imm16;
+    }
+    else
+    {
+        uint64_t v = imm16 << (hw * 16);
+        in->op = SW_OP_MOVI;
+        in->imm = (int64_t)width_mask(opc == 0 ? ~v : v, !sf);
+    }
+}
+
+A64_DECODER(decode_bitfield)
+{
+    static const uint8_t ops[3] = {SW_OP_SBFM, SW_OP_BFM, SW_OP_UBFM};
+    bool sf = bits(insn, 31, 31);
+    unsigned opc = bits(insn, 30, 29);
+
+    if (opc == 3 || bits(insn, 22, 22) != sf ||
+        (!sf && (bits(insn, 21, 16) >= 32 || bits(insn, 15, 10) >= 32)))
+        return;
+    in->op = ops[opc];
+    in->flags = sf ? 0 : SW_F_32;
+    in->rd = wz(bits(insn, 4, 0));
+    in->rn = rz(bits(insn, 9, 5));
+    in->aux = (uint8_t)bits(insn, 21, 16);
+    in->aux2 = (uint8_t)bits(insn, 15, 10);
+}
+
+A64_DECODER(decode_extract)
+{
+    bool sf = bits(insn, 31, 31);
+
+    if (bits(insn, 30, 29) != 0 || bits(insn, 21, 21) || bits(insn, 22, 22) != sf ||
+        (!sf && bits(insn, 15, 10) >= 32))
+        return;
+    in->op = SW_OP_EXTR;
+    in->flags = sf ? 0 : SW_F_32;
+    in->rd = wz(bits(insn, 4, 0));
+    in->rn = rz(bits(insn, 9, 5));
+    in->rm = rz(bits(insn, 20, 16));
+    in->aux = (uint8_t)bits(insn, 15, 10);
+}
+
+/* ---- Branches, exception generation and system -------------------------- */
+
+A64_DECODER(decode_b)
+{
+    in->op = bits(insn, 31, 31) ? SW_OP_BL : SW_OP_B;
+    in->imm = (int64_t)(pc + (sext(bits(insn, 25, 0), 26) << 2));
+}
+
+A64_DECODER(decode_bcond)
+{
+    in->op = SW_OP_BCOND;
+    in->aux = (uint8_t)bits(insn, 3, 0);
+    in->imm = (int64_t)(pc + (sext(bits(insn, 23, 5), 19) << 2));
+}
+
+A64_DECODER(decode_cb)
+{
+    in->op = bits(insn, 24, 24) ? SW_OP_CBNZ : SW_OP_CBZ;
+    in->flags = bits(insn, 31, 31) ? 0 : SW_F_32;
+    in->rn = rz(bits(insn, 4, 0));
+    in->imm = (int64_t)(pc + (sext(bits(insn, 23, 5), 19) << 2));
+}
+
+A64_DECODER(decode_tb)
+{
+    in->op = bits(insn, 24, 24) ? SW_OP_TBNZ : SW_OP_TBZ;
+    in->aux = (uint8_t)((bits(insn, 31, 31) << 5) | bits(insn, 23, 19));
+    in->rn = rz(bits(insn, 4, 0));
+    in->imm = (int64_t)(pc + (sext(bits(insn, 18, 5), 14) << 2));
+}
+
+/* BR / BLR / RET */
+A64_DECODER(decode_br)
+{
+    static const uint8_t ops[3] = {SW_OP_BR, SW_OP_BLR, SW_OP_RET};
+    unsigned opc = bits(insn, 22, 21);
+
+    if (opc == 3)
+        return;
+    in->op = ops[opc];
+    in->rn = rz(bits(insn, 9, 5));
+}
+
+A64_DECODER(decode_exception)
+{
+    unsigned opc = bits(insn, 23, 21), ll = bits(insn, 1, 0);
+    uint32_t imm16 = bits(insn, 20, 5);
+
+    if (opc == 0 && ll == 2)
+    {
+        in->op = SW_OP_HVC;
+        in->imm = imm16;
+    }
+    else if (opc == 0 && ll == 1)
+    {
+        in->op = SW_OP_EXC;
+        in->imm = (int64_t)ESR(EC_SVC64, imm16);
+    }
+    else if (opc == 0 && ll == 3)
+    {
+        in->op = SW_OP_EXC;
+        in->imm = (int64_t)ESR(EC_SMC64, imm16);
+    }
+    else if (opc == 1 && ll == 0)
+    {
+        in->op = SW_OP_EXC;
+        in->imm = (int64_t)ESR(EC_BRK64, imm16);
+    }
+}
+
+/* Hints: WFI traps, everything else is a NOP. That includes WFE: there
+ * is no event register, and WFE is allowed to wake up spuriously, so
+ * spin-wait loops around it just keep spinning. */
+A64_DECODER(decode_hint)
+{
+    in->op = bits(insn, 11, 5) == 3 ? SW_OP_WFI : SW_OP_NOP;
+}
+
+/* Barriers: DMB/DSB order host memory accesses for the other vCPUs,
+ * ISB needs nothing from us */
+A64_DECODER(decode_barrier)
+{
+    static const uint8_t kinds[4] = {SW_BARRIER_FULL, SW_BARRIER_LD,
+                                     SW_BARRIER_ST, SW_BARRIER_FULL};
+    unsigned op2 = bits(insn, 7, 5);
+
+    if (op2 == 2)
+    {
+        in->op = SW_OP_CLREX;
+    }
+    else if (op2 == 4 || op2 == 5)
+    {
+        in->op = SW_OP_DMB;
+        in->aux = kinds[bits(insn, 9, 8)];
+    }
+    else
+    {
+        in->op = SW_OP_NOP;
+    }
+}
+
+/* MSR (immediate) needs nothing from us */
+A64_DECODER(decode_msr_imm)
+{
+    (void)insn;
+    in->op = SW_OP_NOP;
+}
+
+/* SYS: instruction cache maintenance drops translations, rest is a NOP */
+A64_DECODER(decode_sys)
+{
+    bool ic = bits(insn, 15, 12) == 7 && bits(insn, 11, 8) == 5;
+
+    in->op = ic ? SW_OP_IC_FLUSH : SW_OP_NOP;
+}
+
+/* MRS / MSR (register) */
+A64_DECODER(decode_mrs_msr)
+{
+    bool read = bits(insn, 21, 21);
+    int reg = decode_sysreg(bits(insn, 20, 5));
+    unsigned rt = bits(insn, 4, 0);
+
+    if (reg < 0 || (!read && (reg == SW_SYSREG_CNTVCT_EL0 || reg == SW_SYSREG_CNTFRQ_EL0)))
+    {
+        in->op = SW_OP_SYSTRAP;
+        return;
+    }
+    in->op = read ? SW_OP_MRS : SW_OP_MSR;
+    in->aux = (uint8_t)reg;
+    in->rd = wz(rt);
+    in->rn = rz(rt);
+}
+
+/* ---- Loads and stores --------------------------------------------------- */
+
+/* Load/store exclusive, load-acquire/store-release, CAS */
+A64_DECODER(decode_ldst_excl)
+{
+    unsigned rt = bits(insn, 4, 0), rn = bits(insn, 9, 5);
+    unsigned size = bits(insn, 31, 30), rs = bits(insn, 20, 16);
+    bool o2 = bits(insn, 23, 23), load = bits(insn, 22, 22);
+    bool o1 = bits(insn, 21, 21), o0 = bits(insn, 15, 15);
+    unsigned rt2 = bits(insn, 14, 10);
+
+    in->rn = rsp(rn);
+    in->aux = (uint8_t)size;
+    in->flags = size == 3 ? 0 : SW_F_32;
+
+    if (o2 && !o1)
+    {
+        /* LDAR/STLR, and the LDLAR/STLLR (LOAcquire) variants */
+        in->op = load ? SW_OP_LDAR : SW_OP_STLR;
+        in->rd = load ? wz(rt) : rz(rt);
+    }
+    else if (o2)
+    {
+        if (rt2 != 31)
+            return;
+        in->op = SW_OP_CAS;
+        in->rd = rz(rt);
+        in->rm = rz(rs);
+        in->ra = wz(rs);
+    }
+    else if (o1 && size < 2)
+    {
+        /* CASP: even register pairs, each register half the access */
+        if (rt2 != 31 || (rs & 1) || (rt & 1))
+            return;
+        in->op = SW_OP_CASP;
+        in->aux = (uint8_t)(size + 2);
+        in->flags = size ? 0 : SW_F_32;
+        in->rd = (uint8_t)rt;
+        in->rm = (uint8_t)rs;
+    }
+    else if (load)
+    {
+        in->op = o1 ? SW_OP_LDXP : SW_OP_LDXR;
+        in->flags |= o0 ? SW_F_ACQ : 0;
+        in->rd = wz(rt);
+        in->ra = wz(rt2);
+    }
+    else
+    {
+        in->op = o1 ? SW_OP_STXP : SW_OP_STXR;
+        in->rd = rz(rt);
+        in->ra = rz(rt2);
+        in->rm = wz(rs);
+    }
+}
+
+/* Atomic memory operations (LSE): LDADD...LDUMIN, SWP, LDAPR */
+A64_DECODER(decode_ldst_atomic)
+{
+    unsigned o3 = bits(insn, 15, 15), opc = bits(insn, 14, 12);
+
+    in->rn = rsp(bits(insn, 9, 5));
+    in->aux = (uint8_t)bits(insn, 31, 30);
+    in->flags = in->aux == 3 ? 0 : SW_F_32;
+    in->rd = wz(bits(insn, 4, 0));
+    if (o3 && opc == 4)
+    {
+        if (bits(insn, 20, 16) != 31)
+            return;
+        in->op = SW_OP_LDAR;
+    }
+    else if (!o3 || opc == 0)
+    {
+        in->op = SW_OP_AMO;
+        in->aux2 = (uint8_t)(o3 ? SW_AMO_SWP : opc);
+        in->rm = rz(bits(insn, 20, 16));
+    }
+}
+
+/* Load register (literal) */
+A64_DECODER(decode_ld_literal)
+{
+    unsigned opc = bits(insn, 31, 30);
+
+    if (opc == 3)
+    {
+        in->op = SW_OP_NOP; /* PRFM */
+        return;
+    }
+    in->op = SW_OP_LD;
+    in->aux = opc == 1 ? 3 : 2;
+    in->flags = opc == 2 ? SW_F_SIGNED : 0;
+    in->rd = wz(bits(insn, 4, 0));
+    in->rn = SW_REG_ZR;
+    in->imm = (int64_t)(pc + (sext(bits(insn, 23, 5), 19) << 2));
+}
+
+A64_DECODER(decode_ldst_pair)
+{
+    unsigned rt = bits(insn, 4, 0), rt2 = bits(insn, 14, 10);
+    unsigned opc = bits(insn, 31, 30), type = bits(insn, 24, 23);
+    bool load = bits(insn, 22, 22);
+
+    if (opc == 3 || (opc == 1 && !load))
+        return;
+    in->op = load ? SW_OP_LDP : SW_OP_STP;
+    in->aux = opc == 2 ? 3 : 2;
+    in->flags = opc == 1 ? SW_F_SIGNED : 0;
+    if (type == 1)
+        in->flags |= SW_F_POST;
+    else if (type == 3)
+        in->flags |= SW_F_PRE;
+    in->rd = load ? wz(rt) : rz(rt);
+    in->ra = load ? wz(rt2) : rz(rt2);
+    in->rn = rsp(bits(insn, 9, 5));
+    in->imm = (int64_t)(sext(bits(insn, 21, 15), 7) << in->aux);
+}
+
+/* Load/store register (unsigned immediate) */
+A64_DECODER(decode_ldst_uimm)
+{
+    unsigned size = bits(insn, 31, 30), rt = bits(insn, 4, 0);
+    uint8_t flags;
+    int kind = decode_ldst_kind(size, bits(insn, 23, 22), &flags);
+
+    if (kind < 0)
+        return;
+    if (kind == 2)
+    {
+        in->op = SW_OP_NOP;
+        return;
+    }
+    in->op = kind ? SW_OP_LD : SW_OP_ST;
+    in->aux = (uint8_t)size;
+    in->flags = flags;
+    in->rd = kind ? wz(rt) : rz(rt);
+    in->rn = rsp(bits(insn, 9, 5));
+    in->imm = (int64_t)bits(insn, 21, 10) << size;
+}
+
+/* Load/store register (unscaled, pre/post-indexed, unprivileged) */
+A64_DECODER(decode_ldst_imm9)
+{
+    static const uint8_t ld_ops[4] = {SW_OP_LD, SW_OP_LD_POST, SW_OP_LD, SW_OP_LD_PRE};
+    static const uint8_t st_ops[4] = {SW_OP_ST, SW_OP_ST_POST, SW_OP_ST, SW_OP_ST_PRE};
+    unsigned size = bits(insn, 31, 30), rt = bits(insn, 4, 0);
+    unsigned mode = bits(insn, 11, 10);
+    uint8_t flags;
+    int kind = decode_ldst_kind(size, bits(insn, 23, 22), &flags);
+
+    if (kind < 0 || (kind == 2 && mode != 0))
+        return;
+    if (kind == 2)
+    {
+        in->op = SW_OP_NOP; /* PRFUM */
+        return;
+    }
+    in->op = kind ? ld_ops[mode] : st_ops[mode];
+    in->aux = (uint8_t)size;
+    in->flags = flags;
+    in->rd = kind ? wz(rt) : rz(rt);
+    in->rn = rsp(bits(insn, 9, 5));
+    in->imm = (int64_t)sext(bits(insn, 20, 12), 9);
+}
+
+/* Load/store register (register offset) */
+A64_DECODER(decode_ldst_reg)
+{
+    unsigned size = bits(insn, 31, 30), rt = bits(insn, 4, 0);
+    unsigned option = bits(insn, 15, 13);
+    uint8_t flags;
+    int kind = decode_ldst_kind(size, bits(insn, 23, 22), &flags);
+
+    if (kind < 0 || !(option & 2))
+        return;
+    if (kind == 2)
+    {
+        in->op = SW_OP_NOP;
+        return;
+    }
+    in->op = kind ? SW_OP_LD_REG : SW_OP_ST_REG;
+    in->aux = (uint8_t)size;
+    in->aux2 = (uint8_t)((option << 1) | bits(insn, 12, 12));
+    in->flags = flags;
+    in->rd = kind ? wz(rt) : rz(rt);
+    in->rn = rsp(bits(insn, 9, 5));
+    in->rm = rz(bits(insn, 20, 16));
+}
+
+/* Post-index writeback of a structure load/store: Rm, or `bytes` if Rm is 31 */
+static void decode_struct_post(uint32_t insn, sw_insn_t *in, unsigned bytes)
+{
+    unsigned rm = bits(insn, 20, 16);
+
+    in->flags |= SW_F_POST;
+    if (rm == 31)
+    {
+        in->flags |= SW_F_IMM;
+        in->imm = bytes;
+    }
+    else
+    {
+        in->rm = (uint8_t)rm;
+    }
+}
+
+/* Access size (log2) of a SIMD&FP register load/store, -1 if unallocated */
+static int decode_simd_size(unsigned size, unsigned opc)
+{
+    if (opc & 2)
+        return size == 0 ? 4 : -1;
+    return (int)size;
+}
+
+/* Load/store multiple structures (LD1-LD4, ST1-ST4) */
+A64_DECODER(decode_vldst_multi)
+{
+    /* Registers and elements per structure, by opcode */
+    static const uint8_t rpt[16] = {1, 0, 4, 0, 1, 0, 3, 1, 1, 0, 2};
+    static const uint8_t selem[16] = {4, 0, 1, 0, 3, 0, 1, 1, 2, 0, 1};
+    unsigned opcode = bits(insn, 15, 12), esize = bits(insn, 11, 10);
+    bool q = bits(insn, 30, 30);
+
+    if (rpt[opcode] == 0 || (esize == 3 && !q && selem[opcode] > 1))
+        return;
+    in->op = bits(insn, 22, 22) ? SW_OP_VLDN : SW_OP_VSTN;
+    in->rd = (uint8_t)bits(insn, 4, 0);
+    in->rn = rsp(bits(insn, 9, 5));
+    in->ra = (uint8_t)(rpt[opcode] * selem[opcode]);
+    in->aux = (uint8_t)esize;
+    in->aux2 = selem[opcode];
+    in->flags = q ? SW_F_Q : 0;
+    if (bits(insn, 23, 23))
+        decode_struct_post(insn, in, (q ? 16u : 8u) * in->ra);
+}
+
+/* Load/store single structure: LD1-LD4 / ST1-ST4 (one lane), LD1R-LD4R */
+A64_DECODER(decode_vldst_single)
+{
+    unsigned opcode = bits(insn, 15, 13), s = bits(insn, 12, 12);
+    unsigned selem = ((bits(insn, 13, 13) << 1) | bits(insn, 21, 21)) + 1;
+    unsigned esize = bits(insn, 11, 10), lane;
+    bool q = bits(insn, 30, 30), load = bits(insn, 22, 22);
+
+    switch (opcode >> 1)
+    {
+    case 0:
+        lane = (q << 3) | (s << 2) | esize;
+        esize = 0;
+        break;
+    case 1:
+        if (esize & 1)
+            return;
+        lane = (q << 2) | (s << 1) | (esize >> 1);
+        esize = 1;
+        break;
+    case 2:
+        if (esize == 0)
+            lane = (q << 1) | s;
+        else if (esize == 1 && !s)
+            lane = q;
+        else
+            return;
+        esize += 2;
+        break;
+    default:
+        if (!load || s)
+            return;
+        lane = 0;
+        break;
+    }
+
+    in->op = opcode >= 6 ? SW_OP_VLDR : load ? SW_OP_VLD_LANE : SW_OP_VST_LANE;
+    in->rd = (uint8_t)bits(insn, 4, 0);
+    in->rn = rsp(bits(insn, 9, 5));
+    in->ra = (uint8_t)selem;
+    in->aux = (uint8_t)esize;
+    in->aux2 = (uint8_t)lane;
+    in->flags = opcode >= 6 && q ? SW_F_Q : 0;
+    if (bits(insn, 23, 23))
+        decode_struct_post(insn, in, selem << esize);
+}
+
+/* Load SIMD&FP register (literal) */
+A64_DECODER(decode_vld_literal)
+{
+    unsigned size = bits(insn, 31, 30);
+
+    if (size == 3)
+        return;
+    in->op = SW_OP_VLD;
+    in->aux = (uint8_t)(2 + size);
+    in->rd = (uint8_t)bits(insn, 4, 0);
+    in->rn = SW_REG_ZR;
+    in->imm = (int64_t)(pc + (sext(bits(insn, 23, 5), 19) << 2));
+}
+
+A64_DECODER(decode_vldst_pair)
+{
+    unsigned size = bits(insn, 31, 30), type = bits(insn, 24, 23);
+
+    if (size == 3)
+        return;
+    in->op = bits(insn, 22, 22) ? SW_OP_VLDP : SW_OP_VSTP;
+    in->aux = (uint8_t)(2 + size);
+    if (type == 1)
+        in->flags = SW_F_POST;
+    else if (type == 3)
+        in->flags = SW_F_PRE;
+    in->rd = (uint8_t)bits(insn, 4, 0);
+    in->ra = (uint8_t)bits(insn, 14, 10);
+    in->rn = rsp(bits(insn, 9, 5));
+    in->imm = (int64_t)(sext(bits(insn, 21, 15), 7) << in->aux);
+}
+
+A64_DECODER(decode_vldst_uimm)
+{
+    unsigned opc = bits(insn, 23, 22);
+    int log2 = decode_simd_size(bits(insn, 31, 30), opc);
+
+    if (log2 < 0)
+        return;
+    in->op = (opc & 1) ? SW_OP_VLD : SW_OP_VST;
+    in->aux = (uint8_t)log2;
+    in->rd = (uint8_t)bits(insn, 4, 0);
+    in->rn = rsp(bits(insn, 9, 5));
+    in->imm = (int64_t)bits(insn, 21, 10) << log2;
+}
+
+A64_DECODER(decode_vldst_imm9)
+{
+    unsigned opc = bits(insn, 23, 22), mode = bits(insn, 11, 10);
+    int log2 = decode_simd_size(bits(insn, 31, 30), opc);
+
+    if (log2 < 0 || mode == 2)
+        return;
+    in->op = (opc & 1) ? SW_OP_VLD : SW_OP_VST;
+    in->aux = (uint8_t)log2;
+    if (mode == 1)
+        in->flags = SW_F_POST;
+    else if (mode == 3)
+        in->flags = SW_F_PRE;
+    in->rd = (uint8_t)bits(insn, 4, 0);
+    in->rn = rsp(bits(insn, 9, 5));
+    in->imm = (int64_t)sext(bits(insn, 20, 12), 9);
+}
+
+A64_DECODER(decode_vldst_reg)
+{
+    unsigned opc = bits(insn, 23, 22), option = bits(insn, 15, 13);
+    int log2 = decode_simd_size(bits(insn, 31, 30), opc);
+
+    if (log2 < 0 || !(option & 2))
+        return;
+    in->op = (opc & 1) ? SW_OP_VLD_REG : SW_OP_VST_REG;
+    in->aux = (uint8_t)log2;
+    in->aux2 = (uint8_t)((option << 1) | bits(insn, 12, 12));
+    in->rd = (uint8_t)bits(insn, 4, 0);
+    in->rn = rsp(bits(insn, 9, 5));
+    in->rm = rz(bits(insn, 20, 16));
+}
+
+/* ---- Data processing (register) ----------------------------------------- */
+
+/* Operand width and Rd/Rn/Rm, as most of the classes below use them */
+static void decode_rrr(uint32_t insn, sw_insn_t *in)
+{
+    in->flags = bits(insn, 31, 31) ? 0 : SW_F_32;
+    in->rd = wz(bits(insn, 4, 0));
+    in->rn = rz(bits(insn, 9, 5));
+    in->rm = rz(bits(insn, 20, 16));
+}
+
+A64_DECODER(decode_logic_sreg)
+{
+    static const uint8_t ops[4] = {SW_OP_AND_SREG, SW_OP_ORR_SREG,
+                                   SW_OP_EOR_SREG, SW_OP_ANDS_SREG};
+
+    if (!bits(insn, 31, 31) && bits(insn, 15, 15))
+        return;
+    decode_rrr(insn, in);
+    in->op = ops[bits(insn, 30, 29)];
+    in->aux = (uint8_t)bits(insn, 23, 22);
+    in->aux2 = (uint8_t)bits(insn, 15, 10);
+    if (bits(insn, 21, 21))
+        in->flags |= SW_F_INV;
+}
+
+A64_DECODER(decode_addsub_sreg)
+{
+    static const uint8_t ops[4] = {SW_OP_ADD_SREG, SW_OP_ADDS_SREG,
+                                   SW_OP_SUB_SREG, SW_OP_SUBS_SREG};
+
+    if (bits(insn, 23, 22) == 3 || (!bits(insn, 31, 31) && bits(insn, 15, 15)))
+        return;
+    decode_rrr(insn, in);
+    in->op = ops[bits(insn, 30, 29)];
+    in->aux = (uint8_t)bits(insn, 23, 22);
+    in->aux2 = (uint8_t)bits(insn, 15, 10);
+}
+
+A64_DECODER(decode_addsub_ereg)
+{
+    static const uint8_t ops[4] = {SW_OP_ADD_EREG, SW_OP_ADDS_EREG,
+                                   SW_OP_SUB_EREG, SW_OP_SUBS_EREG};
+    unsigned rd = bits(insn, 4, 0);
+
+    if (bits(insn, 23, 22) != 0 || bits(insn, 12, 10) > 4)
+        return;
+    decode_rrr(insn, in);
+    in->op = ops[bits(insn, 30, 29)];
+    in->rd = bits(insn, 29, 29) ? wz(rd) : rsp(rd);
+    in->rn = rsp(bits(insn, 9, 5));
+    in->aux = (uint8_t)bits(insn, 15, 13);
+    in->aux2 = (uint8_t)bits(insn, 12, 10);
+}
+
+/* Add/subtract with carry */
+A64_DECODER(decode_adc)
+{
+    static const uint8_t ops[4] = {SW_OP_ADC, SW_OP_ADCS, SW_OP_SBC, SW_OP_SBCS};
+
+    decode_rrr(insn, in);
+    in->op = ops[bits(insn, 30, 29)];
+}
+
+/* Conditional compare (register / immediate) */
+A64_DECODER(decode_ccmp)
+{
+    decode_rrr(insn, in);
+    in->op = bits(insn, 30, 30) ? SW_OP_CCMP : SW_OP_CCMN;
+    in->aux = (uint8_t)bits(insn, 15, 12);
+    in->aux2 = (uint8_t)bits(insn, 3, 0);
+    if (bits(insn, 11, 11))
+    {
+        in->flags |= SW_F_IMM;
+        in->imm = bits(insn, 20, 16);
+    }
+}
+
+A64_DECODER(decode_csel)
+{
+    static const uint8_t ops[4] = {SW_OP_CSEL, SW_OP_CSINC, SW_OP_CSINV, SW_OP_CSNEG};
+    unsigned op2 = bits(insn, 11, 10);
+
+    if (op2 > 1)
+        return;
+    decode_rrr(insn, in);
+    in->op = ops[(bits(insn, 30, 30) << 1) | op2];
+    in->aux = (uint8_t)bits(insn, 15, 12);
+}
+
+/* Data processing (2 source) */
+A64_DECODER(decode_dp2)
+{
+    decode_rrr(insn, in);
+    switch (bits(insn, 15, 10))
+    {
+    case 0x02: in->op = SW_OP_UDIV; break;
+    case 0x03: in->op = SW_OP_SDIV; break;
+    case 0x08: in->op = SW_OP_LSLV; break;
+    case 0x09: in->op = SW_OP_LSRV; break;
+    case 0x0a: in->op = SW_OP_ASRV; break;
+    case 0x0b: in->op = SW_OP_RORV; break;
+    default: break;
+    }
+}
+
+/* Data processing (1 source) */
+A64_DECODER(decode_dp1)
+{
+    bool sf = bits(insn, 31, 31);
+
+    decode_rrr(insn, in);
+    switch (bits(insn, 15, 10))
+    {
+    case 0: in->op = SW_OP_RBIT; break;
+    case 1: in->op = SW_OP_REV16; break;
+    case 2: in->op = sf ? SW_OP_REV32 : SW_OP_REV; break;
+    case 3: in->op = sf ? SW_OP_REV : SW_OP_UNDEF; break;
+    case 4: in->op = SW_OP_CLZ; break;
+    case 5: in->op = SW_OP_CLS; break;
+    default: break;
+    }
+}
+
+/* Data processing (3 source) */
+A64_DECODER(decode_dp3)
+{
+    bool sf = bits(insn, 31, 31);
+
+    decode_rrr(insn, in);
+    in->ra = rz(bits(insn, 14, 10));
+    switch ((bits(insn, 23, 21) << 1) | bits(insn, 15, 15))
+    {
+    case 0x0: in->op = SW_OP_MADD; break;
+    case 0x1: in->op = SW_OP_MSUB; break;
+    case 0x2: in->op = sf ? SW_OP_SMADDL : SW_OP_UNDEF; break;
+    case 0x3: in->op = sf ? SW_OP_SMSUBL : SW_OP_UNDEF; break;
+    case 0x4: in->op = sf ? SW_OP_SMULH : SW_OP_UNDEF; break;
+    case 0xa: in->op = sf ? SW_OP_UMADDL : SW_OP_UNDEF; break;
+    case 0xb: in->op = sf ? SW_OP_UMSUBL : SW_OP_UNDEF; break;
+    case 0xc: in->op = sf ? SW_OP_UMULH : SW_OP_UNDEF; break;
+    default: break;
+    }
+}
+
+/* ---- AdvSIMD (integer groups) and FMOV to/from X registers -------------- */
+
+/* AdvSIMDExpandImm(): the 64-bit pattern of a modified immediate */
+static uint64_t simd_expand_imm(unsigned op, unsigned cmode, uint64_t imm8)
+{
+    uint64_t imm;
+
+    switch (cmode >> 1)
+    {
+    case 0: case 1: case 2: case 3:
+        imm = imm8 << (8 * (cmode >> 1));
+        return imm | imm << 32;
+    case 4: case 5:
+        imm = imm8 << (8 * ((cmode >> 1) & 1));
+        return imm * 0x0001000100010001ull;
+    case 6:
+        imm = (cmode & 1) ? (imm8 << 16) | 0xffff : (imm8 << 8) | 0xff;
+        return imm | imm << 32;
+    default:
+        if (!(cmode & 1) && !op)
+            return imm8 * 0x0101010101010101ull;
+        if (!(cmode & 1))
+        {
+            imm = 0;
+            for (unsigned i = 0; i < 8; i++)
+                imm |= ((imm8 >> i) & 1) ? 0xffull << (8 * i) : 0;
+            return imm;
+        }
+        if (!op)
+        {
+            /* FMOV (vector, single precision) */
+            imm = ((imm8 & 0x80) << 24) | (((imm8 >> 6) & 1) ? 0x3e000000 : 0x40000000) |
+                  ((imm8 & 0x3f) << 19);
+            return imm | imm << 32;
+        }
+        /* FMOV (vector, double precision) */
+        return ((imm8 & 0x80) << 56) | (((imm8 >> 6) & 1) ? 0x3fc0000000000000ull : 0x4000000000000000ull) |
+               ((imm8 & 0x3f) << 48);
+    }
+}
+
+/* Vd/Vn/Vm, element size and Q, as most of the classes below use them */
+static void decode_vrrr(uint32_t insn, sw_insn_t *in)
+{
+    in->rd = (uint8_t)bits(insn, 4, 0);
+    in->rn = (uint8_t)bits(insn, 9, 5);
+    in->rm = (uint8_t)bits(insn, 20, 16);
+    in->aux = (uint8_t)bits(insn, 23, 22);
+    in->flags = bits(insn, 30, 30) ? SW_F_Q : 0;
+}
+
+/* FMOV between a general register and (part of) a vector register */
+A64_DECODER(decode_fmov_gen)
+{
+    unsigned sf = bits(insn, 31, 31), type = bits(insn, 23, 22), rmode = bits(insn, 20, 19);
+    unsigned opcode = bits(insn, 18, 16);
+
+    if (opcode != 6 && opcode != 7)
+        return;
+    decode_vrrr(insn, in);
+    if (!sf && type == 0 && rmode == 0)
+        in->aux = 2;
+    else if (sf && type == 1 && rmode == 0)
+        in->aux = 3;
+    else if (sf && type == 2 && rmode == 1)
+        in->aux = 3, in->aux2 = 1;
+    else
+        return;
+
+    in->flags = 0;
+    if (opcode == 6)
+    {
+        in->op = SW_OP_VUMOV;
+        in->rd = wz(bits(insn, 4, 0));
+    }
+    else
+    {
+        in->op = in->aux2 ? SW_OP_VINS_GEN : SW_OP_VFMOV_GEN;
+        in->rn = rz(bits(insn, 9, 5));
+    }
+}
+
+/* ADDP (scalar): Dd = Vn.d[0] + Vn.d[1] */
+A64_DECODER(decode_addp_scalar)
+{
+    decode_vrrr(insn, in);
+    in->op = SW_OP_VADDP_D;
+    in->aux = 3;
+}
+
+/* Three registers, same type */
+A64_DECODER(decode_v3same)
+{
+    unsigned size = bits(insn, 23, 22);
+    bool q = bits(insn, 30, 30), u = bits(insn, 29, 29);
+    uint8_t op = SW_OP_UNDEF;
+
+    decode_vrrr(insn, in);
+    switch (bits(insn, 15, 11))
+    {
+    case 0x01: op = u ? SW_OP_VUQADD : SW_OP_VSQADD; break;
+    case 0x05: op = u ? SW_OP_VUQSUB : SW_OP_VSQSUB; break;
+    case 0x06: op = u ? SW_OP_VCMHI : SW_OP_VCMGT; break;
+    case 0x07: op = u ? SW_OP_VCMHS : SW_OP_VCMGE; break;
+    case 0x0c: op = size == 3 ? SW_OP_UNDEF : u ? SW_OP_VUMAX : SW_OP_VSMAX; break;
+    case 0x0d: op = size == 3 ? SW_OP_UNDEF : u ? SW_OP_VUMIN : SW_OP_VSMIN; break;
+    case 0x10: op = u ? SW_OP_VSUB : SW_OP_VADD; break;
+    case 0x11: op = u ? SW_OP_VCMEQ : SW_OP_VCMTST; break;
+    case 0x12: op = size == 3 ? SW_OP_UNDEF : u ? SW_OP_VMLS : SW_OP_VMLA; break;
+    case 0x13: op = size == 3 || u ? SW_OP_UNDEF : SW_OP_VMUL; break;
+    case 0x14: op = size == 3 ? SW_OP_UNDEF : u ? SW_OP_VUMAXP : SW_OP_VSMAXP; break;
+    case 0x15: op = size == 3 ? SW_OP_UNDEF : u ? SW_OP_VUMINP : SW_OP_VSMINP; break;
+    case 0x17: op = u ? SW_OP_UNDEF : SW_OP_VADDP; break;
+    case 0x03:
+    {
+        static const uint8_t ops[8] = {SW_OP_VAND, SW_OP_VBIC, SW_OP_VORR, SW_OP_VORN,
+                                       SW_OP_VEOR, SW_OP_VBSL, SW_OP_VBIT, SW_OP_VBIF};
+        in->op = ops[(u << 2) | size];
+        return;
+    }
+    }
+    if (size == 3 && !q)
+        return;
+    in->op = op;
+}
+
+/* Two registers, miscellaneous */
+A64_DECODER(decode_v2misc)
+{
+    unsigned size = bits(insn, 23, 22);
+    bool q = bits(insn, 30, 30), u = bits(insn, 29, 29);
+    uint8_t op = SW_OP_UNDEF;
+
+    decode_vrrr(insn, in);
+    switch (bits(insn, 16, 12))
+    {
+    case 0x00: /* REV64 / REV32 */
+        if (size >= (u ? 2u : 3u))
+            return;
+        in->op = SW_OP_VREV;
+        in->aux2 = u ? 2 : 3;
+        return;
+    case 0x01: /* REV16 */
+        if (u || size != 0)
+            return;
+        in->op = SW_OP_VREV;
+        in->aux2 = 1;
+        return;
+    case 0x04: op = u && size != 3 ? SW_OP_VCLZ : SW_OP_UNDEF; break;
+    case 0x05:
+        if (!u && size == 0)
+            op = SW_OP_VCNT;
+        else if (u && size == 0)
+            op = SW_OP_VNOT;
+        else if (u && size == 1)
+        {
+            op = SW_OP_VRBIT;
+            in->aux = 0;
+        }
+        break;
+    case 0x08:
+        op = SW_OP_VCMZ;
+        in->aux2 = u ? SW_CMZ_GE : SW_CMZ_GT;
+        break;
+    case 0x09:
+        op = SW_OP_VCMZ;
+        in->aux2 = u ? SW_CMZ_LE : SW_CMZ_EQ;
+        break;
+    case 0x0a:
+        op = u ? SW_OP_UNDEF : SW_OP_VCMZ;
+        in->aux2 = SW_CMZ_LT;
+        break;
+    case 0x0b: op = u ? SW_OP_VNEG : SW_OP_VABS; break;
+    case 0x12: op = u || size == 3 ? SW_OP_UNDEF : SW_OP_VXTN; break;
+    }
+    if (size == 3 && !q)
+        return;
+    in->op = op;
+}
+
+/* Across lanes */
+A64_DECODER(decode_vacross)
+{
+    unsigned size = bits(insn, 23, 22);
+    bool q = bits(insn, 30, 30), u = bits(insn, 29, 29);
+    uint8_t op = SW_OP_UNDEF;
+
+    decode_vrrr(insn, in);
+    switch (bits(insn, 16, 12))
+    {
+    case 0x03: op = u ? SW_OP_VUADDLV : SW_OP_VSADDLV; break;
+    case 0x0a: op = u ? SW_OP_VUMAXV : SW_OP_VSMAXV; break;
+    case 0x1a: op = u ? SW_OP_VUMINV : SW_OP_VSMINV; break;
+    case 0x1b: op = u ? SW_OP_UNDEF : SW_OP_VADDV; break;
+    }
+    if (size == 3 || (size == 2 && !q))
+        return;
+    in->op = op;
+}
+
+/* Copy: DUP, INS, UMOV, SMOV */
+A64_DECODER(decode_vcopy)
+{
+    unsigned imm5 = bits(insn, 20, 16), imm4 = bits(insn, 14, 11);
+    unsigned esize = (unsigned)__builtin_ctz(imm5 | 0x20);
+    unsigned lane = imm5 >> (esize + 1);
+    bool q = bits(insn, 30, 30);
+
+    if (esize > 3)
+        return;
+    decode_vrrr(insn, in);
+    in->aux = (uint8_t)esize;
+    in->aux2 = (uint8_t)lane;
+
+    if (bits(insn, 29, 29))
+    {
+        if (!q)
+            return;
+        in->op = SW_OP_VINS_ELEM;
+        in->ra = (uint8_t)(imm4 >> esize);
+        return;
+    }
+
+    switch (imm4)
+    {
+    case 0x0:
+        if (esize == 3 && !q)
+            return;
+        in->op = SW_OP_VDUP_ELEM;
+        return;
+    case 0x1:
+        if (esize == 3 && !q)
+            return;
+        in->op = SW_OP_VDUP_GEN;
+        in->rn = rz(bits(insn, 9, 5));
+        return;
+    case 0x3:
+        if (!q)
+            return;
+        in->op = SW_OP_VINS_GEN;
+        in->rn = rz(bits(insn, 9, 5));
+        return;
+    case 0x5:
+    case 0x7:
+        /* SMOV: W for bytes/halves, X for up to words. UMOV: X only
+         * for doublewords */
+        if (imm4 == 0x5 ? esize >= (q ? 3u : 2u) : (esize == 3) != q)
+            return;
+        in->op = imm4 == 0x5 ? SW_OP_VSMOV : SW_OP_VUMOV;
+        in->flags = q ? 0 : SW_F_32;
+        in->rd = wz(bits(insn, 4, 0));
+        return;
+    }
+}
+
+/* Permute: UZP, TRN, ZIP */
+A64_DECODER(decode_vperm)
+{
+    static const uint8_t ops[8] = {SW_OP_UNDEF, SW_OP_VUZP1, SW_OP_VTRN1, SW_OP_VZIP1,
+                                   SW_OP_UNDEF, SW_OP_VUZP2, SW_OP_VTRN2, SW_OP_VZIP2};
+
+    if (bits(insn, 23, 22) == 3 && !bits(insn, 30, 30))
+        return;
+    decode_vrrr(insn, in);
+    in->op = ops[bits(insn, 14, 12)];
+}
+
+A64_DECODER(decode_vext)
+{
+    unsigned index = bits(insn, 14, 11);
+
+    if (!bits(insn, 30, 30) && index >= 8)
+        return;
+    decode_vrrr(insn, in);
+    in->op = SW_OP_VEXT;
+    in->aux2 = (uint8_t)index;
+}
+
+/* TBL / TBX */
+A64_DECODER(decode_vtbl)
+{
+    decode_vrrr(insn, in);
+    in->op = bits(insn, 12, 12) ? SW_OP_VTBX : SW_OP_VTBL;
+    in->ra = (uint8_t)(bits(insn, 14, 13) + 1);
+}
+
+/* Modified immediate: MOVI, MVNI, ORR, BIC, FMOV */
+A64_DECODER(decode_vmodimm)
+{
+    unsigned cmode = bits(insn, 15, 12);
+    bool q = bits(insn, 30, 30), u = bits(insn, 29, 29);
+    uint64_t imm8 = (bits(insn, 18, 16) << 5) | bits(insn, 9, 5);
+    uint64_t imm = simd_expand_imm(u, cmode, imm8);
+    bool orr_bic = cmode < 12 && (cmode & 1);
+
+    if (bits(insn, 11, 11) || (cmode == 15 && u && !q))
+        return;
+    decode_vrrr(insn, in);
+    if (orr_bic)
+        in->op = u ? SW_OP_VBIC_IMM : SW_OP_VORR_IMM;
+    else
+        in->op = SW_OP_VMOVI;
+    /* MVNI: the inverted pattern */
+    if (!orr_bic && u && cmode < 14)
+        imm = ~imm;
+    in->imm = (int64_t)imm;
+}
+
+/* Shift by immediate */
+A64_DECODER(decode_vshift)
+{
+    unsigned immh = bits(insn, 22, 19), immhb = bits(insn, 22, 16);
+    unsigned esize = 31 - (unsigned)__builtin_clz(immh);
+    unsigned right = (16u << esize) - immhb, left = immhb - (8u << esize);
+    bool q = bits(insn, 30, 30), u = bits(insn, 29, 29);
+    uint8_t op = SW_OP_UNDEF;
+
+    decode_vrrr(insn, in);
+    in->aux = (uint8_t)esize;
+    switch (bits(insn, 15, 11))
+    {
+    case 0x00: op = u ? SW_OP_VUSHR : SW_OP_VSSHR, in->aux2 = (uint8_t)right; break;
+    case 0x02: op = u ? SW_OP_VUSRA : SW_OP_VSSRA, in->aux2 = (uint8_t)right; break;
+    case 0x0a: op = u ? SW_OP_UNDEF : SW_OP_VSHL, in->aux2 = (uint8_t)left; break;
+    case 0x10:
+        op = u || esize == 3 ? SW_OP_UNDEF : SW_OP_VSHRN, in->aux2 = (uint8_t)right;
+        break;
+    case 0x14:
+        op = esize == 3 ? SW_OP_UNDEF : u ? SW_OP_VUSHLL : SW_OP_VSSHLL, in->aux2 = (uint8_t)left;
+        break;
+    }
+    if (esize == 3 && !q)
+        return;
+    in->op = op;
+}
+
+#undef A64_DECODER
+
+/* ---- Decode tree -------------------------------------------------------- */
+
+/* One row of a64.def per encoding class */
+enum
+{
+#define A64(name, pattern, decode) A64_##name,
+#include "a64.def"
+#undef A64
+    A64_ROWS
+};
+
+static void (*const a64_decoders[A64_ROWS])(uint32_t, uint64_t, sw_insn_t *) = {
+#define A64(name, pattern, decode) decode,
+#include "a64.def"
+#undef A64
+};
+
+/* a64_decode_row(): generated from a64.def by a64gen */
+#include "a64dec.h"
+
+/* Does `op` end a block? Branches, traps, and anything unallocated. */
+static bool sw_op_ends_block(uint8_t op)
+{
+    switch (op)
+    {
+    case SW_OP_B: case SW_OP_BL: case SW_OP_BCOND:
+    case SW_OP_CBZ: case SW_OP_CBNZ: case SW_OP_TBZ: case SW_OP_TBNZ:
+    case SW_OP_BR: case SW_OP_BLR: case SW_OP_RET:
+    case SW_OP_HVC: case SW_OP_EXC: case SW_OP_WFI:
+    case SW_OP_SYSTRAP: case SW_OP_IC_FLUSH: case SW_OP_UNDEF:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Decode one instruction at `pc` into `in`: one walk of the generated
+ * tree picks the encoding class, whose decoder extracts the fields.
+ * Returns true if the instruction ends the block.
+ */
+static bool sw_decode(uint32_t insn, uint64_t pc, sw_insn_t *in)
+{
+    int row = a64_decode_row(insn);
+
+    memset(in, 0, sizeof(*in));
+    in->raw = insn;
+    in->op = SW_OP_UNDEF;
+    if (row >= 0)
+        a64_decoders[row](insn, pc, in);
+    return sw_op_ends_block(in->op);
+}
+
+/* ============================================================================
+ * Interpreter
+ * ============================================================================ */
+
+static uint64_t read_cntvct(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * SW_CNTFRQ + (uint64_t)ts.tv_nsec * (SW_CNTFRQ / 1000000) / 1000;
+}
+
+/* Instructions per second in icount mode */
+static uint64_t icount_rate(const sw_cpu_t *cpu)
+{
+    return (uint64_t)cpu->icount_mips * 1000000;
+}
+
+/* CNTVCT_EL0 once `done` more instructions of the current block retired */
+static uint64_t sw_cntvct(const sw_cpu_t *cpu, uint64_t done)
+{
+    if (cpu->icount_mips == 0)
+        return read_cntvct();
+    return cpu->icount_bias +
+           (uint64_t)((unsigned __int128)(cpu->insns + done) * SW_CNTFRQ / icount_rate(cpu));
+}
+
+static bool vtimer_armed(const sw_cpu_t *cpu)
+{
+    return (cpu->cntv_ctl & (CNTV_CTL_ENABLE | CNTV_CTL_IMASK)) == CNTV_CTL_ENABLE;
+}
+
+/*
+ * After the guest programmed the timer: work out the instruction count
+ * at which CNTVCT reaches CVAL, so the run loop finds the deadline with
+ * one compare per block instead of reading the counter.
+ */
+static void vtimer_update(sw_cpu_t *cpu)
+{
+    cpu->icount_deadline = UINT64_MAX;
+    if (cpu->icount_mips == 0 || !vtimer_armed(cpu))
+        return;
+    if (cpu->cntv_cval <= cpu->icount_bias)
+    {
+        cpu->icount_deadline = 0;
+        return;
+    }
+
+    /* The first count n with n * CNTFRQ / rate >= CVAL - bias */
+    unsigned __int128 n = ((unsigned __int128)(cpu->cntv_cval - cpu->icount_bias) *
+                               icount_rate(cpu) + SW_CNTFRQ - 1) / SW_CNTFRQ;
+    if (n < UINT64_MAX)
+        cpu->icount_deadline = (uint64_t)n;
+}
+
+/* Leave the block at `in` (not retired) with a synchronous exception */
+static int sw_raise(sw_cpu_t *cpu, const sw_block_t *b, const sw_insn_t *in,
+                    uint64_t syndrome, uint64_t far)
+{
+    cpu->pc = b->pc + (int64_t)in->pc_off;
+    cpu->insns += (uint64_t)(in - b->ops);
+    cpu->exit_syndrome = syndrome;
+    cpu->exit_fault_addr = far;
+    return SW_CONT_EXIT;
+}
+
+static int sw_data_abort(sw_cpu_t *cpu, const sw_block_t *b, const sw_insn_t *in,
+                         uint64_t addr, bool write)
+{
+    /* ISV=1 with size/register info, so the VMM could emulate MMIO */
+    uint32_t iss = (1u << 24) | ((uint32_t)in->aux << 22) |
+                   ((in->flags & SW_F_SIGNED) ? 1u << 21 : 0) |
+                   ((uint32_t)(in->raw & 0x1f) << 16) |
+                   ((in->flags & SW_F_32) ? 0 : 1u << 15) |
+                   (write ? 1u << 6 : 0);
+    if (in->op == SW_OP_LDP || in->op == SW_OP_STP || in->op >= SW_OP_VLD ||
+        (in->op >= SW_OP_LDXR && in->op <= SW_OP_AMO))
+        iss = write ? 1u << 6 : 0;
+    /* Post-copy: not ours to emulate, the VMM fetches the page */
+    if (cpu->absent_fault)
+    {
+        cpu->absent_fault = false;
+        iss = (write ? 1u << 6 : 0) | SW_FSC_ABSENT;
+        addr = cpu->absent_addr;
+    }
+    return sw_raise(cpu, b, in, ESR(EC_DABORT_LOWER, iss), addr);
+}
+
+/* Alignment fault (DFSC 0b100001) of an atomic access */
+static int sw_align_fault(sw_cpu_t *cpu, const sw_block_t *b, const sw_insn_t *in,
+                          uint64_t addr, bool write)
+{
+    return sw_raise(cpu, b, in, ESR(EC_DABORT_LOWER, (write ? 1u << 6 : 0) | 0x21), addr);
+}
+
+/*
+ * LDAR/STLR, exclusives, CAS and the LSE atomics (see "Atomics" above).
+ * Returns false after raising a data abort.
+ */
+static bool sw_exec_atomic(sw_cpu_t *cpu, const sw_block_t *b, const sw_insn_t *in)
+{
+    uint64_t *x = cpu->x;
+    uint64_t addr = x[in->rn];
+    unsigned size = in->aux;
+    bool pair = in->op == SW_OP_LDXP || in->op == SW_OP_STXP || in->op == SW_OP_CASP;
+    bool write = in->op != SW_OP_LDAR && in->op != SW_OP_LDXR && in->op != SW_OP_LDXP;
+    unsigned total = size + pair;
+    uint8_t *p;
+
+    if (!mem_ok(cpu, addr, 1ull << total))
+    {
+        sw_data_abort(cpu, b, in, addr, write);
+        return false;
+    }
+    if (!mem_aligned(addr, total))
+    {
+        sw_align_fault(cpu, b, in, addr, write);
+        return false;
+    }
+    if (!note_access(cpu, addr, 1ull << total))
+    {
+        sw_data_abort(cpu, b, in, addr, write);
+        return false;
+    }
+    p = cpu->mem + addr;
+    if (write)
+        note_store(cpu, addr, 1ull << total);
+
+    switch (in->op)
+    {
+    case SW_OP_LDAR:
+        x[in->rd] = amo_load(p, size, true);
+        break;
+
+    case SW_OP_STLR:
+        amo_store(p, size, x[in->rd]);
+        break;
+
+    case SW_OP_LDXR:
+    case SW_OP_LDXP:
+    {
+        bool acquire = in->flags & SW_F_ACQ;
+
+        if (in->op == SW_OP_LDXR)
+        {
+            cpu->excl_val[0] = amo_load(p, size, acquire);
+            x[in->rd] = cpu->excl_val[0];
+        }
+        else if (size == 2)
+        {
+            /* Both words in one load: the pair is single-copy atomic */
+            cpu->excl_val[0] = amo_load(p, 3, acquire);
+            x[in->rd] = (uint32_t)cpu->excl_val[0];
+            x[in->ra] = cpu->excl_val[0] >> 32;
+        }
+        else
+        {
+            /* The halves may tear; STXP then fails and the guest retries */
+            cpu->excl_val[0] = amo_load(p, 3, acquire);
+            cpu->excl_val[1] = amo_load(p + 8, 3, acquire);
+            x[in->rd] = cpu->excl_val[0];
+            x[in->ra] = cpu->excl_val[1];
+        }
+        cpu->excl_addr = addr;
+        cpu->excl_size = total;
+        break;
+    }
+
+    case SW_OP_STXR:
+    case SW_OP_STXP:
+    {
+        bool ok = cpu->excl_addr == addr && cpu->excl_size == total;
+
+        if (ok && in->op == SW_OP_STXR)
+            ok = amo_cas(p, size, cpu->excl_val[0], x[in->rd]) == cpu->excl_val[0];
+        else if (ok && size == 2)
+            ok = amo_cas(p, 3, cpu->excl_val[0],
+                         (uint32_t)x[in->rd] | (x[in->ra] << 32)) == cpu->excl_val[0];
+        else if (ok)
+            ok = amo_cas128(p, cpu->excl_val, x[in->rd], x[in->ra]);
+
+        cpu->excl_addr = SW_EXCL_NONE;
+        cpu->excl_fails += !ok;
+        x[in->rm] = !ok;
+        break;
+    }
+
+    case SW_OP_CAS:
+        x[in->ra] = amo_cas(p, size, x[in->rm], x[in->rd]);
+        break;
+
+    case SW_OP_CASP:
+    {
+        uint64_t cmp_lo = x[rz(in->rm)], cmp_hi = x[rz(in->rm + 1u)];
+        uint64_t new_lo = x[rz(in->rd)], new_hi = x[rz(in->rd + 1u)];
+        uint64_t old[2] = {cmp_lo, cmp_hi};
+
+        if (size == 2)
+        {
+            uint64_t v = amo_cas(p, 3, (uint32_t)cmp_lo | (cmp_hi << 32),
+                                 (uint32_t)new_lo | (new_hi << 32));
+            old[0] = (uint32_t)v;
+            old[1] = v >> 32;
+        }
+        else
+        {
+            amo_cas128(p, old, new_lo, new_hi);
+        }
+        x[wz(in->rm)] = old[0];
+        x[wz(in->rm + 1u)] = old[1];
+        break;
+    }
+
+    default: /* SW_OP_AMO */
+        x[in->rd] = amo_rmw(p, size, in->aux2, x[in->rm]);
+        break;
+    }
+    return true;
+}
+
+/* Syndrome for a trapped MRS/MSR, as the hardware would report it */
+static uint64_t systrap_syndrome(uint32_t raw)
+{
+    uint32_t op0 = bits(raw, 20, 19), op1 = bits(raw, 18, 16), crn = bits(raw, 15, 12);
+    uint32_t crm = bits(raw, 11, 8), op2 = bits(raw, 7, 5), rt = bits(raw, 4, 0);
+    uint32_t iss = (op0 << 20) | (op2 << 17) | (op1 << 14) | (crn << 10) |
+                   (rt << 5) | (crm << 1) | bits(raw, 21, 21);
+    return ESR(EC_SYS64, iss);
+}
+
+/* ============================================================================
+ * AdvSIMD
+ * ============================================================================ */
+
+/* Post-index writeback of structure and single-lane accesses */
+static inline void simd_struct_writeback(sw_cpu_t *cpu, const sw_insn_t *in)
+{
+    if (in->flags & SW_F_POST)
+        cpu->x[in->rn] += (in->flags & SW_F_IMM) ? (uint64_t)in->imm : cpu->x[in->rm];
+}
+
+/* LD1-LD4 / ST1-ST4 (multiple structures), address already checked */
+static void simd_ldst_struct(sw_cpu_t *cpu, const sw_insn_t *in, uint8_t *p, bool load)
+{
+    unsigned selem = in->aux2, rpt = in->ra / selem;
+    unsigned ebytes = 1u << in->aux, datasize = (in->flags & SW_F_Q) ? 16 : 8;
+
+    /* One register per structure element: plain copies */
+    if (selem == 1)
+    {
+        for (unsigned r = 0; r < rpt; r++, p += datasize)
+        {
+            sw_vreg_t *v = &cpu->v[(in->rd + r) % SW_NUM_VREGS];
+            if (load)
+            {
+                v->d[1] = 0;
+                memcpy(v->b, p, datasize);
+            }
+            else
+            {
+                memcpy(p, v->b, datasize);
+            }
+        }
+        return;
+    }
+
+    /* LD2-LD4: element e of structure register s is at p[(e * selem + s) * ebytes] */
+    if (load)
+    {
+        for (unsigned s = 0; s < selem; s++)
+            memset(&cpu->v[(in->rd + s) % SW_NUM_VREGS], 0, sizeof(sw_vreg_t));
+    }
+    for (unsigned e = 0; e < datasize / ebytes; e++)
+    {
+        for (unsigned s = 0; s < selem; s++, p += ebytes)
+        {
+            sw_vreg_t *v = &cpu->v[(in->rd + s) % SW_NUM_VREGS];
+            if (load)
+                memcpy(&v->b[e * ebytes], p, ebytes);
+            else
+                memcpy(p, &v->b[e * ebytes], ebytes);
+        }
+    }
+}
+
+/*
+ * Execute an AdvSIMD data-processing op. These never fault, so they run
+ * outside the main interpreter switch. Results are built as 128-bit host
+ * vectors; 64-bit forms clear the upper half of Vd afterwards.
+ */
+static void sw_exec_simd(sw_cpu_t *cpu, const sw_insn_t *in)
+{
+    sw_vreg_t *v = cpu->v;
+    uint64_t *x = cpu->x;
+    unsigned size = in->aux;
+    bool q = in->flags & SW_F_Q;
+    unsigned lanes = (q ? 16u : 8u) >> size;
+    sw_vec_t a, b, r;
+    sw_vreg_t t, o;
+
+    /* Ops with general register operands, or that keep part of Vd */
+    switch (in->op)
+    {
+    case SW_OP_VDUP_GEN:
+        r = vec_dup(x[in->rn], size);
+        goto out;
+
+    case SW_OP_VINS_GEN:
+        vreg_set_lane(&v[in->rd], size, in->aux2, x[in->rn]);
+        return;
+
+    case SW_OP_VFMOV_GEN:
+        memset(&v[in->rd], 0, sizeof(v[0]));
+        vreg_set_lane(&v[in->rd], size, 0, x[in->rn]);
+        return;
+
+    case SW_OP_VUMOV:
+        x[in->rd] = vreg_lane(&v[in->rn], size, in->aux2);
+        return;
+
+    case SW_OP_VSMOV:
+        x[in->rd] = width_mask(sext(vreg_lane(&v[in->rn], size, in->aux2), 8u << size),
+                               in->flags & SW_F_32);
+        return;
+
+    case SW_OP_VINS_ELEM:
+        vreg_set_lane(&v[in->rd], size, in->aux2, vreg_lane(&v[in->rn], size, in->ra));
+        return;
+
+    case SW_OP_VADDP_D:
+        t = v[in->rn];
+        v[in->rd].d[0] = t.d[0] + t.d[1];
+        v[in->rd].d[1] = 0;
+        return;
+    }
+
+    a = vec_load(&v[in->rn]);
+    b = vec_load(&v[in->rm]);
+
+    switch (in->op)
+    {
+    case SW_OP_VADD: r = vec_add(a, b, size); break;
+    case SW_OP_VSUB: r = vec_sub(a, b, size); break;
+    case SW_OP_VMUL: r = vec_mul(a, b, size); break;
+    case SW_OP_VMLA: r = vec_add(vec_load(&v[in->rd]), vec_mul(a, b, size), size); break;
+    case SW_OP_VMLS: r = vec_sub(vec_load(&v[in->rd]), vec_mul(a, b, size), size); break;
+    case SW_OP_VCMEQ: r = vec_cmeq(a, b, size); break;
+    case SW_OP_VCMGT: r = vec_cmgt(a, b, size); break;
+    case SW_OP_VCMGE: r = vec_not(vec_cmgt(b, a, size)); break;
+    case SW_OP_VCMHI: r = vec_cmhi(a, b, size); break;
+    case SW_OP_VCMHS: r = vec_not(vec_cmhi(b, a, size)); break;
+    case SW_OP_VCMTST: r = vec_not(vec_cmeq(vec_and(a, b), vec_zero(), size)); break;
+    case SW_OP_VSMAX: r = vec_max(a, b, size, true); break;
+    case SW_OP_VSMIN: r = vec_min(a, b, size, true); break;
+    case SW_OP_VUMAX: r = vec_max(a, b, size, false); break;
+    case SW_OP_VUMIN: r = vec_min(a, b, size, false); break;
+    case SW_OP_VSQADD: r = vec_qadd(a, b, size, true); break;
+    case SW_OP_VUQADD: r = vec_qadd(a, b, size, false); break;
+    case SW_OP_VSQSUB: r = vec_qsub(a, b, size, true); break;
+    case SW_OP_VUQSUB: r = vec_qsub(a, b, size, false); break;
+
+    case SW_OP_VADDP:
+    case SW_OP_VSMAXP:
+    case SW_OP_VSMINP:
+    case SW_OP_VUMAXP:
+    case SW_OP_VUMINP:
+    {
+        /* Pairwise: the op between the even and odd lanes of b:a (the low
+         * halves only for 64-bit vectors) */
+        if (!q)
+            a = b = vec_lo64(a, b);
+        sw_vec_t even = vec_uzp(a, b, size, false), odd = vec_uzp(a, b, size, true);
+        switch (in->op)
+        {
+        case SW_OP_VADDP: r = vec_add(even, odd, size); break;
+        case SW_OP_VSMAXP: r = vec_max(even, odd, size, true); break;
+        case SW_OP_VSMINP: r = vec_min(even, odd, size, true); break;
+        case SW_OP_VUMAXP: r = vec_max(even, odd, size, false); break;
+        default: r = vec_min(even, odd, size, false); break;
+        }
+        break;
+    }
+
+    case SW_OP_VAND: r = vec_and(a, b); break;
+    case SW_OP_VBIC: r = vec_bic(a, b); break;
+    case SW_OP_VORR: r = vec_or(a, b); break;
+    case SW_OP_VORN: r = vec_or(a, vec_not(b)); break;
+    case SW_OP_VEOR: r = vec_xor(a, b); break;
+    case SW_OP_VBSL: r = vec_select(vec_load(&v[in->rd]), a, b); break;
+    case SW_OP_VBIT: r = vec_select(b, a, vec_load(&v[in->rd])); break;
+    case SW_OP_VBIF: r = vec_select(b, vec_load(&v[in->rd]), a); break;
+
+    case SW_OP_VCNT: r = vec_cnt8(a); break;
+    case SW_OP_VNOT: r = vec_not(a); break;
+    case SW_OP_VCLZ: r = vec_lanes(VL_CLZ, a, a, size, 0); break;
+    case SW_OP_VABS: r = vec_abs(a, size); break;
+    case SW_OP_VNEG: r = vec_neg(a, size); break;
+
+    case SW_OP_VRBIT:
+        vec_store(&t, a);
+        for (unsigned i = 0; i < 16; i++)
+        {
+            unsigned byte = t.b[i];
+            byte = ((byte & 0xf0) >> 4) | ((byte & 0x0f) << 4);
+            byte = ((byte & 0xcc) >> 2) | ((byte & 0x33) << 2);
+            o.b[i] = (uint8_t)(((byte & 0xaa) >> 1) | ((byte & 0x55) << 1));
+        }
+        r = vec_load(&o);
+        break;
+
+    case SW_OP_VCMZ:
+        switch (in->aux2)
+        {
+        case SW_CMZ_EQ: r = vec_cmeq(a, vec_zero(), size); break;
+        case SW_CMZ_GT: r = vec_cmgt(a, vec_zero(), size); break;
+        case SW_CMZ_GE: r = vec_not(vec_cmgt(vec_zero(), a, size)); break;
+        case SW_CMZ_LE: r = vec_not(vec_cmgt(a, vec_zero(), size)); break;
+        default: r = vec_cmgt(vec_zero(), a, size); break;
+        }
+        break;
+
+    case SW_OP_VREV:
+    {
+        /* Lane i moves to i ^ (lanes per container - 1) */
+        unsigned flip = ((1u << in->aux2) >> size) - 1;
+        vec_store(&t, a);
+        for (unsigned i = 0; i < 16u >> size; i++)
+            vreg_set_lane(&o, size, i ^ flip, vreg_lane(&t, size, i));
+        r = vec_load(&o);
+        break;
+    }
+
+    case SW_OP_VXTN:
+    case SW_OP_VSHRN:
+        /* Narrowing keeps the even (low) half of each wider lane. The
+         * "2" forms write the upper half of Vd and keep the lower. */
+        if (in->op == SW_OP_VSHRN)
+            a = vec_ushr(a, size + 1, in->aux2);
+        r = vec_uzp(a, a, size, false);
+        if (q)
+        {
+            r = vec_lo64(vec_load(&v[in->rd]), r);
+            vec_store(&v[in->rd], r);
+            return;
+        }
+        break;
+
+    case SW_OP_VADDV:
+    case SW_OP_VSMAXV:
+    case SW_OP_VSMINV:
+    case SW_OP_VUMAXV:
+    case SW_OP_VUMINV:
+    case SW_OP_VSADDLV:
+    case SW_OP_VUADDLV:
+    {
+        static const uint8_t kinds[] = {VR_ADD, VR_SMAX, VR_SMIN, VR_UMAX, VR_UMIN,
+                                        VR_SADDL, VR_UADDL};
+        memset(&o, 0, sizeof(o));
+        o.d[0] = vec_reduce(kinds[in->op - SW_OP_VADDV], a, size, lanes);
+        v[in->rd] = o;
+        return;
+    }
+
+    case SW_OP_VSHL: r = vec_shl(a, size, in->aux2); break;
+    case SW_OP_VUSHR: r = vec_ushr(a, size, in->aux2); break;
+    case SW_OP_VSSHR: r = vec_sshr(a, size, in->aux2); break;
+    case SW_OP_VUSRA: r = vec_add(vec_load(&v[in->rd]), vec_ushr(a, size, in->aux2), size); break;
+    case SW_OP_VSSRA: r = vec_add(vec_load(&v[in->rd]), vec_sshr(a, size, in->aux2), size); break;
+
+    case SW_OP_VUSHLL:
+    case SW_OP_VSSHLL:
+    {
+        /* Widen by interleaving each lane with zeros (or its sign) */
+        sw_vec_t src = q ? vec_hi64(a, a) : a;
+        sw_vec_t hi = in->op == SW_OP_VSSHLL ? vec_cmgt(vec_zero(), src, size) : vec_zero();
+        r = vec_shl(vec_zip(src, hi, size, false), size + 1, in->aux2);
+        q = true;
+        break;
+    }
+
+    case SW_OP_VZIP1: r = vec_zip(a, b, size, false); break;
+    case SW_OP_VZIP2:
+        /* The 64-bit form interleaves the upper quarter of each 128-bit
+         * lane set, which is the upper half of ZIP1 */
+        r = q ? vec_zip(a, b, size, true) : vec_hi64(vec_zip(a, b, size, false), a);
+        break;
+    case SW_OP_VUZP1:
+    case SW_OP_VUZP2:
+        if (!q)
+            a = b = vec_lo64(a, b);
+        r = vec_uzp(a, b, size, in->op == SW_OP_VUZP2);
+        break;
+    case SW_OP_VTRN1: r = vec_trn(a, b, size, false); break;
+    case SW_OP_VTRN2: r = vec_trn(a, b, size, true); break;
+
+    case SW_OP_VEXT:
+    {
+        unsigned n = q ? 16 : 8;
+        uint8_t buf[32];
+        vec_store(&t, a);
+        memcpy(buf, t.b, n);
+        vec_store(&t, b);
+        memcpy(buf + n, t.b, n);
+        memcpy(o.b, buf + in->aux2, 16);
+        r = vec_load(&o);
+        break;
+    }
+
+    case SW_OP_VTBL:
+    case SW_OP_VTBX:
+    {
+        /* Look the index up in each 16-byte table register in turn; an
+         * index that doesn't fit a register gives 0 there */
+        r = vec_zero();
+        for (unsigned k = 0; k < in->ra; k++)
+        {
+            sw_vec_t table = vec_load(&v[(in->rn + k) % SW_NUM_VREGS]);
+            r = vec_or(r, vec_tbl1(table, vec_sub(b, vec_dup(16 * k, 0), 0)));
+        }
+        if (in->op == SW_OP_VTBX)
+            r = vec_select(vec_cmhi(vec_dup(16 * in->ra, 0), b, 0), r, vec_load(&v[in->rd]));
+        break;
+    }
+
+    case SW_OP_VMOVI: r = vec_dup((uint64_t)in->imm, 3); break;
+    case SW_OP_VORR_IMM: r = vec_or(vec_load(&v[in->rd]), vec_dup((uint64_t)in->imm, 3)); break;
+    case SW_OP_VBIC_IMM: r = vec_bic(vec_load(&v[in->rd]), vec_dup((uint64_t)in->imm, 3)); break;
+
+    case SW_OP_VDUP_ELEM:
+        r = vec_dup(vreg_lane(&v[in->rn], size, in->aux2), size);
+        break;
+
+    default:
+        return;
+    }
+
+out:
+    vec_store(&v[in->rd], r);
+    if (!q)
+        v[in->rd].d[1] = 0;
+}
+
+/*
+ * Op dispatch. sw_exec_block() is threaded code by default: each handler
+ * ends by jumping straight to the handler of the next op through a table
+ * of label addresses (computed goto). Every handler then has an indirect
+ * branch of its own, which the host predictor learns separately, instead
+ * of all ops sharing the one at the top of a switch. Build with
+ * -DSW_SWITCH_DISPATCH for a plain switch in a loop, to compare.
+ */
+#ifdef SW_SWITCH_DISPATCH
+#define OP(op) case op
+#define OP_RANGE(first, last) case first ... last
+#define NEXT() continue
+#define DISPATCH() goto dispatch
+#else
+#define OP(op) case op: L_##op
+#define OP_RANGE(first, last) case first ... last: L_##first
+#define NEXT()                                                 \
+    do                                                         \
+    {                                                          \
+        in++;                                                  \
+        goto *sw_dispatch[in->op];                             \
+    } while (0)
+#define DISPATCH() goto *sw_dispatch[in->op]
+#endif
+
+/*
+ * Must the dispatcher run before more guest code does? Checked where
+ * execution goes on without it: the back-edge of a looping trace and
+ * chained exits.
+ */
+static inline bool sw_dispatcher_due(sw_cpu_t *cpu)
+{
+    return atomic_load_explicit(&cpu->kick, memory_order_relaxed) ||
+           cpu->insns >= cpu->icount_deadline || cpu->insns >= cpu->insn_limit ||
+           cpu->flush_pending ||
+           (cpu->code_epoch != NULL &&
+            atomic_load_explicit(cpu->code_epoch, memory_order_relaxed) != cpu->code_epoch_seen);
+}
+
+/*
+ * Execute block *bp, and on through the blocks its direct exits are
+ * chained to. Returns SW_CONT_* telling the dispatcher how to find the
+ * next block at cpu->pc, with *bp set to the block that was left.
+ */
+static int sw_exec_block(sw_cpu_t *cpu, sw_block_t **bp)
+{
+    uint64_t *x = cpu->x;
+    uint8_t *mem = cpu->mem;
+    const sw_block_t *b = *bp;
+    const sw_insn_t *in = b->ops;
+    bool taken;
+
+#ifndef SW_SWITCH_DISPATCH
+    /* Every SW_OP_* needs an entry here */
+#define T(op) [op] = &&L_##op
+#define T_RANGE(first, last) [first ... last] = &&L_##first
+    static const void *const sw_dispatch[SW_OP_COUNT] = {
+        T(SW_OP_UNDEF), T(SW_OP_END), T(SW_OP_LOOP), T(SW_OP_NOP), T(SW_OP_MOVI), T(SW_OP_MOVK),
+        T(SW_OP_ADD_IMM), T(SW_OP_ADDS_IMM), T(SW_OP_SUB_IMM), T(SW_OP_SUBS_IMM),
+        T(SW_OP_AND_IMM), T(SW_OP_ORR_IMM), T(SW_OP_EOR_IMM), T(SW_OP_ANDS_IMM),
+        T(SW_OP_SBFM), T(SW_OP_BFM), T(SW_OP_UBFM), T(SW_OP_EXTR), T(SW_OP_ADD_SREG),
+        T(SW_OP_ADDS_SREG), T(SW_OP_SUB_SREG), T(SW_OP_SUBS_SREG), T(SW_OP_ADD_EREG),
+        T(SW_OP_ADDS_EREG), T(SW_OP_SUB_EREG), T(SW_OP_SUBS_EREG), T(SW_OP_AND_SREG),
+        T(SW_OP_ORR_SREG), T(SW_OP_EOR_SREG), T(SW_OP_ANDS_SREG), T(SW_OP_ADC),
+        T(SW_OP_ADCS), T(SW_OP_SBC), T(SW_OP_SBCS), T(SW_OP_CSEL), T(SW_OP_CSINC),
+        T(SW_OP_CSINV), T(SW_OP_CSNEG), T(SW_OP_CCMN), T(SW_OP_CCMP), T(SW_OP_UDIV),
+        T(SW_OP_SDIV), T(SW_OP_LSLV), T(SW_OP_LSRV), T(SW_OP_ASRV), T(SW_OP_RORV),
+        T(SW_OP_MADD), T(SW_OP_MSUB), T(SW_OP_SMADDL), T(SW_OP_SMSUBL), T(SW_OP_UMADDL),
+        T(SW_OP_UMSUBL), T(SW_OP_SMULH), T(SW_OP_UMULH), T(SW_OP_RBIT), T(SW_OP_REV16),
+        T(SW_OP_REV32), T(SW_OP_REV), T(SW_OP_CLZ), T(SW_OP_CLS), T(SW_OP_LD),
+        T(SW_OP_LD_PRE), T(SW_OP_LD_POST), T(SW_OP_LD_REG), T(SW_OP_ST), T(SW_OP_ST_PRE),
+        T(SW_OP_ST_POST), T(SW_OP_ST_REG), T(SW_OP_LDP), T(SW_OP_STP),
+        T_RANGE(SW_OP_LDAR, SW_OP_AMO), T(SW_OP_B), T(SW_OP_BL), T(SW_OP_BCOND),
+        T(SW_OP_CBZ), T(SW_OP_CBNZ), T(SW_OP_TBZ), T(SW_OP_TBNZ), T(SW_OP_BR), T(SW_OP_BLR),
+        T(SW_OP_RET), T(SW_OP_HVC), T(SW_OP_EXC), T(SW_OP_WFI), T(SW_OP_DMB),
+        T(SW_OP_CLREX), T(SW_OP_SYSTRAP), T(SW_OP_MRS), T(SW_OP_MSR), T(SW_OP_IC_FLUSH),
+        T(SW_OP_VLD), T(SW_OP_VST), T(SW_OP_VLD_REG), T(SW_OP_VST_REG), T(SW_OP_VLDP),
+        T(SW_OP_VSTP), T(SW_OP_VLDN), T(SW_OP_VSTN), T(SW_OP_VLDR), T(SW_OP_VLD_LANE),
+        T(SW_OP_VST_LANE), T_RANGE(SW_OP_VADD, SW_OP_VADDP_D),
+    };
+#undef T
+#undef T_RANGE
+#endif
+
+/* Leave the block after `in` retired, continuing at `target` */
+#define BRANCH_HOW(target, how)                                \
+    do                                                         \
+    {                                                          \
+        cpu->pc = (target);                                    \
+        cpu->insns += (uint64_t)(in - b->ops) + 1;             \
+        return (how);                                          \
+    } while (0)
+#define BRANCH(target)                                         \
+    do                                                         \
+    {                                                          \
+        cpu->pc = (target);                                    \
+        cpu->insns += (uint64_t)(in - b->ops) + 1;             \
+        goto direct_exit;                                      \
+    } while (0)
+
+#define INSN_PC() (b->pc + (int64_t)in->pc_off)
+#define IS32() (in->flags & SW_F_32)
+#define SET(v) (x[in->rd] = width_mask((v), IS32()))
+
+    for (;; in++)
+    {
+#ifdef SW_SWITCH_DISPATCH
+    dispatch:
+#endif
+        switch (in->op)
+        {
+        OP(SW_OP_END):
+            cpu->pc = INSN_PC();
+            cpu->insns += (uint64_t)(in - b->ops);
+            goto direct_exit;
+
+        OP(SW_OP_LOOP):
+            /* Back at the head of the trace (pc_off is 0) */
+            cpu->pc = INSN_PC();
+            cpu->insns += (uint64_t)(in - b->ops);
+            if (sw_dispatcher_due(cpu))
+                return SW_CONT_DIRECT;
+            in = b->ops;
+            DISPATCH();
+
+        OP(SW_OP_NOP):
+            NEXT();
+
+        /* ---------------------------------------------------------------- */
+
+        OP(SW_OP_MOVI):
+            x[in->rd] = (uint64_t)in->imm;
+            NEXT();
+
+        OP(SW_OP_MOVK):
+            SET((x[in->rd] & ~(0xffffull << in->aux)) | ((uint64_t)in->imm << in->aux));
+            NEXT();
+
+        OP(SW_OP_ADD_IMM):
+            SET(x[in->rn] + (uint64_t)in->imm);
+            NEXT();
+
+        OP(SW_OP_SUB_IMM):
+            SET(x[in->rn] - (uint64_t)in->imm);
+            NEXT();
+
+        OP(SW_OP_ADDS_IMM):
+            flags_add(cpu, x[in->rn], (uint64_t)in->imm, IS32());
+            SET(x[in->rn] + (uint64_t)in->imm);
+            NEXT();
+
+        OP(SW_OP_SUBS_IMM):
+            flags_sub(cpu, x[in->rn], (uint64_t)in->imm, IS32());
+            SET(x[in->rn] - (uint64_t)in->imm);
+            NEXT();
+
+        OP(SW_OP_AND_IMM):
+            SET(x[in->rn] & (uint64_t)in->imm);
+            NEXT();
+
+        OP(SW_OP_ORR_IMM):
+            SET(x[in->rn] | (uint64_t)in->imm);
+            NEXT();
+
+        OP(SW_OP_EOR_IMM):
+            SET(x[in->rn] ^ (uint64_t)in->imm);
+            NEXT();
+
+        OP(SW_OP_ANDS_IMM):
+            SET(x[in->rn] & (uint64_t)in->imm);
+            flags_logic(cpu, x[in->rd], IS32());
+            NEXT();
+
+        OP(SW_OP_SBFM):
+        OP(SW_OP_BFM):
+        OP(SW_OP_UBFM):
+            x[in->rd] = bitfield(x[in->rd], x[in->rn], in->aux, in->aux2, in->op, IS32());
+            NEXT();
+
+        OP(SW_OP_EXTR):
+        {
+            unsigned width = IS32() ? 32 : 64;
+            uint64_t hi = width_mask(x[in->rn], IS32()), lo = width_mask(x[in->rm], IS32());
+            SET(in->aux ? (lo >> in->aux) | (hi << (width - in->aux)) : lo);
+            NEXT();
+        }
+
+        /* ---------------------------------------------------------------- */
+
+        OP(SW_OP_ADD_SREG):
+            SET(x[in->rn] + shift_reg(x[in->rm], in->aux, in->aux2, IS32()));
+            NEXT();
+
+        OP(SW_OP_SUB_SREG):
+            SET(x[in->rn] - shift_reg(x[in->rm], in->aux, in->aux2, IS32()));
+            NEXT();
+
+        OP(SW_OP_ADDS_SREG):
+        {
+            uint64_t m = shift_reg(x[in->rm], in->aux, in->aux2, IS32());
+            flags_add(cpu, x[in->rn], m, IS32());
+            SET(x[in->rn] + m);
+            NEXT();
+        }
+
+        OP(SW_OP_SUBS_SREG):
+        {
+            uint64_t m = shift_reg(x[in->rm], in->aux, in->aux2, IS32());
+            flags_sub(cpu, x[in->rn], m, IS32());
+            SET(x[in->rn] - m);
+            NEXT();
+        }
+
+        OP(SW_OP_ADD_EREG):
+            SET(x[in->rn] + extend_reg(x[in->rm], in->aux, in->aux2));
+            NEXT();
+
+        OP(SW_OP_SUB_EREG):
+            SET(x[in->rn] - extend_reg(x[in->rm], in->aux, in->aux2));
+            NEXT();
+
+        OP(SW_OP_ADDS_EREG):
+        {
+            uint64_t m = extend_reg(x[in->rm], in->aux, in->aux2);
+            flags_add(cpu, x[in->rn], m, IS32());
+            SET(x[in->rn] + m);
+            NEXT();
+        }
+
+        OP(SW_OP_SUBS_EREG):
+        {
+            uint64_t m = extend_reg(x[in->rm], in->aux, in->aux2);
+            flags_sub(cpu, x[in->rn], m, IS32());
+            SET(x[in->rn] - m);
+            NEXT();
+        }
+
+        OP(SW_OP_AND_SREG):
+        OP(SW_OP_ORR_SREG):
+        OP(SW_OP_EOR_SREG):
+        OP(SW_OP_ANDS_SREG):
+        {
+            uint64_t m = shift_reg(x[in->rm], in->aux, in->aux2, IS32());
+            uint64_t r;
+            if (in->flags & SW_F_INV)
+                m = ~m;
+            switch (in->op)
+            {
+            case SW_OP_ORR_SREG: r = x[in->rn] | m; break;
+            case SW_OP_EOR_SREG: r = x[in->rn] ^ m; break;
+            default: r = x[in->rn] & m; break;
+            }
+            SET(r);
+            if (in->op == SW_OP_ANDS_SREG)
+                flags_logic(cpu, x[in->rd], IS32());
+            NEXT();
+        }
+
+        OP(SW_OP_ADC):
+            SET(x[in->rn] + x[in->rm] + ((flags_get(cpu) & SW_NZCV_C) != 0));
+            NEXT();
+
+        OP(SW_OP_SBC):
+            SET(x[in->rn] + ~x[in->rm] + ((flags_get(cpu) & SW_NZCV_C) != 0));
+            NEXT();
+
+        OP(SW_OP_ADCS):
+        OP(SW_OP_SBCS):
+        {
+            uint64_t m = in->op == SW_OP_SBCS ? ~x[in->rm] : x[in->rm];
+            uint32_t nzcv;
+            x[in->rd] = add_with_carry(x[in->rn], m, (flags_get(cpu) & SW_NZCV_C) != 0,
+                                       IS32(), &nzcv);
+            flags_set(cpu, nzcv);
+            NEXT();
+        }
+
+        OP(SW_OP_CSEL):
+            SET(flags_cond(cpu, in->aux) ? x[in->rn] : x[in->rm]);
+            NEXT();
+
+        OP(SW_OP_CSINC):
+            SET(flags_cond(cpu, in->aux) ? x[in->rn] : x[in->rm] + 1);
+            NEXT();
+
+        OP(SW_OP_CSINV):
+            SET(flags_cond(cpu, in->aux) ? x[in->rn] : ~x[in->rm]);
+            NEXT();
+
+        OP(SW_OP_CSNEG):
+            SET(flags_cond(cpu, in->aux) ? x[in->rn] : -x[in->rm]);
+            NEXT();
+
+        OP(SW_OP_CCMN):
+        OP(SW_OP_CCMP):
+            if (flags_cond(cpu, in->aux))
+            {
+                uint64_t m = (in->flags & SW_F_IMM) ? (uint64_t)in->imm : x[in->rm];
+                if (in->op == SW_OP_CCMP)
+                    flags_sub(cpu, x[in->rn], m, IS32());
+                else
+                    flags_add(cpu, x[in->rn], m, IS32());
+            }
+            else
+            {
+                flags_set(cpu, (uint32_t)in->aux2 << 28);
+            }
+            NEXT();
+
+        OP(SW_OP_UDIV):
+        {
+            uint64_t n = width_mask(x[in->rn], IS32()), m = width_mask(x[in->rm], IS32());
+            SET(m ? n / m : 0);
+            NEXT();
+        }
+
+        OP(SW_OP_SDIV):
+            if (IS32())
+            {
+                int32_t n = (int32_t)x[in->rn], m = (int32_t)x[in->rm];
+                SET(m == 0 ? 0 : (n == INT32_MIN && m == -1) ? (uint32_t)n : (uint32_t)(n / m));
+            }
+            else
+            {
+                int64_t n = (int64_t)x[in->rn], m = (int64_t)x[in->rm];
+                SET(m == 0 ? 0 : (n == INT64_MIN && m == -1) ? (uint64_t)n : (uint64_t)(n / m));
+            }
+            NEXT();
+
+        OP(SW_OP_LSLV):
+        OP(SW_OP_LSRV):
+        OP(SW_OP_ASRV):
+        OP(SW_OP_RORV):
+            SET(shift_reg(x[in->rn], (unsigned)(in->op - SW_OP_LSLV),
+                          (unsigned)(x[in->rm] & (IS32() ? 31 : 63)), IS32()));
+            NEXT();
+
+        OP(SW_OP_MADD):
+            SET(x[in->ra] + x[in->rn] * x[in->rm]);
+            NEXT();
+
+        OP(SW_OP_MSUB):
+            SET(x[in->ra] - x[in->rn] * x[in->rm]);
+            NEXT();
+
+        OP(SW_OP_SMADDL):
+            x[in->rd] = x[in->ra] + (uint64_t)((int64_t)(int32_t)x[in->rn] * (int32_t)x[in->rm]);
+            NEXT();
+
+        OP(SW_OP_SMSUBL):
+            x[in->rd] = x[in->ra] - (uint64_t)((int64_t)(int32_t)x[in->rn] * (int32_t)x[in->rm]);
+            NEXT();
+
+        OP(SW_OP_UMADDL):
+            x[in->rd] = x[in->ra] + (uint64_t)(uint32_t)x[in->rn] * (uint32_t)x[in->rm];
+            NEXT();
+
+        OP(SW_OP_UMSUBL):
+            x[in->rd] = x[in->ra] - (uint64_t)(uint32_t)x[in->rn] * (uint32_t)x[in->rm];
+            NEXT();
+
+        OP(SW_OP_SMULH):
+            x[in->rd] = (uint64_t)(((__int128)(int64_t)x[in->rn] * (int64_t)x[in->rm]) >> 64);
+            NEXT();
+
+        OP(SW_OP_UMULH):
+            x[in->rd] = (uint64_t)(((unsigned __int128)x[in->rn] * x[in->rm]) >> 64);
+            NEXT();
+
+        OP(SW_OP_RBIT):
+        {
+            uint64_t v = x[in->rn], r = 0;
+            unsigned width = IS32() ? 32 : 64;
+            for (unsigned i = 0; i < width; i++)
+                r |= ((v >> i) & 1) << (width - 1 - i);
+            SET(r);
+            NEXT();
+        }
+
+        OP(SW_OP_REV16):
+        {
+            uint64_t v = x[in->rn];
+            SET(((v & 0x00ff00ff00ff00ffull) << 8) | ((v >> 8) & 0x00ff00ff00ff00ffull));
+            NEXT();
+        }
+
+        OP(SW_OP_REV32):
+        {
+            uint64_t v = x[in->rn];
+            x[in->rd] = ((uint64_t)__builtin_bswap32((uint32_t)(v >> 32)) << 32) |
+                        __builtin_bswap32((uint32_t)v);
+            NEXT();
+        }
+
+        OP(SW_OP_REV):
+            SET(IS32() ? __builtin_bswap32((uint32_t)x[in->rn]) : __builtin_bswap64(x[in->rn]));
+            NEXT();
+
+        OP(SW_OP_CLZ):
+        {
+            uint64_t v = width_mask(x[in->rn], IS32());
+            unsigned width = IS32() ? 32 : 64;
+            x[in->rd] = v ? (unsigned)__builtin_clzll(v) - (64 - width) : width;
+            NEXT();
+        }
+
+        OP(SW_OP_CLS):
+        {
+            unsigned width = IS32() ? 32 : 64;
+            uint64_t v = width_mask(x[in->rn], IS32());
+            uint64_t t = width_mask(v ^ (v << 1), IS32()) | 1;
+            x[in->rd] = (unsigned)__builtin_clzll(t) - (64 - width);
+            NEXT();
+        }
+
+        /* ---------------------------------------------------------------- */
+
+        OP(SW_OP_LD):
+        OP(SW_OP_LD_PRE):
+        OP(SW_OP_LD_POST):
+        OP(SW_OP_LD_REG):
+        {
+            uint64_t base = x[in->rn];
+            uint64_t addr;
+
+            if (in->op == SW_OP_LD_REG)
+                addr = base + extend_reg(x[in->rm], in->aux2 >> 1, (in->aux2 & 1) ? in->aux : 0);
+            else
+                addr = in->op == SW_OP_LD_POST ? base : base + (uint64_t)in->imm;
+
+            if (!mem_ok(cpu, addr, 1u << in->aux) || !note_access(cpu, addr, 1u << in->aux))
+                return sw_data_abort(cpu, b, in, addr, false);
+            if (in->op == SW_OP_LD_PRE || in->op == SW_OP_LD_POST)
+                x[in->rn] = base + (uint64_t)in->imm;
+            x[in->rd] = load_extend(mem_read(mem + addr, in->aux), in);
+            NEXT();
+        }
+
+        OP(SW_OP_ST):
+        OP(SW_OP_ST_PRE):
+        OP(SW_OP_ST_POST):
+        OP(SW_OP_ST_REG):
+        {
+            uint64_t base = x[in->rn];
+            uint64_t val = x[in->rd];
+            uint64_t addr;
+
+            if (in->op == SW_OP_ST_REG)
+                addr = base + extend_reg(x[in->rm], in->aux2 >> 1, (in->aux2 & 1) ? in->aux : 0);
+            else
+                addr = in->op == SW_OP_ST_POST ? base : base + (uint64_t)in->imm;
+
+            if (!mem_ok(cpu, addr, 1u << in->aux) || !note_access(cpu, addr, 1u << in->aux))
+                return sw_data_abort(cpu, b, in, addr, true);
+            note_store(cpu, addr, 1u << in->aux);
+            mem_write(mem + addr, in->aux, val);
+            if (in->op == SW_OP_ST_PRE || in->op == SW_OP_ST_POST)
+                x[in->rn] = base + (uint64_t)in->imm;
+            NEXT();
+        }
+
+        OP(SW_OP_LDP):
+        OP(SW_OP_STP):
+        {
+            uint64_t base = x[in->rn];
+            uint64_t addr = (in->flags & SW_F_POST) ? base : base + (uint64_t)in->imm;
+            unsigned size = 1u << in->aux;
+            bool store = in->op == SW_OP_STP;
+
+            if (!mem_ok(cpu, addr, 2 * size) || !note_access(cpu, addr, 2 * size))
+                return sw_data_abort(cpu, b, in, addr, store);
+
+            if (store)
+            {
+                note_store(cpu, addr, 2 * size);
+                mem_write(mem + addr, in->aux, x[in->rd]);
+                mem_write(mem + addr + size, in->aux, x[in->ra]);
+            }
+            else
+            {
+                uint64_t v1 = load_extend(mem_read(mem + addr, in->aux), in);
+                uint64_t v2 = load_extend(mem_read(mem + addr + size, in->aux), in);
+                x[in->rd] = v1;
+                x[in->ra] = v2;
+            }
+            if (in->flags & (SW_F_PRE | SW_F_POST))
+                x[in->rn] = base + (uint64_t)in->imm;
+            NEXT();
+        }
+
+        OP_RANGE(SW_OP_LDAR, SW_OP_AMO):
+            if (!sw_exec_atomic(cpu, b, in))
+                return SW_CONT_EXIT;
+            NEXT();
+
+        /* ---------------------------------------------------------------- */
+
+        OP(SW_OP_VLD):
+        OP(SW_OP_VST):
+        OP(SW_OP_VLD_REG):
+        OP(SW_OP_VST_REG):
+        {
+            uint64_t base = x[in->rn];
+            unsigned n = 1u << in->aux;
+            bool store = in->op == SW_OP_VST || in->op == SW_OP_VST_REG;
+            uint64_t addr;
+
+            if (in->op == SW_OP_VLD_REG || in->op == SW_OP_VST_REG)
+                addr = base + extend_reg(x[in->rm], in->aux2 >> 1, (in->aux2 & 1) ? in->aux : 0);
+            else
+                addr = (in->flags & SW_F_POST) ? base : base + (uint64_t)in->imm;
+
+            if (!mem_ok(cpu, addr, n) || !note_access(cpu, addr, n))
+                return sw_data_abort(cpu, b, in, addr, store);
+            if (store)
+            {
+                note_store(cpu, addr, n);
+                memcpy(mem + addr, cpu->v[in->rd].b, n);
+            }
+            else
+            {
+                /* Scalar loads clear the rest of the register */
+                memset(&cpu->v[in->rd], 0, sizeof(sw_vreg_t));
+                memcpy(cpu->v[in->rd].b, mem + addr, n);
+            }
+            if (in->flags & (SW_F_PRE | SW_F_POST))
+                x[in->rn] = base + (uint64_t)in->imm;
+            NEXT();
+        }
+
+        OP(SW_OP_VLDP):
+        OP(SW_OP_VSTP):
+        {
+            uint64_t base = x[in->rn];
+            uint64_t addr = (in->flags & SW_F_POST) ? base : base + (uint64_t)in->imm;
+            unsigned n = 1u << in->aux;
+            bool store = in->op == SW_OP_VSTP;
+
+            if (!mem_ok(cpu, addr, 2 * n) || !note_access(cpu, addr, 2 * n))
+                return sw_data_abort(cpu, b, in, addr, store);
+            if (store)
+            {
+                note_store(cpu, addr, 2 * n);
+                memcpy(mem + addr, cpu->v[in->rd].b, n);
+                memcpy(mem + addr + n, cpu->v[in->ra].b, n);
+            }
+            else
+            {
+                sw_vreg_t v1 = {.d = {0, 0}}, v2 = {.d = {0, 0}};
+                memcpy(v1.b, mem + addr, n);
+                memcpy(v2.b, mem + addr + n, n);
+                cpu->v[in->rd] = v1;
+                cpu->v[in->ra] = v2;
+            }
+            if (in->flags & (SW_F_PRE | SW_F_POST))
+                x[in->rn] = base + (uint64_t)in->imm;
+            NEXT();
+        }
+
+        OP(SW_OP_VLDN):
+        OP(SW_OP_VSTN):
+        {
+            uint64_t addr = x[in->rn];
+            uint64_t n = (uint64_t)in->ra * ((in->flags & SW_F_Q) ? 16 : 8);
+            bool store = in->op == SW_OP_VSTN;
+
+            if (!mem_ok(cpu, addr, n) || !note_access(cpu, addr, n))
+                return sw_data_abort(cpu, b, in, addr, store);
+            if (store)
+                note_store(cpu, addr, n);
+            simd_ldst_struct(cpu, in, mem + addr, !store);
+            simd_struct_writeback(cpu, in);
+            NEXT();
+        }
+
+        OP(SW_OP_VLDR):
+        OP(SW_OP_VLD_LANE):
+        OP(SW_OP_VST_LANE):
+        {
+            uint64_t addr = x[in->rn];
+            unsigned n = 1u << in->aux;
+            bool store = in->op == SW_OP_VST_LANE;
+
+            if (!mem_ok(cpu, addr, n * in->ra) || !note_access(cpu, addr, n * in->ra))
+                return sw_data_abort(cpu, b, in, addr, store);
+            if (store)
+                note_store(cpu, addr, n * in->ra);
+            for (unsigned i = 0; i < in->ra; i++)
+            {
+                sw_vreg_t *vt = &cpu->v[(in->rd + i) % SW_NUM_VREGS];
+                uint8_t *p = mem + addr + i * n;
+
+                if (store)
+                {
+                    memcpy(p, &vt->b[in->aux2 * n], n);
+                }
+                else if (in->op == SW_OP_VLD_LANE)
+                {
+                    memcpy(&vt->b[in->aux2 * n], p, n);
+                }
+                else
+                {
+                    vec_store(vt, vec_dup(mem_read(p, in->aux), in->aux));
+                    if (!(in->flags & SW_F_Q))
+                        vt->d[1] = 0;
+                }
+            }
+            simd_struct_writeback(cpu, in);
+            NEXT();
+        }
+
+        OP_RANGE(SW_OP_VADD, SW_OP_VADDP_D):
+            sw_exec_simd(cpu, in);
+            NEXT();
+
+        /* ---------------------------------------------------------------- */
+
+        OP(SW_OP_B):
+            if (in->flags & SW_F_TRACE)
+                NEXT();
+            BRANCH((uint64_t)in->imm);
+
+        OP(SW_OP_BL):
+            x[SW_REG_LR] = INSN_PC() + 4;
+            if (in->flags & SW_F_TRACE)
+                NEXT();
+            BRANCH((uint64_t)in->imm);
+
+        OP(SW_OP_BCOND):
+            taken = flags_cond(cpu, in->aux);
+            goto cond_branch;
+
+        OP(SW_OP_CBZ):
+            taken = width_mask(x[in->rn], IS32()) == 0;
+            goto cond_branch;
+
+        OP(SW_OP_CBNZ):
+            taken = width_mask(x[in->rn], IS32()) != 0;
+            goto cond_branch;
+
+        OP(SW_OP_TBZ):
+            taken = ((x[in->rn] >> in->aux) & 1) == 0;
+            goto cond_branch;
+
+        OP(SW_OP_TBNZ):
+            taken = ((x[in->rn] >> in->aux) & 1) != 0;
+        cond_branch:
+            /* Inside a trace the expected direction continues inline */
+            if ((in->flags & SW_F_TRACE) && taken == ((in->flags & SW_F_TAKEN) != 0))
+                NEXT();
+            BRANCH(taken ? (uint64_t)in->imm : INSN_PC() + 4);
+
+        OP(SW_OP_BR):
+        OP(SW_OP_RET):
+            BRANCH_HOW(x[in->rn], SW_CONT_INDIRECT);
+
+        OP(SW_OP_BLR):
+        {
+            uint64_t target = x[in->rn];
+            x[SW_REG_LR] = INSN_PC() + 4;
+            BRANCH_HOW(target, SW_CONT_INDIRECT);
+        }
+
+        /* ---------------------------------------------------------------- */
+
+        OP(SW_OP_HVC):
+            /* Like the hardware, the PC is already past the HVC */
+            cpu->exit_syndrome = ESR(EC_HVC64, (uint64_t)in->imm);
+            cpu->exit_fault_addr = 0;
+            cpu->pc = INSN_PC() + 4;
+            cpu->insns += (uint64_t)(in - b->ops) + 1;
+            return SW_CONT_EXIT;
+
+        OP(SW_OP_EXC):
+            return sw_raise(cpu, b, in, (uint64_t)in->imm, 0);
+
+        OP(SW_OP_WFI):
+            /* In icount mode time only passes as instructions retire, so
+             * waiting for the timer means skipping ahead to its deadline.
+             * Otherwise the VMM decides. */
+            if (cpu->icount_mips != 0 && vtimer_armed(cpu))
+            {
+                uint64_t now = sw_cntvct(cpu, (uint64_t)(in - b->ops));
+                if (now < cpu->cntv_cval)
+                {
+                    cpu->icount_bias += cpu->cntv_cval - now;
+                    vtimer_update(cpu);
+                }
+                BRANCH(INSN_PC() + 4);
+            }
+            return sw_raise(cpu, b, in, ESR(EC_WFX, 0), 0);
+
+        OP(SW_OP_DMB):
+            if (in->aux == SW_BARRIER_LD)
+                atomic_thread_fence(memory_order_acquire);
+            else if (in->aux == SW_BARRIER_ST)
+                atomic_thread_fence(memory_order_release);
+            else
+                atomic_thread_fence(memory_order_seq_cst);
+            NEXT();
+
+        OP(SW_OP_CLREX):
+            cpu->excl_addr = SW_EXCL_NONE;
+            NEXT();
+
+        OP(SW_OP_SYSTRAP):
+            return sw_raise(cpu, b, in, systrap_syndrome(in->raw), 0);
+
+        OP(SW_OP_MRS):
+            switch (in->aux)
+            {
+            case SW_SYSREG_NZCV: x[in->rd] = flags_get(cpu); break;
+            case SW_SYSREG_TPIDR_EL0: x[in->rd] = cpu->tpidr_el0; break;
+            case SW_SYSREG_TPIDR_EL1: x[in->rd] = cpu->tpidr_el1; break;
+            case SW_SYSREG_CNTVCT_EL0: x[in->rd] = sw_cntvct(cpu, (uint64_t)(in - b->ops)); break;
+            case SW_SYSREG_CNTFRQ_EL0: x[in->rd] = SW_CNTFRQ; break;
+            case SW_SYSREG_CNTV_CTL_EL0:
+                x[in->rd] = cpu->cntv_ctl;
+                if ((cpu->cntv_ctl & CNTV_CTL_ENABLE) &&
+                    sw_cntvct(cpu, (uint64_t)(in - b->ops)) >= cpu->cntv_cval)
+                    x[in->rd] |= CNTV_CTL_ISTATUS;
+                break;
+            case SW_SYSREG_CNTV_CVAL_EL0: x[in->rd] = cpu->cntv_cval; break;
+            case SW_SYSREG_CNTV_TVAL_EL0:
+                x[in->rd] = (uint32_t)(cpu->cntv_cval - sw_cntvct(cpu, (uint64_t)(in - b->ops)));
+                break;
+            case SW_SYSREG_FPCR: x[in->rd] = cpu->fpcr; break;
+            case SW_SYSREG_FPSR: x[in->rd] = cpu->fpsr; break;
+            }
+            NEXT();
+
+        OP(SW_OP_MSR):
+            switch (in->aux)
+            {
+            case SW_SYSREG_NZCV: flags_set(cpu, (uint32_t)x[in->rn] & 0xf0000000u); break;
+            case SW_SYSREG_TPIDR_EL0: cpu->tpidr_el0 = x[in->rn]; break;
+            case SW_SYSREG_TPIDR_EL1: cpu->tpidr_el1 = x[in->rn]; break;
+            case SW_SYSREG_CNTV_CTL_EL0:
+                cpu->cntv_ctl = x[in->rn] & (CNTV_CTL_ENABLE | CNTV_CTL_IMASK);
+                vtimer_update(cpu);
+                break;
+            case SW_SYSREG_CNTV_CVAL_EL0:
+                cpu->cntv_cval = x[in->rn];
+                vtimer_update(cpu);
+                break;
+            case SW_SYSREG_CNTV_TVAL_EL0:
+                /* TimerValue is a signed 32-bit offset from now */
+                cpu->cntv_cval = sw_cntvct(cpu, (uint64_t)(in - b->ops)) +
+                                 (uint64_t)(int64_t)(int32_t)x[in->rn];
+                vtimer_update(cpu);
+                break;
+            case SW_SYSREG_FPCR: cpu->fpcr = x[in->rn]; break;
+            case SW_SYSREG_FPSR: cpu->fpsr = x[in->rn]; break;
+            }
+            NEXT();
+
+        OP(SW_OP_IC_FLUSH):
+            cpu->flush_pending = true;
+            BRANCH(INSN_PC() + 4);
+
+        OP(SW_OP_UNDEF):
+        default:
+            return sw_raise(cpu, b, in, ESR(EC_UNKNOWN, 0), 0);
+        }
+    }
+
+direct_exit:
+    /* Go straight on into the block this exit is chained to. The
+     * dispatcher still sees cold blocks, which it profiles, and with
+     * coverage on every edge. */
+    {
+        const sw_chain_t *slot = &b->chain[(cpu->pc >> 2) & (SW_CHAIN_SLOTS - 1)];
+        sw_block_t *next = slot->block;
+
+        if (next == NULL || slot->pc != cpu->pc || b->exec_count < SW_TRACE_THRESHOLD ||
+            next->exec_count < SW_TRACE_THRESHOLD || cpu->cov_map != NULL ||
+            sw_dispatcher_due(cpu))
+            return SW_CONT_DIRECT;
+
+        cpu->chain_inline++;
+        next->hits++;
+        *bp = next;
+        b = next;
+        in = b->ops;
+        DISPATCH();
+    }
+
+#undef BRANCH_HOW
+#undef BRANCH
+#undef OP
+#undef OP_RANGE
+#undef NEXT
+#undef DISPATCH
+#undef INSN_PC
+#undef IS32
+#undef SET
+}
+
+/* ============================================================================
+ * Block Cache
+ * ============================================================================ */
+
+static inline size_t block_hash(uint64_t pc)
+{
+    return (size_t)(pc >> 2) & (SW_BLOCK_HASH_SIZE - 1);
+}
+
+static sw_block_t *sw_find_block(const sw_cpu_t *cpu, uint64_t pc)
+{
+    for (sw_block_t *b = cpu->blocks[block_hash(pc)]; b != NULL; b = b->next)
+    {
+        if (b->pc == pc)
+            return b;
+    }
+    return NULL;
+}
+
+/* Mark the pages a block's code is in as accessed */
+static void note_code_access(sw_cpu_t *cpu, const sw_block_t *b)
+{
+    uint64_t last = UINT64_MAX;
+
+    for (uint32_t i = 0; i < b->n_ops; i++)
+    {
+        uint64_t page = (b->pc + (int64_t)b->ops[i].pc_off) >> GUEST_PAGE_SHIFT;
+        if (b->ops[i].op != SW_OP_END && page != last)
+        {
+            mark_accessed(cpu, page << GUEST_PAGE_SHIFT);
+            last = page;
+        }
+    }
+}
+
+static sw_block_t *sw_insert_block(sw_cpu_t *cpu, uint64_t pc, uint32_t n_insns,
+                                   const sw_insn_t *ops, uint32_t n_ops, bool owned)
+{
+    sw_block_t *b = calloc(1, sizeof(*b));
+    if (b == NULL)
+        return NULL;
+
+    b->pc = pc;
+    b->n_insns = n_insns;
+    b->n_ops = n_ops;
+    b->ops = ops;
+    b->ops_owned = owned;
+    b->taken_pc = UINT64_MAX;
+    b->next = cpu->blocks[block_hash(pc)];
+    cpu->blocks[block_hash(pc)] = b;
+
+    /* Remember which pages hold code, so stores into them flush us.
+     * Traces are not contiguous, so go by the PC of every op. */
+    for (uint32_t i = 0; i < n_ops; i++)
+    {
+        if (ops[i].op == SW_OP_END)
+            continue;
+        uint64_t page = (pc + (int64_t)ops[i].pc_off) >> GUEST_PAGE_SHIFT;
+        cpu->code_pages[page >> 3] |= (uint8_t)(1u << (page & 7));
+    }
+    if (cpu->accessed_pages != NULL)
+        note_code_access(cpu, b);
+
+    /* Profile the final conditional branch, for trace formation */
+    switch (ops[n_ops - 1].op)
+    {
+    case SW_OP_BCOND:
+    case SW_OP_CBZ:
+    case SW_OP_CBNZ:
+    case SW_OP_TBZ:
+    case SW_OP_TBNZ:
+        b->taken_pc = (uint64_t)ops[n_ops - 1].imm;
+        break;
+    default:
+        break;
+    }
+    return b;
+}
+
+/* Try to reuse a translation from the persistent cache */
+static sw_block_t *sw_block_from_tcache(sw_cpu_t *cpu, uint64_t pc)
+{
+    const tcache_entry_t *e = tcache_lookup(cpu->tcache, cpu->image_hash, pc, cpu->mode);
+    const sw_insn_t *ops;
+
+    if (e == NULL)
+        return NULL;
+
+    /* The guest may have changed the code since: check the source bytes */
+    ops = tcache_ops(cpu->tcache, e);
+    if (ops == NULL || !mem_ok(cpu, pc, (uint64_t)e->n_insns * 4) ||
+        sw_hash64(cpu->mem + pc, (size_t)e->n_insns * 4) != e->src_hash)
+    {
+        cpu->tcache_rejects++;
+        return NULL;
+    }
+
+    /* Ops index the dispatch table, a damaged file must not get that far */
+    for (uint32_t i = 0; i < e->n_ops; i++)
+    {
+        if (ops[i].op >= SW_OP_COUNT)
+        {
+            cpu->tcache_rejects++;
+            return NULL;
+        }
+    }
+
+    cpu->blocks_from_tcache++;
+    return sw_insert_block(cpu, pc, e->n_insns, ops, e->n_ops, false);
+}
+
+static sw_block_t *sw_translate(sw_cpu_t *cpu, uint64_t pc)
+{
+    sw_insn_t ops[SW_BLOCK_MAX_INSNS + 1];
+    uint32_t n = 0;
+    bool ended = false;
+
+    if (cpu->tcache != NULL)
+    {
+        sw_block_t *b = sw_block_from_tcache(cpu, pc);
+        if (b != NULL)
+            return b;
+    }
+
+    /* Decode until a block-ending instruction, the size limit or the end
+     * of the page, whichever comes first. */
+    do
+    {
+        uint64_t ipc = pc + (uint64_t)n * 4;
+        uint32_t raw;
+
+        memcpy(&raw, cpu->mem + ipc, sizeof(raw));
+        ended = sw_decode(raw, ipc, &ops[n]);
+        ops[n].pc_off = (int32_t)(n * 4);
+        n++;
+    } while (!ended && n < SW_BLOCK_MAX_INSNS &&
+             ((pc + (uint64_t)n * 4) & (GUEST_PAGE_SIZE - 1)) != 0 &&
+             mem_ok(cpu, pc + (uint64_t)n * 4, 4));
+
+    uint32_t n_ops = n;
+    if (!ended)
+    {
+        memset(&ops[n_ops], 0, sizeof(ops[n_ops]));
+        ops[n_ops].op = SW_OP_END;
+        ops[n_ops].pc_off = (int32_t)(n * 4);
+        n_ops++;
+    }
+
+    sw_insn_t *copy = malloc(n_ops * sizeof(*copy));
+    if (copy == NULL)
+        return NULL;
+    memcpy(copy, ops, n_ops * sizeof(*copy));
+
+    cpu->blocks_translated++;
+    if (cpu->tcache != NULL)
+    {
+        tcache_record(cpu->tcache, cpu->image_hash, pc, cpu->mode, n,
+                      sw_hash64(cpu->mem + pc, (size_t)n * 4), copy, n_ops);
+    }
+
+    sw_block_t *b = sw_insert_block(cpu, pc, n, copy, n_ops, true);
+    if (b == NULL)
+        free(copy);
+    return b;
+}
+
+/* ============================================================================
+ * Superblocks
+ * ============================================================================ */
+
+/* Forget every chain and cached indirect target */
+static void sw_unchain_all(sw_cpu_t *cpu)
+{
+    for (size_t i = 0; i < SW_BLOCK_HASH_SIZE; i++)
+    {
+        for (sw_block_t *b = cpu->blocks[i]; b != NULL; b = b->next)
+            memset(b->chain, 0, sizeof(b->chain));
+    }
+    memset(cpu->ibtc, 0, sizeof(cpu->ibtc));
+}
+
+/*
+ * Where a trace continues after the last op of `b`, or false if it can't.
+ * On success `*flags` holds the SW_F_TRACE* flags to put on that op.
+ */
+static bool trace_successor(const sw_block_t *b, uint64_t *next, uint8_t *flags)
+{
+    const sw_insn_t *last = &b->ops[b->n_ops - 1];
+
+    *flags = SW_F_TRACE;
+    switch (last->op)
+    {
+    case SW_OP_END:
+        *next = b->pc + (int64_t)last->pc_off;
+        return true;
+
+    case SW_OP_B:
+    case SW_OP_BL:
+        *next = (uint64_t)last->imm;
+        return true;
+
+    case SW_OP_BCOND:
+    case SW_OP_CBZ:
+    case SW_OP_CBNZ:
+    case SW_OP_TBZ:
+    case SW_OP_TBNZ:
+        /* Follow the usual direction, if there is enough history */
+        if (b->exec_count < SW_TRACE_MIN_PROFILE)
+            return false;
+        if (b->taken * 2 > b->exec_count)
+        {
+            *next = (uint64_t)last->imm;
+            *flags |= SW_F_TAKEN;
+        }
+        else
+        {
+            *next = b->pc + (int64_t)last->pc_off + 4;
+        }
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+/*
+ * Build a trace starting at the hot block `head` by stitching together
+ * the already translated blocks along its most frequent path. The trace
+ * stops at an indirect branch or exception, at a block we have no profile
+ * for, when it would revisit a block, or when it gets too long. A path
+ * back to `head` itself closes a loop: the trace ends in SW_OP_LOOP and
+ * runs round without the dispatcher.
+ *
+ * Traces are not written to the tcache: their ops are not contiguous in
+ * guest memory, so a single source hash can't validate them.
+ */
+static sw_block_t *sw_form_trace(sw_cpu_t *cpu, sw_block_t *head)
+{
+    sw_insn_t ops[SW_TRACE_MAX_INSNS + 1];
+    uint64_t visited[SW_TRACE_MAX_BLOCKS];
+    uint32_t n = 0, n_insns = 0, n_blocks = 0;
+    bool loops = false;
+    sw_block_t *b = head;
+
+    for (;;)
+    {
+        /* Append b, rebasing its PC offsets onto the trace head */
+        int64_t rebase = (int64_t)(b->pc - head->pc);
+        for (uint32_t i = 0; i < b->n_ops; i++)
+        {
+            ops[n] = b->ops[i];
+            ops[n].pc_off = (int32_t)(ops[n].pc_off + rebase);
+            n++;
+        }
+        n_insns += b->n_insns;
+        visited[n_blocks++] = b->pc;
+
+        uint64_t next_pc;
+        uint8_t flags;
+        if (!trace_successor(b, &next_pc, &flags) || n_blocks == SW_TRACE_MAX_BLOCKS)
+            break;
+
+        if (next_pc == head->pc)
+        {
+            /* Replace a fall-through END, or mark the branch as above */
+            if (ops[n - 1].op == SW_OP_END)
+                n--;
+            else
+                ops[n - 1].flags |= flags;
+            ops[n++] = (sw_insn_t){.op = SW_OP_LOOP, .pc_off = 0};
+            loops = true;
+            break;
+        }
+
+        sw_block_t *next = sw_find_block(cpu, next_pc);
+        int64_t next_rebase = (int64_t)(next_pc - head->pc);
+        if (next == NULL || next->is_trace ||
+            n - (ops[n - 1].op == SW_OP_END) + next->n_ops > SW_TRACE_MAX_INSNS ||
+            next_rebase < INT32_MIN / 2 || next_rebase > INT32_MAX / 2)
+            break;
+
+        bool seen = false;
+        for (uint32_t i = 0; i < n_blocks; i++)
+            seen |= visited[i] == next_pc;
+        if (seen)
+            break;
+
+        /* Carry on inline: drop a fall-through END, or turn the branch
+         * into a trace branch/guard */
+        if (ops[n - 1].op == SW_OP_END)
+            n--;
+        else
+            ops[n - 1].flags |= flags;
+        b = next;
+    }
+
+    if (n_blocks < 2 && !loops)
+        return NULL;
+
+    sw_insn_t *copy = malloc(n * sizeof(*copy));
+    if (copy == NULL)
+        return NULL;
+    memcpy(copy, ops, n * sizeof(*copy));
+
+    sw_block_t *trace = sw_insert_block(cpu, head->pc, n_insns, copy, n, true);
+    if (trace == NULL)
+    {
+        free(copy);
+        return NULL;
+    }
+    trace->is_trace = true;
+    trace->exec_count = SW_TRACE_THRESHOLD; /* No profiling for traces */
+    cpu->traces_formed++;
+
+    /* The trace now shadows head in the hash table; drop chains that
+     * still lead to the old block */
+    sw_unchain_all(cpu);
+    return trace;
+}
+
+/* Keep the count of a block that is about to be freed */
+static void sw_save_count(sw_cpu_t *cpu, const sw_block_t *b)
+{
+    /* Grow by doubling: n_flushed_counts is a power of two when full */
+    size_t n = cpu->n_flushed_counts;
+    if (n == 0 || (n & (n - 1)) == 0)
+    {
+        sw_block_count_t *p = realloc(cpu->flushed_counts, (n ? 2 * n : 64) * sizeof(*p));
+        if (p == NULL)
+            return;
+        cpu->flushed_counts = p;
+    }
+    cpu->flushed_counts[n].pc = b->pc;
+    cpu->flushed_counts[n].n_insns = b->n_insns;
+    cpu->flushed_counts[n].hits = b->hits;
+    cpu->n_flushed_counts = n + 1;
+}
+
+void sw_cpu_flush(sw_cpu_t *cpu)
+{
+    for (size_t i = 0; i < SW_BLOCK_HASH_SIZE; i++)
+    {
+        sw_block_t *b = cpu->blocks[i];
+        while (b != NULL)
+        {
+            sw_block_t *next = b->next;
+            if (cpu->profile && b->hits != 0)
+                sw_save_count(cpu, b);
+            if (cpu->accessed_pages != NULL && b->hits != b->wss_hits)
+                note_code_access(cpu, b);
+            if (b->ops_owned)
+                free((void *)b->ops);
+            free(b);
+            b = next;
+        }
+        cpu->blocks[i] = NULL;
+    }
+
+    memset(cpu->code_pages, 0, ((cpu->mem_size >> GUEST_PAGE_SHIFT) + 8) / 8);
+    memset(cpu->ibtc, 0, sizeof(cpu->ibtc));
+    cpu->flush_pending = false;
+    if (cpu->code_epoch != NULL)
+        cpu->code_epoch_seen = atomic_load(cpu->code_epoch);
+}
+
+/* ============================================================================
+ * API
+ * ============================================================================ */
+
+int sw_cpu_init(sw_cpu_t *cpu, void *mem, uint64_t mem_size)
+{
+    memset(cpu, 0, sizeof(*cpu));
+    cpu->mem = mem;
+    cpu->mem_size = mem_size;
+    cpu->mode = SW_MODE_A64_EL1;
+    cpu->excl_addr = SW_EXCL_NONE;
+    cpu->icount_deadline = UINT64_MAX;
+    cpu->insn_limit = UINT64_MAX;
+    cpu->code_pages = calloc(((mem_size >> GUEST_PAGE_SHIFT) + 8) / 8, 1);
+    return cpu->code_pages != NULL ? 0 : -1;
+}
+
+void sw_cpu_destroy(sw_cpu_t *cpu)
+{
+    if (cpu->code_pages != NULL)
+        sw_cpu_flush(cpu);
+    free(cpu->code_pages);
+    cpu->code_pages = NULL;
+    free(cpu->dirty_pages);
+    cpu->dirty_pages = NULL;
+    free(cpu->accessed_pages);
+    cpu->accessed_pages = NULL;
+    free(cpu->touched_pages);
+    cpu->touched_pages = NULL;
+    free(cpu->touch_order);
+    cpu->touch_order = NULL;
+    cpu->n_touched = 0;
+    free(cpu->flushed_counts);
+    cpu->flushed_counts = NULL;
+    cpu->n_flushed_counts = 0;
+}
+
+static int cmp_block_count(const void *a, const void *b)
+{
+    const sw_block_count_t *x = a, *y = b;
+    return x->pc < y->pc ? -1 : x->pc > y->pc;
+}
+
+ssize_t sw_cpu_block_counts(sw_cpu_t *cpu, sw_block_count_t **out)
+{
+    size_t n = cpu->n_flushed_counts, merged = 0;
+    sw_block_count_t *counts;
+
+    for (size_t i = 0; i < SW_BLOCK_HASH_SIZE; i++)
+        for (const sw_block_t *b = cpu->blocks[i]; b != NULL; b = b->next)
+            n += b->hits != 0;
+
+    counts = malloc((n ? n : 1) * sizeof(*counts));
+    if (counts == NULL)
+        return -1;
+    memcpy(counts, cpu->flushed_counts, cpu->n_flushed_counts * sizeof(*counts));
+    n = cpu->n_flushed_counts;
+    for (size_t i = 0; i < SW_BLOCK_HASH_SIZE; i++)
+    {
+        for (const sw_block_t *b = cpu->blocks[i]; b != NULL; b = b->next)
+        {
+            if (b->hits == 0)
+                continue;
+            counts[n].pc = b->pc;
+            counts[n].n_insns = b->n_insns;
+            counts[n].hits = b->hits;
+            n++;
+        }
+    }
+
+    /* One entry per PC; a retranslated block keeps its longest length */
+    qsort(counts, n, sizeof(*counts), cmp_block_count);
+    for (size_t i = 0; i < n; i++)
+    {
+        if (merged > 0 && counts[merged - 1].pc == counts[i].pc)
+        {
+            counts[merged - 1].hits += counts[i].hits;
+            if (counts[i].n_insns > counts[merged - 1].n_insns)
+                counts[merged - 1].n_insns = counts[i].n_insns;
+        }
+        else
+        {
+            counts[merged++] = counts[i];
+        }
+    }
+    *out = counts;
+    return (ssize_t)merged;
+}
+
+void sw_cpu_set_icount(sw_cpu_t *cpu, uint32_t mips)
+{
+    cpu->icount_mips = mips;
+    cpu->icount_bias = 0;
+    vtimer_update(cpu);
+}
+
+int sw_cpu_track_dirty(sw_cpu_t *cpu)
+{
+    if (cpu->dirty_pages == NULL)
+        cpu->dirty_pages = calloc(((cpu->mem_size >> GUEST_PAGE_SHIFT) + 8) / 8, 1);
+    return cpu->dirty_pages != NULL ? 0 : -1;
+}
+
+void sw_cpu_mark_dirty(sw_cpu_t *cpu, uint64_t addr, uint64_t size)
+{
+    if (cpu->dirty_pages == NULL || size == 0)
+        return;
+    for (uint64_t a = addr & ~(GUEST_PAGE_SIZE - 1); a < addr + size; a += GUEST_PAGE_SIZE)
+        mark_dirty(cpu->dirty_pages, a);
+}
+
+uint64_t sw_cpu_restore_dirty(sw_cpu_t *cpu, const uint8_t *snapshot)
+{
+    uint64_t n_bytes = ((cpu->mem_size >> GUEST_PAGE_SHIFT) + 8) / 8;
+    uint64_t restored = 0;
+
+    for (uint64_t i = 0; i < n_bytes; i++)
+    {
+        /* Most of the bitmap is clear, skip it a byte at a time */
+        uint8_t dirty = cpu->dirty_pages[i];
+        if (dirty == 0)
+            continue;
+        cpu->dirty_pages[i] = 0;
+
+        for (unsigned bit = 0; bit < 8; bit++)
+        {
+            if (!(dirty & (1u << bit)))
+                continue;
+            uint64_t addr = ((i << 3) + bit) << GUEST_PAGE_SHIFT;
+            if (addr >= cpu->mem_size)
+                break;
+            uint64_t len = cpu->mem_size - addr < GUEST_PAGE_SIZE ? cpu->mem_size - addr
+                                                                  : GUEST_PAGE_SIZE;
+            memcpy(cpu->mem + addr, snapshot + addr, len);
+            if (page_has_code(cpu, addr))
+                cpu->flush_pending = true;
+            restored++;
+        }
+    }
+    return restored;
+}
+
+void sw_cpu_harvest_dirty(sw_cpu_t *cpu, uint8_t *bitmap)
+{
+    uint64_t n_bytes = ((cpu->mem_size >> GUEST_PAGE_SHIFT) + 8) / 8;
+
+    if (cpu->dirty_pages == NULL)
+        return;
+    for (uint64_t i = 0; i < n_bytes; i++)
+    {
+        bitmap[i] |= cpu->dirty_pages[i];
+        cpu->dirty_pages[i] = 0;
+    }
+}
+
+int sw_cpu_track_access(sw_cpu_t *cpu)
+{
+    uint64_t n_pages = (cpu->mem_size >> GUEST_PAGE_SHIFT) + 1;
+
+    if (cpu->accessed_pages != NULL)
+        return 0;
+    cpu->accessed_pages = calloc((n_pages + 7) / 8, 1);
+    cpu->touched_pages = calloc((n_pages + 7) / 8, 1);
+    cpu->touch_order = malloc(n_pages * sizeof(*cpu->touch_order));
+    if (cpu->accessed_pages == NULL || cpu->touched_pages == NULL || cpu->touch_order == NULL)
+    {
+        free(cpu->accessed_pages);
+        free(cpu->touched_pages);
+        free(cpu->touch_order);
+        cpu->accessed_pages = cpu->touched_pages = NULL;
+        cpu->touch_order = NULL;
+        return -1;
+    }
+
+    /* Code translated so far has run */
+    for (size_t i = 0; i < SW_BLOCK_HASH_SIZE; i++)
+        for (sw_block_t *b = cpu->blocks[i]; b != NULL; b = b->next)
+            note_code_access(cpu, b);
+    return 0;
+}
+
+void sw_cpu_harvest_access(sw_cpu_t *cpu, uint8_t *bitmap)
+{
+    uint64_t n_bytes = ((cpu->mem_size >> GUEST_PAGE_SHIFT) + 8) / 8;
+
+    if (cpu->accessed_pages == NULL)
+        return;
+    for (size_t i = 0; i < SW_BLOCK_HASH_SIZE; i++)
+    {
+        for (sw_block_t *b = cpu->blocks[i]; b != NULL; b = b->next)
+        {
+            if (b->hits != b->wss_hits)
+            {
+                note_code_access(cpu, b);
+                b->wss_hits = b->hits;
+            }
+        }
+    }
+    for (uint64_t i = 0; i < n_bytes; i++)
+    {
+        bitmap[i] |= cpu->accessed_pages[i];
+        cpu->accessed_pages[i] = 0;
+    }
+}
+
+void sw_cpu_save_regs(const sw_cpu_t *cpu, sw_regs_t *regs)
+{
+    memcpy(regs->x, cpu->x, sizeof(regs->x));
+    regs->pc = cpu->pc;
+    regs->nzcv = cpu->nzcv;
+    regs->tpidr_el0 = cpu->tpidr_el0;
+    regs->tpidr_el1 = cpu->tpidr_el1;
+    regs->fpcr = cpu->fpcr;
+    regs->fpsr = cpu->fpsr;
+    memcpy(regs->v, cpu->v, sizeof(regs->v));
+    regs->cntv_ctl = cpu->cntv_ctl;
+    regs->cntv_cval = cpu->cntv_cval;
+    regs->icount_bias = cpu->icount_bias;
+}
+
+void sw_cpu_load_regs(sw_cpu_t *cpu, const sw_regs_t *regs)
+{
+    memcpy(cpu->x, regs->x, sizeof(cpu->x));
+    cpu->x[SW_REG_ZR] = 0;
+    cpu->pc = regs->pc;
+    cpu->nzcv = regs->nzcv & 0xf0000000u;
+    cpu->flags_op = SW_FLAGS_NZCV;
+    cpu->tpidr_el0 = regs->tpidr_el0;
+    cpu->tpidr_el1 = regs->tpidr_el1;
+    cpu->fpcr = regs->fpcr;
+    cpu->fpsr = regs->fpsr;
+    memcpy(cpu->v, regs->v, sizeof(cpu->v));
+    cpu->cntv_ctl = regs->cntv_ctl & (CNTV_CTL_ENABLE | CNTV_CTL_IMASK);
+    cpu->cntv_cval = regs->cntv_cval;
+    cpu->icount_bias = regs->icount_bias;
+    cpu->excl_addr = SW_EXCL_NONE;
+    vtimer_update(cpu);
+}
+
+uint64_t sw_cpu_timer_ns(const sw_cpu_t *cpu)
+{
+    if (!vtimer_armed(cpu))
+        return UINT64_MAX;
+
+    uint64_t now = sw_cntvct(cpu, 0);
+    if (cpu->icount_mips != 0 || cpu->cntv_cval <= now)
+        return 0; /* With icount, WFI only exits past the deadline */
+    return (uint64_t)((unsigned __int128)(cpu->cntv_cval - now) * 1000000000u / SW_CNTFRQ);
+}
+
+void sw_cpu_kick(sw_cpu_t *cpu)
+{
+    atomic_store(&cpu->kick, true);
+}
+
+/* Find or translate the block at `pc`, NULL if there is no code there */
+static sw_block_t *sw_lookup(sw_cpu_t *cpu, uint64_t pc)
+{
+    sw_block_t *b = sw_find_block(cpu, pc);
+
+    if (b == NULL && (pc & 3) == 0 && mem_ok(cpu, pc, 4) &&
+        (cpu->absent_pages == NULL || !page_absent(cpu, pc)))
+        b = sw_translate(cpu, pc);
+    return b;
+}
+
+static int sw_run_loop(sw_cpu_t *cpu)
+{
+    sw_block_t *prev = NULL;
+    int how = SW_CONT_DIRECT;
+
+    for (;;)
+    {
+        if (atomic_load_explicit(&cpu->kick, memory_order_relaxed) &&
+            atomic_exchange(&cpu->kick, false))
+        {
+            return SW_EXIT_CANCELED;
+        }
+
+        /* The virtual timer's deadline passed (icount mode). It fires
+         * once, until the guest programs it again. */
+        if (cpu->insns >= cpu->icount_deadline)
+        {
+            cpu->icount_deadline = UINT64_MAX;
+            return SW_EXIT_VTIMER;
+        }
+        if (cpu->insns >= cpu->insn_limit)
+            return SW_EXIT_LIMIT;
+
+        /* Code was modified, by us (tell the other vCPUs) or by another
+         * vCPU: drop our translations */
+        if (cpu->flush_pending)
+        {
+            if (cpu->code_epoch != NULL)
+                atomic_fetch_add(cpu->code_epoch, 1);
+            sw_cpu_flush(cpu);
+            prev = NULL;
+        }
+        else if (cpu->code_epoch != NULL &&
+                 atomic_load_explicit(cpu->code_epoch, memory_order_relaxed) !=
+                     cpu->code_epoch_seen)
+        {
+            sw_cpu_flush(cpu);
+            prev = NULL;
+        }
+
+        /* Find the next block: chained, cached indirect target, or the
+         * hash table (patching the chain / cache for next time) */
+        uint64_t pc = cpu->pc;
+        sw_chain_t *slot = NULL;
+        sw_block_t *b = NULL;
+
+        if (how == SW_CONT_INDIRECT)
+            slot = &cpu->ibtc[(pc >> 2) & (SW_IBTC_SIZE - 1)];
+        else if (prev != NULL)
+            slot = &prev->chain[(pc >> 2) & (SW_CHAIN_SLOTS - 1)];
+
+        if (slot != NULL && slot->block != NULL && slot->pc == pc)
+        {
+            b = slot->block;
+            if (how == SW_CONT_INDIRECT)
+                cpu->ibtc_hits++;
+            else
+                cpu->chain_hits++;
+        }
+        else
+        {
+            b = sw_lookup(cpu, pc);
+            if (b == NULL)
+            {
+                cpu->exit_syndrome = ESR(EC_IABORT_LOWER, cpu->absent_fault ? SW_FSC_ABSENT : 0);
+                cpu->exit_fault_addr = cpu->absent_fault ? cpu->absent_addr : pc;
+                cpu->absent_fault = false;
+                return SW_EXIT_EXCEPTION;
+            }
+            if (slot != NULL)
+            {
+                slot->pc = pc;
+                slot->block = b;
+            }
+        }
+
+        /* Edge coverage, AFL style: the map counts (previous, current)
+         * block pairs. Traces would hide the edges inside them, so none
+         * are formed while coverage is on. */
+        if (cpu->cov_map != NULL)
+        {
+            uint32_t cur = (uint32_t)((b->pc >> 2) * 0x9e3779b97f4a7c15ull >> 48);
+            cpu->cov_map[(cur ^ cpu->cov_prev) & (SW_COV_MAP_SIZE - 1)]++;
+            cpu->cov_prev = cur >> 1;
+        }
+
+        /* Profile cold blocks; a block that gets hot becomes a trace */
+        bool profiling = b->exec_count < SW_TRACE_THRESHOLD;
+        if (profiling && ++b->exec_count == SW_TRACE_THRESHOLD && cpu->cov_map == NULL &&
+            !cpu->profile)
+        {
+            sw_block_t *trace = sw_form_trace(cpu, b);
+            if (trace != NULL)
+            {
+                b = trace;
+                profiling = false;
+            }
+        }
+
+        cpu->dispatches++;
+        b->hits++;
+        how = sw_exec_block(cpu, &b);
+        if (how == SW_CONT_EXIT)
+            return SW_EXIT_EXCEPTION;
+
+        if (profiling)
+            b->taken += cpu->pc == b->taken_pc;
+        prev = b;
+    }
+}
+
+int sw_cpu_run(sw_cpu_t *cpu)
+{
+    int ret = sw_run_loop(cpu);
+
+    /* Outside the run loop nzcv is the real thing */
+    flags_get(cpu);
+
+    /* Taking an exception clears the exclusive monitor */
+    if (ret == SW_EXIT_EXCEPTION)
+        cpu->excl_addr = SW_EXCL_NONE;
+    return ret;
+}
+
+/* ============================================================================
+ * Batch Execution
+ * ============================================================================
+ *
+ * See swcpu.h. A lane mask has all bits set in the lanes that execute and
+ * none in the others, the same form host vector compares produce, so a
+ * result is merged into a register with two ANDs and an OR.
+ */
+
+typedef int64_t sw_slanes_t __attribute__((vector_size(SW_BATCH_LANES * 8)));
+
+#define FOR_EACH_LANE(l, set) \
+    for (uint32_t l##_left = (set), l; l##_left != 0 && (l = (uint32_t)__builtin_ctz(l##_left), 1); \
+         l##_left &= l##_left - 1)
+
+static inline sw_lanes_t lanes_dup(uint64_t v)
+{
+    return (sw_lanes_t){0} + v;
+}
+
+static inline sw_lanes_t lanes_mask(uint32_t set)
+{
+    sw_lanes_t m;
+    for (unsigned l = 0; l < SW_BATCH_LANES; l++)
+        m[l] = ((set >> l) & 1) ? ~0ull : 0;
+    return m;
+}
+
+static inline sw_lanes_t lanes_sel(sw_lanes_t m, sw_lanes_t a, sw_lanes_t b)
+{
+    return (a & m) | (b & ~m);
+}
+
+static inline sw_lanes_t lanes_width(sw_lanes_t v, bool is32)
+{
+    return is32 ? v & 0xffffffffull : v;
+}
+
+/* shift_reg() for every lane, except ROR */
+static inline sw_lanes_t lanes_shift(sw_lanes_t v, unsigned type, sw_lanes_t amount, bool is32)
+{
+    if (is32)
+        v = type == 2 ? (sw_lanes_t)((sw_slanes_t)(v << 32) >> 32) : lanes_width(v, true);
+
+    switch (type)
+    {
+    case 0: v = v << amount; break;
+    case 1: v = v >> amount; break;
+    default: v = (sw_lanes_t)((sw_slanes_t)v >> (sw_slanes_t)amount); break;
+    }
+    return lanes_width(v, is32);
+}
+
+static inline sw_lanes_t lanes_flags_nz(sw_lanes_t r, bool is32)
+{
+    return (((r >> (is32 ? 31 : 63)) & 1) << 31) | ((sw_lanes_t)(r == 0) & SW_NZCV_Z);
+}
+
+static inline sw_lanes_t lanes_flags_add(sw_lanes_t a, sw_lanes_t b, bool is32)
+{
+    a = lanes_width(a, is32);
+    b = lanes_width(b, is32);
+    sw_lanes_t r = lanes_width(a + b, is32);
+    sw_lanes_t c = (sw_lanes_t)(r < a) & 1;
+    sw_lanes_t v = (((a ^ r) & (b ^ r)) >> (is32 ? 31 : 63)) & 1;
+    return lanes_flags_nz(r, is32) | (c << 29) | (v << 28);
+}
+
+static inline sw_lanes_t lanes_flags_sub(sw_lanes_t a, sw_lanes_t b, bool is32)
+{
+    a = lanes_width(a, is32);
+    b = lanes_width(b, is32);
+    sw_lanes_t r = lanes_width(a - b, is32);
+    sw_lanes_t c = (sw_lanes_t)(a >= b) & 1;
+    sw_lanes_t v = (((a ^ b) & (a ^ r)) >> (is32 ? 31 : 63)) & 1;
+    return lanes_flags_nz(r, is32) | (c << 29) | (v << 28);
+}
+
+/* cond_holds() for every lane, as a mask */
+static inline sw_lanes_t lanes_cond(sw_lanes_t nzcv, unsigned cond)
+{
+    sw_lanes_t n = nzcv >> 31, z = nzcv >> 30, c = nzcv >> 29, v = nzcv >> 28;
+    sw_lanes_t r;
+
+    switch (cond >> 1)
+    {
+    case 0: r = z; break;
+    case 1: r = c; break;
+    case 2: r = n; break;
+    case 3: r = v; break;
+    case 4: r = c & ~z; break;
+    case 5: r = ~(n ^ v); break;
+    case 6: r = ~(n ^ v) & ~z; break;
+    default: r = lanes_dup(1); break;
+    }
+
+    if ((cond & 1) && cond != 0xf)
+        r = ~r;
+    return -(r & 1);
+}
+
+/*
+ * Run `in` for lane `l` in the scalar interpreter, as a block of its own
+ * on bt->scalar. Returns false if the lane took an exit.
+ */
+static bool sw_batch_scalar_op(sw_batch_t *bt, const sw_block_t *b, const sw_insn_t *in,
+                               unsigned l)
+{
+    sw_cpu_t *cpu = bt->scalar;
+    sw_insn_t ops[2] = {*in, {.op = SW_OP_END, .pc_off = in->pc_off + 4}};
+    sw_block_t one = {.pc = b->pc, .n_insns = 1, .n_ops = 2, .ops = ops};
+    sw_block_t *run = &one;
+
+    for (unsigned r = 0; r < SW_NUM_REGS; r++)
+        cpu->x[r] = bt->x[r][l];
+    cpu->nzcv = (uint32_t)bt->nzcv[l];
+    cpu->flags_op = SW_FLAGS_NZCV;
+    cpu->tpidr_el0 = bt->tpidr_el0[l];
+    cpu->tpidr_el1 = bt->tpidr_el1[l];
+    cpu->cntv_ctl = bt->cntv_ctl[l];
+    cpu->cntv_cval = bt->cntv_cval[l];
+    cpu->excl_addr = bt->excl_addr[l];
+    cpu->excl_val[0] = bt->excl_val[l][0];
+    cpu->excl_val[1] = bt->excl_val[l][1];
+    cpu->excl_size = bt->excl_size[l];
+    cpu->mem = bt->mem[l];
+    cpu->flush_pending = false;
+
+    int how = sw_exec_block(cpu, &run);
+
+    for (unsigned r = 0; r < SW_NUM_REGS; r++)
+        bt->x[r][l] = cpu->x[r];
+    bt->nzcv[l] = flags_get(cpu);
+    bt->pc[l] = cpu->pc;
+    bt->tpidr_el0[l] = cpu->tpidr_el0;
+    bt->tpidr_el1[l] = cpu->tpidr_el1;
+    bt->cntv_ctl[l] = cpu->cntv_ctl;
+    bt->cntv_cval[l] = cpu->cntv_cval;
+    bt->excl_addr[l] = cpu->excl_addr;
+    bt->excl_val[l][0] = cpu->excl_val[0];
+    bt->excl_val[l][1] = cpu->excl_val[1];
+    bt->excl_size[l] = cpu->excl_size;
+    bt->scalar_ops++;
+
+    if (how == SW_CONT_EXIT)
+    {
+        bt->exit_syndrome[l] = cpu->exit_syndrome;
+        bt->exit_fault_addr[l] = cpu->exit_fault_addr;
+        return false;
+    }
+    if (cpu->flush_pending)
+    {
+        /* The lanes share one translation, none of them may change it */
+        bt->pc[l] = b->pc + (int64_t)in->pc_off;
+        bt->exit_syndrome[l] = ESR(EC_DABORT_LOWER, 1u << 6);
+        bt->exit_fault_addr[l] = 0;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Execute block `b` for the lanes in `live`, which are all at its PC.
+ * Returns the lanes that took an exit on the way.
+ */
+static uint32_t sw_batch_exec_block(sw_batch_t *bt, const sw_block_t *b, uint32_t live)
+{
+    sw_lanes_t *x = bt->x;
+    sw_lanes_t m = lanes_mask(live);
+    uint32_t exited = 0, gone;
+    const sw_insn_t *in = b->ops;
+    sw_lanes_t taken, target;
+
+#define INSN_PC() (b->pc + (int64_t)in->pc_off)
+#define IS32() (in->flags & SW_F_32)
+#define IMM() lanes_dup((uint64_t)in->imm)
+#define SET(v) (x[in->rd] = lanes_sel(m, lanes_width((v), IS32()), x[in->rd]))
+#define SET_FLAGS(f) (bt->nzcv = lanes_sel(m, (f), bt->nzcv))
+#define RETIRE()                                                \
+    do                                                          \
+    {                                                           \
+        bt->insns += (uint64_t)__builtin_popcount(live);        \
+        bt->issued++;                                           \
+    } while (0)
+/* Leave the block after `in` retired, continuing at `target` (lanes) */
+#define BRANCH(target)                                          \
+    do                                                          \
+    {                                                           \
+        bt->pc = lanes_sel(m, (target), bt->pc);                \
+        RETIRE();                                               \
+        return exited;                                          \
+    } while (0)
+
+    for (;; in++)
+    {
+        switch (in->op)
+        {
+        case SW_OP_END:
+            bt->pc = lanes_sel(m, lanes_dup(INSN_PC()), bt->pc);
+            return exited;
+
+        case SW_OP_NOP:
+            break;
+
+        /* ---------------------------------------------------------------- */
+
+        case SW_OP_MOVI:
+            x[in->rd] = lanes_sel(m, IMM(), x[in->rd]);
+            break;
+
+        case SW_OP_MOVK:
+            SET((x[in->rd] & ~(0xffffull << in->aux)) | ((uint64_t)in->imm << in->aux));
+            break;
+
+        case SW_OP_ADD_IMM:
+            SET(x[in->rn] + IMM());
+            break;
+
+        case SW_OP_SUB_IMM:
+            SET(x[in->rn] - IMM());
+            break;
+
+        case SW_OP_ADDS_IMM:
+            SET_FLAGS(lanes_flags_add(x[in->rn], IMM(), IS32()));
+            SET(x[in->rn] + IMM());
+            break;
+
+        case SW_OP_SUBS_IMM:
+            SET_FLAGS(lanes_flags_sub(x[in->rn], IMM(), IS32()));
+            SET(x[in->rn] - IMM());
+            break;
+
+        case SW_OP_AND_IMM:
+            SET(x[in->rn] & IMM());
+            break;
+
+        case SW_OP_ORR_IMM:
+            SET(x[in->rn] | IMM());
+            break;
+
+        case SW_OP_EOR_IMM:
+            SET(x[in->rn] ^ IMM());
+            break;
+
+        case SW_OP_ANDS_IMM:
+            SET(x[in->rn] & IMM());
+            SET_FLAGS(lanes_flags_nz(x[in->rd], IS32()));
+            break;
+
+        case SW_OP_SBFM:
+        case SW_OP_BFM:
+        case SW_OP_UBFM:
+            FOR_EACH_LANE(l, live)
+            {
+                x[in->rd][l] = bitfield(x[in->rd][l], x[in->rn][l], in->aux, in->aux2,
+                                        in->op, IS32());
+            }
+            break;
+
+        case SW_OP_ADD_SREG:
+        case SW_OP_SUB_SREG:
+        case SW_OP_ADDS_SREG:
+        case SW_OP_SUBS_SREG:
+        {
+            if (in->aux == 3)
+                goto scalar;
+            sw_lanes_t op2 = lanes_shift(x[in->rm], in->aux, lanes_dup(in->aux2), IS32());
+            bool sub = in->op == SW_OP_SUB_SREG || in->op == SW_OP_SUBS_SREG;
+
+            if (in->op == SW_OP_ADDS_SREG)
+                SET_FLAGS(lanes_flags_add(x[in->rn], op2, IS32()));
+            else if (in->op == SW_OP_SUBS_SREG)
+                SET_FLAGS(lanes_flags_sub(x[in->rn], op2, IS32()));
+            SET(sub ? x[in->rn] - op2 : x[in->rn] + op2);
+            break;
+        }
+
+        case SW_OP_AND_SREG:
+        case SW_OP_ORR_SREG:
+        case SW_OP_EOR_SREG:
+        case SW_OP_ANDS_SREG:
+        {
+            if (in->aux == 3)
+                goto scalar;
+            sw_lanes_t op2 = lanes_shift(x[in->rm], in->aux, lanes_dup(in->aux2), IS32());
+            if (in->flags & SW_F_INV)
+                op2 = ~op2;
+            switch (in->op)
+            {
+            case SW_OP_ORR_SREG: SET(x[in->rn] | op2); break;
+            case SW_OP_EOR_SREG: SET(x[in->rn] ^ op2); break;
+            default: SET(x[in->rn] & op2); break;
+            }
+            if (in->op == SW_OP_ANDS_SREG)
+                SET_FLAGS(lanes_flags_nz(x[in->rd], IS32()));
+            break;
+        }
+
+        case SW_OP_ADD_EREG:
+        case SW_OP_SUB_EREG:
+            FOR_EACH_LANE(l, live)
+            {
+                uint64_t op2 = extend_reg(x[in->rm][l], in->aux, in->aux2);
+                uint64_t r = in->op == SW_OP_ADD_EREG ? x[in->rn][l] + op2 : x[in->rn][l] - op2;
+                x[in->rd][l] = width_mask(r, IS32());
+            }
+            break;
+
+        case SW_OP_CSEL:
+            SET(lanes_sel(lanes_cond(bt->nzcv, in->aux), x[in->rn], x[in->rm]));
+            break;
+
+        case SW_OP_CSINC:
+            SET(lanes_sel(lanes_cond(bt->nzcv, in->aux), x[in->rn], x[in->rm] + 1));
+            break;
+
+        case SW_OP_CSINV:
+            SET(lanes_sel(lanes_cond(bt->nzcv, in->aux), x[in->rn], ~x[in->rm]));
+            break;
+
+        case SW_OP_CSNEG:
+            SET(lanes_sel(lanes_cond(bt->nzcv, in->aux), x[in->rn], -x[in->rm]));
+            break;
+
+        case SW_OP_CCMN:
+        case SW_OP_CCMP:
+        {
+            sw_lanes_t op2 = (in->flags & SW_F_IMM) ? IMM() : x[in->rm];
+            sw_lanes_t f = in->op == SW_OP_CCMP ? lanes_flags_sub(x[in->rn], op2, IS32())
+                                                : lanes_flags_add(x[in->rn], op2, IS32());
+            SET_FLAGS(lanes_sel(lanes_cond(bt->nzcv, in->aux), f,
+                                lanes_dup((uint64_t)in->aux2 << 28)));
+            break;
+        }
+
+        case SW_OP_LSLV:
+        case SW_OP_LSRV:
+        case SW_OP_ASRV:
+            SET(lanes_shift(x[in->rn], (unsigned)(in->op - SW_OP_LSLV),
+                            x[in->rm] & (IS32() ? 31 : 63), IS32()));
+            break;
+
+        case SW_OP_MADD:
+            SET(x[in->ra] + x[in->rn] * x[in->rm]);
+            break;
+
+        case SW_OP_MSUB:
+            SET(x[in->ra] - x[in->rn] * x[in->rm]);
+            break;
+
+        /* ---------------------------------------------------------------- */
+
+        case SW_OP_LD:
+        case SW_OP_ST:
+        {
+            /* Gather / scatter; lanes that fault or would write code go
+             * through the scalar interpreter, which raises the exit */
+            unsigned size = 1u << in->aux;
+            bool store = in->op == SW_OP_ST;
+            uint32_t slow = 0;
+
+            FOR_EACH_LANE(l, live)
+            {
+                uint64_t addr = x[in->rn][l] + (uint64_t)in->imm;
+
+                if (addr >= bt->mem_size || bt->mem_size - addr < size ||
+                    (store && (page_has_code(bt->code, addr) ||
+                               page_has_code(bt->code, addr + size - 1))))
+                {
+                    slow |= 1u << l;
+                }
+                else if (store)
+                {
+                    mem_write(bt->mem[l] + addr, in->aux, x[in->rd][l]);
+                }
+                else
+                {
+                    x[in->rd][l] = load_extend(mem_read(bt->mem[l] + addr, in->aux), in);
+                }
+            }
+            if (slow == 0)
+                break;
+            gone = 0;
+            FOR_EACH_LANE(l, slow)
+            {
+                if (!sw_batch_scalar_op(bt, b, in, l))
+                    gone |= 1u << l;
+            }
+            goto lanes_gone;
+        }
+
+        /* ---------------------------------------------------------------- */
+
+        case SW_OP_B:
+            BRANCH(IMM());
+
+        case SW_OP_BL:
+            x[SW_REG_LR] = lanes_sel(m, lanes_dup(INSN_PC() + 4), x[SW_REG_LR]);
+            BRANCH(IMM());
+
+        case SW_OP_BCOND:
+            taken = lanes_cond(bt->nzcv, in->aux);
+            goto cond_branch;
+
+        case SW_OP_CBZ:
+            taken = (sw_lanes_t)(lanes_width(x[in->rn], IS32()) == 0);
+            goto cond_branch;
+
+        case SW_OP_CBNZ:
+            taken = (sw_lanes_t)(lanes_width(x[in->rn], IS32()) != 0);
+            goto cond_branch;
+
+        case SW_OP_TBZ:
+            taken = (sw_lanes_t)(((x[in->rn] >> in->aux) & 1) == 0);
+            goto cond_branch;
+
+        case SW_OP_TBNZ:
+            taken = (sw_lanes_t)(((x[in->rn] >> in->aux) & 1) != 0);
+        cond_branch:
+            BRANCH(lanes_sel(taken, IMM(), lanes_dup(INSN_PC() + 4)));
+
+        case SW_OP_BR:
+        case SW_OP_RET:
+            BRANCH(x[in->rn]);
+
+        case SW_OP_BLR:
+            target = x[in->rn];
+            x[SW_REG_LR] = lanes_sel(m, lanes_dup(INSN_PC() + 4), x[SW_REG_LR]);
+            BRANCH(target);
+
+        /* ---------------------------------------------------------------- */
+
+        case SW_OP_HVC:
+            /* Like the hardware, the PC is already past the HVC */
+            FOR_EACH_LANE(l, live)
+            {
+                bt->exit_syndrome[l] = ESR(EC_HVC64, (uint64_t)in->imm);
+                bt->exit_fault_addr[l] = 0;
+            }
+            bt->pc = lanes_sel(m, lanes_dup(INSN_PC() + 4), bt->pc);
+            RETIRE();
+            return exited | live;
+
+        case SW_OP_DMB:
+            atomic_thread_fence(memory_order_seq_cst);
+            break;
+
+        case SW_OP_VLD ... SW_OP_VADDP_D:
+            /* The V registers are not kept per lane */
+            FOR_EACH_LANE(l, live)
+            {
+                bt->pc[l] = INSN_PC();
+                bt->exit_syndrome[l] = ESR(EC_UNKNOWN, 0);
+                bt->exit_fault_addr[l] = 0;
+            }
+            return exited | live;
+
+        default:
+        scalar:
+            gone = 0;
+            FOR_EACH_LANE(l, live)
+            {
+                if (!sw_batch_scalar_op(bt, b, in, l))
+                    gone |= 1u << l;
+            }
+        lanes_gone:
+            exited |= gone;
+            live &= ~gone;
+            m = lanes_mask(live);
+            /* Block-ending ops left the new PCs in bt->pc */
+            if (in == &b->ops[b->n_ops - 1])
+            {
+                RETIRE();
+                return exited;
+            }
+            break;
+        }
+
+        RETIRE();
+    }
+
+#undef INSN_PC
+#undef IS32
+#undef IMM
+#undef SET
+#undef SET_FLAGS
+#undef RETIRE
+#undef BRANCH
+}
+
+sw_batch_t *sw_batch_create(sw_cpu_t *code)
+{
+    sw_batch_t *bt;
+
+    /* Host vector loads and stores want the lanes aligned */
+    if (posix_memalign((void **)&bt, _Alignof(sw_batch_t), sizeof(*bt)) != 0)
+        return NULL;
+    memset(bt, 0, sizeof(*bt));
+
+    bt->scalar = calloc(1, sizeof(*bt->scalar));
+    if (bt->scalar == NULL)
+    {
+        free(bt);
+        return NULL;
+    }
+    bt->code = code;
+    bt->mem_size = code->mem_size;
+    bt->scalar->mem_size = code->mem_size;
+    bt->scalar->mode = code->mode;
+    bt->scalar->code_pages = code->code_pages; /* note_store() reads it */
+    sw_batch_reset(bt);
+    return bt;
+}
+
+void sw_batch_destroy(sw_batch_t *bt)
+{
+    if (bt == NULL)
+        return;
+    free(bt->scalar); /* Not sw_cpu_destroy(): code_pages is not its own */
+    free(bt);
+}
+
+void sw_batch_reset(sw_batch_t *bt)
+{
+    memset(bt->x, 0, sizeof(bt->x));
+    bt->pc = lanes_dup(0);
+    bt->nzcv = lanes_dup(0);
+    memset(bt->tpidr_el0, 0, sizeof(bt->tpidr_el0));
+    memset(bt->tpidr_el1, 0, sizeof(bt->tpidr_el1));
+    memset(bt->cntv_ctl, 0, sizeof(bt->cntv_ctl));
+    memset(bt->cntv_cval, 0, sizeof(bt->cntv_cval));
+    memset(bt->excl_val, 0, sizeof(bt->excl_val));
+    memset(bt->excl_size, 0, sizeof(bt->excl_size));
+    for (unsigned l = 0; l < SW_BATCH_LANES; l++)
+        bt->excl_addr[l] = SW_EXCL_NONE;
+}
+
+void sw_batch_run(sw_batch_t *bt, uint32_t lanes)
+{
+    uint32_t live = lanes;
+
+    while (live != 0)
+    {
+        /* Issue the lowest PC first: lanes that went ahead on a forward
+         * branch wait there until the others catch up */
+        uint64_t pc = UINT64_MAX;
+        uint32_t group = 0;
+
+        FOR_EACH_LANE(l, live)
+        {
+            if (bt->pc[l] < pc)
+                pc = bt->pc[l];
+        }
+        FOR_EACH_LANE(l, live)
+        {
+            if (bt->pc[l] == pc)
+                group |= 1u << l;
+        }
+
+        sw_block_t *b = sw_lookup(bt->code, pc);
+        if (b == NULL)
+        {
+            FOR_EACH_LANE(l, group)
+            {
+                bt->exit_syndrome[l] = ESR(EC_IABORT_LOWER, 0);
+                bt->exit_fault_addr[l] = pc;
+            }
+            live &= ~group;
+            continue;
+        }
+
+        /* Taking an exception clears the exclusive monitor */
+        uint32_t exited = sw_batch_exec_block(bt, b, group);
+        FOR_EACH_LANE(l, exited)
+        {
+            bt->excl_addr[l] = SW_EXCL_NONE;
+        }
+        live &= ~exited;
+    }
+}
+
+uint64_t sw_batch_timer_ns(const sw_batch_t *bt, unsigned l)
+{
+    if ((bt->cntv_ctl[l] & (CNTV_CTL_ENABLE | CNTV_CTL_IMASK)) != CNTV_CTL_ENABLE)
+        return UINT64_MAX;
+
+    /* Lanes have no icount mode, their counter is the host's */
+    uint64_t now = read_cntvct();
+    if (bt->cntv_cval[l] <= now)
+        return 0;
+    return (uint64_t)((unsigned __int128)(bt->cntv_cval[l] - now) * 1000000000u / SW_CNTFRQ);
+}
@@ -0,0 +1,454 @@
+/*
+ * swcpu.h - Software AArch64 backend for TinyVMM
+ *
+ * An alternative to Hypervisor.framework that runs guest code by
+ * translating it into blocks of pre-decoded instructions and interpreting
+ * those. It covers the integer subset of AArch64 that bare-metal guests
+ * like ours use plus the integer AdvSIMD (NEON) groups, with the MMU off
+ * (guest virtual == guest physical).
+ *
+ * A translation is plain data: an array of sw_insn_t with no host
+ * pointers in it, so translated blocks can be written to disk and mapped
+ * back in by other VM processes (see tcache.h).
+ *
+ * Guest exits look like Hypervisor.framework exceptions: sw_cpu_run()
+ * returns SW_EXIT_EXCEPTION with an ESR-format syndrome, and the VMM
+ * handles them with the same code as for the hardware backend.
+ *
+ * Several sw_cpu_t can share one guest memory, each run by its own host
+ * thread (SMP). Guest atomics and exclusives become host atomics, so the
+ * vCPUs never take a lock to synchronize with each other.
+ *
+ * This file has no macOS dependencies.
+ */
+
+#ifndef SWCPU_H
+#define SWCPU_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+/* ============================================================================
+ * Register File
+ * ============================================================================
+ *
+ * Register 31 means XZR or SP depending on the instruction. The decoder
+ * resolves that once, so the interpreter never has to: reads of XZR come
+ * from a slot that is always zero and writes to it go to a sink slot.
+ */
+
+#define SW_REG_LR 30
+#define SW_REG_ZR 31   /* Always reads as zero, never written */
+#define SW_REG_SP 32   /* Stack pointer */
+#define SW_REG_SINK 33 /* Destination for writes to XZR */
+#define SW_NUM_REGS 34
+
+/* PSTATE.NZCV bits, same positions as in the NZCV system register */
+#define SW_NZCV_N (1u << 31)
+#define SW_NZCV_Z (1u << 30)
+#define SW_NZCV_C (1u << 29)
+#define SW_NZCV_V (1u << 28)
+
+/*
+ * AdvSIMD register V0-V31, viewed as lanes of any width. Aligned so the
+ * interpreter can use host vector loads and stores on it (see swsimd.h).
+ */
+typedef union
+{
+    _Alignas(16) uint8_t b[16];
+    uint16_t h[8];
+    uint32_t s[4];
+    uint64_t d[2];
+} sw_vreg_t;
+
+#define SW_NUM_VREGS 32
+
+/*
+ * Lazy flags: flag-setting instructions only record what they did, and
+ * NZCV is worked out when something reads it. Conditions on a recorded
+ * compare are usually answered straight from its operands.
+ */
+#define SW_FLAGS_NZCV 0    /* nzcv holds the flags */
+#define SW_FLAGS_ADD64 1   /* flags_a + flags_b */
+#define SW_FLAGS_ADD32 2
+#define SW_FLAGS_SUB64 3   /* flags_a - flags_b */
+#define SW_FLAGS_SUB32 4
+#define SW_FLAGS_LOGIC64 5 /* N and Z of flags_a, C = V = 0 */
+#define SW_FLAGS_LOGIC32 6
+
+/* sw_cpu_t.excl_addr when the exclusive monitor is not armed */
+#define SW_EXCL_NONE UINT64_MAX
+
+/* ============================================================================
+ * Translations
+ * ============================================================================ */
+
+/*
+ * Bump this whenever sw_insn_t or the meaning of any op changes, so stale
+ * on-disk translations are ignored.
+ */
+#define SW_TRANSLATOR_VERSION 4
+
+/* Translation mode, part of the key of every translated block */
+#define SW_MODE_A64_EL1 0x1
+
+/* Maximum guest instructions in one block */
+#define SW_BLOCK_MAX_INSNS 64
+
+/*
+ * Superblocks (traces). A block dispatched SW_TRACE_THRESHOLD times is
+ * extended along its hottest successors into one trace: direct branches
+ * become no-ops and conditional branches become guards that leave the
+ * trace when they go the unusual way. A path that comes back to the head
+ * loops inside the trace.
+ */
+#define SW_TRACE_THRESHOLD 50   /* Dispatches before a trace is formed */
+#define SW_TRACE_MIN_PROFILE 8  /* Executions needed to trust a branch bias */
+#define SW_TRACE_MAX_INSNS 256  /* Guest instructions in one trace */
+#define SW_TRACE_MAX_BLOCKS 16  /* Blocks stitched into one trace */
+
+/* One decoded guest instruction (24 bytes, position independent) */
+typedef struct
+{
+    uint8_t op;     /* SW_OP_* (see swcpu.c) */
+    uint8_t rd;     /* Destination register index */
+    uint8_t rn;     /* First source / base register index */
+    uint8_t rm;     /* Second source register index */
+    uint8_t ra;     /* Third source register, or extra immediate */
+    uint8_t flags;  /* SW_F_* */
+    uint8_t aux;    /* Condition, shift, size... depending on op */
+    uint8_t aux2;   /* Second small operand */
+    int32_t pc_off; /* Guest PC of this instruction minus block PC */
+    uint32_t raw;   /* Original encoding */
+    int64_t imm;    /* Immediate, or absolute branch target */
+} sw_insn_t;
+
+/*
+ * Direct chaining: each block remembers the blocks its direct exits went
+ * to, indexed by exit PC. Once both are hot, execution goes straight on
+ * into the next block; otherwise the dispatcher skips the hash lookup.
+ */
+#define SW_CHAIN_SLOTS 4
+
+typedef struct
+{
+    uint64_t pc;
+    struct sw_block *block;
+} sw_chain_t;
+
+/* A translated block as kept in the block cache */
+typedef struct sw_block
+{
+    uint64_t pc;              /* Guest PC of the first instruction */
+    uint32_t n_insns;         /* Guest instructions covered */
+    uint32_t n_ops;           /* Entries in ops[] */
+    const sw_insn_t *ops;     /* Heap copy or mapped from the tcache */
+    bool ops_owned;           /* ops[] is ours to free */
+    bool is_trace;            /* Superblock built from other blocks */
+    struct sw_block *next;    /* Hash chain */
+
+    /* Profile, collected until exec_count reaches SW_TRACE_THRESHOLD */
+    uint32_t exec_count;
+    uint32_t taken;           /* Exits to taken_pc */
+    uint64_t taken_pc;        /* Taken target of the final conditional branch */
+
+    uint64_t hits;            /* Times entered (see sw_cpu_block_counts()) */
+    uint64_t wss_hits;        /* hits at the last sw_cpu_harvest_access() */
+
+    sw_chain_t chain[SW_CHAIN_SLOTS];
+} sw_block_t;
+
+/* Execution count of one block, as reported by sw_cpu_block_counts() */
+typedef struct
+{
+    uint64_t pc;      /* Guest PC of the first instruction */
+    uint32_t n_insns; /* Guest instructions in the block */
+    uint64_t hits;    /* Times the block was entered */
+} sw_block_count_t;
+
+#define SW_BLOCK_HASH_SIZE 4096
+
+/* Indirect branch target cache (BR/BLR/RET), direct mapped by target PC */
+#define SW_IBTC_SIZE 1024
+
+struct tcache;
+
+/* ============================================================================
+ * CPU State
+ * ============================================================================ */
+
+/*
+ * Architectural state of a vCPU, everything a snapshot needs to resume
+ * it (see sw_cpu_save_regs()). Plain data, safe to write to a file.
+ */
+typedef struct
+{
+    uint64_t x[SW_NUM_REGS];
+    uint64_t pc;
+    uint32_t nzcv;
+    uint64_t tpidr_el0;
+    uint64_t tpidr_el1;
+    uint64_t fpcr;
+    uint64_t fpsr;
+    sw_vreg_t v[SW_NUM_VREGS];
+    uint64_t cntv_ctl;
+    uint64_t cntv_cval;
+    uint64_t icount_bias;
+} sw_regs_t;
+
+/* sw_cpu_run() return values */
+#define SW_EXIT_EXCEPTION 1 /* See exit_syndrome / exit_fault_addr */
+#define SW_EXIT_CANCELED 2  /* sw_cpu_kick() was called */
+#define SW_EXIT_VTIMER 3    /* Virtual timer condition met (icount mode) */
+#define SW_EXIT_LIMIT 4     /* insns reached insn_limit */
+
+/* Fault status code of an abort on a post-copy absent page (see
+ * sw_cpu_t.absent_pages): translation fault, level 3 */
+#define SW_FSC_ABSENT 0x07
+
+/* Edge coverage map size (see sw_cpu_t.cov_map), a power of two <= 65536 */
+#define SW_COV_MAP_SIZE 65536
+
+typedef struct
+{
+    /* Architectural state */
+    uint64_t x[SW_NUM_REGS];
+    uint64_t pc;
+    uint32_t nzcv;        /* Always valid outside sw_cpu_run() */
+    uint32_t flags_op;    /* SW_FLAGS_* (inside sw_cpu_run()) */
+    uint64_t flags_a;
+    uint64_t flags_b;
+    uint64_t tpidr_el0;
+    uint64_t tpidr_el1;
+    uint64_t fpcr;
+    uint64_t fpsr;
+    sw_vreg_t v[SW_NUM_VREGS];
+
+    /* Virtual timer. CNTVCT follows the host clock, or in icount mode the
+     * instructions retired (see sw_cpu_set_icount()) */
+    uint64_t cntv_ctl;        /* ENABLE and IMASK, ISTATUS is computed */
+    uint64_t cntv_cval;
+    uint32_t icount_mips;     /* Virtual CPU speed, 0 = host clock */
+    uint64_t icount_bias;     /* Counter ticks skipped by WFI */
+    uint64_t icount_deadline; /* insns at which the timer fires, or UINT64_MAX */
+
+    /* Snapshot fuzzing support, all off by default */
+    uint64_t insn_limit;   /* sw_cpu_run() returns once insns reaches it */
+    uint8_t *dirty_pages;  /* Bitmap: pages the guest stored to, or NULL */
+    uint8_t *cov_map;      /* Edge hit counts (SW_COV_MAP_SIZE), or NULL */
+    uint32_t cov_prev;     /* Key of the previous block, for cov_map */
+
+    /* Block profile: every block counts its entries in sw_block_t.hits.
+     * With `profile` set no traces are formed, so each count belongs to
+     * one basic block, and counts survive sw_cpu_flush() */
+    bool profile;
+    sw_block_count_t *flushed_counts; /* Counts of flushed blocks */
+    size_t n_flushed_counts;
+
+    /* Working-set tracking (see sw_cpu_track_access()), off by default */
+    uint8_t *accessed_pages;  /* Bitmap: pages touched since the last harvest */
+    uint8_t *touched_pages;   /* Bitmap: pages touched at all */
+    uint32_t *touch_order;    /* Page numbers, in the order first touched */
+    uint32_t n_touched;
+
+    /* Post-copy: bitmap of the pages whose contents have not arrived, or
+     * NULL. Touching one, for data or to fetch code, exits with a data or
+     * instruction abort before the instruction has any effect: a level 3
+     * translation fault (FSC SW_FSC_ABSENT) whose fault address is the
+     * start of the absent page, as a stage-2 fault on an unmapped page
+     * would be. The VMM may clear bits from any thread (with release
+     * order) once the page is in place; bits are never set again. */
+    uint8_t *absent_pages;
+    bool absent_fault;     /* The abort being raised is at absent_addr */
+    uint64_t absent_addr;
+
+    /* Local exclusive monitor: armed by LDXR, checked by STXR */
+    uint64_t excl_addr;    /* SW_EXCL_NONE, or the address LDXR loaded */
+    uint64_t excl_val[2];  /* What LDXR/LDXP loaded from there */
+    uint32_t excl_size;    /* log2 of the access size */
+
+    /* Guest physical memory, mapped at guest address 0 */
+    uint8_t *mem;
+    uint64_t mem_size;
+
+    /* Last exit, valid after sw_cpu_run() returns SW_EXIT_EXCEPTION */
+    uint64_t exit_syndrome;   /* ESR_EL2 format */
+    uint64_t exit_fault_addr; /* FAR for aborts */
+
+    atomic_bool kick; /* Set from other threads to stop sw_cpu_run() */
+
+    /* Block cache */
+    sw_block_t *blocks[SW_BLOCK_HASH_SIZE];
+    uint8_t *code_pages;  /* Bitmap: guest pages with translated code */
+    bool flush_pending;   /* A store hit translated code */
+    atomic_uint *code_epoch;  /* Shared by the vCPUs of a VM (SMP), or NULL */
+    unsigned code_epoch_seen; /* code_epoch when we last flushed */
+    sw_chain_t ibtc[SW_IBTC_SIZE];
+
+    /* Persistent translation cache (optional) */
+    struct tcache *tcache;
+    uint64_t image_hash;  /* Identifies the loaded guest image */
+    uint32_t mode;        /* SW_MODE_* used for translation keys */
+
+    /* Statistics */
+    uint64_t insns;              /* Guest instructions retired */
+    uint64_t blocks_translated;  /* Blocks decoded from guest memory */
+    uint64_t blocks_from_tcache; /* Blocks taken from the tcache */
+    uint64_t tcache_rejects;     /* tcache entries that failed validation */
+    uint64_t traces_formed;      /* Superblocks built */
+    uint64_t dispatches;         /* Blocks entered from the dispatcher */
+    uint64_t chain_hits;         /* ...through a direct chain */
+    uint64_t ibtc_hits;          /* ...through the indirect branch cache */
+    uint64_t chain_inline;       /* Blocks entered straight from a chained exit */
+    uint64_t excl_fails;         /* STXR/STXP that failed */
+} sw_cpu_t;
+
+/* ============================================================================
+ * API
+ * ============================================================================ */
+
+int sw_cpu_init(sw_cpu_t *cpu, void *mem, uint64_t mem_size);
+void sw_cpu_destroy(sw_cpu_t *cpu);
+
+/* Run until the guest exits or sw_cpu_kick() is called */
+int sw_cpu_run(sw_cpu_t *cpu);
+
+/*
+ * Derive CNTVCT from the instructions retired, as if the guest ran at
+ * `mips` million instructions per second. Runs are then repeatable: the
+ * guest sees the same times on every run, and
+ * sw_cpu_run() returns SW_EXIT_VTIMER at the first block boundary after
+ * the virtual timer's deadline. 0 goes back to the host clock.
+ */
+void sw_cpu_set_icount(sw_cpu_t *cpu, uint32_t mips);
+
+/*
+ * Dirty page tracking, for restoring guest memory from a snapshot. Once
+ * enabled, every page the guest stores to is marked in dirty_pages; the
+ * VMM marks the pages it writes itself with sw_cpu_mark_dirty().
+ * sw_cpu_restore_dirty() copies the dirty pages back from `snapshot`, a
+ * full copy of guest memory, clears the bitmap and returns the number of
+ * pages copied. Restored code is retranslated. To send the pages that
+ * changed instead, sw_cpu_harvest_dirty() ORs the marks into `bitmap` (a
+ * page bitmap of the same size) and clears them; call it from the vCPU's
+ * own thread.
+ */
+int sw_cpu_track_dirty(sw_cpu_t *cpu);
+void sw_cpu_mark_dirty(sw_cpu_t *cpu, uint64_t addr, uint64_t size);
+uint64_t sw_cpu_restore_dirty(sw_cpu_t *cpu, const uint8_t *snapshot);
+void sw_cpu_harvest_dirty(sw_cpu_t *cpu, uint8_t *bitmap);
+
+/*
+ * The block profile (see sw_cpu_t.profile) in a new array sorted by PC,
+ * blocks translated more than once merged. Returns the number of entries
+ * and sets *out, which the caller frees; -1 if out of memory.
+ */
+ssize_t sw_cpu_block_counts(sw_cpu_t *cpu, sw_block_count_t **out);
+
+/*
+ * Working-set tracking. Once enabled, the pages the guest loads from,
+ * stores to or runs code in are marked in accessed_pages, and the first
+ * touch of each page is appended to touch_order. Code is marked when it
+ * is translated and, since chained blocks bypass the dispatcher, by the
+ * harvest for the blocks whose hits went up. sw_cpu_harvest_access()
+ * ORs the marks since its last call into `bitmap` (a page bitmap of the
+ * same size) and clears them; call it from the vCPU's own thread.
+ */
+int sw_cpu_track_access(sw_cpu_t *cpu);
+void sw_cpu_harvest_access(sw_cpu_t *cpu, uint8_t *bitmap);
+
+/*
+ * Copy the architectural state out of / into a vCPU that is not running.
+ * Loading also clears the exclusive monitor and rearms the virtual timer.
+ */
+void sw_cpu_save_regs(const sw_cpu_t *cpu, sw_regs_t *regs);
+void sw_cpu_load_regs(sw_cpu_t *cpu, const sw_regs_t *regs);
+
+/*
+ * Host nanoseconds until the virtual timer fires, for a VMM that waits
+ * on WFI: 0 if it already has, UINT64_MAX if it is not armed.
+ */
+uint64_t sw_cpu_timer_ns(const sw_cpu_t *cpu);
+
+/* Make sw_cpu_run() return SW_EXIT_CANCELED soon. Any thread. */
+void sw_cpu_kick(sw_cpu_t *cpu);
+
+/* Drop every translated block */
+void sw_cpu_flush(sw_cpu_t *cpu);
+
+/* 64-bit FNV-1a, used for image and block source hashes */
+uint64_t sw_hash64(const void *data, size_t len);
+
+/* ============================================================================
+ * Batch Execution
+ * ============================================================================
+ *
+ * Experimental: many small VMs running the same guest image, interpreted
+ * in lockstep. The register file is stored structure-of-arrays, x[reg]
+ * holding that register for every lane, so one host vector operation
+ * executes a guest instruction for SW_BATCH_LANES VMs at once.
+ *
+ * Each step issues the block at the lowest PC any live lane is at, with
+ * the lanes at other PCs masked off. Lanes that branched apart run their
+ * paths one after the other and merge again once their PCs meet. Blocks
+ * come from one shared sw_cpu_t, so every lane must run the same code and
+ * never modify it. Ops without a vector version (loads with writeback,
+ * bitfields, atomics...) run lane by lane in the scalar interpreter.
+ * AdvSIMD is not supported in this mode.
+ */
+
+#ifndef SW_BATCH_LANES
+#define SW_BATCH_LANES 16 /* At most 32: lane sets are uint32_t bitmasks */
+#endif
+
+/* One 64-bit value per lane; GCC/Clang map it onto host vector registers */
+typedef uint64_t sw_lanes_t __attribute__((vector_size(SW_BATCH_LANES * 8)));
+
+typedef struct
+{
+    /* Architectural state, one lane per VM */
+    sw_lanes_t x[SW_NUM_REGS];
+    sw_lanes_t pc;
+    sw_lanes_t nzcv;             /* Always computed eagerly */
+    uint64_t tpidr_el0[SW_BATCH_LANES];
+    uint64_t tpidr_el1[SW_BATCH_LANES];
+    uint64_t cntv_ctl[SW_BATCH_LANES];
+    uint64_t cntv_cval[SW_BATCH_LANES];
+    uint64_t excl_addr[SW_BATCH_LANES];
+    uint64_t excl_val[SW_BATCH_LANES][2];
+    uint32_t excl_size[SW_BATCH_LANES];
+
+    /* Guest memory of every lane, all mem_size bytes */
+    uint8_t *mem[SW_BATCH_LANES];
+    uint64_t mem_size;
+
+    /* Exits, valid for the lanes sw_batch_run() was given */
+    uint64_t exit_syndrome[SW_BATCH_LANES];
+    uint64_t exit_fault_addr[SW_BATCH_LANES];
+
+    sw_cpu_t *code;              /* Translates and caches the blocks */
+    sw_cpu_t *scalar;            /* Runs the ops that have no vector version */
+
+    /* Statistics */
+    uint64_t insns;              /* Guest instructions retired, all lanes */
+    uint64_t issued;             /* Instructions issued, each for 1+ lanes */
+    uint64_t scalar_ops;         /* Lane-instructions run by the fallback */
+} sw_batch_t;
+
+/* `code` translates from its own memory, which must hold the same image */
+sw_batch_t *sw_batch_create(sw_cpu_t *code);
+void sw_batch_destroy(sw_batch_t *bt);
+
+/* Clear the architectural state of every lane (not the statistics) */
+void sw_batch_reset(sw_batch_t *bt);
+
+/* Run the lanes in the bitmask until each of them has taken an exit */
+void sw_batch_run(sw_batch_t *bt, uint32_t lanes);
+
+/* sw_cpu_timer_ns() for lane `l`, which waits on WFI */
+uint64_t sw_batch_timer_ns(const sw_batch_t *bt, unsigned l);
+
+#endif /* SWCPU_H */
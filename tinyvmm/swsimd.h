@@ -0,0 +1,897 @@
+/*
+ * swsimd.h - Host vector operations for the software backend
+ *
+ * Guest AdvSIMD registers are 128 bits wide, so each guest vector
+ * instruction becomes one or two 128-bit host instructions: NEON on arm64
+ * hosts, SSE2 on x86-64 (plus SSSE3 and SSE4.1 when the compiler targets
+ * them). Combinations with no host instruction, such as 64-bit lane
+ * minimum on SSE, go through vec_lanes(), a lane-by-lane reference
+ * implementation. Build with -DSW_SIMD_SCALAR to use only the reference,
+ * for example to check the host paths against it.
+ *
+ * Included by swcpu.c only.
+ */
+
+#ifndef SWSIMD_H
+#define SWSIMD_H
+
+#include "swcpu.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#if defined(SW_SIMD_SCALAR)
+/* Reference implementation only */
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define SW_SIMD_NEON 1
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#define SW_SIMD_SSE 1
+#include <emmintrin.h>
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#endif
+#endif
+
+#if defined(SW_SIMD_NEON)
+typedef uint8x16_t sw_vec_t;
+#elif defined(SW_SIMD_SSE)
+typedef __m128i sw_vec_t;
+#else
+typedef sw_vreg_t sw_vec_t;
+#endif
+
+/* ============================================================================
+ * Lanes
+ * ============================================================================
+ *
+ * `size` is log2 of the lane width in bytes throughout: 0 = 8-bit lanes
+ * (16 of them), 3 = 64-bit lanes (2 of them).
+ */
+
+static inline uint64_t vreg_lane(const sw_vreg_t *v, unsigned size, unsigned i)
+{
+    switch (size)
+    {
+    case 0: return v->b[i];
+    case 1: return v->h[i];
+    case 2: return v->s[i];
+    default: return v->d[i];
+    }
+}
+
+static inline void vreg_set_lane(sw_vreg_t *v, unsigned size, unsigned i, uint64_t val)
+{
+    switch (size)
+    {
+    case 0: v->b[i] = (uint8_t)val; break;
+    case 1: v->h[i] = (uint16_t)val; break;
+    case 2: v->s[i] = (uint32_t)val; break;
+    default: v->d[i] = val; break;
+    }
+}
+
+static inline sw_vec_t vec_load(const sw_vreg_t *r)
+{
+#if defined(SW_SIMD_NEON)
+    return vld1q_u8(r->b);
+#elif defined(SW_SIMD_SSE)
+    return _mm_load_si128((const __m128i *)r->b);
+#else
+    return *r;
+#endif
+}
+
+static inline void vec_store(sw_vreg_t *r, sw_vec_t v)
+{
+#if defined(SW_SIMD_NEON)
+    vst1q_u8(r->b, v);
+#elif defined(SW_SIMD_SSE)
+    _mm_store_si128((__m128i *)r->b, v);
+#else
+    *r = v;
+#endif
+}
+
+/* Lane operations of vec_lanes() */
+enum
+{
+    VL_ADD,
+    VL_SUB,
+    VL_MUL,
+    VL_CMEQ,
+    VL_CMGT,  /* Signed > */
+    VL_CMHI,  /* Unsigned > */
+    VL_SMAX,
+    VL_SMIN,
+    VL_UMAX,
+    VL_UMIN,
+    VL_SQADD,
+    VL_UQADD,
+    VL_SQSUB,
+    VL_UQSUB,
+    VL_SHL,   /* By `n` */
+    VL_USHR,
+    VL_SSHR,
+    VL_ABS,
+    VL_NEG,
+    VL_CNT,
+    VL_CLZ,
+};
+
+static inline uint64_t lane_ones(unsigned bits)
+{
+    return bits >= 64 ? ~0ull : (1ull << bits) - 1;
+}
+
+static inline int64_t lane_sext(uint64_t v, unsigned bits)
+{
+    unsigned s = 64 - bits;
+    return (int64_t)(v << s) >> s;
+}
+
+/* Clamp to the signed range of a `bits`-wide lane */
+static inline uint64_t lane_sat_s(__int128 v, unsigned bits)
+{
+    __int128 max = ((__int128)1 << (bits - 1)) - 1, min = -max - 1;
+    return (uint64_t)(v > max ? max : v < min ? min : v);
+}
+
+/* Reference implementation: r[i] = op(a[i], b[i]), `n` is a shift count */
+static inline sw_vec_t vec_lanes(unsigned op, sw_vec_t a, sw_vec_t b, unsigned size, unsigned n)
+{
+    sw_vreg_t x, y, r;
+    unsigned bits = 8u << size;
+    uint64_t mask = lane_ones(bits);
+
+    vec_store(&x, a);
+    vec_store(&y, b);
+
+    for (unsigned i = 0; i < 16u >> size; i++)
+    {
+        uint64_t u = vreg_lane(&x, size, i), v = vreg_lane(&y, size, i);
+        int64_t s = lane_sext(u, bits), t = lane_sext(v, bits);
+        uint64_t res;
+
+        switch (op)
+        {
+        case VL_ADD: res = u + v; break;
+        case VL_SUB: res = u - v; break;
+        case VL_MUL: res = u * v; break;
+        case VL_CMEQ: res = u == v ? mask : 0; break;
+        case VL_CMGT: res = s > t ? mask : 0; break;
+        case VL_CMHI: res = u > v ? mask : 0; break;
+        case VL_SMAX: res = s > t ? u : v; break;
+        case VL_SMIN: res = s < t ? u : v; break;
+        case VL_UMAX: res = u > v ? u : v; break;
+        case VL_UMIN: res = u < v ? u : v; break;
+        case VL_SQADD: res = lane_sat_s((__int128)s + t, bits); break;
+        case VL_SQSUB: res = lane_sat_s((__int128)s - t, bits); break;
+        case VL_UQADD: res = u + v < u || u + v > mask ? mask : u + v; break;
+        case VL_UQSUB: res = u > v ? u - v : 0; break;
+        case VL_SHL: res = n >= bits ? 0 : u << n; break;
+        case VL_USHR: res = n >= bits ? 0 : u >> n; break;
+        case VL_SSHR: res = (uint64_t)(s >> (n >= bits ? bits - 1 : n)); break;
+        case VL_ABS: res = s < 0 ? -(uint64_t)s : u; break;
+        case VL_NEG: res = -u; break;
+        case VL_CNT: res = (unsigned)__builtin_popcountll(u); break;
+        case VL_CLZ: res = u ? (unsigned)__builtin_clzll(u) - (64 - bits) : bits; break;
+        default: res = 0; break;
+        }
+        vreg_set_lane(&r, size, i, res & mask);
+    }
+    return vec_load(&r);
+}
+
+/* ============================================================================
+ * Bitwise
+ * ============================================================================ */
+
+static inline sw_vec_t vec_zero(void)
+{
+#if defined(SW_SIMD_NEON)
+    return vdupq_n_u8(0);
+#elif defined(SW_SIMD_SSE)
+    return _mm_setzero_si128();
+#else
+    sw_vreg_t r = {.d = {0, 0}};
+    return r;
+#endif
+}
+
+static inline sw_vec_t vec_and(sw_vec_t a, sw_vec_t b)
+{
+#if defined(SW_SIMD_NEON)
+    return vandq_u8(a, b);
+#elif defined(SW_SIMD_SSE)
+    return _mm_and_si128(a, b);
+#else
+    a.d[0] &= b.d[0];
+    a.d[1] &= b.d[1];
+    return a;
+#endif
+}
+
+static inline sw_vec_t vec_or(sw_vec_t a, sw_vec_t b)
+{
+#if defined(SW_SIMD_NEON)
+    return vorrq_u8(a, b);
+#elif defined(SW_SIMD_SSE)
+    return _mm_or_si128(a, b);
+#else
+    a.d[0] |= b.d[0];
+    a.d[1] |= b.d[1];
+    return a;
+#endif
+}
+
+static inline sw_vec_t vec_xor(sw_vec_t a, sw_vec_t b)
+{
+#if defined(SW_SIMD_NEON)
+    return veorq_u8(a, b);
+#elif defined(SW_SIMD_SSE)
+    return _mm_xor_si128(a, b);
+#else
+    a.d[0] ^= b.d[0];
+    a.d[1] ^= b.d[1];
+    return a;
+#endif
+}
+
+/* a & ~b */
+static inline sw_vec_t vec_bic(sw_vec_t a, sw_vec_t b)
+{
+#if defined(SW_SIMD_NEON)
+    return vbicq_u8(a, b);
+#elif defined(SW_SIMD_SSE)
+    return _mm_andnot_si128(b, a);
+#else
+    a.d[0] &= ~b.d[0];
+    a.d[1] &= ~b.d[1];
+    return a;
+#endif
+}
+
+static inline sw_vec_t vec_not(sw_vec_t a)
+{
+#if defined(SW_SIMD_NEON)
+    return vmvnq_u8(a);
+#elif defined(SW_SIMD_SSE)
+    return _mm_xor_si128(a, _mm_set1_epi32(-1));
+#else
+    a.d[0] = ~a.d[0];
+    a.d[1] = ~a.d[1];
+    return a;
+#endif
+}
+
+/* Bits of `a` where `sel` is set, bits of `b` elsewhere */
+static inline sw_vec_t vec_select(sw_vec_t sel, sw_vec_t a, sw_vec_t b)
+{
+#if defined(SW_SIMD_NEON)
+    return vbslq_u8(sel, a, b);
+#else
+    return vec_or(vec_and(sel, a), vec_bic(b, sel));
+#endif
+}
+
+/* Every lane set to `val` */
+static inline sw_vec_t vec_dup(uint64_t val, unsigned size)
+{
+#if defined(SW_SIMD_NEON)
+    switch (size)
+    {
+    case 0: return vdupq_n_u8((uint8_t)val);
+    case 1: return vreinterpretq_u8_u16(vdupq_n_u16((uint16_t)val));
+    case 2: return vreinterpretq_u8_u32(vdupq_n_u32((uint32_t)val));
+    default: return vreinterpretq_u8_u64(vdupq_n_u64(val));
+    }
+#elif defined(SW_SIMD_SSE)
+    switch (size)
+    {
+    case 0: return _mm_set1_epi8((char)val);
+    case 1: return _mm_set1_epi16((short)val);
+    case 2: return _mm_set1_epi32((int)val);
+    default: return _mm_set1_epi64x((long long)val);
+    }
+#else
+    sw_vreg_t r;
+    for (unsigned i = 0; i < 16u >> size; i++)
+        vreg_set_lane(&r, size, i, val);
+    return r;
+#endif
+}
+
+/* ============================================================================
+ * Arithmetic
+ * ============================================================================ */
+
+#if defined(SW_SIMD_NEON)
+/* Apply a NEON intrinsic family to the lanes of `size` */
+#define NEON_U(fn, a, b, size)                                                      \
+    ((size) == 0   ? fn##_u8((a), (b))                                               \
+     : (size) == 1 ? vreinterpretq_u8_u16(fn##_u16(vreinterpretq_u16_u8(a),          \
+                                                   vreinterpretq_u16_u8(b)))         \
+     : (size) == 2 ? vreinterpretq_u8_u32(fn##_u32(vreinterpretq_u32_u8(a),          \
+                                                   vreinterpretq_u32_u8(b)))         \
+                   : vreinterpretq_u8_u64(fn##_u64(vreinterpretq_u64_u8(a),          \
+                                                   vreinterpretq_u64_u8(b))))
+#define NEON_S(fn, a, b, size)                                                      \
+    ((size) == 0   ? vreinterpretq_u8_s8(fn##_s8(vreinterpretq_s8_u8(a),             \
+                                                 vreinterpretq_s8_u8(b)))            \
+     : (size) == 1 ? vreinterpretq_u8_s16(fn##_s16(vreinterpretq_s16_u8(a),          \
+                                                   vreinterpretq_s16_u8(b)))         \
+     : (size) == 2 ? vreinterpretq_u8_s32(fn##_s32(vreinterpretq_s32_u8(a),          \
+                                                   vreinterpretq_s32_u8(b)))         \
+                   : vreinterpretq_u8_s64(fn##_s64(vreinterpretq_s64_u8(a),          \
+                                                   vreinterpretq_s64_u8(b))))
+/* Same for comparisons, which return unsigned masks */
+#define NEON_CMP_S(fn, a, b, size)                                                  \
+    ((size) == 0   ? fn##_s8(vreinterpretq_s8_u8(a), vreinterpretq_s8_u8(b))         \
+     : (size) == 1 ? vreinterpretq_u8_u16(fn##_s16(vreinterpretq_s16_u8(a),          \
+                                                   vreinterpretq_s16_u8(b)))         \
+     : (size) == 2 ? vreinterpretq_u8_u32(fn##_s32(vreinterpretq_s32_u8(a),          \
+                                                   vreinterpretq_s32_u8(b)))         \
+                   : vreinterpretq_u8_u64(fn##_s64(vreinterpretq_s64_u8(a),          \
+                                                   vreinterpretq_s64_u8(b))))
+#endif
+
+static inline sw_vec_t vec_add(sw_vec_t a, sw_vec_t b, unsigned size)
+{
+#if defined(SW_SIMD_NEON)
+    return NEON_U(vaddq, a, b, size);
+#elif defined(SW_SIMD_SSE)
+    switch (size)
+    {
+    case 0: return _mm_add_epi8(a, b);
+    case 1: return _mm_add_epi16(a, b);
+    case 2: return _mm_add_epi32(a, b);
+    default: return _mm_add_epi64(a, b);
+    }
+#else
+    return vec_lanes(VL_ADD, a, b, size, 0);
+#endif
+}
+
+static inline sw_vec_t vec_sub(sw_vec_t a, sw_vec_t b, unsigned size)
+{
+#if defined(SW_SIMD_NEON)
+    return NEON_U(vsubq, a, b, size);
+#elif defined(SW_SIMD_SSE)
+    switch (size)
+    {
+    case 0: return _mm_sub_epi8(a, b);
+    case 1: return _mm_sub_epi16(a, b);
+    case 2: return _mm_sub_epi32(a, b);
+    default: return _mm_sub_epi64(a, b);
+    }
+#else
+    return vec_lanes(VL_SUB, a, b, size, 0);
+#endif
+}
+
+/* Lane sizes 0-2 only, like MUL */
+static inline sw_vec_t vec_mul(sw_vec_t a, sw_vec_t b, unsigned size)
+{
+#if defined(SW_SIMD_NEON)
+    switch (size)
+    {
+    case 0: return vmulq_u8(a, b);
+    case 1: return vreinterpretq_u8_u16(vmulq_u16(vreinterpretq_u16_u8(a), vreinterpretq_u16_u8(b)));
+    default: return vreinterpretq_u8_u32(vmulq_u32(vreinterpretq_u32_u8(a), vreinterpretq_u32_u8(b)));
+    }
+#else
+#if defined(SW_SIMD_SSE)
+    if (size == 1)
+        return _mm_mullo_epi16(a, b);
+#ifdef __SSE4_1__
+    if (size == 2)
+        return _mm_mullo_epi32(a, b);
+#endif
+#endif
+    return vec_lanes(VL_MUL, a, b, size, 0);
+#endif
+}
+
+static inline sw_vec_t vec_neg(sw_vec_t a, unsigned size)
+{
+#if defined(SW_SIMD_NEON) || defined(SW_SIMD_SSE)
+    return vec_sub(vec_zero(), a, size);
+#else
+    return vec_lanes(VL_NEG, a, a, size, 0);
+#endif
+}
+
+static inline sw_vec_t vec_abs(sw_vec_t a, unsigned size)
+{
+#if defined(SW_SIMD_NEON)
+    switch (size)
+    {
+    case 0: return vreinterpretq_u8_s8(vabsq_s8(vreinterpretq_s8_u8(a)));
+    case 1: return vreinterpretq_u8_s16(vabsq_s16(vreinterpretq_s16_u8(a)));
+    case 2: return vreinterpretq_u8_s32(vabsq_s32(vreinterpretq_s32_u8(a)));
+    default: return vreinterpretq_u8_s64(vabsq_s64(vreinterpretq_s64_u8(a)));
+    }
+#else
+#if defined(SW_SIMD_SSE) && defined(__SSSE3__)
+    switch (size)
+    {
+    case 0: return _mm_abs_epi8(a);
+    case 1: return _mm_abs_epi16(a);
+    case 2: return _mm_abs_epi32(a);
+    }
+#endif
+    return vec_lanes(VL_ABS, a, a, size, 0);
+#endif
+}
+
+/* Saturating add/subtract; `sign` selects SQADD/SQSUB over UQADD/UQSUB */
+static inline sw_vec_t vec_qadd(sw_vec_t a, sw_vec_t b, unsigned size, bool sign)
+{
+#if defined(SW_SIMD_NEON)
+    return sign ? NEON_S(vqaddq, a, b, size) : NEON_U(vqaddq, a, b, size);
+#else
+#if defined(SW_SIMD_SSE)
+    switch (size)
+    {
+    case 0: return sign ? _mm_adds_epi8(a, b) : _mm_adds_epu8(a, b);
+    case 1: return sign ? _mm_adds_epi16(a, b) : _mm_adds_epu16(a, b);
+    }
+#endif
+    return vec_lanes(sign ? VL_SQADD : VL_UQADD, a, b, size, 0);
+#endif
+}
+
+static inline sw_vec_t vec_qsub(sw_vec_t a, sw_vec_t b, unsigned size, bool sign)
+{
+#if defined(SW_SIMD_NEON)
+    return sign ? NEON_S(vqsubq, a, b, size) : NEON_U(vqsubq, a, b, size);
+#else
+#if defined(SW_SIMD_SSE)
+    switch (size)
+    {
+    case 0: return sign ? _mm_subs_epi8(a, b) : _mm_subs_epu8(a, b);
+    case 1: return sign ? _mm_subs_epi16(a, b) : _mm_subs_epu16(a, b);
+    }
+#endif
+    return vec_lanes(sign ? VL_SQSUB : VL_UQSUB, a, b, size, 0);
+#endif
+}
+
+/* Lane sizes 0-2 only, like SMAX/UMAX and friends */
+static inline sw_vec_t vec_max(sw_vec_t a, sw_vec_t b, unsigned size, bool sign)
+{
+#if defined(SW_SIMD_NEON)
+    switch (size)
+    {
+    case 0:
+        return sign ? vreinterpretq_u8_s8(vmaxq_s8(vreinterpretq_s8_u8(a), vreinterpretq_s8_u8(b)))
+                    : vmaxq_u8(a, b);
+    case 1:
+        return sign ? vreinterpretq_u8_s16(vmaxq_s16(vreinterpretq_s16_u8(a), vreinterpretq_s16_u8(b)))
+                    : vreinterpretq_u8_u16(vmaxq_u16(vreinterpretq_u16_u8(a), vreinterpretq_u16_u8(b)));
+    default:
+        return sign ? vreinterpretq_u8_s32(vmaxq_s32(vreinterpretq_s32_u8(a), vreinterpretq_s32_u8(b)))
+                    : vreinterpretq_u8_u32(vmaxq_u32(vreinterpretq_u32_u8(a), vreinterpretq_u32_u8(b)));
+    }
+#else
+#if defined(SW_SIMD_SSE)
+    if (size == 0 && !sign)
+        return _mm_max_epu8(a, b);
+    if (size == 1 && sign)
+        return _mm_max_epi16(a, b);
+#ifdef __SSE4_1__
+    switch (size)
+    {
+    case 0: return _mm_max_epi8(a, b);
+    case 1: return _mm_max_epu16(a, b);
+    case 2: return sign ? _mm_max_epi32(a, b) : _mm_max_epu32(a, b);
+    }
+#endif
+#endif
+    return vec_lanes(sign ? VL_SMAX : VL_UMAX, a, b, size, 0);
+#endif
+}
+
+static inline sw_vec_t vec_min(sw_vec_t a, sw_vec_t b, unsigned size, bool sign)
+{
+#if defined(SW_SIMD_NEON)
+    switch (size)
+    {
+    case 0:
+        return sign ? vreinterpretq_u8_s8(vminq_s8(vreinterpretq_s8_u8(a), vreinterpretq_s8_u8(b)))
+                    : vminq_u8(a, b);
+    case 1:
+        return sign ? vreinterpretq_u8_s16(vminq_s16(vreinterpretq_s16_u8(a), vreinterpretq_s16_u8(b)))
+                    : vreinterpretq_u8_u16(vminq_u16(vreinterpretq_u16_u8(a), vreinterpretq_u16_u8(b)));
+    default:
+        return sign ? vreinterpretq_u8_s32(vminq_s32(vreinterpretq_s32_u8(a), vreinterpretq_s32_u8(b)))
+                    : vreinterpretq_u8_u32(vminq_u32(vreinterpretq_u32_u8(a), vreinterpretq_u32_u8(b)));
+    }
+#else
+#if defined(SW_SIMD_SSE)
+    if (size == 0 && !sign)
+        return _mm_min_epu8(a, b);
+    if (size == 1 && sign)
+        return _mm_min_epi16(a, b);
+#ifdef __SSE4_1__
+    switch (size)
+    {
+    case 0: return _mm_min_epi8(a, b);
+    case 1: return _mm_min_epu16(a, b);
+    case 2: return sign ? _mm_min_epi32(a, b) : _mm_min_epu32(a, b);
+    }
+#endif
+#endif
+    return vec_lanes(sign ? VL_SMIN : VL_UMIN, a, b, size, 0);
+#endif
+}
+
+/* ============================================================================
+ * Comparisons (all-ones lanes where true)
+ * ============================================================================ */
+
+static inline sw_vec_t vec_cmeq(sw_vec_t a, sw_vec_t b, unsigned size)
+{
+#if defined(SW_SIMD_NEON)
+    return NEON_U(vceqq, a, b, size);
+#else
+#if defined(SW_SIMD_SSE)
+    switch (size)
+    {
+    case 0: return _mm_cmpeq_epi8(a, b);
+    case 1: return _mm_cmpeq_epi16(a, b);
+    case 2: return _mm_cmpeq_epi32(a, b);
+#ifdef __SSE4_1__
+    default: return _mm_cmpeq_epi64(a, b);
+#endif
+    }
+#endif
+    return vec_lanes(VL_CMEQ, a, b, size, 0);
+#endif
+}
+
+/* Signed a > b */
+static inline sw_vec_t vec_cmgt(sw_vec_t a, sw_vec_t b, unsigned size)
+{
+#if defined(SW_SIMD_NEON)
+    return NEON_CMP_S(vcgtq, a, b, size);
+#else
+#if defined(SW_SIMD_SSE)
+    switch (size)
+    {
+    case 0: return _mm_cmpgt_epi8(a, b);
+    case 1: return _mm_cmpgt_epi16(a, b);
+    case 2: return _mm_cmpgt_epi32(a, b);
+    }
+#endif
+    return vec_lanes(VL_CMGT, a, b, size, 0);
+#endif
+}
+
+/* Unsigned a > b */
+static inline sw_vec_t vec_cmhi(sw_vec_t a, sw_vec_t b, unsigned size)
+{
+#if defined(SW_SIMD_NEON)
+    return NEON_U(vcgtq, a, b, size);
+#else
+#if defined(SW_SIMD_SSE)
+    /* Flip the sign bits and compare signed */
+    if (size < 3)
+    {
+        sw_vec_t bias = vec_dup(1ull << ((8u << size) - 1), size);
+        return vec_cmgt(vec_xor(a, bias), vec_xor(b, bias), size);
+    }
+#endif
+    return vec_lanes(VL_CMHI, a, b, size, 0);
+#endif
+}
+
+/* ============================================================================
+ * Shifts by a constant (0 <= n <= lane bits)
+ * ============================================================================ */
+
+static inline sw_vec_t vec_shl(sw_vec_t a, unsigned size, unsigned n)
+{
+#if defined(SW_SIMD_NEON)
+    /* Register shifts take the count from a vector, so `n` need not be a
+     * compile-time constant */
+    switch (size)
+    {
+    case 0: return vshlq_u8(a, vdupq_n_s8((int8_t)n));
+    case 1: return vreinterpretq_u8_u16(vshlq_u16(vreinterpretq_u16_u8(a), vdupq_n_s16((int16_t)n)));
+    case 2: return vreinterpretq_u8_u32(vshlq_u32(vreinterpretq_u32_u8(a), vdupq_n_s32((int32_t)n)));
+    default: return vreinterpretq_u8_u64(vshlq_u64(vreinterpretq_u64_u8(a), vdupq_n_s64((int64_t)n)));
+    }
+#elif defined(SW_SIMD_SSE)
+    __m128i cnt = _mm_cvtsi32_si128((int)n);
+    switch (size)
+    {
+    case 0: return _mm_and_si128(_mm_sll_epi16(a, cnt), _mm_set1_epi8((char)(0xff << n)));
+    case 1: return _mm_sll_epi16(a, cnt);
+    case 2: return _mm_sll_epi32(a, cnt);
+    default: return _mm_sll_epi64(a, cnt);
+    }
+#else
+    return vec_lanes(VL_SHL, a, a, size, n);
+#endif
+}
+
+static inline sw_vec_t vec_ushr(sw_vec_t a, unsigned size, unsigned n)
+{
+#if defined(SW_SIMD_NEON)
+    int64_t c = -(int64_t)n;
+    switch (size)
+    {
+    case 0: return vshlq_u8(a, vdupq_n_s8((int8_t)c));
+    case 1: return vreinterpretq_u8_u16(vshlq_u16(vreinterpretq_u16_u8(a), vdupq_n_s16((int16_t)c)));
+    case 2: return vreinterpretq_u8_u32(vshlq_u32(vreinterpretq_u32_u8(a), vdupq_n_s32((int32_t)c)));
+    default: return vreinterpretq_u8_u64(vshlq_u64(vreinterpretq_u64_u8(a), vdupq_n_s64(c)));
+    }
+#elif defined(SW_SIMD_SSE)
+    __m128i cnt = _mm_cvtsi32_si128((int)n);
+    switch (size)
+    {
+    case 0: return _mm_and_si128(_mm_srl_epi16(a, cnt), _mm_set1_epi8((char)(0xff >> n)));
+    case 1: return _mm_srl_epi16(a, cnt);
+    case 2: return _mm_srl_epi32(a, cnt);
+    default: return _mm_srl_epi64(a, cnt);
+    }
+#else
+    return vec_lanes(VL_USHR, a, a, size, n);
+#endif
+}
+
+static inline sw_vec_t vec_sshr(sw_vec_t a, unsigned size, unsigned n)
+{
+#if defined(SW_SIMD_NEON)
+    int64_t c = -(int64_t)n;
+    switch (size)
+    {
+    case 0: return vreinterpretq_u8_s8(vshlq_s8(vreinterpretq_s8_u8(a), vdupq_n_s8((int8_t)c)));
+    case 1: return vreinterpretq_u8_s16(vshlq_s16(vreinterpretq_s16_u8(a), vdupq_n_s16((int16_t)c)));
+    case 2: return vreinterpretq_u8_s32(vshlq_s32(vreinterpretq_s32_u8(a), vdupq_n_s32((int32_t)c)));
+    default: return vreinterpretq_u8_s64(vshlq_s64(vreinterpretq_s64_u8(a), vdupq_n_s64(c)));
+    }
+#else
+#if defined(SW_SIMD_SSE)
+    __m128i cnt = _mm_cvtsi32_si128((int)n);
+    switch (size)
+    {
+    case 1: return _mm_sra_epi16(a, cnt);
+    case 2: return _mm_sra_epi32(a, cnt);
+    }
+#endif
+    return vec_lanes(VL_SSHR, a, a, size, n);
+#endif
+}
+
+/* ============================================================================
+ * Bytes
+ * ============================================================================ */
+
+/* Population count of each byte (CNT) */
+static inline sw_vec_t vec_cnt8(sw_vec_t a)
+{
+#if defined(SW_SIMD_NEON)
+    return vcntq_u8(a);
+#else
+#if defined(SW_SIMD_SSE) && defined(__SSSE3__)
+    const __m128i lut = _mm_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m128i low = _mm_set1_epi8(0x0f);
+    __m128i lo = _mm_shuffle_epi8(lut, _mm_and_si128(a, low));
+    __m128i hi = _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(a, 4), low));
+    return _mm_add_epi8(lo, hi);
+#endif
+    return vec_lanes(VL_CNT, a, a, 0, 0);
+#endif
+}
+
+/* Byte i of the result is table[idx[i]], or 0 if idx[i] >= 16 */
+static inline sw_vec_t vec_tbl1(sw_vec_t table, sw_vec_t idx)
+{
+#if defined(SW_SIMD_NEON)
+    return vqtbl1q_u8(table, idx);
+#elif defined(SW_SIMD_SSE) && defined(__SSSE3__)
+    /* PSHUFB zeroes bytes whose index has bit 7 set: push 16..255 there */
+    return _mm_shuffle_epi8(table, _mm_adds_epu8(idx, _mm_set1_epi8(0x70)));
+#else
+    sw_vreg_t t, i, r;
+    vec_store(&t, table);
+    vec_store(&i, idx);
+    for (unsigned k = 0; k < 16; k++)
+        r.b[k] = i.b[k] < 16 ? t.b[i.b[k]] : 0;
+    return vec_load(&r);
+#endif
+}
+
+/* ============================================================================
+ * Permutes
+ * ============================================================================ */
+
+/* {a.d[0], b.d[0]} */
+static inline sw_vec_t vec_lo64(sw_vec_t a, sw_vec_t b)
+{
+#if defined(SW_SIMD_NEON)
+    return vcombine_u8(vget_low_u8(a), vget_low_u8(b));
+#elif defined(SW_SIMD_SSE)
+    return _mm_unpacklo_epi64(a, b);
+#else
+    a.d[1] = b.d[0];
+    return a;
+#endif
+}
+
+/* {a.d[1], b.d[1]} */
+static inline sw_vec_t vec_hi64(sw_vec_t a, sw_vec_t b)
+{
+#if defined(SW_SIMD_NEON)
+    return vcombine_u8(vget_high_u8(a), vget_high_u8(b));
+#elif defined(SW_SIMD_SSE)
+    return _mm_unpackhi_epi64(a, b);
+#else
+    a.d[0] = a.d[1];
+    a.d[1] = b.d[1];
+    return a;
+#endif
+}
+
+/* ZIP1 (`hi` false) or ZIP2 of 128-bit vectors */
+static inline sw_vec_t vec_zip(sw_vec_t a, sw_vec_t b, unsigned size, bool hi)
+{
+#if defined(SW_SIMD_NEON)
+    return hi ? NEON_U(vzip2q, a, b, size) : NEON_U(vzip1q, a, b, size);
+#elif defined(SW_SIMD_SSE)
+    switch (size)
+    {
+    case 0: return hi ? _mm_unpackhi_epi8(a, b) : _mm_unpacklo_epi8(a, b);
+    case 1: return hi ? _mm_unpackhi_epi16(a, b) : _mm_unpacklo_epi16(a, b);
+    case 2: return hi ? _mm_unpackhi_epi32(a, b) : _mm_unpacklo_epi32(a, b);
+    default: return hi ? _mm_unpackhi_epi64(a, b) : _mm_unpacklo_epi64(a, b);
+    }
+#else
+    sw_vreg_t r = {.d = {0, 0}};
+    unsigned n = 16u >> size, base = hi ? n / 2 : 0;
+    for (unsigned i = 0; i < n / 2; i++)
+    {
+        vreg_set_lane(&r, size, 2 * i, vreg_lane(&a, size, base + i));
+        vreg_set_lane(&r, size, 2 * i + 1, vreg_lane(&b, size, base + i));
+    }
+    return r;
+#endif
+}
+
+/* UZP1 (even lanes of a then of b) or UZP2 (odd lanes) */
+static inline sw_vec_t vec_uzp(sw_vec_t a, sw_vec_t b, unsigned size, bool odd)
+{
+#if defined(SW_SIMD_NEON)
+    return odd ? NEON_U(vuzp2q, a, b, size) : NEON_U(vuzp1q, a, b, size);
+#elif defined(SW_SIMD_SSE)
+    /* Move the wanted half of each wider lane down, then pack */
+    switch (size)
+    {
+    case 0:
+        if (odd)
+            return _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+        return _mm_packus_epi16(_mm_and_si128(a, _mm_set1_epi16(0xff)),
+                                _mm_and_si128(b, _mm_set1_epi16(0xff)));
+    case 1:
+        if (odd)
+            return _mm_packs_epi32(_mm_srai_epi32(a, 16), _mm_srai_epi32(b, 16));
+        return _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(a, 16), 16),
+                               _mm_srai_epi32(_mm_slli_epi32(b, 16), 16));
+    case 2:
+        if (odd)
+            return _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b),
+                                                   _MM_SHUFFLE(3, 1, 3, 1)));
+        return _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b),
+                                               _MM_SHUFFLE(2, 0, 2, 0)));
+    default:
+        return odd ? _mm_unpackhi_epi64(a, b) : _mm_unpacklo_epi64(a, b);
+    }
+#else
+    sw_vreg_t r = {.d = {0, 0}};
+    unsigned n = 16u >> size;
+    for (unsigned i = 0; i < n / 2; i++)
+    {
+        vreg_set_lane(&r, size, i, vreg_lane(&a, size, 2 * i + odd));
+        vreg_set_lane(&r, size, n / 2 + i, vreg_lane(&b, size, 2 * i + odd));
+    }
+    return r;
+#endif
+}
+
+/* TRN1 (even lanes of a and b interleaved) or TRN2 (odd lanes) */
+static inline sw_vec_t vec_trn(sw_vec_t a, sw_vec_t b, unsigned size, bool odd)
+{
+#if defined(SW_SIMD_NEON)
+    return odd ? NEON_U(vtrn2q, a, b, size) : NEON_U(vtrn1q, a, b, size);
+#else
+    if (size == 3)
+        return odd ? vec_hi64(a, b) : vec_lo64(a, b);
+
+    /* Treat each pair of lanes as one wider lane and shift within it */
+    unsigned bits = 8u << size;
+    sw_vec_t low = vec_dup(lane_ones(bits), size + 1);
+    if (odd)
+        return vec_select(low, vec_ushr(a, size + 1, bits), b);
+    return vec_select(low, a, vec_shl(b, size + 1, bits));
+#endif
+}
+
+/* ============================================================================
+ * Reductions (ADDV, UMAXV, ... over the first `lanes` lanes)
+ * ============================================================================ */
+
+enum
+{
+    VR_ADD,
+    VR_UMAX,
+    VR_UMIN,
+    VR_SMAX,
+    VR_SMIN,
+    VR_UADDL, /* Result is twice the lane width */
+    VR_SADDL,
+};
+
+static inline uint64_t vec_reduce(unsigned op, sw_vec_t a, unsigned size, unsigned lanes)
+{
+#if defined(SW_SIMD_NEON)
+    if (lanes == 16u >> size && size < 3)
+    {
+        uint16x8_t h = vreinterpretq_u16_u8(a);
+        uint32x4_t w = vreinterpretq_u32_u8(a);
+        int8x16_t sb = vreinterpretq_s8_u8(a);
+        int16x8_t sh = vreinterpretq_s16_u8(a);
+        int32x4_t sw = vreinterpretq_s32_u8(a);
+
+        switch (op)
+        {
+        case VR_ADD: return size == 0 ? vaddvq_u8(a) : size == 1 ? vaddvq_u16(h) : vaddvq_u32(w);
+        case VR_UMAX: return size == 0 ? vmaxvq_u8(a) : size == 1 ? vmaxvq_u16(h) : vmaxvq_u32(w);
+        case VR_UMIN: return size == 0 ? vminvq_u8(a) : size == 1 ? vminvq_u16(h) : vminvq_u32(w);
+        case VR_SMAX:
+            return size == 0 ? (uint8_t)vmaxvq_s8(sb) : size == 1 ? (uint16_t)vmaxvq_s16(sh)
+                                                                 : (uint32_t)vmaxvq_s32(sw);
+        case VR_SMIN:
+            return size == 0 ? (uint8_t)vminvq_s8(sb) : size == 1 ? (uint16_t)vminvq_s16(sh)
+                                                                 : (uint32_t)vminvq_s32(sw);
+        case VR_UADDL:
+            return size == 0 ? vaddlvq_u8(a) : size == 1 ? vaddlvq_u16(h) : vaddlvq_u32(w);
+        case VR_SADDL:
+            return size == 0 ? (uint16_t)vaddlvq_s8(sb) : size == 1 ? (uint32_t)vaddlvq_s16(sh)
+                                                                   : (uint64_t)vaddlvq_s32(sw);
+        }
+    }
+#endif
+    sw_vreg_t x;
+    unsigned bits = 8u << size;
+    bool sign = op == VR_SMAX || op == VR_SMIN || op == VR_SADDL;
+    int64_t acc = 0;
+
+    vec_store(&x, a);
+    for (unsigned i = 0; i < lanes; i++)
+    {
+        uint64_t u = vreg_lane(&x, size, i);
+        int64_t e = sign ? lane_sext(u, bits) : (int64_t)u;
+
+        if (i == 0)
+            acc = e;
+        else if (op == VR_ADD || op == VR_UADDL || op == VR_SADDL)
+            acc = (int64_t)((uint64_t)acc + (uint64_t)e);
+        else if (op == VR_UMAX)
+            acc = (uint64_t)e > (uint64_t)acc ? e : acc;
+        else if (op == VR_UMIN)
+            acc = (uint64_t)e < (uint64_t)acc ? e : acc;
+        else if (op == VR_SMAX)
+            acc = e > acc ? e : acc;
+        else
+            acc = e < acc ? e : acc;
+    }
+    return (uint64_t)acc & lane_ones(op >= VR_UADDL ? 2 * bits : bits);
+}
+
+#endif /* SWSIMD_H */
@@ -0,0 +1,396 @@
+/*
+ * tcache.c - Persistent translation cache for the software backend
+ *
+ * See tcache.h for the file format.
+ */
+
+#include "tcache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct tcache
+{
+    char *path;
+
+    /* Mapped file, or NULL if there is none yet */
+    void *map;
+    size_t map_size;
+    const tcache_entry_t *entries;
+    uint32_t n_entries;
+    const sw_insn_t *ops;
+    uint64_t n_ops;
+
+    /* New translations, ops_index points into pending_ops. The vCPUs of
+     * an SMP guest record concurrently, the mapped file is read-only. */
+    pthread_mutex_t lock;
+    tcache_entry_t *pending;
+    uint32_t n_pending, cap_pending;
+    sw_insn_t *pending_ops;
+    uint64_t n_pending_ops, cap_pending_ops;
+};
+
+/* ============================================================================
+ * Mapping
+ * ============================================================================ */
+
+static int entry_cmp(const tcache_entry_t *a, const tcache_entry_t *b)
+{
+    if (a->image_hash != b->image_hash)
+        return a->image_hash < b->image_hash ? -1 : 1;
+    if (a->pc != b->pc)
+        return a->pc < b->pc ? -1 : 1;
+    if (a->mode != b->mode)
+        return a->mode < b->mode ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Map the cache file read-only. Anything that doesn't look exactly like a
+ * file written by this translator is ignored (and will be replaced on the
+ * next save).
+ */
+static int tcache_map(const char *path, void **map, size_t *map_size,
+                      const tcache_entry_t **entries, uint32_t *n_entries,
+                      const sw_insn_t **ops, uint64_t *n_ops)
+{
+    struct stat st;
+    const tcache_header_t *hdr;
+    int fd;
+
+    *map = NULL;
+    *map_size = 0;
+    *entries = NULL;
+    *n_entries = 0;
+    *ops = NULL;
+    *n_ops = 0;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(tcache_header_t))
+    {
+        close(fd);
+        return -1;
+    }
+
+    void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return -1;
+
+    hdr = p;
+    uint64_t size = (uint64_t)st.st_size;
+    if (memcmp(hdr->magic, TCACHE_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->version != TCACHE_FORMAT_VERSION ||
+        hdr->translator != SW_TRANSLATOR_VERSION ||
+        hdr->insn_size != sizeof(sw_insn_t) ||
+        hdr->entries_off > size ||
+        hdr->n_entries > (size - hdr->entries_off) / sizeof(tcache_entry_t) ||
+        hdr->ops_off > size || (hdr->ops_off & 7) != 0 ||
+        hdr->n_ops > (size - hdr->ops_off) / sizeof(sw_insn_t))
+    {
+        munmap(p, (size_t)st.st_size);
+        return -1;
+    }
+
+    *map = p;
+    *map_size = (size_t)st.st_size;
+    *entries = (const tcache_entry_t *)((const uint8_t *)p + hdr->entries_off);
+    *n_entries = hdr->n_entries;
+    *ops = (const sw_insn_t *)((const uint8_t *)p + hdr->ops_off);
+    *n_ops = hdr->n_ops;
+    return 0;
+}
+
+/* ============================================================================
+ * API
+ * ============================================================================ */
+
+tcache_t *tcache_open(const char *path)
+{
+    tcache_t *tc = calloc(1, sizeof(*tc));
+    if (tc == NULL)
+        return NULL;
+
+    tc->path = strdup(path);
+    if (tc->path == NULL)
+    {
+        free(tc);
+        return NULL;
+    }
+    pthread_mutex_init(&tc->lock, NULL);
+
+    tcache_map(path, &tc->map, &tc->map_size, &tc->entries, &tc->n_entries,
+               &tc->ops, &tc->n_ops);
+    return tc;
+}
+
+void tcache_close(tcache_t *tc)
+{
+    if (tc == NULL)
+        return;
+
+    if (tc->map != NULL)
+        munmap(tc->map, tc->map_size);
+    free(tc->pending);
+    free(tc->pending_ops);
+    free(tc->path);
+    pthread_mutex_destroy(&tc->lock);
+    free(tc);
+}
+
+uint32_t tcache_size(const tcache_t *tc)
+{
+    return tc->n_entries;
+}
+
+const tcache_entry_t *tcache_lookup(const tcache_t *tc, uint64_t image_hash,
+                                    uint64_t pc, uint32_t mode)
+{
+    tcache_entry_t key = {.image_hash = image_hash, .pc = pc, .mode = mode};
+    uint32_t lo = 0, hi = tc->n_entries;
+
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int c = entry_cmp(&tc->entries[mid], &key);
+        if (c == 0)
+            return &tc->entries[mid];
+        if (c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return NULL;
+}
+
+const sw_insn_t *tcache_ops(const tcache_t *tc, const tcache_entry_t *e)
+{
+    if (e->n_ops == 0 || e->n_ops > SW_BLOCK_MAX_INSNS + 1 ||
+        e->ops_index > tc->n_ops || e->n_ops > tc->n_ops - e->ops_index)
+        return NULL;
+    return &tc->ops[e->ops_index];
+}
+
+int tcache_record(tcache_t *tc, uint64_t image_hash, uint64_t pc, uint32_t mode,
+                  uint32_t n_insns, uint64_t src_hash,
+                  const sw_insn_t *ops, uint32_t n_ops)
+{
+    int ret = -1;
+
+    pthread_mutex_lock(&tc->lock);
+    if (tc->n_pending == tc->cap_pending)
+    {
+        uint32_t cap = tc->cap_pending ? tc->cap_pending * 2 : 64;
+        tcache_entry_t *p = realloc(tc->pending, cap * sizeof(*p));
+        if (p == NULL)
+            goto out;
+        tc->pending = p;
+        tc->cap_pending = cap;
+    }
+
+    if (tc->n_pending_ops + n_ops > tc->cap_pending_ops)
+    {
+        uint64_t cap = tc->cap_pending_ops ? tc->cap_pending_ops * 2 : 1024;
+        while (cap < tc->n_pending_ops + n_ops)
+            cap *= 2;
+        sw_insn_t *p = realloc(tc->pending_ops, cap * sizeof(*p));
+        if (p == NULL)
+            goto out;
+        tc->pending_ops = p;
+        tc->cap_pending_ops = cap;
+    }
+
+    tcache_entry_t *e = &tc->pending[tc->n_pending++];
+    memset(e, 0, sizeof(*e));
+    e->image_hash = image_hash;
+    e->pc = pc;
+    e->mode = mode;
+    e->n_insns = n_insns;
+    e->src_hash = src_hash;
+    e->ops_index = (uint32_t)tc->n_pending_ops;
+    e->n_ops = n_ops;
+
+    memcpy(&tc->pending_ops[tc->n_pending_ops], ops, n_ops * sizeof(*ops));
+    tc->n_pending_ops += n_ops;
+    ret = 0;
+out:
+    pthread_mutex_unlock(&tc->lock);
+    return ret;
+}
+
+/* ============================================================================
+ * Saving
+ * ============================================================================ */
+
+/* One entry of the merged table, with where its ops currently live */
+typedef struct
+{
+    tcache_entry_t entry;
+    const sw_insn_t *ops;
+    int newer; /* From this process: wins over the file on a key clash */
+} tcache_merge_t;
+
+static int merge_cmp(const void *a, const void *b)
+{
+    const tcache_merge_t *x = a, *y = b;
+    int c = entry_cmp(&x->entry, &y->entry);
+    if (c != 0)
+        return c;
+    return y->newer - x->newer;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    while (len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n < 0)
+            return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+int tcache_save(tcache_t *tc)
+{
+    char lock_path[1024], tmp_path[1024];
+    void *map;
+    size_t map_size;
+    const tcache_entry_t *entries;
+    uint32_t n_entries;
+    const sw_insn_t *ops;
+    uint64_t n_ops;
+    int lock_fd, fd = -1, ret = -1;
+
+    if (tc->n_pending == 0)
+        return 0;
+
+    snprintf(lock_path, sizeof(lock_path), "%s.lock", tc->path);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%d", tc->path, (int)getpid());
+
+    lock_fd = open(lock_path, O_RDWR | O_CREAT, 0644);
+    if (lock_fd < 0 || flock(lock_fd, LOCK_EX) < 0)
+    {
+        perror("tcache lock");
+        if (lock_fd >= 0)
+            close(lock_fd);
+        return -1;
+    }
+
+    /* Re-read the file under the lock: other VMs may have saved since we
+     * opened it. */
+    tcache_map(tc->path, &map, &map_size, &entries, &n_entries, &ops, &n_ops);
+
+    size_t total = (size_t)n_entries + tc->n_pending;
+    tcache_merge_t *m = malloc(total * sizeof(*m));
+    if (m == NULL)
+        goto out;
+
+    size_t n = 0;
+    for (uint32_t i = 0; i < n_entries; i++)
+    {
+        const tcache_entry_t *e = &entries[i];
+        if (e->ops_index > n_ops || e->n_ops > n_ops - e->ops_index)
+            continue;
+        m[n].entry = *e;
+        m[n].ops = &ops[e->ops_index];
+        m[n].newer = 0;
+        n++;
+    }
+    for (uint32_t i = 0; i < tc->n_pending; i++)
+    {
+        m[n].entry = tc->pending[i];
+        m[n].ops = &tc->pending_ops[tc->pending[i].ops_index];
+        m[n].newer = 1;
+        n++;
+    }
+
+    qsort(m, n, sizeof(*m), merge_cmp);
+
+    /* Drop duplicate keys, keeping the first (newest) of each */
+    size_t out_n = 0;
+    uint64_t out_ops = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (out_n > 0 && entry_cmp(&m[out_n - 1].entry, &m[i].entry) == 0)
+            continue;
+        m[out_n] = m[i];
+        m[out_n].entry.ops_index = (uint32_t)out_ops;
+        out_ops += m[out_n].entry.n_ops;
+        out_n++;
+    }
+
+    tcache_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TCACHE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TCACHE_FORMAT_VERSION;
+    hdr.translator = SW_TRANSLATOR_VERSION;
+    hdr.insn_size = sizeof(sw_insn_t);
+    hdr.n_entries = (uint32_t)out_n;
+    hdr.entries_off = sizeof(hdr);
+    hdr.ops_off = (sizeof(hdr) + out_n * sizeof(tcache_entry_t) + 7) & ~7ull;
+    hdr.n_ops = out_ops;
+
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        perror("tcache open");
+        goto out;
+    }
+
+    static const uint8_t pad[8];
+    if (write_all(fd, &hdr, sizeof(hdr)) < 0)
+        goto out;
+    for (size_t i = 0; i < out_n; i++)
+    {
+        if (write_all(fd, &m[i].entry, sizeof(m[i].entry)) < 0)
+            goto out;
+    }
+    if (write_all(fd, pad, hdr.ops_off - sizeof(hdr) - out_n * sizeof(tcache_entry_t)) < 0)
+        goto out;
+    for (size_t i = 0; i < out_n; i++)
+    {
+        if (write_all(fd, m[i].ops, m[i].entry.n_ops * sizeof(sw_insn_t)) < 0)
+            goto out;
+    }
+
+    if (close(fd) < 0 || rename(tmp_path, tc->path) < 0)
+    {
+        fd = -1;
+        perror("tcache rename");
+        goto out;
+    }
+    fd = -1;
+
+    /* Our translations are on disk now */
+    tc->n_pending = 0;
+    tc->n_pending_ops = 0;
+    ret = (int)out_n;
+
+out:
+    if (fd >= 0)
+    {
+        perror("tcache write");
+        close(fd);
+    }
+    if (ret < 0)
+        unlink(tmp_path);
+    free(m);
+    if (map != NULL)
+        munmap(map, map_size);
+    flock(lock_fd, LOCK_UN);
+    close(lock_fd);
+    return ret;
+}
@@ -0,0 +1,83 @@
+/*
+ * tcache.h - Persistent translation cache for the software backend
+ *
+ * Translated blocks are position-independent arrays of sw_insn_t, so they
+ * can be shared between VM processes and across runs. The cache file is
+ * mapped read-only and shared: every VM process running the same guest
+ * image uses the same physical pages for its translations.
+ *
+ * File layout (all little-endian, host format):
+ *
+ *   tcache_header_t
+ *   tcache_entry_t[n_entries]   sorted by (image_hash, pc, mode)
+ *   sw_insn_t[n_ops]            8-byte aligned
+ *
+ * An entry is only used if the guest bytes it was translated from still
+ * hash to src_hash. New translations are kept in memory and merged into
+ * the file by tcache_save(), which holds an flock() on "<path>.lock" and
+ * replaces the file atomically with rename(), so concurrent VM processes
+ * never see a partial file.
+ */
+
+#ifndef TCACHE_H
+#define TCACHE_H
+
+#include "swcpu.h"
+
+#include <stdint.h>
+
+#define TCACHE_MAGIC "TVMMTC1"
+#define TCACHE_FORMAT_VERSION 1
+
+typedef struct
+{
+    char magic[8];        /* TCACHE_MAGIC */
+    uint32_t version;     /* TCACHE_FORMAT_VERSION */
+    uint32_t translator;  /* SW_TRANSLATOR_VERSION */
+    uint32_t insn_size;   /* sizeof(sw_insn_t) */
+    uint32_t n_entries;
+    uint64_t entries_off; /* File offset of the entry table */
+    uint64_t ops_off;     /* File offset of the ops array */
+    uint64_t n_ops;
+} tcache_header_t;
+
+typedef struct
+{
+    uint64_t image_hash;  /* Guest image the block belongs to */
+    uint64_t pc;          /* Guest PC of the block */
+    uint32_t mode;        /* SW_MODE_* */
+    uint32_t n_insns;     /* Guest instructions covered */
+    uint64_t src_hash;    /* sw_hash64() of the guest instruction bytes */
+    uint32_t ops_index;   /* First op in the ops array */
+    uint32_t n_ops;
+} tcache_entry_t;
+
+typedef struct tcache tcache_t;
+
+/* Open (or start) the cache at `path`. Returns NULL on allocation failure
+ * only: a missing or invalid file gives an empty cache. */
+tcache_t *tcache_open(const char *path);
+
+/* Unmap and free. Does not save pending translations. */
+void tcache_close(tcache_t *tc);
+
+/* Find the on-disk entry for a block, or NULL */
+const tcache_entry_t *tcache_lookup(const tcache_t *tc, uint64_t image_hash,
+                                    uint64_t pc, uint32_t mode);
+
+/* The ops of an entry, or NULL if the entry is out of bounds */
+const sw_insn_t *tcache_ops(const tcache_t *tc, const tcache_entry_t *e);
+
+/* Queue a new translation for the next tcache_save() (thread-safe) */
+int tcache_record(tcache_t *tc, uint64_t image_hash, uint64_t pc, uint32_t mode,
+                  uint32_t n_insns, uint64_t src_hash,
+                  const sw_insn_t *ops, uint32_t n_ops);
+
+/* Merge queued translations into the file. Returns the number of entries
+ * written, 0 if there was nothing to do, or -1 on error. */
+int tcache_save(tcache_t *tc);
+
+/* Entries in the mapped file */
+uint32_t tcache_size(const tcache_t *tc);
+
+#endif /* TCACHE_H */
@@ -0,0 +1,299 @@
+/*
+ * xfer.c - Guest page transfer encoding
+ *
+ * See xfer.h for the encodings.
+ */
+
+#include "xfer.h"
+#include "hostclock.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <compression.h>
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#define XFER_WORDS (XFER_PAGE_SIZE / 8)
+#define XFER_NO_PAGE UINT32_MAX   /* Empty cache slot */
+#define XFER_DELTA_FAILED SIZE_MAX
+
+struct xfer_encoder
+{
+    int mode;
+    uint32_t *tags;               /* Page number cached in each slot */
+    uint8_t *cache;               /* XFER_CACHE_PAGES previous versions */
+    void *scratch;                /* LZ4 encoder state */
+};
+
+/* ============================================================================
+ * Zero Pages
+ * ============================================================================
+ *
+ * OR the page together 64 bytes at a time with NEON and give up at the
+ * first nonzero 256 bytes: most pages that are not zero show it early.
+ */
+
+bool xfer_page_is_zero(const uint8_t *page)
+{
+#if defined(__aarch64__) && defined(__ARM_NEON)
+    for (size_t i = 0; i < XFER_PAGE_SIZE; i += 256)
+    {
+        uint8x16_t acc = vdupq_n_u8(0);
+        for (size_t j = i; j < i + 256; j += 64)
+        {
+            acc = vorrq_u8(acc, vorrq_u8(vorrq_u8(vld1q_u8(page + j), vld1q_u8(page + j + 16)),
+                                         vorrq_u8(vld1q_u8(page + j + 32),
+                                                  vld1q_u8(page + j + 48))));
+        }
+        if (vmaxvq_u8(acc) != 0)
+            return false;
+    }
+    return true;
+#else
+    const uint64_t *w = (const uint64_t *)page;
+    for (size_t i = 0; i < XFER_WORDS; i++)
+    {
+        if (w[i] != 0)
+            return false;
+    }
+    return true;
+#endif
+}
+
+/* ============================================================================
+ * XOR Delta
+ * ============================================================================ */
+
+static size_t put_varint(uint8_t *out, uint32_t v)
+{
+    size_t n = 0;
+    while (v >= 0x80)
+    {
+        out[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (uint8_t)v;
+    return n;
+}
+
+static int get_varint(const uint8_t *in, size_t len, size_t *pos, uint32_t *v)
+{
+    *v = 0;
+    for (unsigned shift = 0; shift < 32; shift += 7)
+    {
+        if (*pos >= len)
+            return -1;
+        uint8_t b = in[(*pos)++];
+        *v |= (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return 0;
+    }
+    return -1;
+}
+
+/* Encode `cur` against `old`, XFER_DELTA_FAILED if it takes `limit` bytes
+ * or more. An unchanged page is 0 bytes. */
+static size_t delta_encode(const uint64_t *old, const uint64_t *cur, uint8_t *out, size_t limit)
+{
+    size_t len = 0;
+    uint32_t i = 0;
+
+    while (i < XFER_WORDS)
+    {
+        uint32_t start = i, zeros, changed;
+
+        while (i < XFER_WORDS && old[i] == cur[i])
+            i++;
+        if (i == XFER_WORDS)
+            break; /* The rest is unchanged */
+        zeros = i - start;
+        start = i;
+        while (i < XFER_WORDS && old[i] != cur[i])
+            i++;
+        changed = i - start;
+
+        /* Two varints of at most 2 bytes each: runs are < 16384 words */
+        if (len + 4 + (size_t)changed * 8 >= limit)
+            return XFER_DELTA_FAILED;
+        len += put_varint(out + len, zeros);
+        len += put_varint(out + len, changed);
+        for (uint32_t j = start; j < i; j++)
+        {
+            uint64_t x = old[j] ^ cur[j];
+            memcpy(out + len, &x, 8);
+            len += 8;
+        }
+    }
+    return len;
+}
+
+static int delta_apply(const uint8_t *in, size_t len, uint64_t *page)
+{
+    size_t pos = 0;
+    uint32_t i = 0;
+
+    while (pos < len)
+    {
+        uint32_t zeros, changed;
+        if (get_varint(in, len, &pos, &zeros) < 0 || get_varint(in, len, &pos, &changed) < 0 ||
+            zeros > XFER_WORDS - i || changed > XFER_WORDS - i - zeros ||
+            (size_t)changed * 8 > len - pos)
+            return -1;
+        i += zeros;
+        for (uint32_t j = 0; j < changed; j++, i++)
+        {
+            uint64_t x;
+            memcpy(&x, in + pos, 8);
+            page[i] ^= x;
+            pos += 8;
+        }
+    }
+    return 0;
+}
+
+/* ============================================================================
+ * Encoder and Decoder
+ * ============================================================================ */
+
+xfer_encoder_t *xfer_encoder_create(int mode)
+{
+    xfer_encoder_t *enc = calloc(1, sizeof(*enc));
+    size_t scratch = compression_encode_scratch_buffer_size(COMPRESSION_LZ4);
+
+    if (enc == NULL)
+        return NULL;
+    enc->mode = mode;
+    if (mode != XFER_MODE_RAW)
+    {
+        enc->tags = malloc(XFER_CACHE_PAGES * sizeof(*enc->tags));
+        enc->cache = malloc((size_t)XFER_CACHE_PAGES * XFER_PAGE_SIZE);
+        if (enc->tags == NULL || enc->cache == NULL)
+        {
+            xfer_encoder_destroy(enc);
+            return NULL;
+        }
+        memset(enc->tags, 0xff, XFER_CACHE_PAGES * sizeof(*enc->tags));
+    }
+    if (mode == XFER_MODE_LZ4 && scratch != 0 && (enc->scratch = malloc(scratch)) == NULL)
+    {
+        xfer_encoder_destroy(enc);
+        return NULL;
+    }
+    return enc;
+}
+
+void xfer_encoder_destroy(xfer_encoder_t *enc)
+{
+    if (enc == NULL)
+        return;
+    free(enc->tags);
+    free(enc->cache);
+    free(enc->scratch);
+    free(enc);
+}
+
+size_t xfer_encode(xfer_encoder_t *enc, uint32_t page, const uint8_t *data, uint8_t *out,
+                   int *encoding, xfer_stats_t *stats)
+{
+    uint64_t start = thread_cpu_ns();
+    size_t slot = page % XFER_CACHE_PAGES;
+    uint8_t *old = enc->cache != NULL ? enc->cache + slot * XFER_PAGE_SIZE : NULL;
+    bool cached = old != NULL && enc->tags[slot] == page;
+    size_t len = XFER_DELTA_FAILED;
+
+    if (enc->mode == XFER_MODE_RAW)
+    {
+        *encoding = XFER_RAW;
+    }
+    else if (xfer_page_is_zero(data))
+    {
+        *encoding = XFER_ZERO;
+        len = 0;
+    }
+    else
+    {
+        if (cached)
+        {
+            len = delta_encode((const uint64_t *)old, (const uint64_t *)data, out,
+                               XFER_PAGE_SIZE);
+            *encoding = XFER_DELTA;
+        }
+        /* A delta that saves less than half the page may lose to LZ4 */
+        if (enc->mode == XFER_MODE_LZ4 && (len == XFER_DELTA_FAILED || len > XFER_PAGE_SIZE / 2))
+        {
+            uint8_t packed[XFER_PAGE_SIZE];
+            size_t limit = len == XFER_DELTA_FAILED ? XFER_PAGE_SIZE - 1 : len - 1;
+            size_t n = compression_encode_buffer(packed, limit, data, XFER_PAGE_SIZE,
+                                                 enc->scratch, COMPRESSION_LZ4);
+            if (n != 0)
+            {
+                memcpy(out, packed, n);
+                len = n;
+                *encoding = XFER_LZ4;
+            }
+        }
+        if (len == XFER_DELTA_FAILED)
+            *encoding = XFER_RAW;
+    }
+    if (*encoding == XFER_RAW)
+    {
+        memcpy(out, data, XFER_PAGE_SIZE);
+        len = XFER_PAGE_SIZE;
+    }
+
+    /* What the receiver holds now */
+    if (old != NULL)
+    {
+        memcpy(old, data, XFER_PAGE_SIZE);
+        enc->tags[slot] = page;
+    }
+
+    stats->pages++;
+    stats->zero += *encoding == XFER_ZERO;
+    stats->delta += *encoding == XFER_DELTA;
+    stats->lz4 += *encoding == XFER_LZ4;
+    stats->raw += *encoding == XFER_RAW;
+    stats->cache_hits += cached;
+    stats->raw_bytes += XFER_PAGE_SIZE;
+    stats->encoded_bytes += len;
+    stats->cpu_ns += thread_cpu_ns() - start;
+    return len;
+}
+
+int xfer_decode(int encoding, const uint8_t *in, size_t len, uint8_t *page,
+                xfer_stats_t *stats)
+{
+    uint64_t start = thread_cpu_ns();
+    int ret = 0;
+
+    switch (encoding)
+    {
+    case XFER_RAW:
+        if (len != XFER_PAGE_SIZE)
+            return -1;
+        memcpy(page, in, XFER_PAGE_SIZE);
+        break;
+    case XFER_ZERO:
+        memset(page, 0, XFER_PAGE_SIZE);
+        break;
+    case XFER_DELTA:
+        ret = delta_apply(in, len, (uint64_t *)page);
+        break;
+    case XFER_LZ4:
+        ret = compression_decode_buffer(page, XFER_PAGE_SIZE, in, len, NULL, COMPRESSION_LZ4) ==
+                      XFER_PAGE_SIZE
+                  ? 0
+                  : -1;
+        break;
+    default:
+        return -1;
+    }
+
+    stats->pages++;
+    stats->raw_bytes += XFER_PAGE_SIZE;
+    stats->encoded_bytes += len;
+    stats->cpu_ns += thread_cpu_ns() - start;
+    return ret;
+}
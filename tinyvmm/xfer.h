@@ -0,0 +1,74 @@
+/*
+ * xfer.h - Guest page transfer encoding
+ *
+ * Pages sent more than once, like those the guest dirties again between
+ * migration rounds, rarely change much. The encoder keeps the version of
+ * each page it last sent in a small cache and sends the next version as
+ * the difference, the way the receiver, which holds the previous version
+ * in guest memory, can apply it in place. Each page goes out as one of:
+ *
+ *   XFER_ZERO   all zeroes, nothing else sent (found with a SIMD scan)
+ *   XFER_DELTA  XOR against the cached previous version, run-length coded:
+ *               pairs of varints (zero words, changed words), each pair
+ *               followed by the changed words XORed with the old ones
+ *   XFER_LZ4    compressed (optional, for pages with no useful delta)
+ *   XFER_RAW    as is
+ *
+ * Encoded pages are never larger than XFER_PAGE_SIZE. The cache is
+ * direct-mapped on the page number, XFER_CACHE_PAGES entries; a page whose
+ * previous version was evicted is sent whole.
+ */
+
+#ifndef XFER_H
+#define XFER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define XFER_PAGE_SIZE 4096
+#define XFER_CACHE_PAGES 1024 /* 4 MB of previously sent pages */
+
+/* Page encodings */
+#define XFER_RAW 0
+#define XFER_ZERO 1
+#define XFER_DELTA 2
+#define XFER_LZ4 3
+
+/* Encoder modes (--xfer) */
+#define XFER_MODE_RAW 0   /* Every page as is, for comparison */
+#define XFER_MODE_DELTA 1 /* Zero pages and deltas */
+#define XFER_MODE_LZ4 2   /* Zero pages, deltas, and LZ4 for the rest */
+
+/* What an encoder or decoder did, for reporting */
+typedef struct
+{
+    uint64_t pages;
+    uint64_t zero, delta, lz4, raw; /* Pages sent each way */
+    uint64_t cache_hits;    /* Pages whose previous version was cached */
+    uint64_t raw_bytes;     /* XFER_PAGE_SIZE per page */
+    uint64_t encoded_bytes;
+    uint64_t cpu_ns;        /* Thread CPU time spent encoding or decoding */
+} xfer_stats_t;
+
+typedef struct xfer_encoder xfer_encoder_t;
+
+/* NULL if out of memory */
+xfer_encoder_t *xfer_encoder_create(int mode);
+
+void xfer_encoder_destroy(xfer_encoder_t *enc);
+
+/* Encode guest page number `page`, whose contents must not change during
+ * the call, into `out` (XFER_PAGE_SIZE bytes). Returns the encoded size
+ * and sets *encoding. */
+size_t xfer_encode(xfer_encoder_t *enc, uint32_t page, const uint8_t *data, uint8_t *out,
+                   int *encoding, xfer_stats_t *stats);
+
+/* Apply an encoded page to `page`, which holds the previous version for
+ * XFER_DELTA. Returns 0, or -1 if the encoding is damaged. */
+int xfer_decode(int encoding, const uint8_t *in, size_t len, uint8_t *page,
+                xfer_stats_t *stats);
+
+bool xfer_page_is_zero(const uint8_t *page);
+
+#endif /* XFER_H */